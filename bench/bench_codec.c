@@ -0,0 +1,172 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  bench_codec.c
+ *
+ *    Description:  Compares output codecs' speed and ratio on a FASTQ file,
+ *                      compressed in the same blocks fastDBarcode writes
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 20:05:13
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <getopt.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "fdb_codec.h"
+
+/* Input read for benchmarking is capped at this */
+#define BENCH_MAX_INPUT (256u << 20)
+/* Synthetic data size when no file is given */
+#define BENCH_SYNTH_SIZE (64u << 20)
+#define BENCH_READ_LEN 150
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Reads (and decompresses, if needed) up to BENCH_MAX_INPUT bytes of fn */
+static char *
+read_input (const char *fn, size_t *len)
+{
+    gzFile fp = gzopen(fn, "r");
+    char *buf = NULL;
+    int got = 0;
+    if (fp == NULL) return NULL;
+    buf = km_malloc(BENCH_MAX_INPUT, &km_onerr_print);
+    *len = 0;
+    while (*len < BENCH_MAX_INPUT && (got = gzread(fp, buf + *len,
+                    BENCH_MAX_INPUT - *len)) > 0) {
+        *len += got;
+    }
+    gzclose(fp);
+    return buf;
+}
+
+/* Illumina-like 150bp reads, for when there is no real data to hand */
+static char *
+synth_input (size_t *len)
+{
+    static const char bases[] = "ACGT";
+    static const char quals[] = "FFFFFFFFFFFF:::,#";
+    char *buf = km_malloc(BENCH_SYNTH_SIZE + 1024, &km_onerr_print);
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    size_t n = 0;
+    for (size_t rrr = 0; n < BENCH_SYNTH_SIZE; rrr++) {
+        n += sprintf(buf + n, "@synth:1:FC:1:%zu:%zu:%zu 1:N:0:ACGTAC\n",
+                rrr % 97, rrr / 97, rrr * 7 % 30011);
+        for (int iii = 0; iii < BENCH_READ_LEN; iii++) {
+            rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+            buf[n++] = bases[rng >> 62];
+        }
+        n += sprintf(buf + n, "\n+\n");
+        for (int iii = 0; iii < BENCH_READ_LEN; iii++) {
+            rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+            buf[n++] = quals[(rng >> 33) % (sizeof(quals) - 1)];
+        }
+        buf[n++] = '\n';
+    }
+    *len = n;
+    return buf;
+}
+
+static void
+bench (const fdb_codec_t *codec, int level, const char *data, size_t len)
+{
+    char *out = NULL;
+    size_t out_cap = 0;
+    uint64_t zlen = 0;
+    double start = now(), secs;
+    for (size_t off = 0; off < len; off += FDB_OFILE_BLOCK) {
+        size_t n = len - off < FDB_OFILE_BLOCK ? len - off : FDB_OFILE_BLOCK;
+        size_t z = fdb_codec_compress(codec, level, data + off, n, &out,
+                &out_cap);
+        if (z == 0) {
+            fprintf(stderr, "ERROR: %s level %d failed\n", codec->name, level);
+            free(out);
+            return;
+        }
+        zlen += z;
+    }
+    secs = now() - start;
+    printf("%s\t%d\t%.1f\t%.1f\t%.3f\t%.1f\n", codec->name, level,
+            len / 1048576.0, zlen / 1048576.0, (double)len / zlen,
+            len / 1048576.0 / secs);
+    free(out);
+}
+
+static void
+usage (void)
+{
+    fprintf(stderr, "USAGE:\n\tbench_codec [-l LEVEL,...] [fastq]\n\n");
+    fprintf(stderr, "Compresses fastq (or synthetic reads) with each codec in"
+            " %u KiB blocks,\nprinting codec, level, MB in, MB out, ratio and"
+            " MB/s.\n", FDB_OFILE_BLOCK >> 10);
+}
+
+int
+main (int argc, char **argv)
+{
+    char *levels = NULL;
+    char *data = NULL;
+    size_t len = 0;
+    int c;
+    while ((c = getopt(argc, argv, "hl:")) != -1) {
+        switch (c) {
+            case 'l':
+                levels = optarg;
+                break;
+            default:
+                usage();
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        data = read_input(argv[optind], &len);
+        if (data == NULL) {
+            fprintf(stderr, "ERROR: could not read '%s'\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+    } else {
+        data = synth_input(&len);
+    }
+    printf("codec\tlevel\tmb_in\tmb_out\tratio\tmb_per_sec\n");
+    for (const fdb_codec_t **codec = fdb_codecs; *codec != NULL; codec++) {
+        if (levels != NULL) {
+            char *lvls = strdup(levels), *save = NULL;
+            for (char *l = strtok_r(lvls, ",", &save); l != NULL;
+                    l = strtok_r(NULL, ",", &save)) {
+                if (atoi(l) <= (*codec)->max_level) {
+                    bench(*codec, atoi(l), data, len);
+                }
+            }
+            free(lvls);
+        } else if ((*codec)->ext == NULL) {
+            bench(*codec, 0, data, len);
+        } else {
+            /* Fastest, default, a couple between, and slowest */
+            int max = (*codec)->max_level;
+            int lvls[] = {1, (*codec)->default_level, max / 2, 3 * max / 4, max};
+            for (int iii = 0; iii < 5; iii++) {
+                int dup = 0;
+                for (int jjj = 0; jjj < iii; jjj++) dup |= lvls[jjj] == lvls[iii];
+                if (!dup) bench(*codec, lvls[iii], data, len);
+            }
+        }
+    }
+    fdb_codec_thread_cleanup();
+    free(data);
+    return EXIT_SUCCESS;
+}
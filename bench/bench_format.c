@@ -0,0 +1,152 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  bench_format.c
+ *
+ *    Description:  Compares writing records with fdb_rec_fastq() against
+ *                      the snprintf() formatting it replaced
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 22:31:09
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <time.h>
+
+#include "fdb_batch.h"
+
+#define BENCH_READ_LEN 150
+#define BENCH_TRIM 6
+/* Output gathered before it is thrown away, like an outq block */
+#define BENCH_BLOCK FDB_OUTQ_BLOCK_SIZE
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t
+put (fdb_batch_t *b, const char *s, size_t l)
+{
+    uint32_t off = b->arena_len;
+    memcpy(b->arena + off, s, l);
+    b->arena[off + l] = '\0';
+    b->arena_len += l + 1;
+    return off;
+}
+
+/* A batch of Illumina-like 150bp reads */
+static void
+synth_batch (fdb_batch_t *b)
+{
+    static const char bases[] = "ACGT";
+    static const char quals[] = "FFFFFFFFFFFF:::,#";
+    char name[64], seq[BENCH_READ_LEN], qual[BENCH_READ_LEN];
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    b->m_recs = FDB_BATCH_READS;
+    b->recs = km_calloc(b->m_recs, sizeof(*b->recs), &km_onerr_print);
+    b->arena_cap = b->m_recs * (sizeof(name) + 2 * BENCH_READ_LEN + 32);
+    b->arena = km_malloc(b->arena_cap, &km_onerr_print);
+    for (size_t rrr = 0; rrr < b->m_recs; rrr++) {
+        fdb_rec_t *rec = &b->recs[rrr];
+        for (int iii = 0; iii < BENCH_READ_LEN; iii++) {
+            rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+            seq[iii] = bases[rng >> 62];
+            qual[iii] = quals[(rng >> 33) % (sizeof(quals) - 1)];
+        }
+        rec->name_l = snprintf(name, sizeof(name), "synth:1:FC:1:%zu:%zu:%zu",
+                rrr % 97, rrr / 97, rrr * 7 % 30011);
+        rec->name = put(b, name, rec->name_l);
+        rec->comment_l = strlen("1:N:0:ACGTAC");
+        rec->comment = put(b, "1:N:0:ACGTAC", rec->comment_l);
+        rec->seq_l = rec->qual_l = BENCH_READ_LEN;
+        rec->seq = put(b, seq, BENCH_READ_LEN);
+        rec->qual = put(b, qual, BENCH_READ_LEN);
+    }
+    b->n_recs = b->m_recs;
+}
+
+/* The formatting fdb_rec_fastq() replaced */
+static size_t
+format_snprintf (const fdb_batch_t *b, const fdb_rec_t *rec, size_t trim,
+                 kstring_t *out)
+{
+    int out_len = rec->seq_l + rec->name_l + rec->qual_l + \
+              rec->comment_l + 8 - (2 * trim);
+    if (out->m < (size_t)out_len) {
+        out->m = out_len;
+        kroundup32(out->m);
+        out->s = km_realloc(out->s, out->m, &km_onerr_print);
+    }
+    snprintf(out->s, out_len, "@%s %s\n%s\n+\n%s\n",
+            FDB_REC_NAME(b, rec), FDB_REC_COMMENT(b, rec),
+            FDB_REC_SEQ(b, rec) + trim, FDB_REC_QUAL(b, rec) + trim);
+    return out_len - 1;
+}
+
+int
+main (int argc, char **argv)
+{
+    fdb_batch_t b;
+    kstring_t out = {0, 0, NULL};
+    char *block = km_malloc(BENCH_BLOCK, &km_onerr_print);
+    size_t block_len = 0;
+    size_t reps = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+    uint64_t bytes = 0;
+    double start, secs_old, secs_new;
+    memset(&b, 0, sizeof(b));
+    synth_batch(&b);
+    /* Both must give the same records */
+    for (size_t rrr = 0; rrr < b.n_recs; rrr++) {
+        size_t len = format_snprintf(&b, &b.recs[rrr], BENCH_TRIM, &out);
+        char *end = fdb_rec_fastq(&b, &b.recs[rrr], BENCH_TRIM, block);
+        if ((size_t)(end - block) != len || memcmp(block, out.s, len) != 0 ||
+                fdb_rec_fastq_len(&b.recs[rrr], BENCH_TRIM) != len) {
+            fprintf(stderr, "ERROR: formatters disagree on read %zu\n", rrr);
+            return EXIT_FAILURE;
+        }
+    }
+    start = now();
+    for (size_t iii = 0; iii < reps; iii++) {
+        for (size_t rrr = 0; rrr < b.n_recs; rrr++) {
+            size_t len = format_snprintf(&b, &b.recs[rrr], BENCH_TRIM, &out);
+            if (block_len + len > BENCH_BLOCK) block_len = 0;
+            memcpy(block + block_len, out.s, len);
+            block_len += len;
+            bytes += len;
+        }
+    }
+    secs_old = now() - start;
+    block_len = 0;
+    start = now();
+    for (size_t iii = 0; iii < reps; iii++) {
+        for (size_t rrr = 0; rrr < b.n_recs; rrr++) {
+            size_t len = fdb_rec_fastq_len(&b.recs[rrr], BENCH_TRIM);
+            if (block_len + len > BENCH_BLOCK) block_len = 0;
+            fdb_rec_fastq(&b, &b.recs[rrr], BENCH_TRIM, block + block_len);
+            block_len += len;
+        }
+    }
+    secs_new = now() - start;
+    printf("formatter\tns_per_read\tmb_per_sec\n");
+    printf("snprintf\t%.1f\t%.1f\n", secs_old * 1e9 / (reps * b.n_recs),
+            bytes / 1048576.0 / secs_old);
+    printf("fdb_rec_fastq\t%.1f\t%.1f\n", secs_new * 1e9 / (reps * b.n_recs),
+            bytes / 1048576.0 / secs_new);
+    /* Keep the copies from being optimised away */
+    if (block[0] != '@') return EXIT_FAILURE;
+    free(out.s);
+    free(block);
+    free(b.arena);
+    free(b.recs);
+    return EXIT_SUCCESS;
+}
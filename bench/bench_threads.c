@@ -0,0 +1,293 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  bench_threads.c
+ *
+ *    Description:  Reads per second matched and queued for output against
+ *                      the number of matching threads, placed on NUMA
+ *                      nodes as fastDBarcode -t places them
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 11:40:27
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fdb_batch.h"
+
+#define BENCH_READ_LEN 150
+#define BENCH_BARCODES 96
+#define BENCH_BARCODE_LEN 8
+/* Distinct batches, reused until enough reads are done */
+#define BENCH_BATCHES 32
+
+typedef struct {
+    fdb_batch_t *batches;
+    size_t n_todo;              /* batches to match in all */
+    size_t next;
+    fdb_matcher_t *matcher;
+    fdb_matcher_t *replicas[FDB_NUMA_MAX_NODES];
+    pthread_mutex_t lock;
+    fdb_outq_t *outq;
+    int n_nodes;
+} bench_t;
+
+typedef struct {
+    bench_t *bench;
+    int node;
+    int error;
+} bench_thread_t;
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+rng_next (uint64_t *rng)
+{
+    *rng = *rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *rng;
+}
+
+static uint32_t
+put (fdb_batch_t *b, const char *s, size_t l)
+{
+    uint32_t off = b->arena_len;
+    memcpy(b->arena + off, s, l);
+    b->arena[off + l] = '\0';
+    b->arena_len += l + 1;
+    return off;
+}
+
+/* Reads starting with one of bcds, a tenth with an error in it and a
+ * tenth with no barcode at all */
+static void
+synth_batch (fdb_batch_t *b, char **bcds, uint64_t *rng)
+{
+    static const char bases[] = "ACGT";
+    char name[64], seq[BENCH_READ_LEN], qual[BENCH_READ_LEN];
+    b->m_recs = FDB_BATCH_READS;
+    b->recs = km_calloc(b->m_recs, sizeof(*b->recs), &km_onerr_print);
+    b->arena_cap = b->m_recs * (sizeof(name) + 2 * BENCH_READ_LEN + 8);
+    b->arena = km_malloc(b->arena_cap, &km_onerr_print);
+    for (size_t rrr = 0; rrr < b->m_recs; rrr++) {
+        fdb_rec_t *rec = &b->recs[rrr];
+        uint64_t kind = rng_next(rng) >> 60;
+        for (int iii = 0; iii < BENCH_READ_LEN; iii++) {
+            seq[iii] = bases[rng_next(rng) >> 62];
+            qual[iii] = 'F';
+        }
+        if (kind > 1) {
+            memcpy(seq, bcds[(rng_next(rng) >> 33) % BENCH_BARCODES],
+                    BENCH_BARCODE_LEN);
+        }
+        if (kind == 2) {
+            seq[(rng_next(rng) >> 33) % BENCH_BARCODE_LEN] = 'N';
+        }
+        rec->name_l = snprintf(name, sizeof(name), "synth:%zu", rrr);
+        rec->name = put(b, name, rec->name_l);
+        rec->comment = put(b, "", 0);
+        rec->seq_l = rec->qual_l = BENCH_READ_LEN;
+        rec->seq = put(b, seq, BENCH_READ_LEN);
+        rec->qual = put(b, qual, BENCH_READ_LEN);
+    }
+    b->n_recs = b->m_recs;
+}
+
+/* Matches batches and queues their reads, as a worker of fdb_main() */
+static void *
+bench_thread (void *arg)
+{
+    bench_thread_t *t = arg;
+    bench_t *bench = t->bench;
+    const fdb_matcher_t *m = bench->matcher;
+    fdb_outq_producer_t *prod = NULL;
+    const char *seqs[FDB_BATCH_READS];
+    size_t lens[FDB_BATCH_READS];
+    int32_t assign[FDB_BATCH_READS];
+    uint32_t trim[FDB_BATCH_READS], mismatches[FDB_BATCH_READS];
+    fdb_numa_bind(t->node);
+    if (bench->n_nodes > 1) {
+        pthread_mutex_lock(&bench->lock);
+        if (bench->replicas[t->node] == NULL) {
+            bench->replicas[t->node] = fdb_matcher_copy(bench->matcher);
+        }
+        if (bench->replicas[t->node] != NULL) m = bench->replicas[t->node];
+        pthread_mutex_unlock(&bench->lock);
+    }
+    prod = fdb_outq_producer_new(bench->outq);
+    if (prod == NULL) {
+        t->error = 1;
+        return NULL;
+    }
+    while (1) {
+        size_t idx = __atomic_fetch_add(&bench->next, 1, __ATOMIC_RELAXED);
+        const fdb_batch_t *b = &bench->batches[idx % BENCH_BATCHES];
+        if (idx >= bench->n_todo) break;
+        for (size_t rrr = 0; rrr < b->n_recs; rrr++) {
+            seqs[rrr] = FDB_REC_SEQ(b, &b->recs[rrr]);
+            lens[rrr] = b->recs[rrr].seq_l;
+        }
+        fdb_matcher_classify(m, seqs, lens, b->n_recs, assign, trim,
+                mismatches);
+        for (size_t rrr = 0; rrr < b->n_recs; rrr++) {
+            const fdb_rec_t *rec = &b->recs[rrr];
+            size_t stream = assign[rrr] == FDB_NO_MATCH ? BENCH_BARCODES : \
+                            (size_t)assign[rrr];
+            size_t len = fdb_rec_fastq_len(rec, trim[rrr]);
+            char *out = fdb_outq_reserve(prod, stream, len);
+            if (out == NULL) {
+                t->error = 1;
+                break;
+            }
+            fdb_rec_fastq(b, rec, trim[rrr], out);
+            t->error |= fdb_outq_commit(prod, stream, len);
+        }
+    }
+    fdb_outq_producer_destroy(prod);
+    return NULL;
+}
+
+/* Times n_threads threads through bench's batches, in reads per second */
+static double
+bench_run (bench_t *bench, int n_threads, int n_writers)
+{
+    fdb_aio_t *aio = fdb_aio_create(FDB_AIO_SYNC, 0);
+    fdb_ofile_t *fps[BENCH_BARCODES + 1];
+    int stream_node[BENCH_BARCODES + 1];
+    pthread_t threads[n_threads];
+    bench_thread_t args[n_threads];
+    double start = 0, secs = 0;
+    int error = 0;
+    for (int sss = 0; sss <= BENCH_BARCODES; sss++) {
+        fps[sss] = fdb_ofile_open("/dev/null", -1, 0, aio);
+        if (fps[sss] == NULL) return 0;
+        stream_node[sss] = sss;
+    }
+    bench->outq = fdb_outq_create(fps, BENCH_BARCODES + 1, n_writers,
+            FDB_OUTQ_MEM_DEFAULT, stream_node);
+    if (bench->outq == NULL) return 0;
+    bench->next = 0;
+    start = now();
+    for (int ttt = 0; ttt < n_threads; ttt++) {
+        args[ttt].bench = bench;
+        args[ttt].node = ttt % bench->n_nodes;
+        args[ttt].error = 0;
+        pthread_create(&threads[ttt], NULL, bench_thread, &args[ttt]);
+    }
+    for (int ttt = 0; ttt < n_threads; ttt++) {
+        pthread_join(threads[ttt], NULL);
+        error |= args[ttt].error;
+    }
+    error |= fdb_outq_wait(bench->outq);
+    secs = now() - start;
+    error |= fdb_outq_destroy(bench->outq);
+    for (int sss = 0; sss <= BENCH_BARCODES; sss++) {
+        error |= fdb_ofile_close(fps[sss]);
+    }
+    fdb_aio_destroy(aio);
+    for (int nnn = 0; nnn < FDB_NUMA_MAX_NODES; nnn++) {
+        fdb_matcher_destroy(bench->replicas[nnn]);
+        bench->replicas[nnn] = NULL;
+    }
+    if (error) return 0;
+    return bench->n_todo * FDB_BATCH_READS / secs;
+}
+
+static void
+usage (void)
+{
+    printf("USAGE: bench_threads [-t MAX_THREADS] [-w WRITERS] [-n READS]\n\n"
+            "Matches READS synthetic reads against %d barcodes with 1, 2, 4\n"
+            "... up to MAX_THREADS threads, spread across NUMA nodes, and\n"
+            "queues them for WRITERS writer threads, printing threads, NUMA\n"
+            "nodes, reads/s and speedup over one thread.\n", BENCH_BARCODES);
+}
+
+int
+main (int argc, char **argv)
+{
+    bench_t bench;
+    char *bcds[BENCH_BARCODES];
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_reads = 4000000;
+    int n_writers = 0;
+    double base = 0;
+    int c;
+    while ((c = getopt(argc, argv, "ht:w:n:")) != -1) {
+        switch (c) {
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'w':
+                n_writers = atoi(optarg);
+                break;
+            case 'n':
+                n_reads = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    memset(&bench, 0, sizeof(bench));
+    pthread_mutex_init(&bench.lock, NULL);
+    bench.n_nodes = fdb_numa_nodes();
+    if (max_threads < 1) max_threads = 1;
+    /* A writer per node, as fastDBarcode -t gives by default */
+    if (n_writers < 1) n_writers = bench.n_nodes;
+    for (int bbb = 0; bbb < BENCH_BARCODES; bbb++) {
+        bcds[bbb] = km_calloc(BENCH_BARCODE_LEN + 1, 1, &km_onerr_print);
+        for (int iii = 0; iii < BENCH_BARCODE_LEN; iii++) {
+            bcds[bbb][iii] = "ACGT"[rng_next(&rng) >> 62];
+        }
+    }
+    bench.matcher = fdb_matcher_new((const char *const *)bcds, BENCH_BARCODES,
+            2, NULL, 0);
+    if (bench.matcher == NULL || fdb_matcher_compile(bench.matcher)) {
+        fprintf(stderr, "ERROR: could not make the matcher\n");
+        return EXIT_FAILURE;
+    }
+    bench.batches = km_calloc(BENCH_BATCHES, sizeof(*bench.batches),
+            &km_onerr_print);
+    for (int bbb = 0; bbb < BENCH_BATCHES; bbb++) {
+        synth_batch(&bench.batches[bbb], bcds, &rng);
+    }
+    bench.n_todo = (n_reads + FDB_BATCH_READS - 1) / FDB_BATCH_READS;
+    printf("threads\tnodes\treads_per_sec\tspeedup\n");
+    for (long ttt = 1; ttt <= max_threads; ttt = ttt < max_threads && \
+            2 * ttt > max_threads ? max_threads : 2 * ttt) {
+        double rate = bench_run(&bench, ttt, n_writers);
+        if (rate == 0) {
+            fprintf(stderr, "ERROR: run with %ld threads failed\n", ttt);
+            return EXIT_FAILURE;
+        }
+        if (ttt == 1) base = rate;
+        printf("%ld\t%d\t%.0f\t%.2f\n", ttt,
+                ttt < bench.n_nodes ? (int)ttt : bench.n_nodes, rate,
+                rate / base);
+    }
+    for (int bbb = 0; bbb < BENCH_BATCHES; bbb++) {
+        free(bench.batches[bbb].arena);
+        free(bench.batches[bbb].recs);
+    }
+    for (int bbb = 0; bbb < BENCH_BARCODES; bbb++) free(bcds[bbb]);
+    free(bench.batches);
+    fdb_matcher_destroy(bench.matcher);
+    pthread_mutex_destroy(&bench.lock);
+    return EXIT_SUCCESS;
+}
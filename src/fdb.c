@@ -17,62 +17,32 @@
  */
 
 #include "fdb.h"
-
-/*
- * ===  FUNCTION  =============================================================
- *         Name:    hamming_max
- *  Description:    Calculates the hamming distance up until max. Useful for
- *                      non-exact substring finding.
- *                  If mode is not HAMMING_FROMSTART, arguments must be of
- *                      same length. Preprocessor deals with this.
- * Return Value:    size_t: max if max >= hamming dist, else hamming dist
- * ============================================================================
- */
-inline size_t
-hamming_max                    (const char     *seq1,
-                                const char     *seq2,
-                                size_t          max)
-{                                                                   /* {{{ */
-    size_t len = strlen(seq1);
-    /* check seq lengths */
-/* Don't enforce same-length needle and haystack hamming distance. */
-#ifndef FDB_HAMMING_MODE_FROMSTART
-    if (len != strlen(seq2)) {
-        return(SIZE_MAX);
-    }
-#endif
-    if (strncmp(seq2, seq1, len) == 0){
-        /* exact match */
-        return 0;
-    } else {
-        size_t mismatches = 0;
-        size_t iii = 0;
-        while(iii < len && mismatches < max) {
-            if (seq2[iii] != seq1[iii]) {
-                mismatches++;
-            }
-            iii++;
-        }
-        return mismatches;
-    }
-}
-
+#include "fdb_batch.h"
+#include "fdb_ckpt.h"
+#include "fdb_midx.h"
+#include "fdb_sheet.h"
+#include "fdb_status.h"
 
 /*
  * ===  FUNCTION  =============================================================
  *         Name:  parse_barcode_file
  *  Description:  Parses a fasta file containing barcode sequences
- * Return Value:  int: 1 on success, 0 on failure
+ * Return Value:  int: 0 on success, 1 on failure
  * ============================================================================
  */
 int
 parse_barcode_file (fdb_config_t *cfg)
 {
     size_t alloced_barcodes = 2;
-    FDB_FP_TYPE fp = NULL;
+    fdb_infile_t *fp = NULL;
     kseq_t * ksq = NULL;
+    const char **bcd_seqs = NULL;
     cfg->barcodes = calloc(alloced_barcodes, sizeof(*(cfg->barcodes)));
-    fp = FDB_FP_OPEN(cfg->barcode_file, "r");
+    fp = fdb_infile_open(cfg->barcode_file);
+    if (fp == NULL) {
+        FDB_IO_ERROR(cfg->barcode_file);
+        return 1;
+    }
     ksq = kseq_init(fp);
     while (kseq_read(ksq) >= 0) {
         if (ksq->seq.l)
@@ -102,11 +72,53 @@ parse_barcode_file (fdb_config_t *cfg)
     cfg->barcodes = realloc(cfg->barcodes,
             cfg->n_barcodes * sizeof(*(cfg->barcodes)));
     kseq_destroy(ksq);
-    FDB_FP_CLOSE(fp);
+    fdb_infile_close(fp);
     if (cfg->flag & FLG_VERBOSE) {
         printf("Parsed %zu barcodes from %s\n",
                 cfg->n_barcodes, cfg->barcode_file);
     }
+    /* The matcher gets the barcodes in the same order, so its assignments
+     * index cfg->barcodes */
+    bcd_seqs = km_calloc(cfg->n_barcodes + 1, sizeof(*bcd_seqs),
+            &km_onerr_print);
+    for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        bcd_seqs[bbb] = cfg->barcodes[bbb]->seq.s;
+    }
+    if (cfg->mcache != NULL) {
+        cfg->matcher = fdb_mcache_get(cfg->mcache, bcd_seqs, cfg->n_barcodes,
+                cfg->max_barcode_mismatches, cfg->buffer_seq,
+                cfg->max_buffer_mismatches);
+    } else if (cfg->index_file != NULL) {
+        cfg->matcher = fdb_matcher_load_index(cfg->index_file);
+        if (cfg->matcher != NULL && !fdb_matcher_is(cfg->matcher, bcd_seqs,
+                    cfg->n_barcodes, cfg->max_barcode_mismatches,
+                    cfg->buffer_seq, cfg->max_buffer_mismatches)) {
+            fprintf(stderr, "ERROR: index '%s' was not made from '%s' with "
+                    "these -m, -M and -B options\n", cfg->index_file,
+                    cfg->barcode_file);
+            fdb_matcher_destroy(cfg->matcher);
+            cfg->matcher = NULL;
+        }
+    } else {
+        cfg->matcher = fdb_matcher_new(bcd_seqs, cfg->n_barcodes,
+                cfg->max_barcode_mismatches, cfg->buffer_seq,
+                cfg->max_buffer_mismatches);
+        /* Large sets are matched by lookup; if they can't be indexed,
+         * they are scanned as before */
+        if (cfg->matcher != NULL && \
+                cfg->n_barcodes >= FDB_MATCHER_INDEX_MIN) {
+            fdb_matcher_compile(cfg->matcher);
+        }
+    }
+    free(bcd_seqs);
+    if (cfg->matcher == NULL) {
+        fprintf(stderr, "ERROR: could not set up barcode matching\n");
+        return 1;
+    }
+    if (cfg->flag & FLG_VERBOSE && cfg->matcher->index != NULL) {
+        printf("Matching barcodes with a %zu byte index\n",
+                cfg->matcher->index_size);
+    }
     return 0;
 } /* -----  end of function parse_barcode_file  ----- */
 
@@ -121,7 +133,7 @@ print_usage ()
 {
     printf("fastDBarcode %s\n\n", FDB_VERSION);
     printf("USAGE:\n");
-    printf("\tfastDBarcode [-m -M -B -v -o -s -z] <barcode_file> <fq_file> ...\n\n");
+    printf("\tfastDBarcode [-m -M -B -v -o -s -z -c -r] <barcode_file> <fq_file> ...\n\n");
     printf("\tfastDBarcode -h\n\n");
     printf("OPTIONS:\n");
     printf("\t-m BCD_MISMATCH\tThe maximal hamming distance between barcode\n");
@@ -133,11 +145,272 @@ print_usage ()
     printf("\t-l\t\tLeftover file suffix. [DEFAULT \"_leftover\"]\n");
     printf("\t-o\t\tOutput directory. [DEFAULT dirname(input) for each file]\n");
     printf("\t-z\t\tWrite output fastqs as zipped files.\n");
+    printf("\t--compress EXT\tCompress outputs with the codec for EXT (gz");
+#ifdef FDB_HAVE_ZSTD
+    printf(", zst");
+#endif
+    printf(").\n");
+    printf("\t--level N\tCompression level. [DEFAULT %d for gz]\n",
+            fdb_codec_by_ext(FDB_FP_ZIP_EXT)->default_level);
+    printf("\t-x INDEX\tMatch with INDEX, made by `fastDBarcode index` from\n");
+    printf("\t\t\tbarcode_file and the same -m, -M and -B.\n");
+    printf("\t-c CKPT_FILE\tCheckpoint progress to CKPT_FILE.\n");
+    printf("\t--checkpoint-every N\n");
+    printf("\t\t\tReads between checkpoints. [DEFAULT %d]\n",
+            FDB_CKPT_EVERY_DEFAULT);
+    printf("\t-r, --resume\tResume an interrupted run from CKPT_FILE.\n");
+    printf("\t-w WRITERS\tOutput writer/compressor threads. [DEFAULT 0]\n");
+    printf("\t-t THREADS\tMatching threads. Outputs are written out of order\n");
+    printf("\t\t\twith more than one. Threads are spread across NUMA\n");
+    printf("\t\t\tnodes. [DEFAULT 1]\n");
+    printf("\t--queue-mem MB\tMemory for queued output. [DEFAULT %u]\n",
+            FDB_OUTQ_MEM_DEFAULT >> 20);
+    printf("\t--max-mem MB\tFit batches, queued output and output buffers in\n");
+    printf("\t\t\tMB, flushing the least recently written outputs'\n");
+    printf("\t\t\tbuffers when they don't all fit.\n");
+    printf("\t--io BACKEND\tOutput I/O: sync, threads or uring. [DEFAULT uring,\n");
+    printf("\t\t\tor threads if io_uring is unavailable]\n");
+    printf("\t--io-threads N\tThreads for --io threads. [DEFAULT %d]\n",
+            FDB_AIO_THREADS_DEFAULT);
+    printf("\t--io-depth N\tWrites in flight per output file. [DEFAULT %d]\n",
+            FDB_AIO_DEPTH_DEFAULT);
+    printf("\t--direct\tWrite outputs with O_DIRECT, bypassing the page cache.\n");
+    printf("\t--stats FILE\tWrite per-barcode QC statistics to FILE as JSON.\n");
+    printf("\t--rescue P\tGive leftovers a second chance at the end, assigning\n");
+    printf("\t\t\tthose with a barcode at least P probable under\n");
+    printf("\t\t\terror rates learnt from the assigned reads.\n");
+    printf("\t--min-len N\tFilter reads shorter than N, or than the longest\n");
+    printf("\t\t\tbarcode if N is \"auto\". Filtered reads are written,\n");
+    printf("\t\t\tunmatched, to <input>_filtered.\n");
+    printf("\t--max-n F\tFilter reads with more than F of their bases N.\n");
+    printf("\t--contaminants FASTA\n");
+    printf("\t\t\tFilter reads sharing most k-mers with FASTA's\n");
+    printf("\t\t\tsequences, e.g. PhiX or adapter dimers.\n");
+    printf("\t--contam-k K\tk-mer length for --contaminants. [DEFAULT %d]\n",
+            FDB_FILTER_K_DEFAULT);
+    printf("\t--status FILE\tKeep FILE updated with progress, rates, ETA and\n");
+    printf("\t\t\tbarcode counts as JSON.\n");
+    printf("\t--status-every S\n");
+    printf("\t\t\tSeconds between --status updates. [DEFAULT %d]\n",
+            FDB_STATUS_EVERY_DEFAULT);
+    printf("\t--range START:END\n");
+    printf("\t\t\tOnly process records starting within this range of\n");
+    printf("\t\t\tuncompressed bytes of a single input file.\n");
+    printf("\n\tfastDBarcode gzindex [-s SPAN_MB] [-k N] <fq.gz> ...\n");
+    printf("\t\t\tIndex gzipped inputs for --range, printing N ranges.\n");
+    printf("\tfastDBarcode merge <out_file> <part_file> ...\n");
+    printf("\t\t\tConcatenate per-range outputs.\n");
+    printf("\tfastDBarcode index [-m -M -B] <barcode_file> <index_file>\n");
+    printf("\t\t\tCompile barcodes into an index for -x.\n");
+    printf("\tfastDBarcode sheet [-j JOBS] [OPTIONS] <sample_sheet.tsv>\n");
+    printf("\t\t\tRun every job in a sample sheet of lines\n");
+    printf("\t\t\t<input>\\t<barcode_file>\\t[output_prefix], JOBS at a\n");
+    printf("\t\t\ttime. [DEFAULT one per CPU]\n");
     printf("\t-v\t\tBe more verbose.\n");
     printf("\t-h\t\tProvide some help.\n");
     return EXIT_SUCCESS;
 }
 
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_setup_aio
+ *  Description:  Starts the I/O engine outputs are written through, as
+ *                  cfg's --io options ask.
+ * Return Value:  fdb_aio_t *: the engine, or NULL on failure
+ * ============================================================================
+ */
+fdb_aio_t *
+fdb_setup_aio (const fdb_config_t *cfg)
+{
+    fdb_aio_t *aio = fdb_aio_create(cfg->io_backend, cfg->io_threads);
+    if (aio == NULL) {
+        fprintf(stderr, "ERROR: could not start output I/O\n");
+        return NULL;
+    }
+    aio->direct = cfg->io_direct;
+    if (cfg->io_depth > 0) {
+        aio->depth = cfg->io_depth;
+    }
+    if (cfg->flag & FLG_VERBOSE) {
+        printf("Writing outputs with %s I/O%s\n",
+                fdb_aio_backend_name(aio->backend),
+                cfg->io_direct ? " (O_DIRECT)" : "");
+    }
+    return aio;
+}
+
+/* Adds the sequences of cfg->contam_file to the filter's k-mers */
+static int
+parse_contaminants (fdb_config_t *cfg)
+{
+    fdb_infile_t *fp = fdb_infile_open(cfg->contam_file);
+    kseq_t *ksq = NULL;
+    char **seqs = NULL;
+    size_t *lens = NULL;
+    size_t n_seqs = 0, m_seqs = 0, n_kmers = 0;
+    int ret = 1;
+    if (fp == NULL) {
+        FDB_IO_ERROR(cfg->contam_file);
+        return 1;
+    }
+    /* Read them all first, to size the bloom filter */
+    ksq = kseq_init(fp);
+    while (kseq_read(ksq) >= 0) {
+        if (n_seqs == m_seqs) {
+            m_seqs = m_seqs ? m_seqs << 1 : 16;
+            seqs = km_realloc(seqs, m_seqs * sizeof(*seqs), &km_onerr_print);
+            lens = km_realloc(lens, m_seqs * sizeof(*lens), &km_onerr_print);
+            if (seqs == NULL || lens == NULL) goto exit;
+        }
+        seqs[n_seqs] = strdup(ksq->seq.s);
+        lens[n_seqs] = ksq->seq.l;
+        n_kmers += ksq->seq.l;
+        n_seqs++;
+    }
+    if (n_seqs == 0) {
+        fprintf(stderr, "ERROR: no contaminant sequences in '%s'\n",
+                cfg->contam_file);
+        goto exit;
+    }
+    if (fdb_filter_bloom(cfg->filter, cfg->contam_k, n_kmers)) goto exit;
+    for (size_t sss = 0; sss < n_seqs; sss++) {
+        fdb_filter_add(cfg->filter, seqs[sss], lens[sss]);
+    }
+    if (cfg->flag & FLG_VERBOSE) {
+        printf("Filtering reads like %zu contaminants from %s\n", n_seqs,
+                cfg->contam_file);
+    }
+    ret = 0;
+exit:
+    for (size_t sss = 0; sss < n_seqs; sss++) free(seqs[sss]);
+    free(seqs);
+    free(lens);
+    kseq_destroy(ksq);
+    fdb_infile_close(fp);
+    return ret;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  setup_filter
+ *  Description:  Makes cfg's pre-filter, if any of its checks are asked
+ *                  for. Needs the matcher, for --min-len auto.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+setup_filter (fdb_config_t *cfg)
+{
+    size_t min_len = cfg->filter_min_len;
+    if (cfg->filter_min_len == 0 && cfg->filter_max_n >= 1 && \
+            cfg->contam_file == NULL) {
+        return 0;
+    }
+    if (cfg->filter_min_len < 0) min_len = cfg->matcher->max_len;
+    cfg->filter = fdb_filter_new(min_len, cfg->filter_max_n);
+    cfg->filtered = km_calloc(cfg->n_infs * FDB_FILTER_N_REASONS,
+            sizeof(*cfg->filtered), &km_onerr_print);
+    cfg->filtered_fns = km_calloc(cfg->n_infs, sizeof(*cfg->filtered_fns),
+            &km_onerr_print);
+    cfg->filtered_outfps = km_calloc(cfg->n_infs,
+            sizeof(*cfg->filtered_outfps), &km_onerr_print);
+    if (cfg->filter == NULL || cfg->filtered == NULL || \
+            cfg->filtered_fns == NULL || cfg->filtered_outfps == NULL) {
+        return 1;
+    }
+    if (cfg->contam_file != NULL && parse_contaminants(cfg)) return 1;
+    if (cfg->ckpt != NULL && cfg->ckpt->filtered_lens == NULL) {
+        fprintf(stderr, "ERROR: checkpoint '%s' was made without filtering"
+                " reads\n", cfg->ckpt_file);
+        return 1;
+    }
+    if (cfg->flag & FLG_VERBOSE) {
+        printf("Filtering reads shorter than %zu or over %g N\n", min_len,
+                cfg->filter_max_n);
+    }
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  plan_memory
+ *  Description:  Fits cfg's buffers into --max-mem: batches of reads in
+ *                  flight and queued output blocks get up to a quarter
+ *                  each, and output files' buffers what's left. Files only
+ *                  hold buffers while they're written to, so if every
+ *                  file's can't fit at once, the least recently written
+ *                  are flushed and their buffers freed as needed (see
+ *                  fdb_outq_set_file_mem()). Small allocations, like the
+ *                  matcher and stats, aren't counted.
+ * Return Value:  int: 0 on success, 1 if the budget is too small
+ * ============================================================================
+ */
+static int
+plan_memory (fdb_config_t *cfg)
+{
+    const size_t batch = FDB_BATCH_BYTES + FDB_BATCH_READS * sizeof(fdb_rec_t);
+    const fdb_codec_t *codec = fdb_codec_by_ext(cfg->out_ext != NULL ? \
+            cfg->out_ext : "");
+    size_t quarter = cfg->max_mem / 4;
+    size_t n_streams = ((size_t)cfg->n_barcodes + 1 + (cfg->filter != NULL)) \
+            * cfg->n_infs;
+    size_t n_batches = 1, outq = 0, files = 0, obuf = 0, block = 0;
+    size_t per_file = 0, min_per_file = 0;
+    int n_writers = cfg->n_writers > 0 ? cfg->n_writers : 0;
+    int depth = 0;
+    if (cfg->n_threads > 1) {
+        /* Queued, one per worker, and the one being read */
+        int queued = 2 * cfg->n_threads;
+        while (queued > 1 && \
+                (queued + cfg->n_threads + 1) * batch > quarter) {
+            queued--;
+        }
+        cfg->batch_depth = queued;
+        n_batches = queued + cfg->n_threads + 1;
+    }
+    if (n_writers > 0) {
+        if (cfg->outq_mem > quarter) cfg->outq_mem = quarter;
+        /* fdb_outq_create() makes at least this many blocks */
+        outq = cfg->outq_mem;
+        if (outq < 2 * n_writers * FDB_OUTQ_BLOCK_SIZE) {
+            outq = 2 * n_writers * FDB_OUTQ_BLOCK_SIZE;
+        }
+    }
+    /* Output files' buffers, as fdb_ofile_open() sizes them */
+    block = codec != NULL && codec->ext != NULL ? FDB_OFILE_BLOCK : 0;
+    obuf = cfg->aio != NULL ? cfg->aio->buf_size : FDB_AIO_BUF_SIZE;
+    if (obuf < 2 * FDB_OFILE_BLOCK + FDB_AIO_ALIGN) {
+        obuf = 2 * FDB_OFILE_BLOCK + FDB_AIO_ALIGN;
+    }
+    depth = cfg->aio != NULL ? cfg->aio->depth : \
+            cfg->io_depth > 0 ? cfg->io_depth : FDB_AIO_DEPTH_DEFAULT;
+    per_file = block + depth * obuf;
+    min_per_file = cfg->aio == NULL && cfg->io_depth <= 0 ? \
+            block + obuf : per_file;
+    /* Each writer may be writing a file, and there's the one to write */
+    if (n_batches * batch + outq + (n_writers + 2) * min_per_file > \
+            cfg->max_mem) {
+        fprintf(stderr, "ERROR: --max-mem is too small for these options;"
+                " allow at least %zu MB\n", ((n_batches * batch + outq + \
+                        (n_writers + 2) * min_per_file) >> 20) + 1);
+        return 1;
+    }
+    files = cfg->max_mem - n_batches * batch - outq;
+    if (files < n_streams * per_file && per_file > min_per_file) {
+        /* Less written behind, so fewer files need parking */
+        cfg->io_depth = 1;
+        per_file = min_per_file;
+    }
+    cfg->file_mem = files < n_streams * per_file ? files : 0;
+    if (cfg->flag & FLG_VERBOSE) {
+        printf("Memory: %zu batches of reads, %zu MB of queued output, "
+                "%zu MB of output buffers for %zu of %zu outputs at once\n",
+                n_batches, outq >> 20, files >> 20,
+                cfg->file_mem ? files / per_file : n_streams, n_streams);
+    }
+    return 0;
+}
+
 /*
  * ===  FUNCTION  =============================================================
  *         Name:  setup_files
@@ -147,6 +420,45 @@ print_usage ()
 int
 setup_files (fdb_config_t *cfg)
 {
+    if (cfg->flag & FLG_RESUME) {
+        cfg->ckpt = fdb_ckpt_load(cfg->ckpt_file, cfg);
+        if (cfg->ckpt == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+    cfg->infn_bases = km_calloc(cfg->n_infs, sizeof(*(cfg->infn_bases)),
+            &km_onerr_print);
+    cfg->infn_exts = km_calloc(cfg->n_infs, sizeof(*(cfg->infn_exts)),
+            &km_onerr_print);
+    cfg->outf_dirs = km_calloc(cfg->n_infs, sizeof(*(cfg->outf_dirs)),
+            &km_onerr_print);
+    cfg->leftover_outfps = km_calloc(cfg->n_infs,
+            sizeof(*(cfg->leftover_outfps)), &km_onerr_print);
+    cfg->leftover_fns = km_calloc(cfg->n_infs,
+            sizeof(*(cfg->leftover_fns)), &km_onerr_print);
+    cfg->reads_processed = km_calloc(cfg->n_infs,
+            sizeof(*(cfg->reads_processed)), &km_onerr_print);
+    if (cfg->stats_file != NULL) {
+        cfg->stats = km_calloc(cfg->n_infs, sizeof(*cfg->stats),
+                &km_onerr_print);
+        if (cfg->stats == NULL) return EXIT_FAILURE;
+        for (int fff = 0; fff < cfg->n_infs; fff++) {
+            cfg->stats[fff] = fdb_stats_new(cfg->matcher);
+            if (cfg->stats[fff] == NULL) return EXIT_FAILURE;
+        }
+    }
+    if (cfg->rescue_prob > 0) {
+        cfg->rescue = fdb_rescue_new(cfg->matcher, cfg->rescue_prob);
+        if (cfg->rescue == NULL) return EXIT_FAILURE;
+    }
+    if (setup_filter(cfg)) return EXIT_FAILURE;
+    if (cfg->max_mem > 0 && plan_memory(cfg)) return EXIT_FAILURE;
+    if (cfg->aio == NULL) {
+        cfg->aio = fdb_setup_aio(cfg);
+        if (cfg->aio == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
     for (int fff = 0; fff < cfg->n_infs; fff++) {
         /* base/dirname have to work on a copy of str, it gets mangled*/
         char *infile = strdup(cfg->infns[fff]);
@@ -169,29 +481,88 @@ setup_files (fdb_config_t *cfg)
             infile_ext = strdup(temp + ext_offset + 1);
             free(temp);
         }
-        if (infile_ext != NULL && cfg->flag & FLG_ZIPPED_OUT) {
-            infile_ext = strcat(infile_ext, ".");
-            infile_ext = strcat(infile_ext, FDB_FP_ZIP_EXT);
+        /* Outputs are compressed according to out_ext, not however the
+         * input was, so drop the input's compression extension */
+        if (infile_ext != NULL) {
+            char *dot = strrchr(infile_ext, '.');
+            if (fdb_codec_by_ext(dot != NULL ? dot + 1 : infile_ext) != NULL) {
+                if (dot != NULL) {
+                    *dot = '\0';
+                } else {
+                    free(infile_ext);
+                    infile_ext = NULL;
+                }
+            }
+        }
+        if (cfg->out_ext != NULL) {
+            if (infile_ext == NULL) {
+                infile_ext = strdup(cfg->out_ext);
+            } else {
+                infile_ext = realloc(infile_ext, strlen(infile_ext) + \
+                        strlen(cfg->out_ext) + 2);
+                infile_ext = strcat(infile_ext, ".");
+                infile_ext = strcat(infile_ext, cfg->out_ext);
+            }
         }
         if (infile_ext == NULL) {
-            infile_ext = "";
+            infile_ext = strdup("");
         }
-        if (cfg->out_dir == NULL) {
+        if (cfg->out_prefix != NULL) {
+            /* base/dirname mangle their argument, as above */
+            temp = strdup(cfg->out_prefix);
+            free(infile_base);
+            infile_base = strdup(basename(temp));
+            strcpy(temp, cfg->out_prefix);
+            out_dir = strdup(dirname(temp));
+            free(temp);
+        } else if (cfg->out_dir == NULL) {
             out_dir = strdup(infile_dir);
         } else {
-            out_dir = cfg->out_dir;
+            out_dir = strdup(cfg->out_dir);
         }
+        free(infile_dir);
         cfg->infn_bases[fff] = infile_base;
         cfg->infn_exts[fff] = infile_ext;
         cfg->outf_dirs[fff] = out_dir;
         /* 3 = number of slashes/dots, + 1 \0 */
-        size_t leftover_name_len = strlen(cfg->out_dir) + strlen(infile_base) + \
+        size_t leftover_name_len = strlen(out_dir) + strlen(infile_base) + \
                    strlen(cfg->leftover_suffix) + strlen(infile_ext) + 3 + 1;
         temp = calloc(leftover_name_len, sizeof(*temp));
         snprintf(temp, leftover_name_len - 1, "%s/%s%s.%s", out_dir,
                 infile_base, cfg->leftover_suffix, infile_ext);
-        cfg->leftover_outfps[fff] = FDB_FP_OPEN(temp, cfg->out_mode);
-        free(temp);
+        cfg->leftover_fns[fff] = temp;
+        if (cfg->ckpt != NULL) {
+            cfg->leftover_outfps[fff] = fdb_ckpt_reopen(temp,
+                    cfg->ckpt->leftover_lens[fff], cfg->level, cfg->aio);
+        } else {
+            cfg->leftover_outfps[fff] = fdb_ofile_open(temp, cfg->level, 0,
+                    cfg->aio);
+        }
+        if (cfg->leftover_outfps[fff] == NULL) {
+            fprintf(stderr, "ERROR: Could not open output file '%s'\n", temp);
+            return EXIT_FAILURE;
+        }
+        if (cfg->filter != NULL) {
+            /* As the leftovers' name; 9 = strlen("_filtered") */
+            size_t filtered_name_len = strlen(out_dir) + \
+                    strlen(infile_base) + 9 + strlen(infile_ext) + 3 + 1;
+            temp = calloc(filtered_name_len, sizeof(*temp));
+            snprintf(temp, filtered_name_len - 1, "%s/%s_filtered.%s",
+                    out_dir, infile_base, infile_ext);
+            cfg->filtered_fns[fff] = temp;
+            if (cfg->ckpt != NULL) {
+                cfg->filtered_outfps[fff] = fdb_ckpt_reopen(temp,
+                        cfg->ckpt->filtered_lens[fff], cfg->level, cfg->aio);
+            } else {
+                cfg->filtered_outfps[fff] = fdb_ofile_open(temp, cfg->level,
+                        0, cfg->aio);
+            }
+            if (cfg->filtered_outfps[fff] == NULL) {
+                fprintf(stderr, "ERROR: Could not open output file '%s'\n",
+                        temp);
+                return EXIT_FAILURE;
+            }
+        }
         free(infile);
     }
     /* Setup output files */
@@ -211,8 +582,15 @@ setup_files (fdb_config_t *cfg)
                         cfg->infn_bases[fff], cfg->barcodes[bbb]->name.s);
             }
             cfg->barcodes[bbb]->fns[fff] = strdup(temp2);
-            cfg->barcodes[bbb]->fps[fff] = FDB_FP_OPEN(cfg->barcodes[bbb]->fns[fff],
-                    cfg->out_mode);
+            if (cfg->ckpt != NULL) {
+                cfg->barcodes[bbb]->fps[fff] = fdb_ckpt_reopen(temp2,
+                        cfg->ckpt->out_lens[bbb * cfg->n_infs + fff],
+                        cfg->level, cfg->aio);
+            } else {
+                cfg->barcodes[bbb]->fps[fff] = fdb_ofile_open(
+                        cfg->barcodes[bbb]->fns[fff], cfg->level, 0,
+                        cfg->aio);
+            }
             if (cfg->barcodes[bbb]->fps[fff] == NULL) {
                 fprintf(stderr, "ERROR: Could not open output file '%s'\n",
                         temp2);
@@ -220,11 +598,80 @@ setup_files (fdb_config_t *cfg)
             }
             if (cfg->flag & FLG_VERY_VERBOSE) {
                 printf("outfile for %s with barcode %s is %s (bcd #%i)\n",
-                        cfg->barcodes[bbb]->fns[fff], cfg->barcodes[bbb]->name.s,
-                        cfg->barcodes[bbb]->fps[fff], bbb);
+                        cfg->infns[fff], cfg->barcodes[bbb]->name.s,
+                        cfg->barcodes[bbb]->fns[fff], bbb);
             }
         }
     } /* End of setup of output files }}} */
+    /* Restore position, counts and progress from checkpoint */
+    if (cfg->ckpt != NULL) {
+        fdb_ckpt_t *ckpt = cfg->ckpt;
+        for (int bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+            cfg->barcodes[bbb]->count = ckpt->counts[bbb];
+        }
+        for (int fff = 0; fff < cfg->n_infs; fff++) {
+            cfg->reads_processed[fff] = ckpt->reads_processed[fff];
+        }
+        if (cfg->filter != NULL) {
+            memcpy(cfg->filtered, ckpt->filtered, cfg->n_infs * \
+                    FDB_FILTER_N_REASONS * sizeof(*cfg->filtered));
+        }
+        if (ckpt->cur_inf < cfg->n_infs) {
+            kseq_t *seq = cfg->in_kseqs[ckpt->cur_inf];
+            if (fdb_infile_seek(seq->f->f, ckpt->in_offset) != 0) {
+                fprintf(stderr, "ERROR: Could not seek to %" PRIu64 " in '%s'\n",
+                        ckpt->in_offset, cfg->infns[ckpt->cur_inf]);
+                return EXIT_FAILURE;
+            }
+        }
+        if (cfg->flag & FLG_VERBOSE) {
+            printf("Resuming from record at %" PRIu64 " of input %d\n",
+                    ckpt->in_offset, ckpt->cur_inf);
+        }
+    } else if (cfg->range_start > 0) {
+        /* Start from the first whole record in the range */
+        if (fdb_infile_resync(cfg->in_kseqs[0]->f->f, cfg->range_start)) {
+            fprintf(stderr, "ERROR: Could not find a record at %" PRIu64
+                    " in '%s'\n", cfg->range_start, cfg->infns[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    /* Output queues, one stream per barcode per input, then leftovers,
+     * then filtered reads */
+    size_t n_streams = cfg->filter != NULL ? \
+            FDB_STREAM_FILTERED(cfg, cfg->n_infs) : \
+            FDB_STREAM_LEFTOVER(cfg, cfg->n_infs);
+    int *stream_node = NULL;
+    fdb_ofile_t **fps = km_calloc(n_streams, sizeof(*fps), &km_onerr_print);
+    for (int bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        for (int fff = 0; fff < cfg->n_infs; fff++) {
+            fps[FDB_STREAM_BCD(cfg, bbb, fff)] = cfg->barcodes[bbb]->fps[fff];
+        }
+    }
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        fps[FDB_STREAM_LEFTOVER(cfg, fff)] = cfg->leftover_outfps[fff];
+        if (cfg->filter != NULL) {
+            fps[FDB_STREAM_FILTERED(cfg, fff)] = cfg->filtered_outfps[fff];
+        }
+    }
+    if (cfg->n_threads > 1 && fdb_numa_nodes() > 1) {
+        /* Each barcode's outputs are written on one node */
+        stream_node = km_calloc(n_streams, sizeof(*stream_node),
+                &km_onerr_print);
+        for (size_t sss = 0; sss < n_streams && stream_node != NULL; sss++) {
+            stream_node[sss] = sss / cfg->n_infs;
+        }
+    }
+    cfg->outq = fdb_outq_create(fps, n_streams, cfg->n_writers, cfg->outq_mem,
+            stream_node);
+    free(fps);
+    free(stream_node);
+    if (cfg->outq == NULL || \
+            (cfg->outq_prod = fdb_outq_producer_new(cfg->outq)) == NULL) {
+        fprintf(stderr, "ERROR: could not start output writers\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg->file_mem > 0) fdb_outq_set_file_mem(cfg->outq, cfg->file_mem);
     return 0;
 }
 
@@ -235,11 +682,103 @@ cmp_barcode_t_rev (const void *left, const void *right)
     return ((int)bcd_r->count - (int)bcd_l->count);
 }
 
+/* Options with no short equivalent */
+enum {
+    FDB_OPT_CKPT_EVERY = 256,
+    FDB_OPT_RANGE,
+    FDB_OPT_QUEUE_MEM,
+    FDB_OPT_COMPRESS,
+    FDB_OPT_LEVEL,
+    FDB_OPT_IO,
+    FDB_OPT_IO_THREADS,
+    FDB_OPT_IO_DEPTH,
+    FDB_OPT_DIRECT,
+    FDB_OPT_STATS,
+    FDB_OPT_RESCUE,
+    FDB_OPT_THREADS,
+    FDB_OPT_MIN_LEN,
+    FDB_OPT_MAX_N,
+    FDB_OPT_CONTAM,
+    FDB_OPT_CONTAM_K,
+    FDB_OPT_STATUS,
+    FDB_OPT_STATUS_EVERY,
+    FDB_OPT_MAX_MEM,
+};
+
+static const struct option fdb_long_opts[] = {
+    {"help",              no_argument,       NULL, 'h'},
+    {"verbose",           no_argument,       NULL, 'v'},
+    {"zip",               no_argument,       NULL, 'z'},
+    {"resume",            no_argument,       NULL, 'r'},
+    {"mismatch",          required_argument, NULL, 'm'},
+    {"buffer-mismatch",   required_argument, NULL, 'M'},
+    {"buffer",            required_argument, NULL, 'B'},
+    {"suffix",            required_argument, NULL, 's'},
+    {"outdir",            required_argument, NULL, 'o'},
+    {"leftover-suffix",   required_argument, NULL, 'l'},
+    {"index",             required_argument, NULL, 'x'},
+    {"checkpoint",        required_argument, NULL, 'c'},
+    {"checkpoint-every",  required_argument, NULL, FDB_OPT_CKPT_EVERY},
+    {"range",             required_argument, NULL, FDB_OPT_RANGE},
+    {"writers",           required_argument, NULL, 'w'},
+    {"jobs",              required_argument, NULL, 'j'},
+    {"queue-mem",         required_argument, NULL, FDB_OPT_QUEUE_MEM},
+    {"compress",          required_argument, NULL, FDB_OPT_COMPRESS},
+    {"level",             required_argument, NULL, FDB_OPT_LEVEL},
+    {"io",                required_argument, NULL, FDB_OPT_IO},
+    {"io-threads",        required_argument, NULL, FDB_OPT_IO_THREADS},
+    {"io-depth",          required_argument, NULL, FDB_OPT_IO_DEPTH},
+    {"direct",            no_argument,       NULL, FDB_OPT_DIRECT},
+    {"stats",             required_argument, NULL, FDB_OPT_STATS},
+    {"rescue",            required_argument, NULL, FDB_OPT_RESCUE},
+    {"threads",           required_argument, NULL, 't'},
+    {"min-len",           required_argument, NULL, FDB_OPT_MIN_LEN},
+    {"max-n",             required_argument, NULL, FDB_OPT_MAX_N},
+    {"contaminants",      required_argument, NULL, FDB_OPT_CONTAM},
+    {"contam-k",          required_argument, NULL, FDB_OPT_CONTAM_K},
+    {"status",            required_argument, NULL, FDB_OPT_STATUS},
+    {"status-every",      required_argument, NULL, FDB_OPT_STATUS_EVERY},
+    {"max-mem",           required_argument, NULL, FDB_OPT_MAX_MEM},
+    {NULL,                0,                 NULL, 0}
+};
+
+/* Parses START:END (END may be empty, meaning end of file) */
+static int
+parse_range (const char *str, uint64_t *start, uint64_t *end)
+{
+    char *colon = NULL;
+    *start = strtoull(str, &colon, 10);
+    if (colon == str || *colon != ':') return 1;
+    if (colon[1] == '\0') {
+        *end = UINT64_MAX;
+        return 0;
+    }
+    *end = strtoull(colon + 1, &colon, 10);
+    return *colon != '\0' || *end <= *start;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  parse_options
+ *  Description:  Parses and checks the options shared by the main command
+ *                  and `sheet`, leaving optind at the first positional
+ *                  argument.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
 int
-parse_args (fdb_config_t *cfg, int argc, char **argv)
+parse_options (fdb_config_t *cfg, int argc, char **argv)
 {
-    char c;
-    while ((c = getopt(argc, argv, "hvzm:M:B:s:o:l:")) != -1) {
+    int c;
+    cfg->ckpt_every = FDB_CKPT_EVERY_DEFAULT;
+    cfg->outq_mem = FDB_OUTQ_MEM_DEFAULT;
+    cfg->level = -1;
+    cfg->io_backend = FDB_AIO_URING;
+    cfg->filter_max_n = 1;
+    cfg->contam_k = FDB_FILTER_K_DEFAULT;
+    cfg->status_every = FDB_STATUS_EVERY_DEFAULT;
+    while ((c = getopt_long(argc, argv, "hvzrm:M:B:s:o:l:c:w:j:x:t:", fdb_long_opts,
+                    NULL)) != -1) {
         switch (c) {
             case 'm':
                 cfg->max_barcode_mismatches = atoi(optarg);
@@ -261,6 +800,122 @@ parse_args (fdb_config_t *cfg, int argc, char **argv)
                 break;
             case 'z':
                 cfg->flag |= FLG_ZIPPED_OUT;
+                km_free(cfg->out_ext, &km_onerr_nil);
+                cfg->out_ext = strdup(FDB_FP_ZIP_EXT);
+                break;
+            case FDB_OPT_COMPRESS:
+                cfg->flag |= FLG_ZIPPED_OUT;
+                km_free(cfg->out_ext, &km_onerr_nil);
+                cfg->out_ext = strdup(optarg);
+                break;
+            case FDB_OPT_LEVEL:
+                cfg->level = atoi(optarg);
+                break;
+            case FDB_OPT_IO:
+                if (strcmp(optarg, "sync") == 0) {
+                    cfg->io_backend = FDB_AIO_SYNC;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    cfg->io_backend = FDB_AIO_THREADS;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    cfg->io_backend = FDB_AIO_URING;
+                } else {
+                    fprintf(stderr, "ERROR: unknown I/O backend '%s'\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case FDB_OPT_IO_THREADS:
+                cfg->io_threads = atoi(optarg);
+                break;
+            case FDB_OPT_IO_DEPTH:
+                cfg->io_depth = atoi(optarg);
+                break;
+            case FDB_OPT_DIRECT:
+                cfg->io_direct = 1;
+                break;
+            case FDB_OPT_STATS:
+                cfg->stats_file = strdup(optarg);
+                break;
+            case FDB_OPT_RESCUE:
+                cfg->rescue_prob = strtod(optarg, NULL);
+                if (!(cfg->rescue_prob > 0.5 && cfg->rescue_prob < 1)) {
+                    fprintf(stderr, "ERROR: --rescue needs a probability"
+                            " between 0.5 and 1\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case FDB_OPT_MIN_LEN:
+                if (strcmp(optarg, "auto") == 0) {
+                    cfg->filter_min_len = -1;
+                } else if ((cfg->filter_min_len = atoi(optarg)) < 0) {
+                    fprintf(stderr, "ERROR: bad --min-len '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case FDB_OPT_MAX_N:
+                cfg->filter_max_n = strtod(optarg, NULL);
+                if (!(cfg->filter_max_n >= 0 && cfg->filter_max_n <= 1)) {
+                    fprintf(stderr, "ERROR: --max-n needs a fraction between"
+                            " 0 and 1\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case FDB_OPT_CONTAM:
+                km_free(cfg->contam_file, &km_onerr_nil);
+                cfg->contam_file = strdup(optarg);
+                break;
+            case FDB_OPT_CONTAM_K:
+                cfg->contam_k = atoi(optarg);
+                if (cfg->contam_k < 1 || cfg->contam_k > FDB_FILTER_K_MAX) {
+                    fprintf(stderr, "ERROR: --contam-k must be 1 to %d\n",
+                            FDB_FILTER_K_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case FDB_OPT_STATUS:
+                km_free(cfg->status_file, &km_onerr_nil);
+                cfg->status_file = strdup(optarg);
+                break;
+            case FDB_OPT_STATUS_EVERY:
+                cfg->status_every = strtod(optarg, NULL);
+                if (!(cfg->status_every > 0)) {
+                    fprintf(stderr, "ERROR: --status-every needs a number of"
+                            " seconds\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'x':
+                cfg->index_file = strdup(optarg);
+                break;
+            case 'c':
+                cfg->ckpt_file = strdup(optarg);
+                break;
+            case FDB_OPT_CKPT_EVERY:
+                cfg->ckpt_every = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                cfg->flag |= FLG_RESUME;
+                break;
+            case 'w':
+                cfg->n_writers = atoi(optarg);
+                break;
+            case 't':
+                cfg->n_threads = atoi(optarg);
+                break;
+            case 'j':
+                cfg->n_jobs = atoi(optarg);
+                break;
+            case FDB_OPT_QUEUE_MEM:
+                cfg->outq_mem = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case FDB_OPT_MAX_MEM:
+                cfg->max_mem = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case FDB_OPT_RANGE:
+                if (parse_range(optarg, &cfg->range_start, &cfg->range_end)) {
+                    fprintf(stderr, "ERROR: bad range '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
             case 'v':
                 if (! cfg->flag & FLG_VERBOSE) {
@@ -272,8 +927,7 @@ parse_args (fdb_config_t *cfg, int argc, char **argv)
                 break;
             case 'h':
                 print_usage();
-                return EXIT_SUCCESS;
-                break;
+                exit(EXIT_SUCCESS);
             case '?':
                 fprintf(stderr, "Bad argument -%c\n", c);
                 print_usage();
@@ -283,132 +937,703 @@ parse_args (fdb_config_t *cfg, int argc, char **argv)
     if (cfg->flag & FLG_VERBOSE) {
         printf("Being verbose.\n");
     }
+    if (cfg->leftover_suffix == NULL) {
+        cfg->leftover_suffix = strdup("_leftover");
+    }
+    if (cfg->ckpt_every == 0) {
+        cfg->ckpt_every = FDB_CKPT_EVERY_DEFAULT;
+    }
+    if (cfg->rescue_prob > 0 && (cfg->ckpt_file != NULL || \
+                cfg->flag & FLG_RESUME)) {
+        /* Held back leftovers would be lost from a checkpoint */
+        fprintf(stderr, "ERROR: --rescue can't be used with checkpoints\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg->n_threads < 1) {
+        cfg->n_threads = 1;
+    }
+    if (cfg->n_threads > 1 && (cfg->ckpt_file != NULL || \
+                cfg->rescue_prob > 0)) {
+        /* Both need reads finished in input order */
+        fprintf(stderr, "ERROR: -t can't be used with checkpoints or"
+                " --rescue\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg->n_threads > 1 && cfg->n_writers < 1) {
+        /* Without writers, every thread would write to the files */
+        cfg->n_writers = fdb_numa_nodes();
+    }
+    if (cfg->out_ext != NULL) {
+        const fdb_codec_t *codec = fdb_codec_by_ext(cfg->out_ext);
+        if (codec == NULL) {
+            fprintf(stderr, "ERROR: no compression available for '.%s'"
+                    " outputs\n", cfg->out_ext);
+            return EXIT_FAILURE;
+        }
+        if (cfg->level > codec->max_level) {
+            fprintf(stderr, "ERROR: %s compression levels go up to %d\n",
+                    codec->name, codec->max_level);
+            return EXIT_FAILURE;
+        }
+        if (cfg->flag & FLG_VERBOSE) {
+            printf("Compressing outputs with %s, level %d\n", codec->name,
+                    cfg->level < 0 ? codec->default_level : cfg->level);
+        }
+    }
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  open_inputs
+ *  Description:  Opens cfg's n_infs input files, named in cfg->infns
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+open_inputs (fdb_config_t *cfg)
+{
+    cfg->in_kseqs = km_calloc(cfg->n_infs, sizeof(*(cfg->in_kseqs)),
+            &km_onerr_print);
+    for (int infile_index = 0; infile_index < cfg->n_infs; infile_index++) {
+        fdb_infile_t *infile_ptr = fdb_infile_open(cfg->infns[infile_index]);
+        if (infile_ptr == NULL) {
+            FDB_IO_ERROR(cfg->infns[infile_index]);
+            return EXIT_FAILURE;
+        }
+        cfg->in_kseqs[infile_index] = kseq_init(infile_ptr);
+        if (cfg->flag & FLG_VERBOSE) {
+            printf("Using '%s' as an input file\n", cfg->infns[infile_index]);
+        }
+    }
+    return 0;
+}
+
+int
+parse_args (fdb_config_t *cfg, int argc, char **argv)
+{
+    if (parse_options(cfg, argc, argv) != 0) {
+        return EXIT_FAILURE;
+    }
     int arg_index = optind;
     if ((arg_index + 1) < argc) {
-        FDB_FP_TYPE infile_ptr;
         cfg->barcode_file = strdup(argv[arg_index++]);
         cfg->n_infs = argc - arg_index;
         cfg->infns = km_calloc(cfg->n_infs, sizeof(*(cfg->infns)),
                 &km_onerr_print);
-        cfg->in_kseqs = km_calloc(cfg->n_infs, sizeof(*(cfg->in_kseqs)),
-                &km_onerr_print);
         for (int infile_index = 0; infile_index < cfg->n_infs; infile_index++) {
             cfg->infns[infile_index] = strdup(argv[arg_index++]);
-            infile_ptr = FDB_FP_OPEN(cfg->infns[infile_index], "r");
-            if (infile_ptr == NULL) {
-                FDB_IO_ERROR(cfg->infns[infile_index]);
-            }
-            cfg->in_kseqs[infile_index] = kseq_init(infile_ptr);
-            if (cfg->flag & FLG_VERBOSE) {
-                printf("Using '%s' as an input file\n", cfg->infns[infile_index]);
-            }
         }
     } else {
         fprintf(stderr, "ERROR: insufficent number of arguments\n");
         print_usage();
         return EXIT_FAILURE;
     }
-    if (cfg->leftover_suffix == NULL) {
-        cfg->leftover_suffix = strdup("_leftover");
+    if (cfg->range_end > 0 && cfg->n_infs != 1) {
+        fprintf(stderr, "ERROR: --range needs exactly one input file\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg->range_end == 0) {
+        cfg->range_end = UINT64_MAX;
+    }
+    if (cfg->flag & FLG_RESUME && cfg->ckpt_file == NULL) {
+        fprintf(stderr, "ERROR: --resume requires a checkpoint file (-c)\n");
+        return EXIT_FAILURE;
     }
-    cfg->out_mode = (cfg->flag & FLG_ZIPPED_OUT)? FDB_ZIP_MODE: FDB_NONZIP_MODE;
     /* End of argument parsing }}} */
-    cfg->infn_bases = km_calloc(cfg->n_infs, sizeof(*(cfg->infn_bases)),
-            &km_onerr_print);
-    cfg->infn_exts = km_calloc(cfg->n_infs, sizeof(*(cfg->infn_exts)),
+    return open_inputs(cfg);
+}
+
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  write_record
+ *  Description:  Writes a read, with trim bases cut from its start, to
+ *                  barcode bcd's output, or (if FDB_NO_MATCH) to the
+ *                  leftovers, or (if FDB_FILTERED) to the filtered reads.
+ *                  The record is formatted straight into the output
+ *                  queue's block. Writes and counts go through res's
+ *                  producer and counters, if it has them.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+write_record (fdb_config_t *cfg, const fdb_results_t *res,
+              const fdb_batch_t *b, const fdb_rec_t *rec, int bcd,
+              size_t trim, size_t score)
+{
+    size_t this_out_stream;
+    size_t out_len = fdb_rec_fastq_len(rec, trim);
+    fdb_outq_producer_t *prod = cfg->outq_prod;
+    char *out = NULL;
+    if (res != NULL && res->outq_prod != NULL) prod = res->outq_prod;
+    if (bcd == FDB_FILTERED) {
+        this_out_stream = FDB_STREAM_FILTERED(cfg, b->inf);
+    } else if (bcd != FDB_NO_MATCH) {
+        this_out_stream = FDB_STREAM_BCD(cfg, bcd, b->inf);
+        if (res != NULL && res->counts != NULL) {
+            /* Only this thread writes it, but --status reads it */
+            __atomic_store_n(&res->counts[bcd], res->counts[bcd] + 1,
+                    __ATOMIC_RELAXED);
+        } else {
+            cfg->barcodes[bcd]->count++;
+        }
+    } else {
+        this_out_stream = FDB_STREAM_LEFTOVER(cfg, b->inf);
+    }
+    out = fdb_outq_reserve(prod, this_out_stream, out_len);
+    if (out == NULL) return 1;
+    fdb_rec_fastq(b, rec, trim, out);
+    /* Be verbose about things if we're aksed to */
+    if (cfg->flag & FLG_VERY_VERBOSE) {
+        if (bcd == FDB_FILTERED) {
+            printf("seq %s is filtered.\n", FDB_REC_NAME(b, rec));
+        } else if (bcd != FDB_NO_MATCH) {
+            printf("seq %s is from barcode %s with score of %zu.\n",
+                    FDB_REC_NAME(b, rec), cfg->barcodes[bcd]->name.s,
+                    score);
+        } else {
+            printf("seq %s is from none of the barcodes.\n",
+                    FDB_REC_NAME(b, rec));
+        }
+#ifdef FDB_DEBUG
+        printf("%.*s\n", (int)out_len, out);
+#endif
+    }
+    return fdb_outq_commit(prod, this_out_stream, out_len);
+} /* -----  end of function write_record  ----- */
+
+/* Counts a read of input inf as processed, with a dot every so often */
+static inline void
+count_read (fdb_config_t *cfg, int inf)
+{
+    if (++cfg->reads_processed[inf] % BREAK_EVERY_X_SEQS == 0 && \
+            !(cfg->flag & FLG_SHEET_JOB)) {
+        printf("."); fflush(stdout);
+    }
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_process_batch
+ *  Description:  Matches a batch of reads against cfg's barcodes and writes
+ *                  each to its output. Reads cfg's filter fails are written
+ *                  out first, and never reach the matcher. res holds the
+ *                  matcher's working arrays between batches.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_process_batch (fdb_config_t *cfg, const fdb_batch_t *batch,
+                   fdb_results_t *res)
+{
+    const fdb_matcher_t *m = res->matcher ? res->matcher : cfg->matcher;
+    uint64_t *filtered = res->filtered ? res->filtered : cfg->filtered;
+    fdb_stats_t *stats = NULL;
+    size_t n_pass = 0, ppp = 0;
+    if (cfg->stats != NULL) {
+        stats = (res->stats ? res->stats : cfg->stats)[batch->inf];
+    }
+    if (batch->n_recs > res->m_recs) {
+        res->m_recs = batch->n_recs;
+        kroundup32(res->m_recs);
+        res->seqs = km_realloc(res->seqs, res->m_recs * sizeof(*res->seqs),
+                &km_onerr_print);
+        res->lens = km_realloc(res->lens, res->m_recs * sizeof(*res->lens),
+                &km_onerr_print);
+        res->assign = km_realloc(res->assign,
+                res->m_recs * sizeof(*res->assign), &km_onerr_print);
+        res->trim = km_realloc(res->trim, res->m_recs * sizeof(*res->trim),
+                &km_onerr_print);
+        res->mismatches = km_realloc(res->mismatches,
+                res->m_recs * sizeof(*res->mismatches), &km_onerr_print);
+        res->reasons = km_realloc(res->reasons,
+                res->m_recs * sizeof(*res->reasons), &km_onerr_print);
+        if (res->seqs == NULL || res->lens == NULL || res->assign == NULL || \
+                res->trim == NULL || res->mismatches == NULL || \
+                res->reasons == NULL) return 1;
+    }
+    /* The matcher only sees reads that pass, packed together */
+    for (size_t rrr = 0; rrr < batch->n_recs; rrr++) {
+        const fdb_rec_t *rec = &batch->recs[rrr];
+        res->reasons[rrr] = FDB_FILTER_PASS;
+        if (cfg->filter != NULL) {
+            res->reasons[rrr] = fdb_filter_check(cfg->filter,
+                    FDB_REC_SEQ(batch, rec), rec->seq_l);
+            if (res->reasons[rrr] != FDB_FILTER_PASS) continue;
+        }
+        res->seqs[n_pass] = FDB_REC_SEQ(batch, rec);
+        res->lens[n_pass] = rec->seq_l;
+        n_pass++;
+    }
+    fdb_matcher_classify(m, res->seqs, res->lens, n_pass, res->assign,
+            res->trim, res->mismatches);
+    for (size_t rrr = 0; rrr < batch->n_recs; rrr++) {
+        const fdb_rec_t *rec = &batch->recs[rrr];
+        if (res->reasons[rrr] != FDB_FILTER_PASS) {
+            filtered[FDB_FILTERED_IDX(batch->inf, res->reasons[rrr])]++;
+            if (write_record(cfg, res, batch, rec, FDB_FILTERED, 0, 0)) {
+                fprintf(stderr, "ERROR: writing output failed\n");
+                return 1;
+            }
+            if (res->counts == NULL) count_read(cfg, batch->inf);
+            continue;
+        }
+        if (cfg->rescue != NULL) {
+            fdb_rescue_learn(cfg->rescue, cfg->matcher,
+                    FDB_REC_SEQ(batch, rec), rec->seq_l, res->assign[ppp],
+                    res->mismatches[ppp]);
+        }
+        if (cfg->rescue != NULL && res->assign[ppp] == FDB_NO_MATCH) {
+            /* Written, and counted, by fdb_rescue_leftovers() */
+            if (fdb_batch_spill(batch, rec, cfg->rescue->spill)) {
+                fprintf(stderr, "ERROR: Could not spill leftover reads\n");
+                return 1;
+            }
+            cfg->rescue->n_spilled++;
+        } else {
+            if (write_record(cfg, res, batch, rec, res->assign[ppp],
+                        res->trim[ppp], res->mismatches[ppp])) {
+                fprintf(stderr, "ERROR: writing output failed\n");
+                return 1;
+            }
+            if (stats != NULL) {
+                fdb_stats_add(stats, m, FDB_REC_SEQ(batch, rec), rec->seq_l,
+                        FDB_REC_QUAL(batch, rec), rec->qual_l,
+                        res->assign[ppp], res->mismatches[ppp]);
+            }
+        }
+        ppp++;
+        /* Workers' reads are counted by the reader */
+        if (res->counts == NULL) count_read(cfg, batch->inf);
+    }
+    return 0;
+}
+
+void
+fdb_results_free (fdb_results_t *res)
+{
+    free(res->seqs);
+    free(res->lens);
+    free(res->assign);
+    free(res->trim);
+    free(res->mismatches);
+    free(res->reasons);
+    memset(res, 0, sizeof(*res));
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_write_stats
+ *  Description:  Writes cfg's statistics as a JSON report: reads per
+ *                  input, then every input's stats merged. Only reads
+ *                  processed by this run are counted, so a resumed run's
+ *                  report leaves out those before its checkpoint.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_write_stats (const fdb_config_t *cfg, FILE *fp)
+{
+    fdb_stats_t *total = fdb_stats_new(cfg->matcher);
+    const char **names = km_calloc(cfg->n_barcodes + 1, sizeof(*names),
             &km_onerr_print);
-    cfg->outf_dirs = km_calloc(cfg->n_infs, sizeof(*(cfg->outf_dirs)),
+    if (total == NULL || names == NULL) {
+        fdb_stats_destroy(total);
+        free(names);
+        return 1;
+    }
+    for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        names[bbb] = cfg->barcodes[bbb]->name.s;
+    }
+    fprintf(fp, "{\"barcode_file\": ");
+    fdb_json_str(fp, cfg->barcode_file);
+    fprintf(fp, ", \"max_mismatches\": %d,\n\"inputs\": [",
+            cfg->max_barcode_mismatches);
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        const fdb_stats_t *st = cfg->stats[fff];
+        fprintf(fp, "%s\n  {\"file\": ", fff ? "," : "");
+        fdb_json_str(fp, cfg->infns[fff]);
+        fprintf(fp, ", \"reads\": %zu, \"leftover\": %" PRIu64,
+                cfg->reads_processed[fff], st->reads[st->n_barcodes]);
+        if (cfg->filter != NULL) {
+            const uint64_t *n = &cfg->filtered[FDB_FILTERED_IDX(fff, 0)];
+            fprintf(fp, ", \"filtered\": {");
+            for (int rrr = FDB_FILTER_PASS + 1; rrr < FDB_FILTER_N_REASONS;
+                    rrr++) {
+                fprintf(fp, "%s\"%s\": %" PRIu64, rrr > 1 ? ", " : "",
+                        fdb_filter_reason_name(rrr), n[rrr]);
+            }
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "}");
+        fdb_stats_merge(total, st);
+    }
+    fprintf(fp, "],\n\"stats\": ");
+    fdb_stats_json(total, cfg->matcher, names, fp);
+    fprintf(fp, "}\n");
+    fdb_stats_destroy(total);
+    free(names);
+    return ferror(fp) != 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  rescue_pass
+ *  Description:  Reads back the leftovers fdb_process_batch() spilled. If
+ *                  fitting, counts them towards the next fdb_rescue_fit();
+ *                  otherwise writes each to the barcode fdb_rescue_assign()
+ *                  gives it, or still to the leftovers.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+rescue_pass (fdb_config_t *cfg, fdb_batch_pool_t *pool, int fitting)
+{
+    fdb_rescue_t *r = cfg->rescue;
+    fdb_batch_t *batch = NULL;
+    int ret = 1;
+    if (fflush(r->spill) != 0 || fseek(r->spill, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: Could not read back spilled leftovers\n");
+        return 1;
+    }
+    while (1) {
+        batch = fdb_batch_get(pool);
+        if (batch == NULL) goto exit;
+        if (fdb_batch_fill_spill(batch, r->spill) == 0) break;
+        for (size_t rrr = 0; rrr < batch->n_recs; rrr++) {
+            const fdb_rec_t *rec = &batch->recs[rrr];
+            const char *seq = FDB_REC_SEQ(batch, rec);
+            size_t mismatches = 0, trim = 0;
+            int bcd = FDB_NO_MATCH;
+            if (fitting) {
+                fdb_rescue_expect(r, cfg->matcher, seq, rec->seq_l);
+                continue;
+            }
+            bcd = fdb_rescue_assign(r, cfg->matcher, seq, rec->seq_l,
+                    &mismatches);
+            if (bcd != FDB_NO_MATCH) {
+                trim = cfg->matcher->lens[bcd];
+                if (trim > rec->seq_l) trim = rec->seq_l;
+                r->n_rescued++;
+            }
+            if (write_record(cfg, NULL, batch, rec, bcd, trim, mismatches)) {
+                fprintf(stderr, "ERROR: writing output failed\n");
+                goto exit;
+            }
+            if (cfg->stats != NULL) {
+                fdb_stats_add(cfg->stats[batch->inf], cfg->matcher, seq,
+                        rec->seq_l, FDB_REC_QUAL(batch, rec), rec->qual_l,
+                        bcd, mismatches);
+            }
+        }
+        fdb_batch_put(pool, batch);
+        batch = NULL;
+    }
+    if (batch->eof < 0) {
+        fprintf(stderr, "ERROR: Could not read back spilled leftovers\n");
+        goto exit;
+    }
+    ret = 0;
+exit:
+    fdb_batch_put(pool, batch);
+    return ret;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rescue_leftovers
+ *  Description:  Fits the rescue stage's model to the spilled leftovers,
+ *                  for at most FDB_RESCUE_ROUNDS rounds, then gives each
+ *                  leftover its second chance. Call once every input is
+ *                  processed, with a pool for the batches.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_rescue_leftovers (fdb_config_t *cfg, fdb_batch_pool_t *pool)
+{
+    fdb_rescue_t *r = cfg->rescue;
+    if (r == NULL) return 0;
+    fdb_rescue_fit(r, cfg->matcher);
+    for (int rrr = 0; rrr < FDB_RESCUE_ROUNDS && r->n_spilled > 0; rrr++) {
+        if (rescue_pass(cfg, pool, 1)) return 1;
+        if (fdb_rescue_fit(r, cfg->matcher)) break;
+    }
+    if (rescue_pass(cfg, pool, 0)) return 1;
+    if (cfg->flag & FLG_VERBOSE) {
+        printf("Rescued %" PRIu64 " of %" PRIu64 " leftover reads, fit in %d"
+                " rounds\n", r->n_rescued, r->n_spilled, r->n_rounds);
+    }
+    return 0;
+}
+
+/* A matching thread of fdb_main(), with its own producer and counters */
+typedef struct __fdb_worker_t {
+    struct __fdb_workers_t *ws;
+    int node;
+    pthread_t thread;
+    int started;
+    fdb_results_t res;
+} fdb_worker_t;
+
+/* fdb_main()'s matching threads, fed batches by the reading thread */
+typedef struct __fdb_workers_t {
+    fdb_config_t *cfg;
+    fdb_batch_queue_t queue;
+    fdb_worker_t *workers;
+    int n_workers;
+    int n_nodes;
+    /* One copy of the matcher per node, made there */
+    fdb_matcher_t *replicas[FDB_NUMA_MAX_NODES];
+    pthread_mutex_t lock;
+    int error;
+} fdb_workers_t;
+
+/* Pins a worker to its node and gives it local counters and matcher */
+static int
+worker_setup (fdb_worker_t *w)
+{
+    fdb_workers_t *ws = w->ws;
+    fdb_config_t *cfg = ws->cfg;
+    fdb_results_t *res = &w->res;
+    uint64_t *counts = NULL;
+    if (fdb_numa_bind(w->node)) {
+        fprintf(stderr, "WARNING: could not pin a thread to NUMA node %d\n",
+                w->node);
+    }
+    res->matcher = cfg->matcher;
+    if (ws->n_nodes > 1) {
+        pthread_mutex_lock(&ws->lock);
+        if (ws->replicas[w->node] == NULL) {
+            ws->replicas[w->node] = fdb_matcher_copy(cfg->matcher);
+        }
+        if (ws->replicas[w->node] != NULL) {
+            res->matcher = ws->replicas[w->node];
+        }
+        pthread_mutex_unlock(&ws->lock);
+    }
+    res->outq_prod = fdb_outq_producer_new(cfg->outq);
+    counts = km_calloc(cfg->n_barcodes + 1, sizeof(*counts), &km_onerr_print);
+    /* Published for --status, which reads it from the reading thread */
+    __atomic_store_n(&res->counts, counts, __ATOMIC_RELEASE);
+    if (res->outq_prod == NULL || res->counts == NULL) return 1;
+    if (cfg->filter != NULL) {
+        res->filtered = km_calloc(cfg->n_infs * FDB_FILTER_N_REASONS,
+                sizeof(*res->filtered), &km_onerr_print);
+        if (res->filtered == NULL) return 1;
+    }
+    if (cfg->stats != NULL) {
+        res->stats = km_calloc(cfg->n_infs, sizeof(*res->stats),
+                &km_onerr_print);
+        if (res->stats == NULL) return 1;
+        for (int fff = 0; fff < cfg->n_infs; fff++) {
+            res->stats[fff] = fdb_stats_new(res->matcher);
+            if (res->stats[fff] == NULL) return 1;
+        }
+    }
+    return 0;
+}
+
+static void *
+worker_main (void *arg)
+{
+    fdb_worker_t *w = arg;
+    fdb_workers_t *ws = w->ws;
+    fdb_batch_t *batch = NULL;
+    int ok = worker_setup(w) == 0;
+    /* Keep taking batches after an error, so the reader never blocks */
+    while ((batch = fdb_batch_queue_pop(&ws->queue)) != NULL) {
+        if (ok && fdb_process_batch(ws->cfg, batch, &w->res)) ok = 0;
+        fdb_batch_put(ws->cfg->batch_pool, batch);
+    }
+    if (ok && fdb_outq_flush(w->res.outq_prod)) ok = 0;
+    if (!ok) __atomic_store_n(&ws->error, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  workers_start
+ *  Description:  Starts cfg->n_threads matching threads, spread in turn
+ *                  across NUMA nodes. The calling thread, which reads, is
+ *                  pinned to the first node.
+ * Return Value:  fdb_workers_t *: the threads, or NULL on failure
+ * ============================================================================
+ */
+static fdb_workers_t *
+workers_start (fdb_config_t *cfg)
+{
+    fdb_workers_t *ws = km_calloc(1, sizeof(*ws), &km_onerr_print);
+    if (ws == NULL) return NULL;
+    ws->cfg = cfg;
+    ws->n_nodes = fdb_numa_nodes();
+    pthread_mutex_init(&ws->lock, NULL);
+    /* Enough batches queued to keep every worker busy */
+    fdb_batch_queue_init(&ws->queue, cfg->batch_depth > 0 ? \
+            cfg->batch_depth : 2 * cfg->n_threads);
+    ws->workers = km_calloc(cfg->n_threads, sizeof(*ws->workers),
             &km_onerr_print);
-    cfg->leftover_outfps = km_calloc(cfg->n_infs,
-            sizeof(*(cfg->leftover_outfps)), &km_onerr_print);
-    cfg->reads_processed = km_calloc(cfg->n_infs,
-            sizeof(*(cfg->reads_processed)), &km_onerr_print);
+    if (ws->workers == NULL) {
+        fdb_batch_queue_destroy(&ws->queue);
+        pthread_mutex_destroy(&ws->lock);
+        free(ws);
+        return NULL;
+    }
+    fdb_numa_bind(0);
+    for (int ttt = 0; ttt < cfg->n_threads; ttt++) {
+        fdb_worker_t *w = &ws->workers[ttt];
+        w->ws = ws;
+        w->node = ttt % ws->n_nodes;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            ws->error = 1;
+            break;
+        }
+        w->started = 1;
+        ws->n_workers++;
+    }
+    if (cfg->flag & FLG_VERBOSE) {
+        printf("Matching with %d threads on %d NUMA node%s\n", ws->n_workers,
+                ws->n_nodes, ws->n_nodes > 1 ? "s" : "");
+    }
+    return ws;
 }
 
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  workers_finish
+ *  Description:  Waits for the workers to match every queued batch, then
+ *                  adds their counts and stats to cfg's, and frees them.
+ * Return Value:  int: 0 on success, 1 if any worker failed
+ * ============================================================================
+ */
+static int
+workers_finish (fdb_workers_t *ws)
+{
+    fdb_config_t *cfg = ws->cfg;
+    int ret = 0;
+    fdb_batch_queue_close(&ws->queue);
+    for (int ttt = 0; ttt < cfg->n_threads; ttt++) {
+        fdb_worker_t *w = &ws->workers[ttt];
+        fdb_results_t *res = &w->res;
+        if (w->started) pthread_join(w->thread, NULL);
+        for (size_t bbb = 0; bbb < cfg->n_barcodes && res->counts; bbb++) {
+            cfg->barcodes[bbb]->count += res->counts[bbb];
+        }
+        for (size_t iii = 0; iii < cfg->n_infs * FDB_FILTER_N_REASONS && \
+                res->filtered; iii++) {
+            cfg->filtered[iii] += res->filtered[iii];
+        }
+        for (int fff = 0; fff < cfg->n_infs && res->stats; fff++) {
+            if (res->stats[fff] == NULL) continue;
+            fdb_stats_merge(cfg->stats[fff], res->stats[fff]);
+            fdb_stats_destroy(res->stats[fff]);
+        }
+        fdb_outq_producer_destroy(res->outq_prod);
+        free(res->stats);
+        free(res->counts);
+        free(res->filtered);
+        fdb_results_free(res);
+    }
+    for (int nnn = 0; nnn < FDB_NUMA_MAX_NODES; nnn++) {
+        fdb_matcher_destroy(ws->replicas[nnn]);
+    }
+    ret = ws->error;
+    fdb_batch_queue_destroy(&ws->queue);
+    pthread_mutex_destroy(&ws->lock);
+    free(ws->workers);
+    free(ws);
+    return ret;
+}
+
+/* Writes cfg's status file, counting the workers' reads so far */
+static int
+status_report (fdb_config_t *cfg, const fdb_workers_t *ws, int cur_inf,
+               int done)
+{
+    uint64_t *counts = km_calloc(cfg->n_barcodes + 1, sizeof(*counts),
+            &km_onerr_print);
+    int ret = 0;
+    if (counts == NULL) return 1;
+    for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        counts[bbb] = cfg->barcodes[bbb]->count;
+    }
+    for (int ttt = 0; ws != NULL && ttt < ws->n_workers; ttt++) {
+        /* Set by the worker as it starts */
+        const uint64_t *wc = __atomic_load_n(&ws->workers[ttt].res.counts,
+                __ATOMIC_ACQUIRE);
+        for (size_t bbb = 0; wc != NULL && bbb < cfg->n_barcodes; bbb++) {
+            counts[bbb] += __atomic_load_n(&wc[bbb], __ATOMIC_RELAXED);
+        }
+    }
+    ret = fdb_status_write(cfg->status, cfg, cur_inf, counts, done);
+    free(counts);
+    return ret;
+}
 
 int
 fdb_main (fdb_config_t *cfg)
 {
+    size_t reads_since_ckpt = 0;
+    int first_inf = (cfg->ckpt != NULL)? cfg->ckpt->cur_inf: 0;
+    fdb_results_t res;
+    fdb_batch_t *batch = NULL;
+    fdb_workers_t *ws = NULL;
+    int ret = EXIT_FAILURE;
+    memset(&res, 0, sizeof(res));
+    cfg->batch_pool = fdb_batch_pool_create();
+    if (cfg->batch_pool == NULL) goto exit;
+    if (cfg->status_file != NULL) {
+        cfg->status = fdb_status_new(cfg, cfg->status_file,
+                cfg->status_every);
+        if (cfg->status == NULL || \
+                status_report(cfg, NULL, first_inf, 0)) goto exit;
+    }
+    if (cfg->n_threads > 1 && (ws = workers_start(cfg)) == NULL) goto exit;
     /* Main Loop: for each file, split by barcode and write {{{ */
-    for (int fff = 0; fff < cfg->n_infs; fff++) {
+    for (int fff = first_inf; fff < cfg->n_infs; fff++) {
         printf("Processing %s:\t", cfg->infns[fff]); fflush(stdout);
         kseq_t *seq = cfg->in_kseqs[fff];
-        while(kseq_read(seq) >= 0) {
-            cfg->reads_processed[fff]++;
-            size_t *scores = calloc(cfg->n_barcodes, sizeof(*scores));
-            char *out_seq = NULL;
-            int out_len = 0;
-            size_t best_score = SIZE_MAX;
-            int best_bcd = 0;
-            int best_bcd_len = 0;
-            int buffer_match = 0;
-            for (int bbb = 0; bbb < cfg->n_barcodes; bbb++) {
-                barcode_t *bcd = cfg->barcodes[bbb];
-                scores[bbb] = hamming_max(bcd->seq.s, seq->seq.s,
-                        cfg->max_barcode_mismatches + 1);
-            }
-            for (int bbb = 0; bbb < cfg->n_barcodes; bbb++){
-                if (cfg->buffer_seq != NULL) {
-                    size_t buffer_hamdist = hamming_max(cfg->buffer_seq,
-                            seq->seq.s + cfg->barcodes[bbb]->seq.l,
-                            cfg->max_buffer_mismatches + 1);
-                    buffer_match = buffer_hamdist <= cfg->max_buffer_mismatches;
-                } else {
-                    /* if no buffer seq, always match */
-                    buffer_match = 1;
-                }
-                if (scores[bbb] <= best_score && \
-                        cfg->barcodes[bbb]->seq.l >= best_bcd_len && \
-                        buffer_match) {
-                    best_bcd = bbb;
-                    best_bcd_len = cfg->barcodes[bbb]->seq.l;
-                    best_score = scores[bbb];
+        while (1) {
+            batch = fdb_batch_get(cfg->batch_pool);
+            if (batch == NULL) goto exit;
+            if (fdb_batch_fill(batch, seq, fff, cfg->range_end) == 0) {
+                if (batch->eof < 0) {
+                    fprintf(stderr, "ERROR: Could not read '%s'\n",
+                            cfg->infns[fff]);
+                    goto exit;
                 }
+                break;
             }
-            FDB_FP_TYPE this_out_fp;
-            if (best_score < cfg->max_barcode_mismatches) {
-                this_out_fp = cfg->barcodes[best_bcd]->fps[fff];
-                cfg->barcodes[best_bcd]->count++;
-            } else {
-                best_bcd_len = 0;
-                this_out_fp = cfg->leftover_outfps[fff];
-            }
-            /* Write out the barcode */
-            /* Extra length: @ + space + '+' 4*\n + \0 = 8
-             * -2 * best_bcd_len because we're removing barcode
-             */
-            out_len = seq->seq.l + seq->name.l + seq->qual.l + \
-                      seq->comment.l + 8 - (2 * best_bcd_len);
-            out_seq = calloc(out_len, sizeof(*out_seq));
-            //snprintf(out_seq, out_len, "@%s %s\n%s\n+\n%s\n",
-            snprintf(out_seq, out_len, "@%s %s\n%s\n+\n%s\n",
-                    seq->name.s, seq->comment.s, seq->seq.s + best_bcd_len,
-                    seq->qual.s + best_bcd_len);
-            /* Be verbose about things if we're aksed to */
-            if (cfg->flag & FLG_VERY_VERBOSE) {
-                if (best_score < cfg->max_barcode_mismatches) {
-                    printf("seq %s is from barcode %s with score of %zu.\n",
-                            seq->name.s, cfg->barcodes[best_bcd]->name.s,
-                            best_score);
-#ifdef FDB_DEBUG
-                    printf("%s\n\n", out_seq);
-#endif
-                } else {
-                    printf("seq %s is from none of the barcodes.\n",
-                            seq->name.s);
-#ifdef FDB_DEBUG
-                    printf("%s\n\n", out_seq);
-#endif
+            if (cfg->status != NULL && \
+                    fdb_status_due(cfg->status, fdb_status_now()) && \
+                    status_report(cfg, ws, fff, 0)) goto exit;
+            if (ws != NULL) {
+                /* The workers count nothing, so reads are counted here */
+                if (__atomic_load_n(&ws->error, __ATOMIC_SEQ_CST)) goto exit;
+                for (size_t rrr = 0; rrr < batch->n_recs; rrr++) {
+                    count_read(cfg, fff);
                 }
+                fdb_batch_queue_push(&ws->queue, batch);
+                batch = NULL;
+                continue;
             }
-            /* out_len-1 because we don't want to write the \0 */
-            FDB_FP_WRITE(this_out_fp, out_seq, out_len - 1);
-            /* Clean up */
-            free(scores);
-            free(out_seq);
-            if (cfg->reads_processed[fff] % BREAK_EVERY_X_SEQS == 0) {
-                printf("."); fflush(stdout);
+            if (fdb_process_batch(cfg, batch, &res)) goto exit;
+            reads_since_ckpt += batch->n_recs;
+            if (cfg->ckpt_file != NULL && \
+                    reads_since_ckpt >= cfg->ckpt_every) {
+                if (fdb_ckpt_save(cfg, fff, batch->end_offset)) goto exit;
+                reads_since_ckpt = 0;
             }
+            fdb_batch_put(cfg->batch_pool, batch);
+            batch = NULL;
+        }
+        fdb_batch_put(cfg->batch_pool, batch);
+        batch = NULL;
+        if (cfg->ckpt_file != NULL) {
+            /* Input complete, resume from the start of the next one */
+            if (fdb_ckpt_save(cfg, fff + 1, 0)) goto exit;
+            reads_since_ckpt = 0;
         }
         printf(" done!\n");
         if (cfg->flag & FLG_VERBOSE) {
@@ -416,18 +1641,67 @@ fdb_main (fdb_config_t *cfg)
                     cfg->reads_processed[fff], cfg->infns[fff]);
         }
     } /*  End of main loop }}} */
+    if (ws != NULL) {
+        int failed = workers_finish(ws);
+        ws = NULL;
+        if (failed) goto exit;
+    }
+    if (fdb_rescue_leftovers(cfg, cfg->batch_pool)) goto exit;
     if (cfg->flag & FLG_VERBOSE) {
         printf("\n\n------------------------------------------------\n");
         printf("[main] Summary of barcodes (reads from all input files):\n");
         for (int ccc = 0; ccc<cfg->n_barcodes; ccc++) {
-            printf("%s: %d\n", cfg->barcodes[ccc]->name.s, cfg->barcodes[ccc]->count);
+            printf("%s: %" PRIu64 "\n", cfg->barcodes[ccc]->name.s,
+                    cfg->barcodes[ccc]->count);
+        }
+        for (int rrr = FDB_FILTER_PASS + 1; rrr < FDB_FILTER_N_REASONS && \
+                cfg->filter != NULL; rrr++) {
+            uint64_t n = 0;
+            for (int fff = 0; fff < cfg->n_infs; fff++) {
+                n += cfg->filtered[FDB_FILTERED_IDX(fff, rrr)];
+            }
+            printf("filtered (%s): %" PRIu64 "\n",
+                    fdb_filter_reason_name(rrr), n);
+        }
+    }
+    if (fdb_outq_flush(cfg->outq_prod) || fdb_outq_wait(cfg->outq)) {
+        fprintf(stderr, "ERROR: writing output failed\n");
+        goto exit;
+    }
+    if (cfg->status != NULL && status_report(cfg, NULL, cfg->n_infs, 1)) {
+        goto exit;
+    }
+    if (cfg->flag & FLG_VERBOSE && cfg->file_mem > 0) {
+        printf("Output buffers were flushed and freed %" PRIu64 " times to"
+                " stay within --max-mem\n", cfg->outq->n_parked);
+    }
+    if (cfg->stats != NULL) {
+        FILE *fp = fopen(cfg->stats_file, "w");
+        if (fp == NULL) {
+            FDB_IO_ERROR(cfg->stats_file);
+            goto exit;
+        }
+        if (fdb_write_stats(cfg, fp) | (fclose(fp) != 0)) {
+            fprintf(stderr, "ERROR: Could not write stats to '%s'\n",
+                    cfg->stats_file);
+            goto exit;
         }
     }
+    ret = 0;
+exit:
+    if (ws != NULL) workers_finish(ws);
+    fdb_batch_put(cfg->batch_pool, batch);
+    fdb_results_free(&res);
+    return ret;
 }
 
 int
 fdb_config_destroy (fdb_config_t *cfg)
 {
+    fdb_batch_pool_destroy(cfg->batch_pool);
+    /* Drain the writers before closing anything they write to */
+    fdb_outq_producer_destroy(cfg->outq_prod);
+    fdb_outq_destroy(cfg->outq);
     if (cfg->infns != NULL){
         for (int iii = 0; iii < cfg->n_infs; iii++) {
             if (cfg->infns[iii] != NULL) free(cfg->infns[iii]);
@@ -437,7 +1711,7 @@ fdb_config_destroy (fdb_config_t *cfg)
     if (cfg->in_kseqs != NULL){
         for (int iii = 0; iii < cfg->n_infs; iii++) {
             if (cfg->in_kseqs[iii] != NULL) {
-                FDB_FP_CLOSE(cfg->in_kseqs[iii]->f->f);
+                fdb_infile_close(cfg->in_kseqs[iii]->f->f);
                 kseq_destroy(cfg->in_kseqs[iii]);
             }
         }
@@ -447,6 +1721,7 @@ fdb_config_destroy (fdb_config_t *cfg)
     if (cfg->buffer_seq != NULL) free(cfg->buffer_seq);
     if (cfg->out_dir != NULL) free(cfg->out_dir);
     if (cfg->out_suffix != NULL) free(cfg->out_suffix);
+    km_free(cfg->out_ext, &km_onerr_nil);
     if (cfg->leftover_suffix != NULL) free(cfg->leftover_suffix);
     if (cfg->barcodes != NULL) {
         for (int iii = 0; iii < cfg->n_barcodes; iii++) {
@@ -457,15 +1732,18 @@ fdb_config_destroy (fdb_config_t *cfg)
                 if (cfg->barcodes[iii]->seq.s != NULL) {
                     free(cfg->barcodes[iii]->seq.s);
                 }
-                for (int jjj = 0; jjj < cfg->n_infs; jjj++) {
+                for (int jjj = 0; jjj < cfg->n_infs && \
+                        cfg->barcodes[iii]->fps != NULL; jjj++) {
                     if (cfg->barcodes[iii]->fns[jjj] != NULL) {
                         free(cfg->barcodes[iii]->fns[jjj]);
                     }
                     if (cfg->barcodes[iii]->fps[jjj] != NULL) {
-                        FDB_FP_CLOSE(cfg->barcodes[iii]->fps[jjj]);
+                        fdb_ofile_close(cfg->barcodes[iii]->fps[jjj]);
                     }
                 }
-            free(cfg->barcodes[iii]);
+                km_free(cfg->barcodes[iii]->fps, &km_onerr_nil);
+                km_free(cfg->barcodes[iii]->fns, &km_onerr_nil);
+                free(cfg->barcodes[iii]);
             }
         }
         free(cfg->barcodes);
@@ -473,9 +1751,204 @@ fdb_config_destroy (fdb_config_t *cfg)
     if (cfg->leftover_outfps != NULL) {
         for (int iii = 0; iii <  cfg->n_infs; iii++) {
             if (cfg->leftover_outfps[iii] != NULL) {
-                FDB_FP_CLOSE(cfg->leftover_outfps[iii]);
+                fdb_ofile_close(cfg->leftover_outfps[iii]);
             }
         }
         free(cfg->leftover_outfps);
     }
+    if (cfg->leftover_fns != NULL) {
+        for (int iii = 0; iii <  cfg->n_infs; iii++) {
+            km_free(cfg->leftover_fns[iii], &km_onerr_nil);
+        }
+        free(cfg->leftover_fns);
+    }
+    for (int iii = 0; iii < cfg->n_infs && cfg->filtered_fns != NULL && \
+            cfg->filtered_outfps != NULL; iii++) {
+        if (cfg->filtered_outfps[iii] != NULL) {
+            fdb_ofile_close(cfg->filtered_outfps[iii]);
+        }
+        km_free(cfg->filtered_fns[iii], &km_onerr_nil);
+    }
+    km_free(cfg->filtered_outfps, &km_onerr_nil);
+    km_free(cfg->filtered_fns, &km_onerr_nil);
+    km_free(cfg->filtered, &km_onerr_nil);
+    km_free(cfg->contam_file, &km_onerr_nil);
+    fdb_filter_destroy(cfg->filter);
+    km_free(cfg->status_file, &km_onerr_nil);
+    fdb_status_destroy(cfg->status);
+    for (int iii = 0; iii < cfg->n_infs && cfg->infn_bases != NULL; iii++) {
+        km_free(cfg->infn_bases[iii], &km_onerr_nil);
+        km_free(cfg->infn_exts[iii], &km_onerr_nil);
+        km_free(cfg->outf_dirs[iii], &km_onerr_nil);
+    }
+    km_free(cfg->infn_bases, &km_onerr_nil);
+    km_free(cfg->infn_exts, &km_onerr_nil);
+    km_free(cfg->outf_dirs, &km_onerr_nil);
+    km_free(cfg->reads_processed, &km_onerr_nil);
+    km_free(cfg->out_prefix, &km_onerr_nil);
+    km_free(cfg->ckpt_file, &km_onerr_nil);
+    km_free(cfg->index_file, &km_onerr_nil);
+    km_free(cfg->stats_file, &km_onerr_nil);
+    for (int iii = 0; iii < cfg->n_infs && cfg->stats != NULL; iii++) {
+        fdb_stats_destroy(cfg->stats[iii]);
+    }
+    km_free(cfg->stats, &km_onerr_nil);
+    fdb_rescue_destroy(cfg->rescue);
+    fdb_ckpt_destroy(cfg->ckpt);
+    if (!(cfg->flag & FLG_SHEET_JOB)) {
+        /* Every output is closed, so nothing is left in flight */
+        fdb_aio_destroy(cfg->aio);
+        fdb_matcher_destroy(cfg->matcher);
+    }
+    fdb_codec_thread_cleanup();
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_gzindex_main
+ *  Description:  `fastDBarcode gzindex`: writes <file>.fdbi access point
+ *                  indices for gzipped inputs, optionally printing N
+ *                  START:END ranges splitting each file evenly.
+ * ============================================================================
+ */
+int
+fdb_gzindex_main (int argc, char **argv)
+{
+    uint64_t span = FDB_GZIDX_SPAN_DEFAULT;
+    uint64_t n_ranges = 0;
+    int c;
+    optind = 1;
+    while ((c = getopt(argc, argv, "hs:k:")) != -1) {
+        switch (c) {
+            case 's':
+                span = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'k':
+                n_ranges = strtoull(optarg, NULL, 10);
+                break;
+            case 'h':
+            default:
+                print_usage();
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || span == 0) {
+        fprintf(stderr, "ERROR: gzindex needs at least one input file\n");
+        return EXIT_FAILURE;
+    }
+    for (int iii = optind; iii < argc; iii++) {
+        fdb_gzidx_t *idx = fdb_gzidx_build(argv[iii], span);
+        char *idx_fn = NULL;
+        int ret = 0;
+        if (idx == NULL) return EXIT_FAILURE;
+        idx_fn = km_calloc(strlen(argv[iii]) + strlen(FDB_GZIDX_EXT) + 1, 1,
+                &km_onerr_print);
+        strcat(strcpy(idx_fn, argv[iii]), FDB_GZIDX_EXT);
+        ret = fdb_gzidx_save(idx, idx_fn);
+        printf("%s: %zu access points over %" PRIu64 " bytes, written to %s\n",
+                argv[iii], idx->n_points, idx->length, idx_fn);
+        for (uint64_t rrr = 0; rrr < n_ranges; rrr++) {
+            printf("%" PRIu64 ":%" PRIu64 "\n", idx->length * rrr / n_ranges,
+                    idx->length * (rrr + 1) / n_ranges);
+        }
+        free(idx_fn);
+        fdb_gzidx_destroy(idx);
+        if (ret != 0) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_merge_main
+ *  Description:  `fastDBarcode merge`: joins the outputs of --range runs, in
+ *                  range order. Concatenated gzip members are a valid gzip
+ *                  file, so this is a plain byte copy.
+ * ============================================================================
+ */
+int
+fdb_merge_main (int argc, char **argv)
+{
+    const size_t bufsize = 1 << 20;
+    char *buf = NULL;
+    FILE *out = NULL;
+    int ret = EXIT_FAILURE;
+    if (argc < 3) {
+        fprintf(stderr, "ERROR: merge needs an output and input files\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    out = fopen(argv[1], "wb");
+    if (out == NULL) {
+        FDB_IO_ERROR(argv[1]);
+        return EXIT_FAILURE;
+    }
+    buf = km_malloc(bufsize, &km_onerr_print);
+    for (int iii = 2; iii < argc; iii++) {
+        FILE *in = fopen(argv[iii], "rb");
+        size_t got = 0;
+        if (in == NULL) {
+            FDB_IO_ERROR(argv[iii]);
+            goto exit;
+        }
+        while ((got = fread(buf, 1, bufsize, in)) > 0) {
+            if (fwrite(buf, 1, got, out) != got) {
+                FDB_IO_ERROR(argv[1]);
+                fclose(in);
+                goto exit;
+            }
+        }
+        if (ferror(in)) {
+            FDB_IO_ERROR(argv[iii]);
+            fclose(in);
+            goto exit;
+        }
+        fclose(in);
+    }
+    ret = EXIT_SUCCESS;
+exit:
+    if (fclose(out) != 0) ret = EXIT_FAILURE;
+    free(buf);
+    return ret;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_index_main
+ *  Description:  `fastDBarcode index`: compiles a barcode file, with the
+ *                  -m, -M and -B it will be used with, into an index file
+ *                  for -x. The file is mapped when used, so any number of
+ *                  runs share one copy of it in memory.
+ * ============================================================================
+ */
+int
+fdb_index_main (int argc, char **argv)
+{
+    fdb_config_t *cfg = km_calloc(1, sizeof(*cfg), &km_onerr_print);
+    const fdb_midx_hdr_t *idx = NULL;
+    int ret = EXIT_FAILURE;
+    optind = 1;
+    if (parse_options(cfg, argc, argv) != 0) goto exit;
+    if (optind + 2 != argc || cfg->index_file != NULL) {
+        fprintf(stderr, "ERROR: index needs a barcode file and an index "
+                "file\n");
+        print_usage();
+        goto exit;
+    }
+    cfg->barcode_file = strdup(argv[optind]);
+    if (parse_barcode_file(cfg) != 0 || \
+            fdb_matcher_save_index(cfg->matcher, argv[optind + 1]) != 0) {
+        goto exit;
+    }
+    idx = cfg->matcher->index;
+    printf("%s: %u barcodes of %u lengths, fewer than %u mismatches; %zu "
+            "byte index written to %s\n", cfg->barcode_file, idx->n_barcodes,
+            idx->n_classes, idx->max_mismatches, cfg->matcher->index_size,
+            argv[optind + 1]);
+    ret = EXIT_SUCCESS;
+exit:
+    fdb_config_destroy(cfg);
+    free(cfg);
+    return ret;
 }
@@ -19,6 +19,8 @@
 #define FDB_H
 
 #include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -29,14 +31,17 @@
 #include <zlib.h>
 
 #include "kdm.h"
+#include "fdb_codec.h"
+#include "fdb_filter.h"
+#include "fdb_gzidx.h"
+#include "fdb_match.h"
+#include "fdb_numa.h"
+#include "fdb_outq.h"
+#include "fdb_rescue.h"
+#include "fdb_stats.h"
 
 #define BREAK_EVERY_X_SEQS 1000000
 
-#define FDB_FP_TYPE gzFile
-#define FDB_FP_READ gzread
-#define FDB_FP_OPEN gzopen
-#define FDB_FP_CLOSE gzclose
-#define FDB_FP_WRITE gzwrite
 #define FDB_FP_ZIP_EXT "gz"
 
 #define FDB_VERSION "v0.0.1a"
@@ -44,21 +49,22 @@
 #define	FLG_VERBOSE 1 << 0
 #define	FLG_ZIPPED_OUT 1 << 1
 #define	FLG_VERY_VERBOSE 1 << 2
+#define	FLG_RESUME 1 << 3
+/* One of a sample sheet's jobs: the sheet owns the I/O engine and matcher,
+ * and progress dots are not printed */
+#define	FLG_SHEET_JOB 1 << 4
 
-#define FDB_ZIP_MODE "w9"
-#define FDB_NONZIP_MODE "wT"
-
-/* Don't enforce same-length needle and haystack hamming distance. */
-#define FDB_HAMMING_MODE_FROMSTART
+/* Default number of reads between checkpoints, when checkpointing */
+#define FDB_CKPT_EVERY_DEFAULT (10 * BREAK_EVERY_X_SEQS)
 
 #include "kseq.h"
-KSEQ_INIT(FDB_FP_TYPE, FDB_FP_READ)
+KSEQ_INIT(fdb_infile_t *, fdb_infile_read)
 
 typedef struct __barcode_t {
     kstring_t name;
     kstring_t seq;
     uint64_t count;
-    FDB_FP_TYPE *fps;
+    fdb_ofile_t **fps;
     char **fns;
 } barcode_t;
 
@@ -67,15 +73,19 @@ typedef struct __fdb_config_t {
     char **infns;
     int n_infs;
     char *out_dir;
-    char *out_mode;
+    char *out_prefix;           /* replaces out_dir/input basename */
+    char *out_ext;
+    int level;
     char *leftover_suffix;
     char **infn_bases;
     char **infn_exts;
     char **outf_dirs;
-    FDB_FP_TYPE *leftover_outfps;
+    char **leftover_fns;
+    fdb_ofile_t **leftover_outfps;
     kseq_t **in_kseqs;
     char *out_suffix;
     char *barcode_file;
+    char *index_file;           /* compiled matcher for barcode_file */
     barcode_t **barcodes;
     size_t n_barcodes;
     size_t n_infiles;
@@ -83,19 +93,100 @@ typedef struct __fdb_config_t {
     int max_buffer_mismatches;
     char *buffer_seq;
     size_t *reads_processed;
+    char *ckpt_file;
+    size_t ckpt_every;
+    struct __fdb_ckpt_t *ckpt;
+    uint64_t range_start;
+    uint64_t range_end;
+    int n_writers;
+    int n_threads;              /* matching threads, besides the reader */
+    size_t outq_mem;
+    size_t max_mem;             /* 0 for no budget */
+    int batch_depth;            /* batches queued for -t, 0 for default */
+    size_t file_mem;            /* cap on output files' buffers, or 0 */
+    fdb_outq_t *outq;
+    fdb_outq_producer_t *outq_prod;
+    struct __fdb_batch_pool_t *batch_pool;
+    fdb_matcher_t *matcher;
+    enum fdb_aio_backend io_backend;
+    int io_threads;
+    int io_depth;
+    int io_direct;
+    fdb_aio_t *aio;
+    int n_jobs;
+    struct __fdb_mcache_t *mcache;
+    char *stats_file;
+    fdb_stats_t **stats;        /* per input */
+    double rescue_prob;         /* 0 unless --rescue */
+    fdb_rescue_t *rescue;
+    /* Pre-filter: reads failing it go to <input>_filtered, unmatched */
+    int filter_min_len;         /* -1 for the longest barcode */
+    double filter_max_n;
+    char *contam_file;
+    int contam_k;
+    fdb_filter_t *filter;       /* NULL if nothing is filtered */
+    char **filtered_fns;
+    fdb_ofile_t **filtered_outfps;
+    uint64_t *filtered;         /* per input x fdb_filter_reason */
+    char *status_file;
+    double status_every;        /* seconds */
+    struct __fdb_status_t *status;
 } fdb_config_t;
 
+/* Matcher input and results for a batch, kept between batches */
+typedef struct __fdb_results_t {
+    const char **seqs;
+    size_t *lens;
+    int32_t *assign;
+    uint32_t *trim;
+    uint32_t *mismatches;
+    uint8_t *reasons;           /* fdb_filter_check()'s, per read */
+    size_t m_recs;
+    /* A worker thread's own matcher, output producer and counters, merged
+     * into cfg's when it's done. Left NULL, cfg's are used, and reads are
+     * counted as processed. */
+    const fdb_matcher_t *matcher;
+    fdb_outq_producer_t *outq_prod;
+    fdb_stats_t **stats;
+    uint64_t *counts;           /* per barcode */
+    uint64_t *filtered;         /* as cfg->filtered */
+} fdb_results_t;
+
+/* Output stream numbering for fdb_outq_t */
+#define FDB_STREAM_BCD(cfg, bcd, inf) ((size_t)(bcd) * (cfg)->n_infs + (inf))
+#define FDB_STREAM_LEFTOVER(cfg, inf) \
+    ((size_t)(cfg)->n_barcodes * (cfg)->n_infs + (inf))
+#define FDB_STREAM_FILTERED(cfg, inf) \
+    (((size_t)(cfg)->n_barcodes + 1) * (cfg)->n_infs + (inf))
+/* Filtered reads' "barcode", for write_record() */
+#define FDB_FILTERED (FDB_NO_MATCH - 1)
+#define FDB_FILTERED_IDX(inf, reason) \
+    ((size_t)(inf) * FDB_FILTER_N_REASONS + (reason))
+
 #define FDB_IO_ERROR(fle) \
     fprintf(stderr, "IO Error: Could not open file '%s' at line %i in %s\n%s\n", \
             fle, __LINE__, __FILE__, strerror(errno));
 
-extern size_t hamming_max (const char *seq1, const char *seq2, size_t max);
+struct __fdb_batch_t;
+
 extern int cmp_barcode_t_rev (const void *left, const void *right);
+int parse_options (fdb_config_t *cfg, int argc, char **argv);
+int open_inputs (fdb_config_t *cfg);
 int parse_args (fdb_config_t *cfg, int argc, char **argv);
 int parse_barcode_file (fdb_config_t *cfg);
+fdb_aio_t *fdb_setup_aio (const fdb_config_t *cfg);
 int setup_files (fdb_config_t *cfg);
+int fdb_process_batch (fdb_config_t *cfg, const struct __fdb_batch_t *batch,
+                       fdb_results_t *res);
+void fdb_results_free (fdb_results_t *res);
+int fdb_write_stats (const fdb_config_t *cfg, FILE *fp);
+int fdb_rescue_leftovers (fdb_config_t *cfg,
+                          struct __fdb_batch_pool_t *pool);
 int fdb_main (fdb_config_t *cfg);
 int fdb_config_destroy (fdb_config_t *cfg);
+int fdb_gzindex_main (int argc, char **argv);
+int fdb_merge_main (int argc, char **argv);
+int fdb_index_main (int argc, char **argv);
 int print_usage();
 
 #endif /* FDB_H */
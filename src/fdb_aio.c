@@ -0,0 +1,281 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_aio.c
+ *
+ *    Description:  Asynchronous positioned writes: io_uring where available,
+ *                      otherwise a pool of threads calling pwrite()
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 23:14:52
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "fdb_aio.h"
+
+/* Writes what is left of a request, retrying short writes */
+static int
+pwrite_all (fdb_aio_req_t *req)
+{
+    while (req->written < req->len) {
+        ssize_t ret = pwrite(req->fd, req->buf + req->written,
+                req->len - req->written, req->off + req->written);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (ret == 0) return EIO;
+        req->written += ret;
+    }
+    return 0;
+}
+
+static void *
+aio_thread (void *arg)
+{
+    fdb_aio_t *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    while (1) {
+        fdb_aio_req_t *req = NULL;
+        int err;
+        while (aio->head == NULL && !aio->shutdown) {
+            pthread_cond_wait(&aio->work_cond, &aio->lock);
+        }
+        if (aio->head == NULL) break;
+        req = aio->head;
+        aio->head = req->next;
+        if (aio->head == NULL) aio->tail = NULL;
+        pthread_mutex_unlock(&aio->lock);
+        err = pwrite_all(req);
+        pthread_mutex_lock(&aio->lock);
+        req->err = err;
+        req->done = 1;
+        pthread_cond_broadcast(&aio->done_cond);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+#ifdef FDB_HAVE_LIBURING
+/* Queues the rest of a request on the ring. Called with the lock held. */
+static void
+uring_queue (fdb_aio_t *aio, fdb_aio_req_t *req)
+{
+    struct io_uring_sqe *sqe;
+    while ((sqe = io_uring_get_sqe(&aio->ring)) == NULL) {
+        /* Submitting frees the submission queue's slots */
+        io_uring_submit(&aio->ring);
+    }
+    io_uring_prep_write(sqe, req->fd, req->buf + req->written,
+            req->len - req->written, req->off + req->written);
+    io_uring_sqe_set_data(sqe, req);
+    io_uring_submit(&aio->ring);
+}
+
+/* Handles the completions that have arrived. Short writes are requeued.
+ * Called with the lock held, by the reaping waiter. */
+static void
+uring_reap (fdb_aio_t *aio)
+{
+    struct io_uring_cqe *cqe = NULL;
+    while (io_uring_peek_cqe(&aio->ring, &cqe) == 0 && cqe != NULL) {
+        fdb_aio_req_t *req = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&aio->ring, cqe);
+        if (res == -EINTR || res == -EAGAIN) {
+            uring_queue(aio, req);
+        } else if (res < 0 || res == 0) {
+            req->err = res < 0 ? -res : EIO;
+            req->done = 1;
+        } else {
+            req->written += res;
+            if (req->written < req->len) {
+                uring_queue(aio, req);
+            } else {
+                req->done = 1;
+            }
+        }
+        cqe = NULL;
+    }
+}
+
+/* Waits for completions and handles them, or if another waiter is doing
+ * so, for it to finish. Either way, some request may now be done. Called
+ * with the lock held; it is released while waiting, so submissions carry
+ * on meanwhile. */
+static void
+uring_wait (fdb_aio_t *aio)
+{
+    struct io_uring_cqe *cqe = NULL;
+    if (aio->reaping) {
+        pthread_cond_wait(&aio->done_cond, &aio->lock);
+        return;
+    }
+    aio->reaping = 1;
+    pthread_mutex_unlock(&aio->lock);
+    /* Only the reaper touches the completion queue, so this needs no lock */
+    io_uring_wait_cqe(&aio->ring, &cqe);
+    pthread_mutex_lock(&aio->lock);
+    uring_reap(aio);
+    aio->reaping = 0;
+    pthread_cond_broadcast(&aio->done_cond);
+}
+#endif
+
+const char *
+fdb_aio_backend_name (enum fdb_aio_backend backend)
+{
+    switch (backend) {
+        case FDB_AIO_THREADS:
+            return "threads";
+        case FDB_AIO_URING:
+            return "io_uring";
+        default:
+            return "sync";
+    }
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_aio_create
+ *  Description:  Starts an I/O engine. FDB_AIO_URING falls back to
+ *                  FDB_AIO_THREADS when io_uring is not built in or not
+ *                  allowed; aio->backend says which one is in use.
+ *                  n_threads is the thread pool's size.
+ * Return Value:  fdb_aio_t *: the engine, or NULL on failure
+ * ============================================================================
+ */
+fdb_aio_t *
+fdb_aio_create (enum fdb_aio_backend backend, int n_threads)
+{
+    fdb_aio_t *aio = km_calloc(1, sizeof(*aio), &km_onerr_print);
+    if (aio == NULL) return NULL;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work_cond, NULL);
+    pthread_cond_init(&aio->done_cond, NULL);
+    aio->depth = FDB_AIO_DEPTH_DEFAULT;
+    aio->buf_size = FDB_AIO_BUF_SIZE;
+    aio->backend = backend;
+    if (backend == FDB_AIO_URING) {
+#ifdef FDB_HAVE_LIBURING
+        if (io_uring_queue_init(FDB_AIO_URING_ENTRIES, &aio->ring, 0) == 0) {
+            return aio;
+        }
+#endif
+        aio->backend = FDB_AIO_THREADS;
+    }
+    if (aio->backend == FDB_AIO_THREADS) {
+        if (n_threads < 1) n_threads = FDB_AIO_THREADS_DEFAULT;
+        aio->threads = km_calloc(n_threads, sizeof(*aio->threads),
+                &km_onerr_print);
+        if (aio->threads == NULL) goto fail;
+        for (int ttt = 0; ttt < n_threads; ttt++) {
+            if (pthread_create(&aio->threads[ttt], NULL, aio_thread, aio)) {
+                goto fail;
+            }
+            aio->n_threads++;
+        }
+    }
+    return aio;
+fail:
+    fdb_aio_destroy(aio);
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_aio_submit
+ *  Description:  Starts writing req->len bytes of req->buf at req->off in
+ *                  req->fd. The buffer must be left alone until
+ *                  fdb_aio_wait() says the write is done.
+ * Return Value:  int: 0 on success, an errno if a synchronous write failed
+ * ============================================================================
+ */
+int
+fdb_aio_submit (fdb_aio_t *aio, fdb_aio_req_t *req)
+{
+    req->written = 0;
+    req->done = 0;
+    req->err = 0;
+    req->next = NULL;
+    if (aio == NULL || aio->backend == FDB_AIO_SYNC) {
+        req->err = pwrite_all(req);
+        req->done = 1;
+        return req->err;
+    }
+    pthread_mutex_lock(&aio->lock);
+#ifdef FDB_HAVE_LIBURING
+    if (aio->backend == FDB_AIO_URING) {
+        uring_queue(aio, req);
+        pthread_mutex_unlock(&aio->lock);
+        return 0;
+    }
+#endif
+    if (aio->tail != NULL) {
+        aio->tail->next = req;
+    } else {
+        aio->head = req;
+    }
+    aio->tail = req;
+    pthread_cond_signal(&aio->work_cond);
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_aio_wait
+ *  Description:  Waits for a submitted write to finish.
+ * Return Value:  int: 0 on success, or the write's errno
+ * ============================================================================
+ */
+int
+fdb_aio_wait (fdb_aio_t *aio, fdb_aio_req_t *req)
+{
+    int err;
+    if (aio == NULL || aio->backend == FDB_AIO_SYNC) return req->err;
+    pthread_mutex_lock(&aio->lock);
+    while (!req->done) {
+#ifdef FDB_HAVE_LIBURING
+        if (aio->backend == FDB_AIO_URING) {
+            uring_wait(aio);
+            continue;
+        }
+#endif
+        pthread_cond_wait(&aio->done_cond, &aio->lock);
+    }
+    err = req->err;
+    pthread_mutex_unlock(&aio->lock);
+    return err;
+}
+
+/* Finishes all submitted writes, then stops the engine */
+void
+fdb_aio_destroy (fdb_aio_t *aio)
+{
+    if (aio == NULL) return;
+    pthread_mutex_lock(&aio->lock);
+    aio->shutdown = 1;
+    pthread_cond_broadcast(&aio->work_cond);
+    pthread_mutex_unlock(&aio->lock);
+    for (int ttt = 0; ttt < aio->n_threads; ttt++) {
+        pthread_join(aio->threads[ttt], NULL);
+    }
+    free(aio->threads);
+#ifdef FDB_HAVE_LIBURING
+    if (aio->backend == FDB_AIO_URING) io_uring_queue_exit(&aio->ring);
+#endif
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->work_cond);
+    pthread_cond_destroy(&aio->done_cond);
+    free(aio);
+}
@@ -0,0 +1,83 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_aio.h
+ *
+ *    Description:  Asynchronous positioned writes: io_uring where available,
+ *                      otherwise a pool of threads calling pwrite()
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 23:14:52
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_AIO_H
+#define FDB_AIO_H
+
+#include <pthread.h>
+#include <stdint.h>
+#ifdef FDB_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "kdm.h"
+
+enum fdb_aio_backend {
+    FDB_AIO_SYNC = 0,       /* write in the caller */
+    FDB_AIO_THREADS,
+    FDB_AIO_URING,
+};
+
+#define FDB_AIO_THREADS_DEFAULT 2
+#define FDB_AIO_URING_ENTRIES 256
+/* Output buffer size, and how many of each file's may be in flight */
+#define FDB_AIO_BUF_SIZE (512u << 10)
+#define FDB_AIO_DEPTH_DEFAULT 2
+/* Buffer, length and offset alignment for O_DIRECT */
+#define FDB_AIO_ALIGN 4096
+
+typedef struct __fdb_aio_req_t {
+    int fd;
+    const char *buf;
+    size_t len;
+    uint64_t off;
+    size_t written;
+    int done;
+    int err;                /* errno, if the write failed */
+    struct __fdb_aio_req_t *next;
+} fdb_aio_req_t;
+
+typedef struct __fdb_aio_t {
+    enum fdb_aio_backend backend;
+    /* Options for files written through this engine */
+    int direct;
+    int depth;
+    size_t buf_size;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    fdb_aio_req_t *head;
+    fdb_aio_req_t *tail;
+    pthread_t *threads;
+    int n_threads;
+    int shutdown;
+#ifdef FDB_HAVE_LIBURING
+    /* Submissions are made under the lock. One waiter at a time reaps
+     * completions, blocking without the lock while reaping is set. */
+    struct io_uring ring;
+    int reaping;
+#endif
+} fdb_aio_t;
+
+fdb_aio_t *fdb_aio_create (enum fdb_aio_backend backend, int n_threads);
+const char *fdb_aio_backend_name (enum fdb_aio_backend backend);
+int fdb_aio_submit (fdb_aio_t *aio, fdb_aio_req_t *req);
+int fdb_aio_wait (fdb_aio_t *aio, fdb_aio_req_t *req);
+void fdb_aio_destroy (fdb_aio_t *aio);
+
+#endif /* FDB_AIO_H */
@@ -0,0 +1,522 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_batch.c
+ *
+ *    Description:  Batches of reads parsed into one contiguous arena
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 19:25:50
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "fdb_batch.h"
+#include "fdb_ckpt.h"
+
+fdb_batch_pool_t *
+fdb_batch_pool_create (void)
+{
+    fdb_batch_pool_t *pool = km_calloc(1, sizeof(*pool), &km_onerr_print);
+    if (pool == NULL) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_batch_get
+ *  Description:  Takes a batch off the free list, allocating one only if the
+ *                  list is empty. Recycled batches keep their arena and
+ *                  record array, so a steady state allocates nothing.
+ * ============================================================================
+ */
+fdb_batch_t *
+fdb_batch_get (fdb_batch_pool_t *pool)
+{
+    fdb_batch_t *b = NULL;
+    pthread_mutex_lock(&pool->lock);
+    b = pool->free;
+    if (b != NULL) pool->free = b->next;
+    pthread_mutex_unlock(&pool->lock);
+    if (b != NULL) {
+        b->next = NULL;
+        return b;
+    }
+    b = km_calloc(1, sizeof(*b), &km_onerr_print);
+    if (b == NULL) return NULL;
+    /* A full batch, plus the read that went past it and a partial record */
+    b->arena_cap = FDB_BATCH_BYTES + 2 * FDB_BATCH_READ_SIZE;
+    b->arena = km_malloc(b->arena_cap, &km_onerr_print);
+    b->m_recs = FDB_BATCH_READS;
+    b->recs = km_calloc(b->m_recs, sizeof(*b->recs), &km_onerr_print);
+    if (b->arena == NULL || b->recs == NULL) {
+        km_free(b->arena, &km_onerr_nil);
+        km_free(b->recs, &km_onerr_nil);
+        free(b);
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->n_batches++;
+    pthread_mutex_unlock(&pool->lock);
+    return b;
+}
+
+void
+fdb_batch_put (fdb_batch_pool_t *pool, fdb_batch_t *b)
+{
+    if (b == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    b->next = pool->free;
+    pool->free = b;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+fdb_batch_pool_destroy (fdb_batch_pool_t *pool)
+{
+    if (pool == NULL) return;
+    while (pool->free != NULL) {
+        fdb_batch_t *b = pool->free;
+        pool->free = b->next;
+        free(b->arena);
+        free(b->recs);
+        free(b);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void
+fdb_batch_queue_init (fdb_batch_queue_t *q, size_t cap)
+{
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->cap = cap > 0 ? cap : 1;
+}
+
+/* Queues b for a worker, waiting while the queue is full */
+void
+fdb_batch_queue_push (fdb_batch_queue_t *q, fdb_batch_t *b)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->n >= q->cap) pthread_cond_wait(&q->not_full, &q->lock);
+    b->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = b;
+    } else {
+        q->head = b;
+    }
+    q->tail = b;
+    q->n++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_batch_queue_pop
+ *  Description:  Takes the oldest batch, waiting for one if need be.
+ * Return Value:  fdb_batch_t *: the batch, or NULL once the queue is
+ *                  closed and empty
+ * ============================================================================
+ */
+fdb_batch_t *
+fdb_batch_queue_pop (fdb_batch_queue_t *q)
+{
+    fdb_batch_t *b = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->head == NULL && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    b = q->head;
+    if (b != NULL) {
+        q->head = b->next;
+        if (q->head == NULL) q->tail = NULL;
+        b->next = NULL;
+        q->n--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+/* No more batches: workers finish what's queued, then get NULL */
+void
+fdb_batch_queue_close (fdb_batch_queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void
+fdb_batch_queue_destroy (fdb_batch_queue_t *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+/* Makes room for l more bytes in the arena. Returns 0 on success, 1 if
+ * out of memory. */
+static inline int
+arena_reserve (fdb_batch_t *b, size_t l)
+{
+    if (b->arena_len + l > b->arena_cap) {
+        /* Records are offsets, so moving the arena is harmless */
+        size_t cap = b->arena_cap;
+        char *grown = NULL;
+        while (b->arena_len + l > cap) cap <<= 1;
+        grown = km_realloc(b->arena, cap, &km_onerr_print);
+        if (grown == NULL) return 1;
+        b->arena = grown;
+        b->arena_cap = cap;
+    }
+    return 0;
+}
+
+/* Reads more input onto the end of the arena: FDB_BATCH_READ_SIZE, or as
+ * much as the partial record at its end already has, so that a huge record
+ * is rescanned O(log n) times. The arena is left NUL terminated. Returns 0
+ * on success, 1 on error. */
+static int
+arena_load (fdb_batch_t *b, kstream_t *ks, size_t partial)
+{
+    size_t want = partial > FDB_BATCH_READ_SIZE ? partial : FDB_BATCH_READ_SIZE;
+    int got = 0;
+    if (want > (1u << 30)) want = 1u << 30;
+    if (arena_reserve(b, want + 1)) return 1;
+    got = fdb_infile_read(ks->f, b->arena + b->arena_len, want);
+    if (got < 0) return 1;
+    if ((size_t)got < want) ks->is_eof = 1;
+    b->arena_len += got;
+    b->arena[b->arena_len] = '\0';
+    return 0;
+}
+
+/* Where a record's fields lie in the text it was parsed from, relative to
+ * its start. raw is the bytes a field's lines take, newlines and all. */
+typedef struct {
+    size_t name, name_l;
+    size_t comment, comment_l;
+    size_t seq, seq_raw, seq_l, seq_lines;
+    size_t qual, qual_raw, qual_l, qual_lines;
+    size_t used;
+} rec_span_t;
+
+/* Finds the end of the line at p in s: its '\n', or the end of s if the
+ * input ends there. Returns 1 if more input is needed to tell, else 0. */
+static inline int
+scan_line (const char *s, size_t len, int at_eof, size_t p, size_t *eol)
+{
+    const char *nl = memchr(s + p, '\n', len - p);
+    if (nl != NULL) {
+        *eol = nl - s;
+        return 0;
+    }
+    if (!at_eof) return 1;
+    *eol = len;
+    return 0;
+}
+
+/* Counts the line [from, eol) onto a field of *l bytes, as kseq appends
+ * it: a trailing '\r' is dropped, unless it would be all the field has */
+static inline void
+add_line (const char *s, size_t from, size_t eol, size_t *l)
+{
+    *l += eol - from;
+    if (eol > from && *l > 1 && s[eol - 1] == '\r') (*l)--;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  scan_record
+ *  Description:  Finds the fields of the FASTA/Q record at the start of s,
+ *                  exactly as kseq_read() would parse it, without touching
+ *                  s. at_eof says whether s runs to the end of the input.
+ * Return Value:  int: 0 for a record, 1 if more input is needed to parse
+ *                  it, -1 at the end of input or at a record kseq_read()
+ *                  would reject
+ * ============================================================================
+ */
+static int
+scan_record (const char *s, size_t len, int at_eof, rec_span_t *sp)
+{
+    size_t p = 0, eol = 0;
+    int c = -1;
+    memset(sp, 0, sizeof(*sp));
+    /* Skip to the header */
+    while (p < len && s[p] != '>' && s[p] != '@') p++;
+    if (p + 1 >= len) return at_eof ? -1 : 1;
+    sp->name = ++p;
+    while (p < len && !isspace((unsigned char)s[p])) p++;
+    if (p == len && !at_eof) return 1;
+    sp->name_l = p - sp->name;
+    /* The rest of the header line, if any, is the comment */
+    if (p < len && s[p++] != '\n') {
+        if (scan_line(s, len, at_eof, p, &eol)) return 1;
+        sp->comment = p;
+        add_line(s, p, eol, &sp->comment_l);
+        p = eol + (eol < len);
+    }
+    /* Sequence lines, up to a '+' line or the next record's header */
+    sp->seq = p;
+    while (1) {
+        if (p == len) {
+            if (!at_eof) return 1;
+            c = -1;
+            break;
+        }
+        c = s[p];
+        if (c == '>' || c == '+' || c == '@') break;
+        sp->seq_lines++;
+        if (c == '\n') {
+            p++;
+            continue;
+        }
+        if (scan_line(s, len, at_eof, p + 1, &eol)) return 1;
+        add_line(s, p, eol, &sp->seq_l);
+        p = eol + (eol < len);
+    }
+    sp->seq_raw = p - sp->seq;
+    if (c != '+') {
+        /* FASTA, ending at the input's end or the next header */
+        sp->used = p;
+        return 0;
+    }
+    /* Skip the '+' line: without a quality after it, the record is bad */
+    if (scan_line(s, len, at_eof, p + 1, &eol)) return 1;
+    if (eol == len) return -1;
+    p = eol + 1;
+    /* Quality lines, whatever they start with, until there are enough */
+    sp->qual = p;
+    do {
+        if (p == len) {
+            if (!at_eof) return 1;
+            break;
+        }
+        if (scan_line(s, len, at_eof, p, &eol)) return 1;
+        add_line(s, p, eol, &sp->qual_l);
+        sp->qual_lines++;
+        p = eol + (eol < len);
+    } while (sp->qual_l < sp->seq_l);
+    sp->qual_raw = p - sp->qual;
+    sp->used = p;
+    return sp->qual_l == sp->seq_l ? 0 : -1;
+}
+
+/* Joins a field's raw lines into its first l bytes, as add_line() counted
+ * them, and NUL terminates it. A one line field only needs the NUL. */
+static void
+squeeze_field (char *s, size_t raw, size_t l, size_t n_lines)
+{
+    size_t from = 0, out = 0;
+    if (n_lines > 1) {
+        while (from < raw) {
+            const char *nl = memchr(s + from, '\n', raw - from);
+            size_t eol = nl != NULL ? (size_t)(nl - s) : raw;
+            memmove(s + out, s + from, eol - from);
+            add_line(s, out, out + eol - from, &out);
+            from = eol + 1;
+        }
+    }
+    s[l] = '\0';
+}
+
+/* Turns the scanned record at `at` in the arena into rec, in place. Its
+ * NULs land on its separators, or on the byte after the arena at the end
+ * of input. Empty fields share the previous field's NUL, as writing one
+ * of their own could overwrite the next record. */
+static void
+take_record (fdb_batch_t *b, size_t at, const rec_span_t *sp, fdb_rec_t *rec)
+{
+    char *s = b->arena + at;
+    s[sp->name + sp->name_l] = '\0';
+    rec->name = at + sp->name;
+    rec->name_l = sp->name_l;
+    rec->comment = rec->name + rec->name_l;
+    rec->comment_l = 0;
+    if (sp->comment_l > 0) {
+        s[sp->comment + sp->comment_l] = '\0';
+        rec->comment = at + sp->comment;
+        rec->comment_l = sp->comment_l;
+    }
+    rec->seq = rec->comment + rec->comment_l;
+    rec->seq_l = 0;
+    if (sp->seq_l > 0) {
+        squeeze_field(s + sp->seq, sp->seq_raw, sp->seq_l, sp->seq_lines);
+        rec->seq = at + sp->seq;
+        rec->seq_l = sp->seq_l;
+    }
+    rec->qual = rec->seq + rec->seq_l;
+    rec->qual_l = 0;
+    if (sp->qual_l > 0) {
+        squeeze_field(s + sp->qual, sp->qual_raw, sp->qual_l,
+                sp->qual_lines);
+        rec->qual = at + sp->qual;
+        rec->qual_l = sp->qual_l;
+    }
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_batch_fill
+ *  Description:  Parses reads from seq into an emptied batch until it holds
+ *                  FDB_BATCH_READS reads or FDB_BATCH_BYTES of arena, the
+ *                  input ends, or the next read starts at or after `end`.
+ *                  Input is read straight into the arena and records are
+ *                  parsed where they lie, so each byte is copied once. seq
+ *                  is only a handle on the input: what it had buffered is
+ *                  taken over first, and the partial record left at the end
+ *                  is put back in its buffer, so fdb_kseq_tell() stays
+ *                  right.
+ * Return Value:  size_t: number of reads in the batch, 0 at the end of the
+ *                  input or on error, after which b->eof is -1
+ * ============================================================================
+ */
+size_t
+fdb_batch_fill (fdb_batch_t *b, kseq_t *seq, int inf, uint64_t end)
+{
+    kstream_t *ks = seq->f;
+    uint64_t base = fdb_kseq_tell(seq);
+    size_t done = 0, left = 0;
+    b->n_recs = 0;
+    b->arena_len = 0;
+    b->inf = inf;
+    b->eof = 0;
+    left = ks->end > ks->begin ? ks->end - ks->begin : 0;
+    if (arena_reserve(b, left + 2)) goto fail;
+    if (seq->last_char != 0) {
+        b->arena[b->arena_len++] = seq->last_char;
+        seq->last_char = 0;
+    }
+    memcpy(b->arena + b->arena_len, ks->buf + ks->begin, left);
+    b->arena_len += left;
+    b->arena[b->arena_len] = '\0';
+    ks->begin = ks->end = 0;
+    while (b->n_recs < b->m_recs && done < FDB_BATCH_BYTES) {
+        rec_span_t sp;
+        int ret = 0;
+        if (base + done >= end) {
+            b->eof = 1;
+            break;
+        }
+        ret = scan_record(b->arena + done, b->arena_len - done, ks->is_eof,
+                &sp);
+        if (ret > 0) {
+            if (arena_load(b, ks, b->arena_len - done)) goto fail;
+            continue;
+        }
+        if (ret < 0) {
+            b->eof = 1;
+            break;
+        }
+        take_record(b, done, &sp, &b->recs[b->n_recs++]);
+        done += sp.used;
+    }
+    /* The rest goes back to seq, for the next batch */
+    left = b->arena_len - done;
+    if (left > FDB_KSEQ_BUFSIZE) {
+        unsigned char *grown = km_realloc(ks->buf, left, &km_onerr_print);
+        if (grown == NULL) goto fail;
+        ks->buf = grown;
+    }
+    memcpy(ks->buf, b->arena + done, left);
+    ks->end = left;
+    b->arena_len = done;
+    b->end_offset = base + done;
+    return b->n_recs;
+fail:
+    b->n_recs = 0;
+    b->eof = -1;
+    return 0;
+} /* -----  end of function fdb_batch_fill  ----- */
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_batch_spill
+ *  Description:  Appends a read to fp, for fdb_batch_fill_spill() to read
+ *                  back later.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_batch_spill (const fdb_batch_t *b, const fdb_rec_t *rec, FILE *fp)
+{
+    fdb_spill_hdr_t hdr = {
+        rec->name_l, rec->comment_l, rec->seq_l, rec->qual_l, b->inf
+    };
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) return 1;
+    fwrite(FDB_REC_NAME(b, rec), 1, rec->name_l, fp);
+    fwrite(FDB_REC_COMMENT(b, rec), 1, rec->comment_l, fp);
+    fwrite(FDB_REC_SEQ(b, rec), 1, rec->seq_l, fp);
+    fwrite(FDB_REC_QUAL(b, rec), 1, rec->qual_l, fp);
+    return ferror(fp) != 0;
+}
+
+/* Reads a spilled field into the arena, NUL terminated. Returns 0 on
+ * success, 1 on error. */
+static inline int
+arena_read (fdb_batch_t *b, FILE *fp, uint32_t l, uint32_t *off)
+{
+    *off = b->arena_len;
+    if (arena_reserve(b, (size_t)l + 1)) return 1;
+    if (l > 0 && fread(b->arena + *off, 1, l, fp) != l) return 1;
+    b->arena[*off + l] = '\0';
+    b->arena_len = *off + l + 1;
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_batch_fill_spill
+ *  Description:  Reads spilled reads back into an emptied batch, as
+ *                  fdb_batch_fill() would from their input. A batch holds
+ *                  reads of one input, so stops where the input changes.
+ * Return Value:  size_t: number of reads in the batch, 0 at the end of fp
+ *                  or on error, after which b->eof is -1
+ * ============================================================================
+ */
+size_t
+fdb_batch_fill_spill (fdb_batch_t *b, FILE *fp)
+{
+    b->n_recs = 0;
+    b->arena_len = 0;
+    b->eof = 0;
+    while (b->n_recs < b->m_recs && b->arena_len < FDB_BATCH_BYTES) {
+        fdb_rec_t *rec = &b->recs[b->n_recs];
+        fdb_spill_hdr_t hdr;
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+            b->eof = ferror(fp) ? -1 : 1;
+            break;
+        }
+        if (b->n_recs == 0) {
+            b->inf = hdr.inf;
+        } else if (hdr.inf != b->inf) {
+            fseek(fp, -(long)sizeof(hdr), SEEK_CUR);
+            break;
+        }
+        rec->name_l = hdr.name_l;
+        rec->comment_l = hdr.comment_l;
+        rec->seq_l = hdr.seq_l;
+        rec->qual_l = hdr.qual_l;
+        if (arena_read(b, fp, hdr.name_l, &rec->name) || \
+                arena_read(b, fp, hdr.comment_l, &rec->comment) || \
+                arena_read(b, fp, hdr.seq_l, &rec->seq) || \
+                arena_read(b, fp, hdr.qual_l, &rec->qual)) {
+            b->eof = -1;
+            return 0;
+        }
+        b->n_recs++;
+    }
+    return b->n_recs;
+}
@@ -0,0 +1,159 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_batch.h
+ *
+ *    Description:  Batches of reads parsed into one contiguous arena
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 19:25:50
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_BATCH_H
+#define FDB_BATCH_H
+
+#include <pthread.h>
+
+#include "fdb.h"
+
+/* A batch is full at whichever of these comes first */
+#define FDB_BATCH_READS 4096
+#define FDB_BATCH_BYTES (4u << 20)
+/* Input is read into a batch's arena this much at a time */
+#define FDB_BATCH_READ_SIZE (64u << 10)
+/* The buffer size KSEQ_INIT gives kseq, which fdb_batch_fill() may grow */
+#define FDB_KSEQ_BUFSIZE 16384
+
+/* A read, as offsets into its batch's arena. Every field is NUL
+ * terminated in the arena, and an absent comment is "". */
+typedef struct __fdb_rec_t {
+    uint32_t name;
+    uint32_t comment;
+    uint32_t seq;
+    uint32_t qual;
+    uint32_t name_l;
+    uint32_t comment_l;
+    uint32_t seq_l;
+    uint32_t qual_l;
+} fdb_rec_t;
+
+typedef struct __fdb_batch_t {
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    fdb_rec_t *recs;
+    size_t n_recs;
+    size_t m_recs;
+    int inf;                    /* input file index */
+    uint64_t end_offset;        /* input offset just past the last read */
+    int eof;
+    struct __fdb_batch_t *next; /* free list */
+} fdb_batch_t;
+
+typedef struct __fdb_batch_pool_t {
+    pthread_mutex_t lock;
+    fdb_batch_t *free;
+    size_t n_batches;
+} fdb_batch_pool_t;
+
+/* Filled batches on their way from the reader to worker threads. Bounded,
+ * so the reader can't get far ahead of the workers. */
+typedef struct __fdb_batch_queue_t {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    fdb_batch_t *head;
+    fdb_batch_t *tail;
+    size_t n;
+    size_t cap;
+    int closed;
+} fdb_batch_queue_t;
+
+#define FDB_REC_NAME(b, r) ((b)->arena + (r)->name)
+#define FDB_REC_COMMENT(b, r) ((b)->arena + (r)->comment)
+#define FDB_REC_SEQ(b, r) ((b)->arena + (r)->seq)
+#define FDB_REC_QUAL(b, r) ((b)->arena + (r)->qual)
+
+/* Trimmed length of a field, never below zero */
+#define FDB_REC_TRIMMED(l, trim) ((l) > (trim) ? (l) - (trim) : 0)
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rec_fastq_len
+ *  Description:  Bytes fdb_rec_fastq() writes for rec.
+ * ============================================================================
+ */
+static inline size_t
+fdb_rec_fastq_len (const fdb_rec_t *rec, size_t trim)
+{
+    /* @name[ comment]\nseq\n+\nqual\n */
+    return 1 + rec->name_l + (rec->comment_l ? 1 + rec->comment_l : 0) + 1 + \
+        FDB_REC_TRIMMED(rec->seq_l, trim) + 3 + \
+        FDB_REC_TRIMMED(rec->qual_l, trim) + 1;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rec_fastq
+ *  Description:  Writes rec to out as a FASTQ record, with trim bases cut
+ *                  from the start of its sequence and quality. Fields are
+ *                  copied by their known lengths; out must have
+ *                  fdb_rec_fastq_len() bytes free and is not NUL terminated.
+ * Return Value:  char *: the end of the record in out
+ * ============================================================================
+ */
+static inline char *
+fdb_rec_fastq (const fdb_batch_t *b, const fdb_rec_t *rec, size_t trim,
+               char *out)
+{
+    size_t seq_l = FDB_REC_TRIMMED(rec->seq_l, trim);
+    size_t qual_l = FDB_REC_TRIMMED(rec->qual_l, trim);
+    *out++ = '@';
+    memcpy(out, FDB_REC_NAME(b, rec), rec->name_l);
+    out += rec->name_l;
+    if (rec->comment_l) {
+        *out++ = ' ';
+        memcpy(out, FDB_REC_COMMENT(b, rec), rec->comment_l);
+        out += rec->comment_l;
+    }
+    *out++ = '\n';
+    memcpy(out, FDB_REC_SEQ(b, rec) + rec->seq_l - seq_l, seq_l);
+    out += seq_l;
+    memcpy(out, "\n+\n", 3);
+    out += 3;
+    memcpy(out, FDB_REC_QUAL(b, rec) + rec->qual_l - qual_l, qual_l);
+    out += qual_l;
+    *out++ = '\n';
+    return out;
+}
+
+/* A read spilled to a file: its lengths and input, then its fields
+ * without separators */
+typedef struct __fdb_spill_hdr_t {
+    uint32_t name_l;
+    uint32_t comment_l;
+    uint32_t seq_l;
+    uint32_t qual_l;
+    int32_t inf;
+} fdb_spill_hdr_t;
+
+fdb_batch_pool_t *fdb_batch_pool_create (void);
+fdb_batch_t *fdb_batch_get (fdb_batch_pool_t *pool);
+void fdb_batch_put (fdb_batch_pool_t *pool, fdb_batch_t *b);
+void fdb_batch_pool_destroy (fdb_batch_pool_t *pool);
+size_t fdb_batch_fill (fdb_batch_t *b, kseq_t *seq, int inf, uint64_t end);
+void fdb_batch_queue_init (fdb_batch_queue_t *q, size_t cap);
+void fdb_batch_queue_push (fdb_batch_queue_t *q, fdb_batch_t *b);
+fdb_batch_t *fdb_batch_queue_pop (fdb_batch_queue_t *q);
+void fdb_batch_queue_close (fdb_batch_queue_t *q);
+void fdb_batch_queue_destroy (fdb_batch_queue_t *q);
+int fdb_batch_spill (const fdb_batch_t *b, const fdb_rec_t *rec, FILE *fp);
+size_t fdb_batch_fill_spill (fdb_batch_t *b, FILE *fp);
+
+#endif /* FDB_BATCH_H */
@@ -0,0 +1,349 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_ckpt.c
+ *
+ *    Description:  Checkpointing and resumption of interrupted runs
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 10:12:41
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "fdb_ckpt.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t
+fnv1a (uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t iii = 0; iii < len; iii++) {
+        hash = (hash ^ p[iii]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t
+hash_str (uint64_t hash, const char *str)
+{
+    if (str == NULL) return fnv1a(hash, "", 1);
+    return fnv1a(hash, str, strlen(str) + 1);
+}
+
+/* A file's name and size, or 1 if it can't be found */
+static int
+hash_file (uint64_t *hash, const char *fn)
+{
+    struct stat st;
+    uint64_t size = 0;
+    if (stat(fn, &st) != 0) {
+        FDB_IO_ERROR(fn);
+        return 1;
+    }
+    size = st.st_size;
+    *hash = hash_str(*hash, fn);
+    *hash = fnv1a(*hash, &size, sizeof(size));
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  ckpt_fingerprint
+ *  Description:  Hashes what a run's outputs depend on: its inputs' names
+ *                  and sizes, its barcodes, matching and filtering options,
+ *                  and how its outputs are named and compressed. Resuming
+ *                  with any of these changed would append to the outputs
+ *                  something other than what they hold.
+ * Return Value:  int: 0 on success, 1 if an input can't be found
+ * ============================================================================
+ */
+static int
+ckpt_fingerprint (const fdb_config_t *cfg, uint64_t *fingerprint)
+{
+    uint64_t hash = FNV_OFFSET;
+    int zipped = !!(cfg->flag & FLG_ZIPPED_OUT);
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        if (hash_file(&hash, cfg->infns[fff])) return 1;
+    }
+    for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        hash = hash_str(hash, cfg->barcodes[bbb]->name.s);
+        hash = hash_str(hash, cfg->barcodes[bbb]->seq.s);
+    }
+    hash = fnv1a(hash, &cfg->max_barcode_mismatches,
+            sizeof(cfg->max_barcode_mismatches));
+    hash = hash_str(hash, cfg->buffer_seq);
+    hash = fnv1a(hash, &cfg->max_buffer_mismatches,
+            sizeof(cfg->max_buffer_mismatches));
+    hash = fnv1a(hash, &cfg->filter_min_len, sizeof(cfg->filter_min_len));
+    hash = fnv1a(hash, &cfg->filter_max_n, sizeof(cfg->filter_max_n));
+    if (cfg->contam_file != NULL && hash_file(&hash, cfg->contam_file)) {
+        return 1;
+    }
+    hash = fnv1a(hash, &cfg->contam_k, sizeof(cfg->contam_k));
+    hash = fnv1a(hash, &zipped, sizeof(zipped));
+    hash = hash_str(hash, cfg->out_ext);
+    hash = fnv1a(hash, &cfg->level, sizeof(cfg->level));
+    hash = hash_str(hash, cfg->leftover_suffix);
+    *fingerprint = hash;
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  flush_output
+ *  Description:  Ends the current compressed block of an output file, and
+ *                  gets its length on disk.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+flush_output (fdb_ofile_t *fp, uint64_t *len)
+{
+    if (fdb_ofile_flush(fp)) return 1;
+    *len = fp->size;
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_ckpt_save
+ *  Description:  Flushes all outputs and atomically (re)writes the checkpoint
+ *                  file. cur_inf and in_offset give the input record that
+ *                  processing would resume from.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_ckpt_save (fdb_config_t *cfg, int cur_inf, uint64_t in_offset)
+{
+    size_t tmp_len = strlen(cfg->ckpt_file) + 5;
+    char *tmp_fn = km_calloc(tmp_len, sizeof(*tmp_fn), &km_onerr_print);
+    FILE *fp = NULL;
+    uint64_t len = 0;
+    uint64_t fingerprint = 0;
+    int ret = 1;
+    if (tmp_fn == NULL) return 1;
+    if (ckpt_fingerprint(cfg, &fingerprint)) {
+        free(tmp_fn);
+        return 1;
+    }
+    snprintf(tmp_fn, tmp_len, "%s.tmp", cfg->ckpt_file);
+    /* Everything up to this record must be written before we look at the
+     * outputs */
+    if (fdb_outq_flush(cfg->outq_prod) || fdb_outq_wait(cfg->outq)) {
+        fprintf(stderr, "ERROR: writing output failed\n");
+        free(tmp_fn);
+        return 1;
+    }
+    fp = fopen(tmp_fn, "w");
+    if (fp == NULL) {
+        FDB_IO_ERROR(tmp_fn);
+        free(tmp_fn);
+        return 1;
+    }
+    fprintf(fp, "%s %d\n", FDB_CKPT_MAGIC, FDB_CKPT_VERSION);
+    fprintf(fp, "inputs %d barcodes %zu\n", cfg->n_infs, cfg->n_barcodes);
+    fprintf(fp, "fingerprint %016" PRIx64 "\n", fingerprint);
+    fprintf(fp, "position %d %" PRIu64 "\n", cur_inf, in_offset);
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        fprintf(fp, "reads %d %zu\n", fff, cfg->reads_processed[fff]);
+    }
+    for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        fprintf(fp, "count %zu %" PRIu64 "\n", bbb, cfg->barcodes[bbb]->count);
+    }
+    for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        barcode_t *bcd = cfg->barcodes[bbb];
+        for (int fff = 0; fff < cfg->n_infs; fff++) {
+            if (flush_output(bcd->fps[fff], &len)) goto exit;
+            fprintf(fp, "output %zu %d %" PRIu64 "\n", bbb, fff, len);
+        }
+    }
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        if (flush_output(cfg->leftover_outfps[fff], &len)) goto exit;
+        fprintf(fp, "leftover %d %" PRIu64 "\n", fff, len);
+    }
+    for (int fff = 0; fff < cfg->n_infs && cfg->filter != NULL; fff++) {
+        const uint64_t *n = &cfg->filtered[FDB_FILTERED_IDX(fff, 0)];
+        if (flush_output(cfg->filtered_outfps[fff], &len)) goto exit;
+        fprintf(fp, "filtered %d %" PRIu64 " %" PRIu64 " %" PRIu64 " %"
+                PRIu64 "\n", fff, len, n[FDB_FILTER_SHORT], n[FDB_FILTER_NS],
+                n[FDB_FILTER_CONTAM]);
+    }
+    /* Only replace the previous checkpoint once this one is on disk */
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        FDB_IO_ERROR(tmp_fn);
+        goto exit;
+    }
+    fclose(fp);
+    fp = NULL;
+    if (rename(tmp_fn, cfg->ckpt_file) != 0) {
+        FDB_IO_ERROR(cfg->ckpt_file);
+        goto exit;
+    }
+    ret = 0;
+exit:
+    if (fp != NULL) fclose(fp);
+    free(tmp_fn);
+    return ret;
+} /* -----  end of function fdb_ckpt_save  ----- */
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_ckpt_load
+ *  Description:  Reads a checkpoint file written by fdb_ckpt_save, checking
+ *                  that it was made by a run with the same inputs, barcodes
+ *                  and options as cfg's (see ckpt_fingerprint()).
+ * Return Value:  fdb_ckpt_t *: the checkpoint, or NULL on failure
+ * ============================================================================
+ */
+fdb_ckpt_t *
+fdb_ckpt_load (const char *fn, const fdb_config_t *cfg)
+{
+    FILE *fp = NULL;
+    fdb_ckpt_t *ckpt = NULL;
+    char magic[64];
+    int version = 0;
+    int fff = 0;
+    size_t bbb = 0;
+    int n_infs = cfg->n_infs;
+    size_t n_barcodes = cfg->n_barcodes;
+    uint64_t fingerprint = 0, saved = 0;
+    if (ckpt_fingerprint(cfg, &fingerprint)) return NULL;
+    fp = fopen(fn, "r");
+    if (fp == NULL) {
+        FDB_IO_ERROR(fn);
+        return NULL;
+    }
+    ckpt = km_calloc(1, sizeof(*ckpt), &km_onerr_print);
+    if (ckpt == NULL) goto fail;
+    if (fscanf(fp, "%63s %d\n", magic, &version) != 2 || \
+            strcmp(magic, FDB_CKPT_MAGIC) != 0 || \
+            version != FDB_CKPT_VERSION) {
+        fprintf(stderr, "ERROR: '%s' is not a version %d checkpoint\n", fn,
+                FDB_CKPT_VERSION);
+        goto fail;
+    }
+    if (fscanf(fp, "inputs %d barcodes %zu\n", &ckpt->n_infs,
+                &ckpt->n_barcodes) != 2 || ckpt->n_infs != n_infs || \
+            ckpt->n_barcodes != n_barcodes) {
+        fprintf(stderr, "ERROR: checkpoint '%s' does not match the inputs or"
+                " barcodes of this run\n", fn);
+        goto fail;
+    }
+    if (fscanf(fp, "fingerprint %" SCNx64 "\n", &saved) != 1) goto bad;
+    if (saved != fingerprint) {
+        fprintf(stderr, "ERROR: checkpoint '%s' was made with other inputs,"
+                " barcodes or options than this run\n", fn);
+        goto fail;
+    }
+    if (fscanf(fp, "position %d %" SCNu64 "\n", &ckpt->cur_inf,
+                &ckpt->in_offset) != 2) goto bad;
+    ckpt->reads_processed = km_calloc(n_infs,
+            sizeof(*ckpt->reads_processed), &km_onerr_print);
+    ckpt->leftover_lens = km_calloc(n_infs, sizeof(*ckpt->leftover_lens),
+            &km_onerr_print);
+    ckpt->counts = km_calloc(n_barcodes, sizeof(*ckpt->counts),
+            &km_onerr_print);
+    ckpt->out_lens = km_calloc(n_barcodes * n_infs, sizeof(*ckpt->out_lens),
+            &km_onerr_print);
+    if (ckpt->reads_processed == NULL || ckpt->leftover_lens == NULL || \
+            ckpt->counts == NULL || ckpt->out_lens == NULL) goto fail;
+    for (int iii = 0; iii < n_infs; iii++) {
+        if (fscanf(fp, "reads %d %zu\n", &fff,
+                    &ckpt->reads_processed[iii]) != 2 || fff != iii) goto bad;
+    }
+    for (size_t iii = 0; iii < n_barcodes; iii++) {
+        if (fscanf(fp, "count %zu %" SCNu64 "\n", &bbb,
+                    &ckpt->counts[iii]) != 2 || bbb != iii) goto bad;
+    }
+    for (size_t iii = 0; iii < n_barcodes; iii++) {
+        for (int jjj = 0; jjj < n_infs; jjj++) {
+            if (fscanf(fp, "output %zu %d %" SCNu64 "\n", &bbb, &fff,
+                        &ckpt->out_lens[iii * n_infs + jjj]) != 3 || \
+                    bbb != iii || fff != jjj) goto bad;
+        }
+    }
+    for (int iii = 0; iii < n_infs; iii++) {
+        if (fscanf(fp, "leftover %d %" SCNu64 "\n", &fff,
+                    &ckpt->leftover_lens[iii]) != 2 || fff != iii) goto bad;
+    }
+    /* Then, if the run was filtering, its filtered outputs and counts */
+    for (int iii = 0; iii < n_infs; iii++) {
+        uint64_t *n = NULL;
+        if (iii == 0) {
+            int c = getc(fp);
+            if (c == EOF) break;
+            ungetc(c, fp);
+            ckpt->filtered_lens = km_calloc(n_infs,
+                    sizeof(*ckpt->filtered_lens), &km_onerr_print);
+            ckpt->filtered = km_calloc(n_infs * FDB_FILTER_N_REASONS,
+                    sizeof(*ckpt->filtered), &km_onerr_print);
+            if (ckpt->filtered_lens == NULL || ckpt->filtered == NULL) {
+                goto fail;
+            }
+        }
+        n = &ckpt->filtered[FDB_FILTERED_IDX(iii, 0)];
+        if (fscanf(fp, "filtered %d %" SCNu64 " %" SCNu64 " %" SCNu64 " %"
+                    SCNu64 "\n", &fff, &ckpt->filtered_lens[iii],
+                    &n[FDB_FILTER_SHORT], &n[FDB_FILTER_NS],
+                    &n[FDB_FILTER_CONTAM]) != 5 || fff != iii) goto bad;
+    }
+    fclose(fp);
+    return ckpt;
+bad:
+    fprintf(stderr, "ERROR: checkpoint '%s' is truncated or corrupt\n", fn);
+fail:
+    fclose(fp);
+    fdb_ckpt_destroy(ckpt);
+    return NULL;
+} /* -----  end of function fdb_ckpt_load  ----- */
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_ckpt_reopen
+ *  Description:  Truncates an output file back to its checkpointed length,
+ *                  and opens it for appending.
+ * Return Value:  fdb_ofile_t *: the reopened file, or NULL on failure
+ * ============================================================================
+ */
+fdb_ofile_t *
+fdb_ckpt_reopen (const char *fn, uint64_t len, int level, fdb_aio_t *aio)
+{
+    struct stat st;
+    if (stat(fn, &st) != 0) {
+        FDB_IO_ERROR(fn);
+        return NULL;
+    }
+    if ((uint64_t)st.st_size < len) {
+        fprintf(stderr, "ERROR: output '%s' is shorter than at checkpoint"
+                " (%" PRIu64 " < %" PRIu64 ")\n", fn, (uint64_t)st.st_size,
+                len);
+        return NULL;
+    }
+    if (truncate(fn, len) != 0) {
+        FDB_IO_ERROR(fn);
+        return NULL;
+    }
+    return fdb_ofile_open(fn, level, 1, aio);
+} /* -----  end of function fdb_ckpt_reopen  ----- */
+
+void
+fdb_ckpt_destroy (fdb_ckpt_t *ckpt)
+{
+    if (ckpt == NULL) return;
+    km_free(ckpt->reads_processed, &km_onerr_nil);
+    km_free(ckpt->counts, &km_onerr_nil);
+    km_free(ckpt->out_lens, &km_onerr_nil);
+    km_free(ckpt->leftover_lens, &km_onerr_nil);
+    km_free(ckpt->filtered_lens, &km_onerr_nil);
+    km_free(ckpt->filtered, &km_onerr_nil);
+    free(ckpt);
+}
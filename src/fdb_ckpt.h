@@ -0,0 +1,71 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_ckpt.h
+ *
+ *    Description:  Checkpointing and resumption of interrupted runs
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 10:12:41
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_CKPT_H
+#define FDB_CKPT_H
+
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fdb.h"
+
+#define FDB_CKPT_MAGIC "fastDBarcode_checkpoint"
+#define FDB_CKPT_VERSION 2
+
+/* State recorded at a checkpoint. Every output file is cut at a compressed
+ * block boundary (or at a plain byte offset for unzipped output), so
+ * truncating it back to out_lens/leftover_lens/filtered_lens and appending
+ * gives a valid file. */
+typedef struct __fdb_ckpt_t {
+    int n_infs;
+    size_t n_barcodes;
+    int cur_inf;                /* first input not completely processed */
+    uint64_t in_offset;         /* uncompressed offset of next record */
+    size_t *reads_processed;    /* per input */
+    uint64_t *counts;           /* per barcode */
+    uint64_t *out_lens;         /* per barcode x input, barcode major */
+    uint64_t *leftover_lens;    /* per input */
+    /* NULL if the run wasn't filtering reads */
+    uint64_t *filtered_lens;    /* per input */
+    uint64_t *filtered;         /* as fdb_config_t's */
+} fdb_ckpt_t;
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_kseq_tell
+ *  Description:  Uncompressed offset of the start of the next unread record,
+ *                  i.e. gztell() less whatever kseq has buffered, less the
+ *                  header char kseq has consumed for FASTA input.
+ * ============================================================================
+ */
+static inline uint64_t
+fdb_kseq_tell (kseq_t *ks)
+{
+    int64_t buffered = ks->f->end - ks->f->begin;
+    uint64_t pos = fdb_infile_tell(ks->f->f);
+    if (buffered < 0) buffered = 0;
+    return pos - buffered - (ks->last_char != 0);
+}
+
+int fdb_ckpt_save (fdb_config_t *cfg, int cur_inf, uint64_t in_offset);
+fdb_ckpt_t *fdb_ckpt_load (const char *fn, const fdb_config_t *cfg);
+fdb_ofile_t *fdb_ckpt_reopen (const char *fn, uint64_t len, int level,
+                              fdb_aio_t *aio);
+void fdb_ckpt_destroy (fdb_ckpt_t *ckpt);
+
+#endif /* FDB_CKPT_H */
@@ -0,0 +1,620 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_codec.c
+ *
+ *    Description:  Output compression codecs, and the output file type that
+ *                      writes through them
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 19:21:48
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+/* For O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef FDB_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef FDB_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "fdb_codec.h"
+
+/* Compressor state is kept per thread, and reused for every block that
+ * thread compresses, whichever file it is for. */
+static __thread z_stream *tl_zstrm = NULL;
+static __thread int tl_zlevel = -1;
+#ifdef FDB_HAVE_LIBDEFLATE
+static __thread struct libdeflate_compressor *tl_ldc = NULL;
+static __thread int tl_ldc_level = -1;
+#endif
+#ifdef FDB_HAVE_ZSTD
+static __thread ZSTD_CCtx *tl_zcctx = NULL;
+#endif
+
+/* Uncompressed: a straight copy */
+static size_t
+plain_bound (size_t len)
+{
+    return len;
+}
+
+static size_t
+plain_compress (int level, const char *in, size_t len, char *out,
+                size_t out_cap)
+{
+    (void) level;
+    if (len > out_cap) return 0;
+    memcpy(out, in, len);
+    return len;
+}
+
+/* zlib: one gzip member per block */
+static size_t
+zlib_bound (size_t len)
+{
+    /* compressBound() allows for a zlib wrapper, gzip's is 12 bytes more */
+    return compressBound(len) + 18;
+}
+
+static size_t
+zlib_compress (int level, const char *in, size_t len, char *out,
+               size_t out_cap)
+{
+    z_stream *zs = tl_zstrm;
+    if (zs != NULL && tl_zlevel != level) {
+        deflateEnd(zs);
+        free(zs);
+        zs = tl_zstrm = NULL;
+    }
+    if (zs == NULL) {
+        zs = calloc(1, sizeof(*zs));
+        if (zs == NULL) return 0;
+        /* windowBits + 16 writes a gzip header and trailer */
+        if (deflateInit2(zs, level, Z_DEFLATED, 15 + 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(zs);
+            return 0;
+        }
+        tl_zstrm = zs;
+        tl_zlevel = level;
+    } else if (deflateReset(zs) != Z_OK) {
+        return 0;
+    }
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *)out;
+    zs->avail_out = out_cap;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) return 0;
+    return out_cap - zs->avail_out;
+}
+
+const fdb_codec_t fdb_codec_plain = {
+    "plain", NULL, 0, 0, &plain_bound, &plain_compress
+};
+
+const fdb_codec_t fdb_codec_zlib = {
+    "zlib", "gz", 4, 9, &zlib_bound, &zlib_compress
+};
+
+#ifdef FDB_HAVE_LIBDEFLATE
+/* libdeflate: one gzip member per block, compressed in a single call */
+static struct libdeflate_compressor *
+ldc_get (int level)
+{
+    if (tl_ldc != NULL && tl_ldc_level != level) {
+        libdeflate_free_compressor(tl_ldc);
+        tl_ldc = NULL;
+    }
+    if (tl_ldc == NULL) {
+        tl_ldc = libdeflate_alloc_compressor(level);
+        tl_ldc_level = level;
+    }
+    return tl_ldc;
+}
+
+static size_t
+libdeflate_bound (size_t len)
+{
+    struct libdeflate_compressor *c = ldc_get(tl_ldc_level < 0 ? \
+            fdb_codec_libdeflate.default_level : tl_ldc_level);
+    if (c == NULL) return 0;
+    return libdeflate_gzip_compress_bound(c, len);
+}
+
+static size_t
+libdeflate_compress (int level, const char *in, size_t len, char *out,
+                     size_t out_cap)
+{
+    struct libdeflate_compressor *c = ldc_get(level);
+    if (c == NULL) return 0;
+    return libdeflate_gzip_compress(c, in, len, out, out_cap);
+}
+
+const fdb_codec_t fdb_codec_libdeflate = {
+    "libdeflate", "gz", 4, 12, &libdeflate_bound, &libdeflate_compress
+};
+#endif
+
+#ifdef FDB_HAVE_ZSTD
+/* zstd: one frame per block */
+static size_t
+zstd_bound (size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+static size_t
+zstd_compress (int level, const char *in, size_t len, char *out,
+               size_t out_cap)
+{
+    size_t ret;
+    if (tl_zcctx == NULL && (tl_zcctx = ZSTD_createCCtx()) == NULL) return 0;
+    ret = ZSTD_compressCCtx(tl_zcctx, out, out_cap, in, len, level);
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+
+const fdb_codec_t fdb_codec_zstd = {
+    "zstd", "zst", 3, 19, &zstd_bound, &zstd_compress
+};
+#endif
+
+/* Where two codecs share an extension, the first listed is used for it */
+const fdb_codec_t *fdb_codecs[] = {
+#ifdef FDB_HAVE_LIBDEFLATE
+    &fdb_codec_libdeflate,
+#endif
+    &fdb_codec_zlib,
+#ifdef FDB_HAVE_ZSTD
+    &fdb_codec_zstd,
+#endif
+    &fdb_codec_plain,
+    NULL
+};
+
+const fdb_codec_t *
+fdb_codec_by_name (const char *name)
+{
+    for (const fdb_codec_t **c = fdb_codecs; *c != NULL; c++) {
+        if (strcmp((*c)->name, name) == 0) return *c;
+    }
+    return NULL;
+}
+
+const fdb_codec_t *
+fdb_codec_by_ext (const char *ext)
+{
+    for (const fdb_codec_t **c = fdb_codecs; *c != NULL; c++) {
+        if ((*c)->ext != NULL && strcmp((*c)->ext, ext) == 0) return *c;
+    }
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_codec_for_path
+ *  Description:  Picks the codec for a file from its extension, falling back
+ *                  to writing it uncompressed.
+ * Return Value:  const fdb_codec_t *: the codec, never NULL
+ * ============================================================================
+ */
+const fdb_codec_t *
+fdb_codec_for_path (const char *fn)
+{
+    const char *dot = strrchr(fn, '.');
+    const fdb_codec_t *codec = NULL;
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        codec = fdb_codec_by_ext(dot + 1);
+    }
+    return codec != NULL ? codec : &fdb_codec_plain;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_codec_compress
+ *  Description:  Compresses len bytes into *out as one block, growing *out
+ *                  (of *out_cap bytes) to fit. A level below zero means the
+ *                  codec's default.
+ * Return Value:  size_t: compressed length, 0 on failure
+ * ============================================================================
+ */
+size_t
+fdb_codec_compress (const fdb_codec_t *codec, int level, const char *in,
+                    size_t len, char **out, size_t *out_cap)
+{
+    size_t need = codec->bound(len);
+    if (level < 0) level = codec->default_level;
+    if (need == 0) return 0;
+    if (*out_cap < need) {
+        char *grown = km_realloc(*out, need, &km_onerr_print);
+        if (grown == NULL) return 0;
+        *out = grown;
+        *out_cap = need;
+    }
+    return codec->compress(level, in, len, *out, *out_cap);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_codec_thread_cleanup
+ *  Description:  Frees the calling thread's compressor state. Threads that
+ *                  have compressed anything should call this before exiting.
+ * ============================================================================
+ */
+void
+fdb_codec_thread_cleanup (void)
+{
+    if (tl_zstrm != NULL) {
+        deflateEnd(tl_zstrm);
+        free(tl_zstrm);
+        tl_zstrm = NULL;
+        tl_zlevel = -1;
+    }
+#ifdef FDB_HAVE_LIBDEFLATE
+    if (tl_ldc != NULL) {
+        libdeflate_free_compressor(tl_ldc);
+        tl_ldc = NULL;
+        tl_ldc_level = -1;
+    }
+#endif
+#ifdef FDB_HAVE_ZSTD
+    if (tl_zcctx != NULL) {
+        ZSTD_freeCCtx(tl_zcctx);
+        tl_zcctx = NULL;
+    }
+#endif
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  obuf_ready
+ *  Description:  Gets an output buffer ready to fill, allocating it or
+ *                  waiting for its last write to finish. A parked file's
+ *                  unaligned tail is read back into its current buffer.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+obuf_ready (fdb_ofile_t *of, fdb_obuf_t *ob)
+{
+    if (ob->data == NULL) {
+        void *data = NULL;
+        if (posix_memalign(&data, FDB_AIO_ALIGN, of->obuf_size) != 0) {
+            fprintf(stderr, "ERROR: out of memory for '%s'\n", of->fn);
+            return 1;
+        }
+        ob->data = data;
+        if (ob == &of->obufs[of->cur] && ob->len > 0 && \
+                pread(of->fd_tail, ob->data, ob->len, of->obuf_off) != \
+                (ssize_t)ob->len) {
+            fprintf(stderr, "ERROR: could not read back '%s': %s\n", of->fn,
+                    strerror(errno));
+            return 1;
+        }
+    }
+    if (ob->busy) {
+        int err = fdb_aio_wait(of->aio, &ob->req);
+        ob->busy = 0;
+        if (err != 0) {
+            fprintf(stderr, "ERROR: could not write to '%s': %s\n", of->fn,
+                    strerror(err));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  obuf_submit
+ *  Description:  Starts writing the current output buffer and moves on to
+ *                  the next. With O_DIRECT, only a whole number of aligned
+ *                  blocks is written; the rest is carried to the start of the
+ *                  next buffer, which starts at the following aligned offset.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+obuf_submit (fdb_ofile_t *of)
+{
+    fdb_obuf_t *ob = &of->obufs[of->cur];
+    fdb_obuf_t *next = &of->obufs[(of->cur + 1) % of->n_obufs];
+    size_t n = ob->len - ob->len % of->align;
+    size_t tail = ob->len - n;
+    if (n == 0) return 0;
+    ob->req.fd = of->fd;
+    ob->req.buf = ob->data;
+    ob->req.len = n;
+    ob->req.off = of->obuf_off;
+    ob->busy = 1;
+    if (fdb_aio_submit(of->aio, &ob->req) != 0) {
+        fprintf(stderr, "ERROR: could not write to '%s': %s\n", of->fn,
+                strerror(ob->req.err));
+        ob->busy = 0;
+        return 1;
+    }
+    of->obuf_off += n;
+    if (next == ob) {
+        /* Only one buffer: nothing to do but wait */
+        if (obuf_ready(of, ob)) return 1;
+        memmove(ob->data, ob->data + n, tail);
+    } else {
+        if (obuf_ready(of, next)) return 1;
+        memcpy(next->data, ob->data + n, tail);
+    }
+    next->len = tail;
+    of->cur = (of->cur + 1) % of->n_obufs;
+    return 0;
+}
+
+/* Returns space for at least need bytes in the current output buffer */
+static char *
+obuf_reserve (fdb_ofile_t *of, size_t need)
+{
+    fdb_obuf_t *ob = &of->obufs[of->cur];
+    if (ob->data == NULL && obuf_ready(of, ob)) return NULL;
+    if (of->obuf_size - ob->len < need) {
+        if (obuf_submit(of)) return NULL;
+        ob = &of->obufs[of->cur];
+    }
+    return ob->data + ob->len;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  write_block
+ *  Description:  Compresses an output file's pending data into its output
+ *                  buffer. With force, an empty block is written even if
+ *                  nothing is pending, so that an empty output is still a
+ *                  valid file.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+write_block (fdb_ofile_t *of, int force)
+{
+    size_t bound, zlen;
+    char *out;
+    if (of->len == 0 && !force) return 0;
+    bound = of->codec->bound(of->len);
+    out = obuf_reserve(of, bound);
+    if (out == NULL) return 1;
+    zlen = of->codec->compress(of->level, of->buf, of->len, out, bound);
+    if (zlen == 0) {
+        fprintf(stderr, "ERROR: could not compress output for '%s'\n",
+                of->fn);
+        return 1;
+    }
+    of->obufs[of->cur].len += zlen;
+    of->size += zlen;
+    of->len = 0;
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_ofile_open
+ *  Description:  Opens an output file, compressed according to its
+ *                  extension, written through aio (synchronously if NULL).
+ *                  With append, writes are added to the end of an existing
+ *                  file.
+ * Return Value:  fdb_ofile_t *: the file, or NULL on failure
+ * ============================================================================
+ */
+fdb_ofile_t *
+fdb_ofile_open (const char *fn, int level, int append, fdb_aio_t *aio)
+{
+    fdb_ofile_t *of = km_calloc(1, sizeof(*of), &km_onerr_print);
+    int flags = O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC);
+    off_t end = 0;
+    if (of == NULL) return NULL;
+    of->fd = of->fd_tail = -1;
+    of->aio = aio;
+    of->codec = fdb_codec_for_path(fn);
+    of->level = level;
+    if (level < 0 || level > of->codec->max_level) {
+        of->level = of->codec->default_level;
+    }
+    of->fn = strdup(fn);
+    of->align = 1;
+    of->n_obufs = aio != NULL && aio->depth > 0 ? aio->depth : 1;
+    of->obuf_size = aio != NULL ? aio->buf_size : FDB_AIO_BUF_SIZE;
+    /* A whole compressed block, plus an unaligned tail, must fit */
+    if (of->obuf_size < 2 * FDB_OFILE_BLOCK + FDB_AIO_ALIGN) {
+        of->obuf_size = 2 * FDB_OFILE_BLOCK + FDB_AIO_ALIGN;
+    }
+    of->obufs = km_calloc(of->n_obufs, sizeof(*of->obufs), &km_onerr_print);
+    if (of->fn == NULL || of->obufs == NULL) goto fail;
+#ifdef O_DIRECT
+    if (aio != NULL && aio->direct) {
+        of->fd = open(fn, flags | O_DIRECT, 0644);
+        if (of->fd >= 0) {
+            /* Unaligned ends of the file are written without O_DIRECT */
+            of->fd_tail = open(fn, O_RDWR);
+            if (of->fd_tail < 0) goto fail;
+            of->align = FDB_AIO_ALIGN;
+        } else if (errno != EINVAL) {
+            goto fail;
+        }
+        /* else the filesystem can't do O_DIRECT: carry on without */
+    }
+#endif
+    if (of->fd < 0) of->fd = open(fn, flags, 0644);
+    if (of->fd < 0) goto fail;
+    if (append) {
+        size_t head;
+        if ((end = lseek(of->fd, 0, SEEK_END)) < 0) goto fail;
+        of->size = end;
+        /* Buffers start aligned, so re-read the partial block at the end */
+        head = end % of->align;
+        of->obuf_off = end - head;
+        if (head > 0) {
+            if (obuf_ready(of, &of->obufs[0]) || pread(of->fd_tail,
+                        of->obufs[0].data, head, of->obuf_off) != \
+                    (ssize_t)head) {
+                goto fail;
+            }
+            of->obufs[0].len = head;
+        }
+    }
+    return of;
+fail:
+    if (of->fd >= 0) close(of->fd);
+    if (of->fd_tail >= 0) close(of->fd_tail);
+    if (of->obufs != NULL) free(of->obufs[0].data);
+    free(of->obufs);
+    free(of->fn);
+    free(of);
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_ofile_write
+ *  Description:  Writes len bytes to an output file. Compressed output is
+ *                  gathered into FDB_OFILE_BLOCK sized blocks first.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_ofile_write (fdb_ofile_t *of, const char *data, size_t len)
+{
+    if (of->codec->ext == NULL) {
+        while (len > 0) {
+            fdb_obuf_t *ob = NULL;
+            size_t n;
+            if (obuf_reserve(of, 1) == NULL) return 1;
+            ob = &of->obufs[of->cur];
+            n = of->obuf_size - ob->len;
+            if (n > len) n = len;
+            memcpy(ob->data + ob->len, data, n);
+            ob->len += n;
+            of->size += n;
+            data += n;
+            len -= n;
+        }
+        return 0;
+    }
+    if (of->buf == NULL) {
+        /* Outputs which never get a read need no buffer */
+        of->buf = km_malloc(FDB_OFILE_BLOCK, &km_onerr_print);
+        if (of->buf == NULL) return 1;
+    }
+    while (len > 0) {
+        size_t n = FDB_OFILE_BLOCK - of->len;
+        if (n > len) n = len;
+        memcpy(of->buf + of->len, data, n);
+        of->len += n;
+        data += n;
+        len -= n;
+        if (of->len == FDB_OFILE_BLOCK && write_block(of, 0)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_ofile_flush
+ *  Description:  Ends the current block and waits until everything written
+ *                  has been handed to the OS, after which of->size is the
+ *                  file's length on disk.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_ofile_flush (fdb_ofile_t *of)
+{
+    fdb_obuf_t *ob = NULL;
+    int ret = 0;
+    if (write_block(of, 0)) return 1;
+    /* Parked, with nothing written since */
+    if (of->obufs[of->cur].data == NULL) return 0;
+    if (of->obufs[of->cur].len > 0 && obuf_submit(of)) return 1;
+    /* The O_DIRECT leftover goes out through the other descriptor. It stays
+     * buffered too, and is rewritten with whatever follows it. */
+    ob = &of->obufs[of->cur];
+    if (ob->len > 0) {
+        fdb_aio_req_t req = {of->fd_tail, ob->data, ob->len, of->obuf_off,
+                             0, 0, 0, NULL};
+        if (fdb_aio_submit(NULL, &req) != 0) {
+            fprintf(stderr, "ERROR: could not write to '%s': %s\n", of->fn,
+                    strerror(req.err));
+            return 1;
+        }
+    }
+    for (int iii = 0; iii < of->n_obufs; iii++) {
+        if (iii != of->cur && of->obufs[iii].data != NULL && \
+                obuf_ready(of, &of->obufs[iii])) ret = 1;
+    }
+    return ret;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_ofile_park
+ *  Description:  Flushes an output file and frees its buffers, until its
+ *                  next write allocates them again. Compressed output ends
+ *                  its block early, so a file parked often compresses a
+ *                  little worse.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_ofile_park (fdb_ofile_t *of)
+{
+    if (fdb_ofile_flush(of)) return 1;
+    for (int iii = 0; iii < of->n_obufs; iii++) {
+        free(of->obufs[iii].data);
+        of->obufs[iii].data = NULL;
+        /* Only the current buffer's O_DIRECT tail is kept, on disk */
+        if (iii != of->cur) of->obufs[iii].len = 0;
+    }
+    km_free(of->buf, &km_onerr_nil);
+    of->buf = NULL;
+    return 0;
+}
+
+/* Bytes of buffers an output file holds */
+size_t
+fdb_ofile_mem (const fdb_ofile_t *of)
+{
+    size_t mem = of->buf != NULL ? FDB_OFILE_BLOCK : 0;
+    for (int iii = 0; iii < of->n_obufs; iii++) {
+        if (of->obufs[iii].data != NULL) mem += of->obuf_size;
+    }
+    return mem;
+}
+
+int
+fdb_ofile_close (fdb_ofile_t *of)
+{
+    int ret = 0;
+    if (of == NULL) return 0;
+    if (of->codec->ext != NULL && write_block(of, of->size == 0)) ret = 1;
+    if (fdb_ofile_flush(of)) ret = 1;
+    if (close(of->fd) != 0) ret = 1;
+    if (of->fd_tail >= 0) close(of->fd_tail);
+    for (int iii = 0; iii < of->n_obufs; iii++) {
+        free(of->obufs[iii].data);
+    }
+    free(of->obufs);
+    km_free(of->buf, &km_onerr_nil);
+    free(of->fn);
+    free(of);
+    return ret;
+}
@@ -0,0 +1,100 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_codec.h
+ *
+ *    Description:  Output compression codecs, and the output file type that
+ *                      writes through them
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 19:21:48
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_CODEC_H
+#define FDB_CODEC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "kdm.h"
+#include "fdb_aio.h"
+
+/* Uncompressed bytes per gzip member / zstd frame. Every block is compressed
+ * on its own, so compressor state need not be kept per file and each block
+ * boundary is a place an output can be cut and appended to. */
+#define FDB_OFILE_BLOCK (128u << 10)
+
+/* Output compressed in blocks, each self contained, so that concatenations
+ * of blocks form a valid file. */
+typedef struct __fdb_codec_t {
+    const char *name;
+    const char *ext;        /* file extension, NULL if not compressed */
+    int default_level;
+    int max_level;
+    /* Returns the most compress() can write for len bytes of input */
+    size_t (*bound) (size_t len);
+    /* Compresses in to out, returning the bytes written or 0 on failure */
+    size_t (*compress) (int level, const char *in, size_t len, char *out,
+                        size_t out_cap);
+} fdb_codec_t;
+
+extern const fdb_codec_t fdb_codec_plain;
+extern const fdb_codec_t fdb_codec_zlib;
+#ifdef FDB_HAVE_LIBDEFLATE
+extern const fdb_codec_t fdb_codec_libdeflate;
+#endif
+#ifdef FDB_HAVE_ZSTD
+extern const fdb_codec_t fdb_codec_zstd;
+#endif
+/* All codecs built in, NULL terminated */
+extern const fdb_codec_t *fdb_codecs[];
+
+/* Compressed output waiting to be written, or being written */
+typedef struct __fdb_obuf_t {
+    char *data;             /* FDB_AIO_ALIGN aligned */
+    size_t len;
+    int busy;               /* req submitted, not yet waited for */
+    fdb_aio_req_t req;
+} fdb_obuf_t;
+
+typedef struct __fdb_ofile_t {
+    char *fn;
+    int fd;
+    int fd_tail;            /* without O_DIRECT, or -1 if fd is buffered */
+    fdb_aio_t *aio;
+    const fdb_codec_t *codec;
+    int level;
+    char *buf;              /* pending uncompressed data */
+    size_t len;
+    /* Ring of output buffers; all but cur may be in flight */
+    fdb_obuf_t *obufs;
+    int n_obufs;
+    int cur;
+    size_t obuf_size;
+    size_t align;           /* write offsets and lengths, for O_DIRECT */
+    uint64_t obuf_off;      /* file offset of obufs[cur] */
+    uint64_t size;          /* bytes written to fn */
+} fdb_ofile_t;
+
+const fdb_codec_t *fdb_codec_by_name (const char *name);
+const fdb_codec_t *fdb_codec_by_ext (const char *ext);
+const fdb_codec_t *fdb_codec_for_path (const char *fn);
+size_t fdb_codec_compress (const fdb_codec_t *codec, int level, const char *in,
+                           size_t len, char **out, size_t *out_cap);
+void fdb_codec_thread_cleanup (void);
+
+fdb_ofile_t *fdb_ofile_open (const char *fn, int level, int append,
+                             fdb_aio_t *aio);
+int fdb_ofile_write (fdb_ofile_t *of, const char *data, size_t len);
+int fdb_ofile_flush (fdb_ofile_t *of);
+int fdb_ofile_park (fdb_ofile_t *of);
+size_t fdb_ofile_mem (const fdb_ofile_t *of);
+int fdb_ofile_close (fdb_ofile_t *of);
+
+#endif /* FDB_CODEC_H */
@@ -0,0 +1,202 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_filter.c
+ *
+ *    Description:  Cheap checks that send junk reads to their own output
+ *                      before any barcode matching
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 14:22:16
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <stdlib.h>
+
+#include "kdm.h"
+#include "fdb_filter.h"
+
+/* 2-bit code of a base, or 4 for anything but ACGT */
+static inline uint8_t
+base_code (char c)
+{
+    switch (c) {
+        case 'A': case 'a':
+            return 0;
+        case 'C': case 'c':
+            return 1;
+        case 'G': case 'g':
+            return 2;
+        case 'T': case 't':
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+static inline uint64_t
+mix64 (uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/*
+ * Bloom filter of k-mers, the same for either strand
+ */
+
+/* Runs body with kmer set to each k-mer of seq without Ns, as the lesser
+ * of its and its reverse complement's codes */
+#define FOREACH_KMER(seq, len, k, kmer, body) do {                          \
+    uint64_t _kmask = (1ULL << 2 * (k)) - 1;                                \
+    uint64_t _fwd = 0, _rev = 0;                                            \
+    int _valid = 0;                                                         \
+    for (size_t _iii = 0; _iii < (len); _iii++) {                           \
+        uint8_t _code = base_code((seq)[_iii]);                             \
+        if (_code > 3) {                                                    \
+            _valid = 0;                                                     \
+            continue;                                                       \
+        }                                                                   \
+        _fwd = (_fwd << 2 | _code) & _kmask;                                \
+        _rev = _rev >> 2 | (uint64_t)(3 - _code) << 2 * ((k) - 1);          \
+        if (++_valid < (k)) continue;                                       \
+        kmer = _fwd < _rev ? _fwd : _rev;                                   \
+        body                                                                \
+    }                                                                       \
+} while (0)
+
+static inline void
+bloom_add (fdb_filter_t *f, uint64_t kmer)
+{
+    uint64_t h = mix64(kmer), h2 = (h >> 32) | 1;
+    for (int hhh = 0; hhh < FDB_BLOOM_HASHES; hhh++) {
+        uint64_t bit = (h + hhh * h2) & f->bloom_mask;
+        f->bloom[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+static inline int
+bloom_has (const fdb_filter_t *f, uint64_t kmer)
+{
+    uint64_t h = mix64(kmer), h2 = (h >> 32) | 1;
+    for (int hhh = 0; hhh < FDB_BLOOM_HASHES; hhh++) {
+        uint64_t bit = (h + hhh * h2) & f->bloom_mask;
+        if (!(f->bloom[bit >> 6] & 1ULL << (bit & 63))) return 0;
+    }
+    return 1;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_filter_new
+ *  Description:  Makes a filter of reads shorter than min_len (0 for none),
+ *                  or with more than max_n of their bases not A, C, G or T
+ *                  (1 for none). Contaminants are added with
+ *                  fdb_filter_bloom() and fdb_filter_add().
+ * Return Value:  fdb_filter_t *: the filter, or NULL on failure
+ * ============================================================================
+ */
+fdb_filter_t *
+fdb_filter_new (size_t min_len, double max_n)
+{
+    fdb_filter_t *f = km_calloc(1, sizeof(*f), &km_onerr_print);
+    if (f == NULL) return NULL;
+    f->min_len = min_len;
+    f->max_n = max_n;
+    return f;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_filter_bloom
+ *  Description:  Sets f up to filter contaminants' k-mers, for about
+ *                  n_kmers of them.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_filter_bloom (fdb_filter_t *f, int k, size_t n_kmers)
+{
+    uint64_t bits = 1ULL << 16;
+    if (k < 1 || k > FDB_FILTER_K_MAX || f->bloom != NULL) return 1;
+    while (bits < (uint64_t)n_kmers * FDB_BLOOM_BITS_PER_KMER) bits <<= 1;
+    f->bloom = km_calloc(bits / 64, sizeof(*f->bloom), &km_onerr_print);
+    if (f->bloom == NULL) return 1;
+    f->bloom_mask = bits - 1;
+    f->k = k;
+    return 0;
+}
+
+/* Adds every k-mer of a contaminant's sequence */
+void
+fdb_filter_add (fdb_filter_t *f, const char *seq, size_t len)
+{
+    uint64_t kmer = 0;
+    FOREACH_KMER(seq, len, f->k, kmer, { bloom_add(f, kmer); });
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_filter_check
+ *  Description:  Checks a read, cheapest test first.
+ * Return Value:  enum fdb_filter_reason: why the read is filtered, or
+ *                  FDB_FILTER_PASS to match it against the barcodes
+ * ============================================================================
+ */
+enum fdb_filter_reason
+fdb_filter_check (const fdb_filter_t *f, const char *seq, size_t len)
+{
+    if (len < f->min_len) return FDB_FILTER_SHORT;
+    if (f->max_n < 1) {
+        size_t n_ns = 0;
+        for (size_t iii = 0; iii < len; iii++) {
+            n_ns += base_code(seq[iii]) > 3;
+        }
+        if (n_ns > f->max_n * len) return FDB_FILTER_NS;
+    }
+    if (f->bloom != NULL) {
+        size_t n_kmers = 0, n_hits = 0;
+        uint64_t kmer = 0;
+        FOREACH_KMER(seq, len, f->k, kmer, {
+            n_kmers++;
+            n_hits += bloom_has(f, kmer);
+        });
+        if (n_kmers > 0 && n_hits >= FDB_FILTER_CONTAM_FRAC * n_kmers) {
+            return FDB_FILTER_CONTAM;
+        }
+    }
+    return FDB_FILTER_PASS;
+}
+
+const char *
+fdb_filter_reason_name (enum fdb_filter_reason reason)
+{
+    switch (reason) {
+        case FDB_FILTER_SHORT:
+            return "short";
+        case FDB_FILTER_NS:
+            return "ns";
+        case FDB_FILTER_CONTAM:
+            return "contaminant";
+        default:
+            return "pass";
+    }
+}
+
+void
+fdb_filter_destroy (fdb_filter_t *f)
+{
+    if (f == NULL) return;
+    free(f->bloom);
+    free(f);
+}
@@ -0,0 +1,59 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_filter.h
+ *
+ *    Description:  Cheap checks that send junk reads to their own output
+ *                      before any barcode matching
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 14:22:16
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_FILTER_H
+#define FDB_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FDB_FILTER_K_DEFAULT 21
+#define FDB_FILTER_K_MAX 31
+/* Bloom filter bits per contaminant k-mer, and hashes per k-mer */
+#define FDB_BLOOM_BITS_PER_KMER 16
+#define FDB_BLOOM_HASHES 4
+/* A read is a contaminant if at least this share of its k-mers are */
+#define FDB_FILTER_CONTAM_FRAC 0.5
+
+/* Why fdb_filter_check() filtered a read */
+enum fdb_filter_reason {
+    FDB_FILTER_PASS = 0,
+    FDB_FILTER_SHORT,
+    FDB_FILTER_NS,
+    FDB_FILTER_CONTAM,
+    FDB_FILTER_N_REASONS
+};
+
+typedef struct __fdb_filter_t {
+    size_t min_len;             /* 0 for any length */
+    double max_n;               /* share of non-ACGT bases; 1 for any */
+    /* Contaminant k-mers, both strands as one, or no bloom filter */
+    int k;
+    uint64_t *bloom;
+    uint64_t bloom_mask;        /* bits - 1 */
+} fdb_filter_t;
+
+fdb_filter_t *fdb_filter_new (size_t min_len, double max_n);
+int fdb_filter_bloom (fdb_filter_t *f, int k, size_t n_kmers);
+void fdb_filter_add (fdb_filter_t *f, const char *seq, size_t len);
+enum fdb_filter_reason fdb_filter_check (const fdb_filter_t *f,
+                                         const char *seq, size_t len);
+const char *fdb_filter_reason_name (enum fdb_filter_reason reason);
+void fdb_filter_destroy (fdb_filter_t *f);
+
+#endif /* FDB_FILTER_H */
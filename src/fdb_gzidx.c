@@ -0,0 +1,544 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_gzidx.c
+ *
+ *    Description:  Random access into gzipped inputs via an index of
+ *                      inflate access points (after zlib's zran.c), and the
+ *                      input file abstraction kseq reads through.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 13:40:02
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "fdb_gzidx.h"
+
+static int
+add_point (fdb_gzidx_t *idx, uint64_t out, uint64_t in, int bits,
+           const unsigned char *window, unsigned left)
+{
+    unsigned char flat[FDB_GZIDX_WINSIZE];
+    uLongf zlen = compressBound(FDB_GZIDX_WINSIZE);
+    fdb_gzpoint_t *pt = NULL;
+    if (idx->n_points == idx->m_points) {
+        idx->m_points = idx->m_points ? idx->m_points << 1 : 8;
+        idx->points = km_realloc(idx->points,
+                idx->m_points * sizeof(*idx->points), &km_onerr_print);
+        if (idx->points == NULL) return 1;
+    }
+    pt = &idx->points[idx->n_points++];
+    pt->out = out;
+    pt->in = in;
+    pt->bits = bits;
+    /* The window is circular, with `left` unused bytes at its end */
+    if (left) memcpy(flat, window + FDB_GZIDX_WINSIZE - left, left);
+    if (left < FDB_GZIDX_WINSIZE) {
+        memcpy(flat + left, window, FDB_GZIDX_WINSIZE - left);
+    }
+    pt->window = km_malloc(zlen, &km_onerr_print);
+    if (pt->window == NULL || \
+            compress2(pt->window, &zlen, flat, FDB_GZIDX_WINSIZE, 1) != Z_OK) {
+        return 1;
+    }
+    pt->wlen = zlen;
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_gzidx_build
+ *  Description:  Inflates a whole gzip file, recording an access point at
+ *                  the first deflate block boundary after every `span`
+ *                  uncompressed bytes. Concatenated gzip members (BGZF, or
+ *                  our own checkpointed output) are followed across.
+ * Return Value:  fdb_gzidx_t *: the index, or NULL on failure
+ * ============================================================================
+ */
+fdb_gzidx_t *
+fdb_gzidx_build (const char *fn, uint64_t span)
+{
+    FILE *in = fopen(fn, "rb");
+    z_stream strm;
+    unsigned char *input = NULL;
+    unsigned char *window = NULL;
+    uint64_t totin = 0, totout = 0, last = 0;
+    int member_start = 1;
+    int ret = Z_OK;
+    struct stat st;
+    fdb_gzidx_t *idx = NULL;
+    if (in == NULL || fstat(fileno(in), &st) != 0) {
+        fprintf(stderr, "IO Error: Could not open file '%s'\n%s\n", fn,
+                strerror(errno));
+        if (in != NULL) fclose(in);
+        return NULL;
+    }
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 47) != Z_OK) {
+        fclose(in);
+        return NULL;
+    }
+    input = km_malloc(FDB_GZIDX_CHUNK, &km_onerr_print);
+    window = km_calloc(FDB_GZIDX_WINSIZE, 1, &km_onerr_print);
+    idx = km_calloc(1, sizeof(*idx), &km_onerr_print);
+    idx->span = span;
+    idx->in_size = st.st_size;
+    strm.avail_out = 0;
+    while (1) {
+        strm.avail_in = fread(input, 1, FDB_GZIDX_CHUNK, in);
+        if (ferror(in)) goto fail;
+        if (strm.avail_in == 0) break;
+        strm.next_in = input;
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = FDB_GZIDX_WINSIZE;
+                strm.next_out = window;
+            }
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+            if (ret == Z_DATA_ERROR && member_start) {
+                /* Trailing garbage after the last member, gzread ignores
+                 * it and so do we */
+                goto done;
+            }
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || \
+                    ret == Z_MEM_ERROR) {
+                goto fail;
+            }
+            member_start = 0;
+            if (ret == Z_STREAM_END) {
+                inflateReset(&strm);
+                member_start = 1;
+                continue;
+            }
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && \
+                    (totout == 0 || totout - last > span)) {
+                if (add_point(idx, totout, totin, strm.data_type & 7,
+                            window, strm.avail_out)) goto fail;
+                last = totout;
+            }
+        } while (strm.avail_in != 0);
+    }
+    if (!member_start) {
+        fprintf(stderr, "ERROR: '%s' is truncated\n", fn);
+        goto fail;
+    }
+done:
+    idx->length = totout;
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    fclose(in);
+    return idx;
+fail:
+    fprintf(stderr, "ERROR: could not index '%s' (%s)\n", fn,
+            strm.msg ? strm.msg : "read error");
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    fclose(in);
+    fdb_gzidx_destroy(idx);
+    return NULL;
+} /* -----  end of function fdb_gzidx_build  ----- */
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_gzidx_save
+ *  Description:  Writes an index to disk. Integers are in host byte order;
+ *                  indices are a cache to be rebuilt, not an interchange
+ *                  format.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_gzidx_save (const fdb_gzidx_t *idx, const char *fn)
+{
+    FILE *fp = fopen(fn, "wb");
+    uint64_t n_points = idx->n_points;
+    int ok = 1;
+    if (fp == NULL) {
+        fprintf(stderr, "IO Error: Could not open file '%s'\n%s\n", fn,
+                strerror(errno));
+        return 1;
+    }
+    ok &= fwrite(FDB_GZIDX_MAGIC, 1, sizeof(FDB_GZIDX_MAGIC), fp) == \
+          sizeof(FDB_GZIDX_MAGIC);
+    ok &= fwrite(&idx->span, sizeof(idx->span), 1, fp) == 1;
+    ok &= fwrite(&idx->in_size, sizeof(idx->in_size), 1, fp) == 1;
+    ok &= fwrite(&idx->length, sizeof(idx->length), 1, fp) == 1;
+    ok &= fwrite(&n_points, sizeof(n_points), 1, fp) == 1;
+    for (size_t iii = 0; iii < idx->n_points && ok; iii++) {
+        const fdb_gzpoint_t *pt = &idx->points[iii];
+        int32_t bits = pt->bits;
+        ok &= fwrite(&pt->out, sizeof(pt->out), 1, fp) == 1;
+        ok &= fwrite(&pt->in, sizeof(pt->in), 1, fp) == 1;
+        ok &= fwrite(&bits, sizeof(bits), 1, fp) == 1;
+        ok &= fwrite(&pt->wlen, sizeof(pt->wlen), 1, fp) == 1;
+        ok &= fwrite(pt->window, 1, pt->wlen, fp) == pt->wlen;
+    }
+    ok &= fclose(fp) == 0;
+    if (!ok) {
+        fprintf(stderr, "ERROR: failed writing index '%s'\n", fn);
+        return 1;
+    }
+    return 0;
+} /* -----  end of function fdb_gzidx_save  ----- */
+
+fdb_gzidx_t *
+fdb_gzidx_load (const char *fn)
+{
+    FILE *fp = fopen(fn, "rb");
+    char magic[sizeof(FDB_GZIDX_MAGIC)];
+    uint64_t n_points = 0;
+    fdb_gzidx_t *idx = NULL;
+    if (fp == NULL) return NULL;
+    idx = km_calloc(1, sizeof(*idx), &km_onerr_print);
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || \
+            memcmp(magic, FDB_GZIDX_MAGIC, sizeof(magic)) != 0 || \
+            fread(&idx->span, sizeof(idx->span), 1, fp) != 1 || \
+            fread(&idx->in_size, sizeof(idx->in_size), 1, fp) != 1 || \
+            fread(&idx->length, sizeof(idx->length), 1, fp) != 1 || \
+            fread(&n_points, sizeof(n_points), 1, fp) != 1) {
+        goto fail;
+    }
+    idx->points = km_calloc(n_points ? n_points : 1, sizeof(*idx->points),
+            &km_onerr_print);
+    if (idx->points == NULL) goto fail;
+    idx->m_points = n_points;
+    for (; idx->n_points < n_points; idx->n_points++) {
+        fdb_gzpoint_t *pt = &idx->points[idx->n_points];
+        int32_t bits = 0;
+        if (fread(&pt->out, sizeof(pt->out), 1, fp) != 1 || \
+                fread(&pt->in, sizeof(pt->in), 1, fp) != 1 || \
+                fread(&bits, sizeof(bits), 1, fp) != 1 || \
+                fread(&pt->wlen, sizeof(pt->wlen), 1, fp) != 1 || \
+                bits < 0 || bits > 7 || \
+                pt->wlen > compressBound(FDB_GZIDX_WINSIZE)) {
+            goto fail;
+        }
+        pt->bits = bits;
+        pt->window = km_malloc(pt->wlen, &km_onerr_print);
+        if (fread(pt->window, 1, pt->wlen, fp) != pt->wlen) {
+            idx->n_points++;
+            goto fail;
+        }
+    }
+    fclose(fp);
+    return idx;
+fail:
+    fprintf(stderr, "ERROR: '%s' is not a valid index\n", fn);
+    fclose(fp);
+    fdb_gzidx_destroy(idx);
+    return NULL;
+}
+
+void
+fdb_gzidx_destroy (fdb_gzidx_t *idx)
+{
+    if (idx == NULL) return;
+    for (size_t iii = 0; iii < idx->n_points; iii++) {
+        km_free(idx->points[iii].window, &km_onerr_nil);
+    }
+    km_free(idx->points, &km_onerr_nil);
+    free(idx);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_infile_open
+ *  Description:  Opens an input file, plain or gzipped, picking up an index
+ *                  from <fn>.fdbi if there is one for this file.
+ * Return Value:  fdb_infile_t *: the file, or NULL on failure
+ * ============================================================================
+ */
+fdb_infile_t *
+fdb_infile_open (const char *fn)
+{
+    fdb_infile_t *in = NULL;
+    gzFile gz = gzopen(fn, "r");
+    char *idx_fn = NULL;
+    struct stat st;
+    if (gz == NULL) return NULL;
+    in = km_calloc(1, sizeof(*in), &km_onerr_print);
+    in->fn = strdup(fn);
+    in->gz = gz;
+    idx_fn = km_calloc(strlen(fn) + strlen(FDB_GZIDX_EXT) + 1, 1,
+            &km_onerr_print);
+    strcat(strcpy(idx_fn, fn), FDB_GZIDX_EXT);
+    if (access(idx_fn, R_OK) == 0) {
+        in->idx = fdb_gzidx_load(idx_fn);
+        if (in->idx != NULL && (stat(fn, &st) != 0 || \
+                    (uint64_t)st.st_size != in->idx->in_size)) {
+            fprintf(stderr, "WARNING: ignoring stale index '%s'\n", idx_fn);
+            fdb_gzidx_destroy(in->idx);
+            in->idx = NULL;
+        }
+    }
+    free(idx_fn);
+    return in;
+}
+
+/* Ensures at least `need` compressed bytes are available, unless at EOF */
+static unsigned
+fill_input (fdb_infile_t *in, unsigned need)
+{
+    z_stream *strm = &in->strm;
+    if (strm->avail_in >= need) return strm->avail_in;
+    memmove(in->inbuf, strm->next_in, strm->avail_in);
+    strm->next_in = in->inbuf;
+    strm->avail_in += fread(in->inbuf + strm->avail_in, 1,
+            FDB_GZIDX_CHUNK - strm->avail_in, in->raw);
+    return strm->avail_in;
+}
+
+static int
+raw_read (fdb_infile_t *in, unsigned char *buf, unsigned len)
+{
+    z_stream *strm = &in->strm;
+    int ret = Z_OK;
+    strm->next_out = buf;
+    strm->avail_out = len;
+    while (strm->avail_out > 0 && !in->raw_eof) {
+        if (fill_input(in, 1) == 0) {
+            if (ferror(in->raw)) return -1;
+            in->raw_eof = 1;
+            break;
+        }
+        ret = inflate(strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            /* Skip the gzip trailer if we started mid-member, then carry on
+             * into the next member if there is one */
+            if (in->strm_raw) {
+                if (fill_input(in, 8) < 8) {
+                    in->raw_eof = 1;
+                    break;
+                }
+                strm->next_in += 8;
+                strm->avail_in -= 8;
+                inflateReset2(strm, 47);
+                in->strm_raw = 0;
+            } else {
+                inflateReset(strm);
+            }
+            if (fill_input(in, 2) < 2 || strm->next_in[0] != 0x1f || \
+                    strm->next_in[1] != 0x8b) {
+                in->raw_eof = 1;
+            }
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "ERROR: inflate failed on '%s' (%s)\n", in->fn,
+                    strm->msg ? strm->msg : "unknown error");
+            return -1;
+        }
+    }
+    in->pos += len - strm->avail_out;
+    return len - strm->avail_out;
+}
+
+int
+fdb_infile_read (fdb_infile_t *in, void *buf, unsigned len)
+{
+    int got = 0;
+    if (in->raw != NULL) {
+        return raw_read(in, buf, len);
+    }
+    got = gzread(in->gz, buf, len);
+    if (got > 0) in->pos += got;
+    return got;
+}
+
+uint64_t
+fdb_infile_tell (fdb_infile_t *in)
+{
+    return in->pos;
+}
+
+/* Offset in the file itself of the next byte to read, for progress */
+uint64_t
+fdb_infile_raw_tell (fdb_infile_t *in)
+{
+    if (in->raw != NULL) {
+        off_t off = ftello(in->raw);
+        return off < 0 ? 0 : (uint64_t)off - in->strm.avail_in;
+    }
+    return gzoffset(in->gz) < 0 ? 0 : (uint64_t)gzoffset(in->gz);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_infile_seek
+ *  Description:  Seeks to an uncompressed offset. With an index, inflation
+ *                  restarts at the closest preceding access point; without
+ *                  one, gzseek inflates from wherever we are (or the start).
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_infile_seek (fdb_infile_t *in, uint64_t offset)
+{
+    unsigned char window[FDB_GZIDX_WINSIZE];
+    uLongf wlen = FDB_GZIDX_WINSIZE;
+    const fdb_gzpoint_t *pt = NULL;
+    size_t lo = 0, hi = 0;
+    uint64_t skip = 0;
+    if (in->idx == NULL || in->idx->n_points == 0) {
+        if (gzseek(in->gz, offset, SEEK_SET) < 0) return 1;
+        in->pos = offset;
+        return 0;
+    }
+    /* Last access point at or before offset */
+    hi = in->idx->n_points;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (in->idx->points[mid].out <= offset) lo = mid;
+        else hi = mid;
+    }
+    pt = &in->idx->points[lo];
+    if (in->raw == NULL) {
+        in->raw = fopen(in->fn, "rb");
+        in->inbuf = km_malloc(FDB_GZIDX_CHUNK, &km_onerr_print);
+        if (in->raw == NULL || in->inbuf == NULL) return 1;
+    }
+    if (in->strm_init) inflateEnd(&in->strm);
+    memset(&in->strm, 0, sizeof(in->strm));
+    if (inflateInit2(&in->strm, -15) != Z_OK) return 1;
+    in->strm_init = 1;
+    in->strm_raw = 1;
+    in->raw_eof = 0;
+    in->strm.next_in = in->inbuf;
+    in->strm.avail_in = 0;
+    if (fseeko(in->raw, pt->in - (pt->bits ? 1 : 0), SEEK_SET) != 0) {
+        return 1;
+    }
+    if (pt->bits) {
+        int ch = getc(in->raw);
+        if (ch == EOF) return 1;
+        inflatePrime(&in->strm, pt->bits, ch >> (8 - pt->bits));
+    }
+    if (uncompress(window, &wlen, pt->window, pt->wlen) != Z_OK || \
+            wlen != FDB_GZIDX_WINSIZE) {
+        return 1;
+    }
+    inflateSetDictionary(&in->strm, window, FDB_GZIDX_WINSIZE);
+    in->pos = pt->out;
+    /* Inflate and discard up to the offset */
+    skip = offset - pt->out;
+    while (skip > 0) {
+        unsigned want = skip > FDB_GZIDX_WINSIZE ? FDB_GZIDX_WINSIZE : skip;
+        int got = raw_read(in, window, want);
+        if (got <= 0) return got < 0;
+        skip -= got;
+    }
+    return 0;
+} /* -----  end of function fdb_infile_seek  ----- */
+
+/* 1 if s starts a record, 0 if not, -1 if more data is needed to tell. At
+ * EOF the end of the buffer terminates the last line. */
+static int
+is_record_start (const char *s, size_t n, int fasta, int eof)
+{
+    size_t ends[4];
+    size_t n_ends = 0;
+    if (n == 0) return eof ? 0 : -1;
+    if (fasta || s[0] != '@') return s[0] == (fasta ? '>' : '@');
+    for (size_t iii = 0; iii < n && n_ends < 4; iii++) {
+        if (s[iii] == '\n') ends[n_ends++] = iii;
+    }
+    if (n_ends < 4 && eof) ends[n_ends++] = n;
+    if (n_ends < 4) return eof ? 0 : -1;
+    /* @name \n seq \n + \n qual, where len(seq) == len(qual) */
+    size_t seq_len = ends[1] - ends[0] - 1;
+    size_t qual_len = ends[3] - ends[2] - 1;
+    if (seq_len > 0 && s[ends[1] - 1] == '\r') seq_len--;
+    if (qual_len > 0 && s[ends[3] - 1] == '\r') qual_len--;
+    return s[ends[1] + 1] == '+' && seq_len == qual_len;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_infile_resync
+ *  Description:  Seeks to the first record starting at or after `start`. A
+ *                  FASTQ record start is an '@' line two lines before a '+'
+ *                  line, with equal length sequence and quality lines.
+ *                  Every caller given the same `start` finds the same
+ *                  record, so adjacent ranges neither overlap nor skip.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_infile_resync (fdb_infile_t *in, uint64_t start)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    size_t line = 1;
+    unsigned char first = 0;
+    int fasta = 0;
+    int eof = 0;
+    int ret = 1;
+    if (fdb_infile_seek(in, 0) || fdb_infile_read(in, &first, 1) < 0) {
+        return 1;
+    }
+    fasta = first == '>';
+    if (start == 0) return fdb_infile_seek(in, 0);
+    /* Read from start - 1, so we know whether start begins a line */
+    if (fdb_infile_seek(in, start - 1)) return 1;
+    buf = km_malloc(FDB_RESYNC_MAX, &km_onerr_print);
+    if (buf == NULL) return 1;
+    while (1) {
+        int found = 0;
+        /* Advance to the next line start */
+        while (line <= len && buf[line - 1] != '\n') line++;
+        if (line <= len) {
+            found = is_record_start(buf + line, len - line, fasta, eof);
+            if (found == 1) break;
+            if (found == 0) {
+                line++;
+                continue;
+            }
+        } else if (eof) {
+            line = len;
+            break;
+        }
+        /* Need more data */
+        if (len == FDB_RESYNC_MAX) {
+            fprintf(stderr, "ERROR: no record found within %u bytes of %"
+                    PRIu64 " in '%s'\n", FDB_RESYNC_MAX, start, in->fn);
+            goto exit;
+        }
+        unsigned want = FDB_RESYNC_MAX - len;
+        int got = fdb_infile_read(in, buf + len,
+                want > FDB_GZIDX_CHUNK ? FDB_GZIDX_CHUNK : want);
+        if (got < 0) goto exit;
+        if (got == 0) eof = 1;
+        len += got;
+    }
+    ret = fdb_infile_seek(in, start - 1 + line);
+exit:
+    free(buf);
+    return ret;
+} /* -----  end of function fdb_infile_resync  ----- */
+
+void
+fdb_infile_close (fdb_infile_t *in)
+{
+    if (in == NULL) return;
+    gzclose(in->gz);
+    if (in->raw != NULL) fclose(in->raw);
+    if (in->strm_init) inflateEnd(&in->strm);
+    km_free(in->inbuf, &km_onerr_nil);
+    km_free(in->fn, &km_onerr_nil);
+    fdb_gzidx_destroy(in->idx);
+    free(in);
+}
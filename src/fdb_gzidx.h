@@ -0,0 +1,87 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_gzidx.h
+ *
+ *    Description:  Random access into gzipped inputs via an index of
+ *                      inflate access points (after zlib's zran.c), and the
+ *                      input file abstraction kseq reads through.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 13:40:02
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_GZIDX_H
+#define FDB_GZIDX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "kdm.h"
+
+#define FDB_GZIDX_MAGIC "FDBGZI1"
+#define FDB_GZIDX_EXT ".fdbi"
+/* Uncompressed bytes between access points */
+#define FDB_GZIDX_SPAN_DEFAULT (8u << 20)
+#define FDB_GZIDX_WINSIZE 32768
+#define FDB_GZIDX_CHUNK 65536
+/* Give up looking for a record boundary after this many bytes */
+#define FDB_RESYNC_MAX (16u << 20)
+
+/* A point at which inflation can restart: a deflate block boundary, with the
+ * preceding 32K of output (zlib-compressed) as the dictionary. */
+typedef struct __fdb_gzpoint_t {
+    uint64_t out;           /* uncompressed offset */
+    uint64_t in;            /* compressed offset of the first full byte */
+    int bits;               /* bits of the previous byte in use, 0-7 */
+    uint32_t wlen;          /* compressed window length */
+    unsigned char *window;
+} fdb_gzpoint_t;
+
+typedef struct __fdb_gzidx_t {
+    uint64_t span;
+    uint64_t in_size;       /* compressed file size, to detect stale indices */
+    uint64_t length;        /* total uncompressed length */
+    size_t n_points;
+    size_t m_points;
+    fdb_gzpoint_t *points;
+} fdb_gzidx_t;
+
+/* An input file. Reads go through gzread until a seek lands somewhere an
+ * access point can reach, after which we inflate from the raw file
+ * ourselves. */
+typedef struct __fdb_infile_t {
+    char *fn;
+    gzFile gz;
+    fdb_gzidx_t *idx;
+    /* State for reading from an access point */
+    FILE *raw;
+    z_stream strm;
+    int strm_init;
+    int strm_raw;           /* inflating raw deflate, not gzip */
+    int raw_eof;
+    unsigned char *inbuf;
+    uint64_t pos;           /* uncompressed offset of next byte read */
+} fdb_infile_t;
+
+fdb_gzidx_t *fdb_gzidx_build (const char *fn, uint64_t span);
+int fdb_gzidx_save (const fdb_gzidx_t *idx, const char *fn);
+fdb_gzidx_t *fdb_gzidx_load (const char *fn);
+void fdb_gzidx_destroy (fdb_gzidx_t *idx);
+
+fdb_infile_t *fdb_infile_open (const char *fn);
+int fdb_infile_read (fdb_infile_t *in, void *buf, unsigned len);
+int fdb_infile_seek (fdb_infile_t *in, uint64_t offset);
+int fdb_infile_resync (fdb_infile_t *in, uint64_t start);
+uint64_t fdb_infile_tell (fdb_infile_t *in);
+uint64_t fdb_infile_raw_tell (fdb_infile_t *in);
+void fdb_infile_close (fdb_infile_t *in);
+
+#endif /* FDB_GZIDX_H */
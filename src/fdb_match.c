@@ -0,0 +1,386 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_match.c
+ *
+ *    Description:  libfdb's barcode matcher: assigns reads to the barcode
+ *                      they start with
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 21:10:37
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kdm.h"
+#include "fdb_match.h"
+#include "fdb_midx.h"
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:    fdb_hamming_max
+ *  Description:    Calculates the hamming distance between needle and the
+ *                      start of hay, up until max. Needle bases past the end
+ *                      of hay count as mismatches.
+ * Return Value:    size_t: max if max <= hamming dist, else hamming dist
+ * ============================================================================
+ */
+size_t
+fdb_hamming_max (const char *needle, size_t needle_len, const char *hay,
+                 size_t hay_len, size_t max)
+{
+    size_t mismatches = 0;
+    size_t len = needle_len < hay_len ? needle_len : hay_len;
+    if (len == needle_len && memcmp(needle, hay, len) == 0) {
+        /* exact match */
+        return 0;
+    }
+    for (size_t iii = 0; iii < len && mismatches < max; iii++) {
+        if (needle[iii] != hay[iii]) {
+            mismatches++;
+        }
+    }
+    mismatches += needle_len - len;
+    return mismatches < max ? mismatches : max;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_new
+ *  Description:  Makes a matcher for n_barcodes barcode sequences. Reads
+ *                  are assigned to a barcode with fewer than max_mismatches
+ *                  mismatches, which (if buffer_seq isn't NULL) is followed
+ *                  by buffer_seq with at most max_buffer_mismatches.
+ * Return Value:  fdb_matcher_t *: the matcher, or NULL on failure
+ * ============================================================================
+ */
+fdb_matcher_t *
+fdb_matcher_new (const char *const *seqs, size_t n_barcodes,
+                 int max_mismatches, const char *buffer_seq,
+                 int max_buffer_mismatches)
+{
+    fdb_matcher_t *m = NULL;
+    if (seqs == NULL || max_mismatches < 0 || max_buffer_mismatches < 0) {
+        return NULL;
+    }
+    m = km_calloc(1, sizeof(*m), &km_onerr_print);
+    if (m == NULL) return NULL;
+    m->n_barcodes = n_barcodes;
+    m->max_mismatches = max_mismatches;
+    m->max_buffer_mismatches = max_buffer_mismatches;
+    m->seqs = km_calloc(n_barcodes + 1, sizeof(*m->seqs), &km_onerr_print);
+    m->lens = km_calloc(n_barcodes + 1, sizeof(*m->lens), &km_onerr_print);
+    if (m->seqs == NULL || m->lens == NULL) goto fail;
+    for (size_t bbb = 0; bbb < n_barcodes; bbb++) {
+        if (seqs[bbb] == NULL || seqs[bbb][0] == '\0') goto fail;
+        m->seqs[bbb] = strdup(seqs[bbb]);
+        if (m->seqs[bbb] == NULL) goto fail;
+        m->lens[bbb] = strlen(seqs[bbb]);
+        if (m->lens[bbb] > m->max_len) m->max_len = m->lens[bbb];
+    }
+    if (buffer_seq != NULL) {
+        m->buffer_seq = strdup(buffer_seq);
+        if (m->buffer_seq == NULL) goto fail;
+        m->buffer_len = strlen(buffer_seq);
+    }
+    return m;
+fail:
+    fdb_matcher_destroy(m);
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_match
+ *  Description:  Finds the barcode a read starts with. Of the barcodes
+ *                  whose buffer sequence matches, the one with fewest
+ *                  mismatches wins, ties going to the longer barcode and
+ *                  then to the later one. Barcodes max_mismatches or more
+ *                  away can't be matched, so all score max_mismatches. If
+ *                  mismatches isn't NULL, the winner's score is stored
+ *                  there.
+ * Return Value:  int: the barcode's index, or FDB_NO_MATCH
+ * ============================================================================
+ */
+int
+fdb_matcher_match (const fdb_matcher_t *m, const char *seq, size_t len,
+                   size_t *mismatches)
+{
+    size_t best_score = SIZE_MAX;
+    size_t best_len = 0;
+    int best = 0;
+    if (m->index != NULL && fdb_midx_match(m, seq, len, mismatches,
+                &best) == 0) {
+        return best;
+    }
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        size_t score = fdb_hamming_max(m->seqs[bbb], m->lens[bbb], seq, len,
+                m->max_mismatches);
+        if (m->buffer_seq != NULL) {
+            size_t off = m->lens[bbb] < len ? m->lens[bbb] : len;
+            size_t buffer_hamdist = fdb_hamming_max(m->buffer_seq,
+                    m->buffer_len, seq + off, len - off,
+                    m->max_buffer_mismatches + 1);
+            if (buffer_hamdist > (size_t)m->max_buffer_mismatches) continue;
+        }
+        if (score <= best_score && m->lens[bbb] >= best_len) {
+            best = bbb;
+            best_len = m->lens[bbb];
+            best_score = score;
+        }
+    }
+    if (mismatches != NULL) *mismatches = best_score;
+    return best_score < (size_t)m->max_mismatches ? best : FDB_NO_MATCH;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_classify
+ *  Description:  Matches n reads, storing each one's barcode (or
+ *                  FDB_NO_MATCH) in assign and the number of bases to trim
+ *                  from its start in trim. mismatches may be NULL; otherwise
+ *                  it gets the best barcode's mismatches, capped at
+ *                  max_mismatches.
+ * Return Value:  int: number of reads assigned to a barcode
+ * ============================================================================
+ */
+int
+fdb_matcher_classify (const fdb_matcher_t *m, const char *const *seqs,
+                      const size_t *lens, size_t n, int32_t *assign,
+                      uint32_t *trim, uint32_t *mismatches)
+{
+    size_t cap = m->max_mismatches;
+    int n_assigned = 0;
+    for (size_t rrr = 0; rrr < n; rrr++) {
+        size_t score = 0;
+        int bcd = fdb_matcher_match(m, seqs[rrr], lens[rrr], &score);
+        assign[rrr] = bcd;
+        trim[rrr] = 0;
+        if (bcd != FDB_NO_MATCH) {
+            /* A read may be shorter than the barcode it matches */
+            trim[rrr] = m->lens[bcd] < lens[rrr] ? m->lens[bcd] : lens[rrr];
+        }
+        if (mismatches != NULL) mismatches[rrr] = score < cap ? score : cap;
+        n_assigned += bcd != FDB_NO_MATCH;
+    }
+    return n_assigned;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_is
+ *  Description:  Checks whether m was made from these barcodes and limits
+ * Return Value:  int: 1 if it was, 0 otherwise
+ * ============================================================================
+ */
+int
+fdb_matcher_is (const fdb_matcher_t *m, const char *const *seqs,
+                size_t n_barcodes, int max_mismatches, const char *buffer_seq,
+                int max_buffer_mismatches)
+{
+    if (m->n_barcodes != n_barcodes || m->max_mismatches != max_mismatches || \
+            (m->buffer_seq == NULL) != (buffer_seq == NULL)) {
+        return 0;
+    }
+    if (buffer_seq != NULL && (strcmp(m->buffer_seq, buffer_seq) != 0 || \
+                m->max_buffer_mismatches != max_buffer_mismatches)) {
+        return 0;
+    }
+    for (size_t bbb = 0; bbb < n_barcodes; bbb++) {
+        if (strcmp(m->seqs[bbb], seqs[bbb]) != 0) return 0;
+    }
+    return 1;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_copy
+ *  Description:  Makes a copy of m, index and all, in memory the calling
+ *                  thread allocates. Threads on another NUMA node match
+ *                  with a copy made there, rather than reaching across for
+ *                  m's tables.
+ * Return Value:  fdb_matcher_t *: the copy, or NULL on failure
+ * ============================================================================
+ */
+fdb_matcher_t *
+fdb_matcher_copy (const fdb_matcher_t *m)
+{
+    fdb_matcher_t *copy = fdb_matcher_new((const char *const *)m->seqs,
+            m->n_barcodes, m->max_mismatches, m->buffer_seq,
+            m->max_buffer_mismatches);
+    void *idx = NULL;
+    if (copy == NULL || m->index == NULL) return copy;
+    idx = km_malloc(m->index_size, &km_onerr_print);
+    if (idx == NULL) {
+        fdb_matcher_destroy(copy);
+        return NULL;
+    }
+    memcpy(idx, m->index, m->index_size);
+    copy->index = idx;
+    copy->index_size = m->index_size;
+    copy->index_mapped = 0;
+    return copy;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_compile
+ *  Description:  Indexes every sequence fewer than max_mismatches from
+ *                  a barcode, so reads are matched by lookup rather than by
+ *                  comparison with every barcode. Matches are as without
+ *                  the index. Barcodes must be of A, C, G and T only, and at
+ *                  most 32 bases, and the index can't be too large.
+ * Return Value:  int: 0 on success, 1 if m can't be indexed
+ * ============================================================================
+ */
+int
+fdb_matcher_compile (fdb_matcher_t *m)
+{
+    fdb_midx_hdr_t *idx = NULL;
+    if (m->index != NULL) return 0;
+    idx = fdb_midx_build(m);
+    if (idx == NULL) return 1;
+    m->index = idx;
+    m->index_size = idx->size;
+    m->index_mapped = 0;
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_save_index
+ *  Description:  Compiles m if need be, and writes its index to fn. fn is
+ *                  replaced atomically, as other processes may have it
+ *                  mapped.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_matcher_save_index (fdb_matcher_t *m, const char *fn)
+{
+    char *tmp_fn = NULL;
+    FILE *fp = NULL;
+    int res = 1;
+    if (fdb_matcher_compile(m) != 0) {
+        fprintf(stderr, "ERROR: barcodes can't be indexed; they must be "
+                "of A, C, G and T only, at most %d bases, and few enough for "
+                "their mismatches\n", FDB_MIDX_MAX_LEN);
+        return 1;
+    }
+    tmp_fn = km_calloc(strlen(fn) + 5, 1, &km_onerr_print);
+    if (tmp_fn == NULL) return 1;
+    sprintf(tmp_fn, "%s.tmp", fn);
+    fp = fopen(tmp_fn, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Could not open index file '%s': %s\n", tmp_fn,
+                strerror(errno));
+        goto exit;
+    }
+    if (fwrite(m->index, 1, m->index_size, fp) != m->index_size) {
+        fprintf(stderr, "ERROR: Could not write index file '%s'\n", tmp_fn);
+        fclose(fp);
+        unlink(tmp_fn);
+        goto exit;
+    }
+    if (fclose(fp) != 0 || rename(tmp_fn, fn) != 0) {
+        fprintf(stderr, "ERROR: Could not write index file '%s': %s\n", fn,
+                strerror(errno));
+        unlink(tmp_fn);
+        goto exit;
+    }
+    res = 0;
+exit:
+    free(tmp_fn);
+    return res;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_matcher_load_index
+ *  Description:  Makes a matcher from an index file written by
+ *                  fdb_matcher_save_index(). The index is mapped, not read,
+ *                  so processes loading the same file share its pages.
+ * Return Value:  fdb_matcher_t *: the matcher, or NULL on failure
+ * ============================================================================
+ */
+fdb_matcher_t *
+fdb_matcher_load_index (const char *fn)
+{
+    struct stat st;
+    const fdb_midx_hdr_t *idx = NULL;
+    const uint32_t *seq_offs = NULL;
+    const char **seqs = NULL;
+    fdb_matcher_t *m = NULL;
+    void *map = MAP_FAILED;
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Could not open index file '%s': %s\n", fn,
+                strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(*idx)) {
+        fprintf(stderr, "ERROR: '%s' is not a fastDBarcode index\n", fn);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map index file '%s'\n", fn);
+        return NULL;
+    }
+    idx = map;
+    if (fdb_midx_check(idx, st.st_size) != 0) goto fail;
+    seqs = km_calloc(idx->n_barcodes, sizeof(*seqs), &km_onerr_print);
+    if (seqs == NULL) goto fail;
+    seq_offs = (const uint32_t *)((const char *)idx + idx->seq_offs_off);
+    for (size_t bbb = 0; bbb < idx->n_barcodes; bbb++) {
+        seqs[bbb] = (const char *)idx + idx->seqs_off + seq_offs[bbb];
+    }
+    m = fdb_matcher_new(seqs, idx->n_barcodes, idx->max_mismatches,
+            idx->has_buffer ? (const char *)idx + idx->buffer_off : NULL,
+            idx->max_buffer_mismatches);
+    free(seqs);
+    if (m == NULL) goto fail;
+    m->index = idx;
+    m->index_size = st.st_size;
+    m->index_mapped = 1;
+    return m;
+fail:
+    fprintf(stderr, "ERROR: Could not load index file '%s'\n", fn);
+    munmap(map, st.st_size);
+    return NULL;
+}
+
+void
+fdb_matcher_destroy (fdb_matcher_t *m)
+{
+    if (m == NULL) return;
+    if (m->index_mapped) {
+        munmap((void *)m->index, m->index_size);
+    } else {
+        free((void *)m->index);
+    }
+    if (m->seqs != NULL) {
+        for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+            free(m->seqs[bbb]);
+        }
+        free(m->seqs);
+    }
+    free(m->lens);
+    free(m->buffer_seq);
+    free(m);
+}
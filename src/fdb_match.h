@@ -0,0 +1,70 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_match.h
+ *
+ *    Description:  libfdb's barcode matcher: assigns reads to the barcode
+ *                      they start with
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 21:10:37
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_MATCH_H
+#define FDB_MATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Assignment of a read matching no barcode */
+#define FDB_NO_MATCH (-1)
+/* Barcode sets at least this large are indexed when loaded */
+#define FDB_MATCHER_INDEX_MIN 32
+
+struct __fdb_midx_hdr_t;
+
+/* Immutable once made, so any number of threads may classify with one
+ * matcher at once. */
+typedef struct __fdb_matcher_t {
+    size_t n_barcodes;
+    char **seqs;
+    size_t *lens;
+    size_t max_len;
+    /* A read is assigned only with fewer than this many mismatches */
+    int max_mismatches;
+    /* Sequence which must follow the barcode, or NULL */
+    char *buffer_seq;
+    size_t buffer_len;
+    int max_buffer_mismatches;
+    /* Compiled index, from fdb_matcher_compile() or a file, or NULL */
+    const struct __fdb_midx_hdr_t *index;
+    size_t index_size;
+    int index_mapped;
+} fdb_matcher_t;
+
+size_t fdb_hamming_max (const char *needle, size_t needle_len,
+                        const char *hay, size_t hay_len, size_t max);
+fdb_matcher_t *fdb_matcher_new (const char *const *seqs, size_t n_barcodes,
+                                int max_mismatches, const char *buffer_seq,
+                                int max_buffer_mismatches);
+int fdb_matcher_match (const fdb_matcher_t *m, const char *seq, size_t len,
+                       size_t *mismatches);
+int fdb_matcher_classify (const fdb_matcher_t *m, const char *const *seqs,
+                          const size_t *lens, size_t n, int32_t *assign,
+                          uint32_t *trim, uint32_t *mismatches);
+int fdb_matcher_is (const fdb_matcher_t *m, const char *const *seqs,
+                    size_t n_barcodes, int max_mismatches,
+                    const char *buffer_seq, int max_buffer_mismatches);
+fdb_matcher_t *fdb_matcher_copy (const fdb_matcher_t *m);
+int fdb_matcher_compile (fdb_matcher_t *m);
+int fdb_matcher_save_index (fdb_matcher_t *m, const char *fn);
+fdb_matcher_t *fdb_matcher_load_index (const char *fn);
+void fdb_matcher_destroy (fdb_matcher_t *m);
+
+#endif /* FDB_MATCH_H */
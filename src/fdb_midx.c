@@ -0,0 +1,555 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_midx.c
+ *
+ *    Description:  Compiled barcode matcher indices, built in memory or
+ *                      mapped from a file
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 14:05:33
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <string.h>
+
+#include "kdm.h"
+#include "fdb_midx.h"
+
+#define MIDX_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+#define MIDX_AT(idx, off) ((const void *)((const char *)(idx) + (off)))
+
+/* 2-bit code of a base, or 4 for anything but ACGT */
+static inline uint8_t
+midx_code (char c)
+{
+    switch (c) {
+        case 'A':
+            return 0;
+        case 'C':
+            return 1;
+        case 'G':
+            return 2;
+        case 'T':
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+static inline uint64_t
+midx_hash (uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/* A class's table while it is built; ambiguous slots' vals index amb */
+typedef struct __midx_build_class_t {
+    uint32_t len;
+    uint32_t n_members;
+    uint32_t *members;
+    fdb_midx_slot_t *slots;
+    uint64_t mask;
+} midx_build_class_t;
+
+typedef struct __midx_build_t {
+    uint32_t n_barcodes;
+    midx_build_class_t classes[FDB_MIDX_MAX_LEN];
+    uint32_t n_classes;
+    /* Runs of barcodes sharing a neighbour */
+    uint32_t **amb;
+    uint32_t *amb_lens;
+    size_t n_amb;
+    size_t m_amb;
+    uint64_t amb_words;
+} midx_build_t;
+
+/* Sequences within max mismatches of one of length len */
+static uint64_t
+neighbourhood_size (uint32_t len, int max)
+{
+    uint64_t total = 0, choose = 1, subs = 1;
+    for (int kkk = 0; kkk <= max && (uint32_t)kkk <= len; kkk++) {
+        total += choose * subs;
+        if (total > FDB_MIDX_MAX_ENTRIES) return UINT64_MAX;
+        choose = choose * (len - kkk) / (kkk + 1);
+        subs *= 3;
+    }
+    return total;
+}
+
+static int
+slot_insert (midx_build_t *bt, midx_build_class_t *cls, uint64_t key,
+             uint32_t bcd)
+{
+    uint64_t iii = midx_hash(key) & cls->mask;
+    while (cls->slots[iii].val != FDB_MIDX_EMPTY) {
+        fdb_midx_slot_t *slot = &cls->slots[iii];
+        uint32_t *run = NULL;
+        if (slot->key != key) {
+            iii = (iii + 1) & cls->mask;
+            continue;
+        }
+        if (slot->val < bt->n_barcodes) {
+            /* Second barcode with this neighbour: start a run */
+            if (bt->n_amb == bt->m_amb) {
+                bt->m_amb = bt->m_amb ? bt->m_amb << 1 : 64;
+                bt->amb = km_realloc(bt->amb, bt->m_amb * sizeof(*bt->amb),
+                        &km_onerr_print);
+                bt->amb_lens = km_realloc(bt->amb_lens,
+                        bt->m_amb * sizeof(*bt->amb_lens), &km_onerr_print);
+                if (bt->amb == NULL || bt->amb_lens == NULL) return 1;
+            }
+            run = km_malloc(2 * sizeof(*run), &km_onerr_print);
+            if (run == NULL) return 1;
+            run[0] = slot->val;
+            bt->amb[bt->n_amb] = run;
+            bt->amb_lens[bt->n_amb] = 1;
+            slot->val = bt->n_barcodes + bt->n_amb++;
+            bt->amb_words += 2;
+        } else {
+            size_t aaa = slot->val - bt->n_barcodes;
+            uint32_t n = bt->amb_lens[aaa];
+            /* Runs grow in powers of two */
+            if ((n & (n - 1)) == 0 && n >= 2) {
+                run = km_realloc(bt->amb[aaa], 2 * n * sizeof(*run),
+                        &km_onerr_print);
+                if (run == NULL) return 1;
+                bt->amb[aaa] = run;
+            }
+        }
+        if (run == NULL) {
+            bt->amb_words++;
+        }
+        bt->amb[slot->val - bt->n_barcodes][
+            bt->amb_lens[slot->val - bt->n_barcodes]++] = bcd;
+        return 0;
+    }
+    cls->slots[iii].key = key;
+    cls->slots[iii].val = bcd;
+    return 0;
+}
+
+/* Inserts key and every variant of it with up to budget substitutions at
+ * positions from start, each exactly once */
+static int
+insert_variants (midx_build_t *bt, midx_build_class_t *cls, uint64_t key,
+                 uint32_t start, int budget, uint32_t bcd)
+{
+    if (slot_insert(bt, cls, key, bcd)) return 1;
+    if (budget == 0) return 0;
+    for (uint32_t pos = start; pos < cls->len; pos++) {
+        int shift = 2 * (cls->len - 1 - pos);
+        uint64_t orig = (key >> shift) & 3;
+        for (uint64_t base = 0; base < 4; base++) {
+            if (base == orig) continue;
+            if (insert_variants(bt, cls, key ^ ((orig ^ base) << shift),
+                        pos + 1, budget - 1, bcd)) return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+build_free (midx_build_t *bt)
+{
+    for (uint32_t ccc = 0; ccc < bt->n_classes; ccc++) {
+        free(bt->classes[ccc].members);
+        free(bt->classes[ccc].slots);
+    }
+    for (size_t aaa = 0; aaa < bt->n_amb; aaa++) {
+        free(bt->amb[aaa]);
+    }
+    free(bt->amb);
+    free(bt->amb_lens);
+}
+
+static int
+cmp_class_len_rev (const void *left, const void *right)
+{
+    const midx_build_class_t *l = left, *r = right;
+    return (int)r->len - (int)l->len;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_midx_build
+ *  Description:  Compiles m's barcodes into an index. Only barcodes of
+ *                  A, C, G and T, at most FDB_MIDX_MAX_LEN long, can be
+ *                  indexed, and their neighbourhoods must total at most
+ *                  FDB_MIDX_MAX_ENTRIES sequences. A neighbourhood is the
+ *                  sequences a barcode can be matched to, those fewer than
+ *                  max_mismatches from it; the ones further off would only
+ *                  score the cap.
+ * Return Value:  fdb_midx_hdr_t *: the index, to be free()d, or NULL if
+ *                  m can't be indexed
+ * ============================================================================
+ */
+fdb_midx_hdr_t *
+fdb_midx_build (const fdb_matcher_t *m)
+{
+    midx_build_t bt;
+    int class_of_len[FDB_MIDX_MAX_LEN + 1];
+    uint64_t entries = 0;
+    uint64_t off = 0, seqs_len = 0, amb_run = 0;
+    fdb_midx_hdr_t *idx = NULL;
+    fdb_midx_class_t *classes = NULL;
+    uint32_t *seq_offs = NULL, *amb = NULL;
+    char *seqs = NULL;
+    /* With -m 0 nothing can match, and the tables are left empty */
+    const int budget = (int)m->max_mismatches - 1;
+    memset(&bt, 0, sizeof(bt));
+    if (m->n_barcodes == 0 || m->n_barcodes >= UINT32_MAX / 4) return NULL;
+    bt.n_barcodes = m->n_barcodes;
+    for (int lll = 0; lll <= FDB_MIDX_MAX_LEN; lll++) class_of_len[lll] = -1;
+    /* Group barcodes by length */
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        size_t len = m->lens[bbb];
+        if (len > FDB_MIDX_MAX_LEN) return NULL;
+        for (size_t iii = 0; iii < len; iii++) {
+            if (midx_code(m->seqs[bbb][iii]) > 3) return NULL;
+        }
+        if (class_of_len[len] < 0) {
+            class_of_len[len] = bt.n_classes;
+            bt.classes[bt.n_classes++].len = len;
+        }
+        bt.classes[class_of_len[len]].n_members++;
+    }
+    qsort(bt.classes, bt.n_classes, sizeof(*bt.classes), cmp_class_len_rev);
+    for (uint32_t ccc = 0; ccc < bt.n_classes; ccc++) {
+        midx_build_class_t *cls = &bt.classes[ccc];
+        uint64_t n = neighbourhood_size(cls->len, budget);
+        uint64_t n_slots = 16;
+        class_of_len[cls->len] = ccc;
+        if (n == UINT64_MAX || (entries += n * cls->n_members) > \
+                FDB_MIDX_MAX_ENTRIES) goto fail;
+        /* At most 3/4 full, so probes are short and always end */
+        while (n_slots * 3 < n * cls->n_members * 4) n_slots <<= 1;
+        cls->mask = n_slots - 1;
+        cls->slots = km_malloc(n_slots * sizeof(*cls->slots), &km_onerr_print);
+        cls->members = km_malloc(cls->n_members * sizeof(*cls->members),
+                &km_onerr_print);
+        if (cls->slots == NULL || cls->members == NULL) goto fail;
+        for (uint64_t sss = 0; sss < n_slots; sss++) {
+            cls->slots[sss].key = 0;
+            cls->slots[sss].val = FDB_MIDX_EMPTY;
+            cls->slots[sss].pad = 0;
+        }
+        cls->n_members = 0;
+    }
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        midx_build_class_t *cls = &bt.classes[class_of_len[m->lens[bbb]]];
+        uint64_t key = 0;
+        for (size_t iii = 0; iii < m->lens[bbb]; iii++) {
+            key = key << 2 | midx_code(m->seqs[bbb][iii]);
+        }
+        cls->members[cls->n_members++] = bbb;
+        if (budget >= 0 && insert_variants(&bt, cls, key, 0, budget, bbb)) {
+            goto fail;
+        }
+        seqs_len += m->lens[bbb] + 1;
+    }
+    if (bt.n_barcodes + bt.amb_words >= FDB_MIDX_EMPTY) goto fail;
+    /* Lay the index out */
+    off = MIDX_ALIGN(sizeof(*idx));
+    uint64_t classes_off = off;
+    off = MIDX_ALIGN(off + bt.n_classes * sizeof(*classes));
+    uint64_t seq_offs_off = off;
+    off = MIDX_ALIGN(off + m->n_barcodes * sizeof(*seq_offs));
+    uint64_t members_off = off;
+    off = MIDX_ALIGN(off + m->n_barcodes * sizeof(uint32_t));
+    uint64_t seqs_off = off;
+    uint64_t buffer_off = off + seqs_len;
+    off = MIDX_ALIGN(buffer_off + (m->buffer_seq ? m->buffer_len + 1 : 0));
+    uint64_t amb_off = off;
+    off = MIDX_ALIGN(off + bt.amb_words * sizeof(*amb));
+    uint64_t slots_off = off;
+    for (uint32_t ccc = 0; ccc < bt.n_classes; ccc++) {
+        off += (bt.classes[ccc].mask + 1) * sizeof(fdb_midx_slot_t);
+    }
+    idx = km_calloc(1, off, &km_onerr_print);
+    if (idx == NULL) goto fail;
+    memcpy(idx->magic, FDB_MIDX_MAGIC, sizeof(FDB_MIDX_MAGIC));
+    idx->version = FDB_MIDX_VERSION;
+    idx->byte_order = FDB_MIDX_BYTE_ORDER;
+    idx->size = off;
+    idx->n_barcodes = m->n_barcodes;
+    idx->max_mismatches = m->max_mismatches;
+    idx->max_buffer_mismatches = m->max_buffer_mismatches;
+    idx->has_buffer = m->buffer_seq != NULL;
+    idx->n_classes = bt.n_classes;
+    idx->max_len = bt.classes[0].len;
+    idx->classes_off = classes_off;
+    idx->seq_offs_off = seq_offs_off;
+    idx->seqs_off = seqs_off;
+    idx->buffer_off = buffer_off;
+    idx->amb_off = amb_off;
+    idx->n_amb = bt.amb_words;
+    classes = (fdb_midx_class_t *)((char *)idx + classes_off);
+    seq_offs = (uint32_t *)((char *)idx + seq_offs_off);
+    seqs = (char *)idx + seqs_off;
+    amb = (uint32_t *)((char *)idx + amb_off);
+    for (size_t bbb = 0, soff = 0; bbb < m->n_barcodes; bbb++) {
+        seq_offs[bbb] = soff;
+        memcpy(seqs + soff, m->seqs[bbb], m->lens[bbb] + 1);
+        soff += m->lens[bbb] + 1;
+    }
+    if (m->buffer_seq != NULL) {
+        memcpy((char *)idx + buffer_off, m->buffer_seq, m->buffer_len + 1);
+    }
+    /* Ambiguity runs, whose slots then point at them */
+    for (size_t aaa = 0; aaa < bt.n_amb; aaa++) {
+        uint32_t n_run = bt.amb_lens[aaa];
+        amb[amb_run] = n_run;
+        memcpy(amb + amb_run + 1, bt.amb[aaa], n_run * sizeof(*amb));
+        bt.amb_lens[aaa] = amb_run;
+        amb_run += 1 + n_run;
+    }
+    for (uint32_t ccc = 0; ccc < bt.n_classes; ccc++) {
+        midx_build_class_t *cls = &bt.classes[ccc];
+        fdb_midx_slot_t *slots = (fdb_midx_slot_t *)((char *)idx + slots_off);
+        uint32_t *members = (uint32_t *)((char *)idx + members_off);
+        for (uint64_t sss = 0; sss <= cls->mask; sss++) {
+            if (cls->slots[sss].val != FDB_MIDX_EMPTY && \
+                    cls->slots[sss].val >= bt.n_barcodes) {
+                cls->slots[sss].val = bt.n_barcodes + \
+                    bt.amb_lens[cls->slots[sss].val - bt.n_barcodes];
+            }
+        }
+        memcpy(slots, cls->slots, (cls->mask + 1) * sizeof(*slots));
+        memcpy(members, cls->members, cls->n_members * sizeof(*members));
+        classes[ccc].len = cls->len;
+        classes[ccc].n_members = cls->n_members;
+        classes[ccc].members_off = members_off;
+        classes[ccc].slots_off = slots_off;
+        classes[ccc].mask = cls->mask;
+        members_off += cls->n_members * sizeof(*members);
+        slots_off += (cls->mask + 1) * sizeof(*slots);
+    }
+    build_free(&bt);
+    return idx;
+fail:
+    build_free(&bt);
+    free(idx);
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_midx_check
+ *  Description:  Checks an index read from a file of size bytes is one
+ *                  this version can use, and that every offset in it stays
+ *                  inside it.
+ * Return Value:  int: 0 if it is usable, 1 otherwise
+ * ============================================================================
+ */
+int
+fdb_midx_check (const fdb_midx_hdr_t *idx, size_t size)
+{
+    const fdb_midx_class_t *classes = NULL;
+    const uint32_t *seq_offs = NULL;
+    uint64_t n_members = 0;
+    if (size < sizeof(*idx) || \
+            memcmp(idx->magic, FDB_MIDX_MAGIC, sizeof(FDB_MIDX_MAGIC)) != 0) {
+        fprintf(stderr, "ERROR: not a fastDBarcode index\n");
+        return 1;
+    }
+    if (idx->byte_order != FDB_MIDX_BYTE_ORDER || \
+            idx->version != FDB_MIDX_VERSION) {
+        fprintf(stderr, "ERROR: index is version %u, this is version %u%s\n",
+                idx->version, FDB_MIDX_VERSION,
+                idx->byte_order != FDB_MIDX_BYTE_ORDER ? \
+                " (or from a machine of different endianness)" : "");
+        return 1;
+    }
+#define MIDX_FITS(off, len) ((off) <= size && (len) <= size - (off))
+    if (idx->size != size || idx->n_barcodes == 0 || \
+            idx->n_classes == 0 || idx->n_classes > FDB_MIDX_MAX_LEN || \
+            idx->max_len > FDB_MIDX_MAX_LEN || \
+            !MIDX_FITS(idx->classes_off,
+                idx->n_classes * sizeof(fdb_midx_class_t)) || \
+            !MIDX_FITS(idx->seq_offs_off,
+                (uint64_t)idx->n_barcodes * sizeof(uint32_t)) || \
+            !MIDX_FITS(idx->amb_off, idx->n_amb * sizeof(uint32_t)) || \
+            idx->seqs_off >= size || idx->buffer_off >= size || \
+            (idx->classes_off | idx->seq_offs_off | idx->amb_off) & 7) {
+        goto bad;
+    }
+    classes = MIDX_AT(idx, idx->classes_off);
+    seq_offs = MIDX_AT(idx, idx->seq_offs_off);
+    for (uint32_t bbb = 0; bbb < idx->n_barcodes; bbb++) {
+        uint64_t off = idx->seqs_off + seq_offs[bbb];
+        if (off >= size || memchr((const char *)idx + off, '\0',
+                    size - off) == NULL) goto bad;
+    }
+    if (idx->has_buffer && memchr((const char *)idx + idx->buffer_off, '\0',
+                size - idx->buffer_off) == NULL) goto bad;
+    for (uint32_t ccc = 0; ccc < idx->n_classes; ccc++) {
+        const fdb_midx_class_t *cls = &classes[ccc];
+        const uint32_t *members = NULL;
+        if (cls->len == 0 || cls->len > idx->max_len || \
+                (ccc > 0 && cls->len >= classes[ccc - 1].len) || \
+                (cls->mask & (cls->mask + 1)) != 0 || \
+                cls->members_off & 3 || cls->slots_off & 7 || \
+                !MIDX_FITS(cls->members_off,
+                    (uint64_t)cls->n_members * sizeof(uint32_t)) || \
+                cls->mask >= size / sizeof(fdb_midx_slot_t) || \
+                !MIDX_FITS(cls->slots_off,
+                    (cls->mask + 1) * sizeof(fdb_midx_slot_t))) goto bad;
+        members = MIDX_AT(idx, cls->members_off);
+        for (uint32_t iii = 0; iii < cls->n_members; iii++) {
+            const char *seq = NULL;
+            if (members[iii] >= idx->n_barcodes || \
+                    (iii > 0 && members[iii] <= members[iii - 1])) goto bad;
+            seq = (const char *)idx + idx->seqs_off + seq_offs[members[iii]];
+            if (strnlen(seq, cls->len + 1) != cls->len) goto bad;
+        }
+        n_members += cls->n_members;
+    }
+    if (n_members != idx->n_barcodes) goto bad;
+#undef MIDX_FITS
+    return 0;
+bad:
+    fprintf(stderr, "ERROR: index is damaged\n");
+    return 1;
+}
+
+static inline size_t
+lower_bound (const uint32_t *arr, size_t n, uint32_t val)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (arr[mid] < val) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_midx_match
+ *  Description:  fdb_matcher_match() through m's index. Barcodes fewer
+ *                  than max_mismatches from the read ("hits") are looked
+ *                  up; every other barcode scores the cap, max_mismatches,
+ *                  as the scan would score it. The scan's choice is then
+ *                  replayed over the hits in order, with the barcodes
+ *                  between hits taken as the scan would take them: only
+ *                  while no hit has been, and then the last of the longest.
+ * Return Value:  int: 0 with the result in *bcd and *mismatches, or 1 if
+ *                  the read can't be looked up (it is short, has bases
+ *                  other than ACGT, or too many hits) and must be scanned
+ * ============================================================================
+ */
+int
+fdb_midx_match (const fdb_matcher_t *m, const char *seq, size_t len,
+                size_t *mismatches, int *bcd)
+{
+    const fdb_midx_hdr_t *idx = m->index;
+    const fdb_midx_class_t *classes = MIDX_AT(idx, idx->classes_off);
+    const uint32_t *amb = MIDX_AT(idx, idx->amb_off);
+    const uint32_t n = idx->n_barcodes;
+    const size_t cap = m->max_mismatches;
+    uint32_t hits[FDB_MIDX_MAX_HITS];
+    size_t n_hits = 0;
+    uint32_t filtered = 0;
+    uint64_t key = 0;
+    size_t best_score = SIZE_MAX;
+    size_t best_len = 0;
+    uint32_t best = 0;
+    uint32_t prev = 0;
+    if (len < idx->max_len) return 1;
+    for (uint32_t iii = 0; iii < idx->max_len; iii++) {
+        uint8_t code = midx_code(seq[iii]);
+        if (code > 3) return 1;
+        key = key << 2 | code;
+    }
+    for (uint32_t ccc = 0; ccc < idx->n_classes; ccc++) {
+        const fdb_midx_class_t *cls = &classes[ccc];
+        const fdb_midx_slot_t *slots = MIDX_AT(idx, cls->slots_off);
+        uint64_t ckey = key >> 2 * (idx->max_len - cls->len);
+        uint64_t sss = midx_hash(ckey) & cls->mask;
+        /* The scan skips barcodes whose buffer sequence doesn't match */
+        if (m->buffer_seq != NULL && fdb_hamming_max(m->buffer_seq,
+                    m->buffer_len, seq + cls->len, len - cls->len,
+                    m->max_buffer_mismatches + 1) > \
+                (size_t)m->max_buffer_mismatches) {
+            filtered |= 1u << ccc;
+            continue;
+        }
+        for (uint64_t probe = 0; probe <= cls->mask; probe++) {
+            const fdb_midx_slot_t *slot = &slots[sss];
+            if (slot->val == FDB_MIDX_EMPTY) break;
+            if (slot->key == ckey) {
+                const uint32_t *run = &slot->val;
+                uint32_t n_run = 1;
+                if (slot->val >= n) {
+                    uint64_t aoff = slot->val - n;
+                    if (aoff >= idx->n_amb || \
+                            amb[aoff] > idx->n_amb - aoff - 1) return 1;
+                    n_run = amb[aoff];
+                    run = &amb[aoff + 1];
+                }
+                if (n_hits + n_run > FDB_MIDX_MAX_HITS) return 1;
+                for (uint32_t rrr = 0; rrr < n_run; rrr++) {
+                    if (run[rrr] >= n) return 1;
+                    hits[n_hits++] = run[rrr];
+                }
+                break;
+            }
+            sss = (sss + 1) & cls->mask;
+        }
+    }
+    /* Hits in barcode order */
+    for (size_t iii = 1; iii < n_hits; iii++) {
+        uint32_t hit = hits[iii];
+        size_t jjj = iii;
+        for (; jjj > 0 && hits[jjj - 1] > hit; jjj--) hits[jjj] = hits[jjj - 1];
+        hits[jjj] = hit;
+    }
+    for (size_t hhh = 0; hhh <= n_hits; hhh++) {
+        uint32_t end = hhh < n_hits ? hits[hhh] : n;
+        if (best_score >= cap && end > prev) {
+            /* Barcodes in [prev, end) all score cap */
+            for (uint32_t ccc = 0; ccc < idx->n_classes; ccc++) {
+                const fdb_midx_class_t *cls = &classes[ccc];
+                const uint32_t *members = MIDX_AT(idx, cls->members_off);
+                size_t pos = 0;
+                if (filtered & (1u << ccc)) continue;
+                pos = lower_bound(members, cls->n_members, end);
+                if (pos > 0 && members[pos - 1] >= prev) {
+                    if (cls->len >= best_len) {
+                        best = members[pos - 1];
+                        best_len = cls->len;
+                        best_score = cap;
+                    }
+                    break;
+                }
+            }
+        }
+        if (hhh == n_hits) break;
+        size_t score = fdb_hamming_max(m->seqs[end], m->lens[end], seq, len,
+                cap);
+        if (score <= best_score && m->lens[end] >= best_len) {
+            best = end;
+            best_len = m->lens[end];
+            best_score = score;
+        }
+        prev = end + 1;
+    }
+    if (mismatches != NULL) *mismatches = best_score;
+    *bcd = best_score < (size_t)m->max_mismatches ? (int)best : FDB_NO_MATCH;
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_midx.h
+ *
+ *    Description:  Compiled barcode matcher indices, built in memory or
+ *                      mapped from a file
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 14:05:33
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_MIDX_H
+#define FDB_MIDX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fdb_match.h"
+
+#define FDB_MIDX_MAGIC "FDBMIDX"
+#define FDB_MIDX_VERSION 1
+#define FDB_MIDX_BYTE_ORDER 0x01020304u
+/* Barcodes are 2-bit packed into 64-bit keys */
+#define FDB_MIDX_MAX_LEN 32
+/* Neighbourhood entries allowed, which bounds an index's size */
+#define FDB_MIDX_MAX_ENTRIES (1u << 23)
+/* Barcodes that can match a read, most looked at per read */
+#define FDB_MIDX_MAX_HITS 64
+#define FDB_MIDX_EMPTY UINT32_MAX
+
+/* An index is one block of memory, laid out as below, which is also its
+ * file format. Offsets are from the start of the header, and aligned
+ * for what they point to. */
+typedef struct __fdb_midx_hdr_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    uint32_t n_barcodes;
+    uint32_t max_mismatches;
+    uint32_t max_buffer_mismatches;
+    uint32_t has_buffer;
+    uint32_t n_classes;
+    uint32_t max_len;
+    uint64_t classes_off;       /* fdb_midx_class_t, longest first */
+    uint64_t seq_offs_off;      /* uint32_t per barcode, into seqs */
+    uint64_t seqs_off;          /* NUL terminated barcodes, then buffer */
+    uint64_t buffer_off;
+    uint64_t amb_off;           /* uint32_t runs of count, barcodes... */
+    uint64_t n_amb;
+} fdb_midx_hdr_t;
+
+/* The barcodes of one length, and a hash table of every sequence fewer
+ * than max_mismatches from one of them */
+typedef struct __fdb_midx_class_t {
+    uint32_t len;
+    uint32_t n_members;
+    uint64_t members_off;       /* uint32_t barcode indices, ascending */
+    uint64_t slots_off;
+    uint64_t mask;              /* slots - 1 */
+} fdb_midx_class_t;
+
+/* val is a barcode index, n_barcodes + an offset into the ambiguity
+ * runs when several barcodes are this close to key, or FDB_MIDX_EMPTY */
+typedef struct __fdb_midx_slot_t {
+    uint64_t key;
+    uint32_t val;
+    uint32_t pad;
+} fdb_midx_slot_t;
+
+fdb_midx_hdr_t *fdb_midx_build (const fdb_matcher_t *m);
+int fdb_midx_check (const fdb_midx_hdr_t *idx, size_t size);
+int fdb_midx_match (const fdb_matcher_t *m, const char *seq, size_t len,
+                    size_t *mismatches, int *bcd);
+
+#endif /* FDB_MIDX_H */
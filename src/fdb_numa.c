@@ -0,0 +1,88 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_numa.c
+ *
+ *    Description:  NUMA nodes, and pinning threads to them
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 10:05:51
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <pthread.h>
+
+#ifdef FDB_HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#include "fdb_numa.h"
+
+/* Nodes with CPUs, numbered from 0 in the order libnuma gives them */
+static int numa_ids[FDB_NUMA_MAX_NODES];
+static int n_numa = 1;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+static void
+numa_probe (void)
+{
+#ifdef FDB_HAVE_LIBNUMA
+    struct bitmask *cpus = NULL;
+    int n = 0;
+    if (numa_available() < 0) return;
+    cpus = numa_allocate_cpumask();
+    if (cpus == NULL) return;
+    for (int nnn = 0; nnn <= numa_max_node() && n < FDB_NUMA_MAX_NODES;
+            nnn++) {
+        /* Memory-only nodes have nothing to run on */
+        if (numa_node_to_cpus(nnn, cpus) == 0 && \
+                numa_bitmask_weight(cpus) > 0) {
+            numa_ids[n++] = nnn;
+        }
+    }
+    numa_free_cpumask(cpus);
+    if (n > 0) n_numa = n;
+#endif
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_numa_nodes
+ *  Description:  Counts the NUMA nodes threads can be pinned to.
+ * Return Value:  int: the number of nodes, 1 without libnuma or NUMA
+ * ============================================================================
+ */
+int
+fdb_numa_nodes (void)
+{
+    pthread_once(&numa_once, numa_probe);
+    return n_numa;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_numa_bind
+ *  Description:  Pins the calling thread to the CPUs of node (taken modulo
+ *                  fdb_numa_nodes()), and has it allocate from the node's
+ *                  memory. Memory is placed where it is first touched, so
+ *                  what the thread then allocates and fills stays local.
+ * Return Value:  int: 0 on success or with nothing to do, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_numa_bind (int node)
+{
+    if (fdb_numa_nodes() < 2) return 0;
+#ifdef FDB_HAVE_LIBNUMA
+    node = numa_ids[node % n_numa];
+    if (numa_run_on_node(node) != 0) return 1;
+    numa_set_preferred(node);
+#endif
+    return 0;
+}
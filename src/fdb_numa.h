@@ -0,0 +1,27 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_numa.h
+ *
+ *    Description:  NUMA nodes, and pinning threads to them
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 10:05:51
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_NUMA_H
+#define FDB_NUMA_H
+
+/* Nodes beyond this many are treated as one of the first ones */
+#define FDB_NUMA_MAX_NODES 64
+
+int fdb_numa_nodes (void);
+int fdb_numa_bind (int node);
+
+#endif /* FDB_NUMA_H */
@@ -0,0 +1,625 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_outq.c
+ *
+ *    Description:  Threaded output: per-stream lock-free queues of record
+ *                      blocks, drained by a pool of writer threads
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 16:02:17
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <sched.h>
+#include <sys/time.h>
+
+#include "fdb_numa.h"
+#include "fdb_outq.h"
+
+/*
+ * Lock-free ring
+ */
+
+static int
+ring_init (fdb_ring_t *r, size_t slots)
+{
+    size_t cap = 2;
+    while (cap < slots) cap <<= 1;
+    r->cells = km_calloc(cap, sizeof(*r->cells), &km_onerr_print);
+    if (r->cells == NULL) return 1;
+    for (size_t iii = 0; iii < cap; iii++) {
+        r->cells[iii].seq = iii;
+    }
+    r->mask = cap - 1;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+/* 0 on success, 1 if full */
+static int
+ring_push (fdb_ring_t *r, void *data)
+{
+    fdb_ring_cell_t *cell = NULL;
+    uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &r->cells[pos & r->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return 1;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* NULL if empty */
+static void *
+ring_pop (fdb_ring_t *r)
+{
+    fdb_ring_cell_t *cell = NULL;
+    void *data = NULL;
+    uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &r->cells[pos & r->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+    data = cell->data;
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return data;
+}
+
+static inline uint64_t
+ring_pending (fdb_ring_t *r)
+{
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    return tail > head ? tail - head : 0;
+}
+
+static void
+timed_wait (pthread_cond_t *cond, pthread_mutex_t *lock, long usec)
+{
+    struct timeval now;
+    struct timespec until;
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + (now.tv_usec + usec) / 1000000;
+    until.tv_nsec = ((now.tv_usec + usec) % 1000000) * 1000;
+    pthread_cond_timedwait(cond, lock, &until);
+}
+
+/*
+ * Writers
+ */
+
+static void
+recycle_block (fdb_outq_t *q, fdb_outblk_t *blk)
+{
+    blk->len = 0;
+    ring_push(&q->free_blocks, blk);
+    __atomic_sub_fetch(&q->blocks_out, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&q->free_gen, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->n_waiting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->free_cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  govern_files
+ *  Description:  Counts stream st's file buffers after a write to it, by
+ *                  the thread that has it. If that takes all files' over
+ *                  the cap, the least recently written files that nobody
+ *                  is writing are parked, freeing their buffers until
+ *                  they're next written.
+ * Return Value:  int: 0 on success, 1 if parking a file failed
+ * ============================================================================
+ */
+static int
+govern_files (fdb_outq_t *q, fdb_outstream_t *st)
+{
+    size_t mem = 0;
+    int ret = 0;
+    if (q->file_mem_cap == 0) return 0;
+    __atomic_store_n(&st->last_use,
+            __atomic_add_fetch(&q->file_tick, 1, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    mem = fdb_ofile_mem(st->fp);
+    if (mem == st->mem) return 0;
+    /* Unsigned, so a shrink wraps around to a subtraction */
+    __atomic_add_fetch(&q->file_mem, mem - st->mem, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&st->mem, mem, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&q->file_mem, __ATOMIC_SEQ_CST) > \
+            q->file_mem_cap) {
+        fdb_outstream_t *cold = NULL;
+        uint64_t oldest = UINT64_MAX;
+        int expected = 0;
+        for (size_t sss = 0; sss < q->n_streams; sss++) {
+            fdb_outstream_t *o = &q->streams[sss];
+            uint64_t used = __atomic_load_n(&o->last_use, __ATOMIC_RELAXED);
+            if (o == st || used >= oldest || \
+                    __atomic_load_n(&o->mem, __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            oldest = used;
+            cold = o;
+        }
+        /* If it's being written, try again after the next write */
+        if (cold == NULL || !__atomic_compare_exchange_n(&cold->busy,
+                    &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (cold->mem > 0) {
+            ret |= fdb_ofile_park(cold->fp);
+            __atomic_sub_fetch(&q->file_mem, cold->mem, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&cold->mem, 0, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&q->n_parked, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&cold->busy, 0, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  drain_stream
+ *  Description:  Claims a stream, writes out up to FDB_OUTQ_DRAIN_MAX of its
+ *                  blocks in order, and releases it. The claim is released
+ *                  before the blocks are recycled, so once every block is
+ *                  back in the free pool no writer is touching any stream.
+ * Return Value:  int: number of blocks written
+ * ============================================================================
+ */
+static int
+drain_stream (fdb_outq_t *q, fdb_outstream_t *st)
+{
+    fdb_outblk_t *done[FDB_OUTQ_DRAIN_MAX];
+    int expected = 0;
+    int n = 0;
+    if (ring_pending(&st->ring) == 0) return 0;
+    if (!__atomic_compare_exchange_n(&st->busy, &expected, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    while (n < FDB_OUTQ_DRAIN_MAX) {
+        fdb_outblk_t *blk = ring_pop(&st->ring);
+        if (blk == NULL) break;
+        if (fdb_ofile_write(st->fp, blk->data, blk->len) || \
+                govern_files(q, st)) {
+            __atomic_store_n(&q->error, 1, __ATOMIC_SEQ_CST);
+        }
+        done[n++] = blk;
+    }
+    __atomic_store_n(&st->busy, 0, __ATOMIC_RELEASE);
+    for (int iii = 0; iii < n; iii++) {
+        recycle_block(q, done[iii]);
+    }
+    return n;
+}
+
+typedef struct {
+    fdb_outq_t *q;
+    int id;
+} writer_arg_t;
+
+/* Whether stream sss is among writer id's own share. With streams sharded
+ * across nodes, a node's writers share its streams, and write none of the
+ * others' unless stealing. */
+static inline int
+writer_owns (const fdb_outq_t *q, int id, size_t sss)
+{
+    int node = 0, n_local = 0;
+    if (q->stream_node == NULL) return sss % q->n_writers == (size_t)id;
+    node = id % q->n_nodes;
+    if (q->stream_node[sss] != node) return 0;
+    n_local = (q->n_writers - node + q->n_nodes - 1) / q->n_nodes;
+    return sss % n_local == (size_t)(id / q->n_nodes);
+}
+
+static void *
+writer_main (void *arg)
+{
+    writer_arg_t *w = arg;
+    fdb_outq_t *q = w->q;
+    if (q->stream_node != NULL) fdb_numa_bind(w->id % q->n_nodes);
+    while (1) {
+        uint64_t gen = __atomic_load_n(&q->work_gen, __ATOMIC_SEQ_CST);
+        int did = 0;
+        /* Our own share of the streams first */
+        for (size_t sss = 0; sss < q->n_streams; sss++) {
+            if (writer_owns(q, w->id, sss)) {
+                did += drain_stream(q, &q->streams[sss]);
+            }
+        }
+        /* Then steal from whichever stream has the most queued */
+        if (!did) {
+            uint64_t most = 0;
+            fdb_outstream_t *victim = NULL;
+            for (size_t sss = 0; sss < q->n_streams; sss++) {
+                uint64_t pending = ring_pending(&q->streams[sss].ring);
+                if (pending > most) {
+                    most = pending;
+                    victim = &q->streams[sss];
+                }
+            }
+            if (victim != NULL) did += drain_stream(q, victim);
+        }
+        if (did) continue;
+        if (__atomic_load_n(&q->shutdown, __ATOMIC_SEQ_CST) && \
+                __atomic_load_n(&q->blocks_out, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        /* Nothing to do: sleep until a producer bumps work_gen. Producers
+         * bump it before checking n_sleeping, we do the converse. */
+        pthread_mutex_lock(&q->lock);
+        __atomic_add_fetch(&q->n_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->work_gen, __ATOMIC_SEQ_CST) == gen && \
+                !__atomic_load_n(&q->shutdown, __ATOMIC_SEQ_CST)) {
+            timed_wait(&q->work_cond, &q->lock, 10000);
+        }
+        __atomic_sub_fetch(&q->n_sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+    fdb_codec_thread_cleanup();
+    free(w);
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_outq_create
+ *  Description:  Creates queues for n_streams output files and starts
+ *                  n_writers threads to drain them. mem_bytes worth of
+ *                  blocks are allocated up front and never exceeded; with
+ *                  no writers, writes go straight to the files. If
+ *                  stream_node isn't NULL, it gives each stream a NUMA
+ *                  node, and writers are pinned to the nodes in turn and
+ *                  write their own node's streams first.
+ * Return Value:  fdb_outq_t *: the queue, or NULL on failure
+ * ============================================================================
+ */
+fdb_outq_t *
+fdb_outq_create (fdb_ofile_t **fps, size_t n_streams, int n_writers,
+                 size_t mem_bytes, const int *stream_node)
+{
+    fdb_outq_t *q = km_calloc(1, sizeof(*q), &km_onerr_print);
+    if (q == NULL) return NULL;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work_cond, NULL);
+    pthread_cond_init(&q->free_cond, NULL);
+    q->n_streams = n_streams;
+    q->n_writers = n_writers > 0 ? n_writers : 0;
+    q->streams = km_calloc(n_streams, sizeof(*q->streams), &km_onerr_print);
+    if (q->streams == NULL) goto fail;
+    for (size_t sss = 0; sss < n_streams; sss++) {
+        q->streams[sss].fp = fps[sss];
+    }
+    if (q->n_writers == 0) return q;
+    if (stream_node != NULL && fdb_numa_nodes() > 1) {
+        q->n_nodes = fdb_numa_nodes();
+        q->stream_node = km_calloc(n_streams, sizeof(*q->stream_node),
+                &km_onerr_print);
+        if (q->stream_node == NULL) goto fail;
+        for (size_t sss = 0; sss < n_streams; sss++) {
+            q->stream_node[sss] = stream_node[sss] % q->n_nodes;
+        }
+    }
+    for (size_t sss = 0; sss < n_streams; sss++) {
+        if (ring_init(&q->streams[sss].ring, FDB_OUTQ_RING_SLOTS)) goto fail;
+    }
+    q->n_blocks = mem_bytes / FDB_OUTQ_BLOCK_SIZE;
+    if (q->n_blocks < 2 * (size_t)q->n_writers) {
+        q->n_blocks = 2 * q->n_writers;
+    }
+    if (ring_init(&q->free_blocks, q->n_blocks)) goto fail;
+    q->blocks = km_calloc(q->n_blocks, sizeof(*q->blocks), &km_onerr_print);
+    if (q->blocks == NULL) goto fail;
+    for (size_t bbb = 0; bbb < q->n_blocks; bbb++) {
+        q->blocks[bbb].cap = FDB_OUTQ_BLOCK_SIZE;
+        q->blocks[bbb].data = km_malloc(FDB_OUTQ_BLOCK_SIZE, &km_onerr_print);
+        if (q->blocks[bbb].data == NULL) goto fail;
+        ring_push(&q->free_blocks, &q->blocks[bbb]);
+    }
+    q->writers = km_calloc(q->n_writers, sizeof(*q->writers), &km_onerr_print);
+    if (q->writers == NULL) goto fail;
+    for (int www = 0; www < q->n_writers; www++) {
+        writer_arg_t *arg = km_calloc(1, sizeof(*arg), &km_onerr_print);
+        if (arg != NULL) {
+            arg->q = q;
+            arg->id = www;
+        }
+        if (arg == NULL || \
+                pthread_create(&q->writers[www], NULL, writer_main, arg)) {
+            /* Stop the writers started so far */
+            free(arg);
+            q->n_writers = www;
+            fdb_outq_destroy(q);
+            return NULL;
+        }
+    }
+    return q;
+fail:
+    q->n_writers = 0;
+    fdb_outq_destroy(q);
+    return NULL;
+} /* -----  end of function fdb_outq_create  ----- */
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_outq_set_file_mem
+ *  Description:  Caps the buffers the output files hold all together. Set
+ *                  before anything is written. Files are parked to stay
+ *                  under it, but each file being written may go over, so
+ *                  allow a file's worth per writer, and one more.
+ * ============================================================================
+ */
+void
+fdb_outq_set_file_mem (fdb_outq_t *q, size_t cap)
+{
+    q->file_mem_cap = cap;
+    q->file_mem = 0;
+    for (size_t sss = 0; sss < q->n_streams && cap > 0; sss++) {
+        q->streams[sss].mem = fdb_ofile_mem(q->streams[sss].fp);
+        q->file_mem += q->streams[sss].mem;
+    }
+}
+
+fdb_outq_producer_t *
+fdb_outq_producer_new (fdb_outq_t *q)
+{
+    fdb_outq_producer_t *p = km_calloc(1, sizeof(*p), &km_onerr_print);
+    if (p == NULL) return NULL;
+    p->q = q;
+    p->cur = km_calloc(q->n_streams, sizeof(*p->cur), &km_onerr_print);
+    if (p->cur == NULL) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+static void
+push_block (fdb_outq_t *q, size_t stream, fdb_outblk_t *blk)
+{
+    /* A full ring only drains, so backing off here cannot deadlock */
+    while (ring_push(&q->streams[stream].ring, blk)) {
+        sched_yield();
+    }
+    __atomic_add_fetch(&q->work_gen, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->n_sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->work_cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  get_block
+ *  Description:  Takes an empty block from the pool. When the pool is dry
+ *                  the producer first hands over its own partial blocks, so
+ *                  that every block is either queued or being written, then
+ *                  sleeps until a writer recycles one.
+ * ============================================================================
+ */
+static fdb_outblk_t *
+get_block (fdb_outq_producer_t *p)
+{
+    fdb_outq_t *q = p->q;
+    fdb_outblk_t *blk = NULL;
+    int flushed = 0;
+    while (1) {
+        uint64_t gen = __atomic_load_n(&q->free_gen, __ATOMIC_SEQ_CST);
+        blk = ring_pop(&q->free_blocks);
+        if (blk != NULL) break;
+        if (!flushed) {
+            fdb_outq_flush(p);
+            flushed = 1;
+            continue;
+        }
+        pthread_mutex_lock(&q->lock);
+        __atomic_add_fetch(&q->n_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->free_gen, __ATOMIC_SEQ_CST) == gen) {
+            timed_wait(&q->free_cond, &q->lock, 1000);
+        }
+        __atomic_sub_fetch(&q->n_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+    __atomic_add_fetch(&q->blocks_out, 1, __ATOMIC_SEQ_CST);
+    return blk;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_outq_reserve
+ *  Description:  Returns space for len bytes (whole records) at the end of a
+ *                  stream's current block, queueing the block for the
+ *                  writers first if it is too full. The caller fills it in
+ *                  and calls fdb_outq_commit() before anything else touches
+ *                  the producer.
+ * Return Value:  char *: space for len bytes, or NULL on failure
+ * ============================================================================
+ */
+char *
+fdb_outq_reserve (fdb_outq_producer_t *p, size_t stream, size_t len)
+{
+    fdb_outq_t *q = p->q;
+    fdb_outblk_t *blk = NULL;
+    if (q->n_writers == 0) {
+        /* Written straight to the file on commit */
+        if (len > p->scratch_cap) {
+            char *grown = km_realloc(p->scratch, len, &km_onerr_print);
+            if (grown == NULL) return NULL;
+            p->scratch = grown;
+            p->scratch_cap = len;
+        }
+        return p->scratch;
+    }
+    blk = p->cur[stream];
+    if (blk != NULL && blk->len + len > blk->cap) {
+        push_block(q, stream, blk);
+        blk = p->cur[stream] = NULL;
+    }
+    if (blk == NULL) {
+        blk = p->cur[stream] = get_block(p);
+    }
+    if (len > blk->cap) {
+        /* Oversized record: grow this block to hold it */
+        char *grown = km_realloc(blk->data, len, &km_onerr_print);
+        if (grown == NULL) return NULL;
+        blk->data = grown;
+        blk->cap = len;
+    }
+    return blk->data + blk->len;
+}
+
+/* Adds len bytes written to the space from fdb_outq_reserve() to the
+ * stream. Returns 0 on success, 1 if a write has failed. */
+int
+fdb_outq_commit (fdb_outq_producer_t *p, size_t stream, size_t len)
+{
+    fdb_outq_t *q = p->q;
+    if (q->n_writers == 0) {
+        return fdb_ofile_write(q->streams[stream].fp, p->scratch, len) || \
+                govern_files(q, &q->streams[stream]);
+    }
+    p->cur[stream]->len += len;
+    return __atomic_load_n(&q->error, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_outq_write
+ *  Description:  Appends data (whole records) to a stream's current block,
+ *                  queueing the block for the writers once it is full.
+ * Return Value:  int: 0 on success, 1 if a write has failed
+ * ============================================================================
+ */
+int
+fdb_outq_write (fdb_outq_producer_t *p, size_t stream, const char *data,
+                size_t len)
+{
+    char *dest = NULL;
+    if (p->q->n_writers == 0) {
+        return fdb_ofile_write(p->q->streams[stream].fp, data, len) || \
+                govern_files(p->q, &p->q->streams[stream]);
+    }
+    dest = fdb_outq_reserve(p, stream, len);
+    if (dest == NULL) return 1;
+    memcpy(dest, data, len);
+    return fdb_outq_commit(p, stream, len);
+}
+
+/* Queues all of a producer's partial blocks */
+int
+fdb_outq_flush (fdb_outq_producer_t *p)
+{
+    for (size_t sss = 0; sss < p->q->n_streams; sss++) {
+        if (p->cur[sss] != NULL) {
+            push_block(p->q, sss, p->cur[sss]);
+            p->cur[sss] = NULL;
+        }
+    }
+    return __atomic_load_n(&p->q->error, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_outq_wait
+ *  Description:  Waits until every queued block has been written. Producers
+ *                  must have flushed first. Afterwards the output files may
+ *                  be used directly (e.g. flushed for a checkpoint) until the
+ *                  next write.
+ * Return Value:  int: 0 on success, 1 if a write has failed
+ * ============================================================================
+ */
+int
+fdb_outq_wait (fdb_outq_t *q)
+{
+    while (__atomic_load_n(&q->blocks_out, __ATOMIC_SEQ_CST) > 0) {
+        uint64_t gen = __atomic_load_n(&q->free_gen, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&q->lock);
+        __atomic_add_fetch(&q->n_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->free_gen, __ATOMIC_SEQ_CST) == gen && \
+                __atomic_load_n(&q->blocks_out, __ATOMIC_SEQ_CST) > 0) {
+            timed_wait(&q->free_cond, &q->lock, 1000);
+        }
+        __atomic_sub_fetch(&q->n_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return __atomic_load_n(&q->error, __ATOMIC_SEQ_CST);
+}
+
+void
+fdb_outq_producer_destroy (fdb_outq_producer_t *p)
+{
+    if (p == NULL) return;
+    fdb_outq_flush(p);
+    free(p->cur);
+    free(p->scratch);
+    free(p);
+}
+
+/* Writes everything still queued, stops the writers and frees the queue.
+ * The output files themselves are left open. */
+int
+fdb_outq_destroy (fdb_outq_t *q)
+{
+    int ret = 0;
+    if (q == NULL) return 0;
+    if (q->n_writers > 0) {
+        ret = fdb_outq_wait(q);
+        pthread_mutex_lock(&q->lock);
+        __atomic_store_n(&q->shutdown, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_broadcast(&q->work_cond);
+        pthread_mutex_unlock(&q->lock);
+        for (int www = 0; www < q->n_writers; www++) {
+            pthread_join(q->writers[www], NULL);
+        }
+    }
+    if (q->streams != NULL) {
+        for (size_t sss = 0; sss < q->n_streams; sss++) {
+            km_free(q->streams[sss].ring.cells, &km_onerr_nil);
+        }
+        free(q->streams);
+    }
+    if (q->blocks != NULL) {
+        for (size_t bbb = 0; bbb < q->n_blocks; bbb++) {
+            km_free(q->blocks[bbb].data, &km_onerr_nil);
+        }
+        free(q->blocks);
+    }
+    km_free(q->free_blocks.cells, &km_onerr_nil);
+    km_free(q->writers, &km_onerr_nil);
+    km_free(q->stream_node, &km_onerr_nil);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->work_cond);
+    pthread_cond_destroy(&q->free_cond);
+    ret |= q->error;
+    free(q);
+    return ret;
+}
@@ -0,0 +1,121 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_outq.h
+ *
+ *    Description:  Threaded output: per-stream lock-free queues of record
+ *                      blocks, drained by a pool of writer threads
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 16:02:17
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_OUTQ_H
+#define FDB_OUTQ_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "kdm.h"
+#include "fdb_codec.h"
+
+/* Bytes of records batched before a block is handed to the writers */
+#define FDB_OUTQ_BLOCK_SIZE (64u << 10)
+/* Default total size of all blocks, which bounds the queues' memory */
+#define FDB_OUTQ_MEM_DEFAULT (64u << 20)
+/* Slots in each stream's ring; producers back off when one is full */
+#define FDB_OUTQ_RING_SLOTS 256
+/* Blocks a writer takes from a stream before looking elsewhere */
+#define FDB_OUTQ_DRAIN_MAX 16
+#define FDB_OUTQ_CACHELINE 64
+
+typedef struct __fdb_outblk_t {
+    char *data;
+    size_t len;
+    size_t cap;
+} fdb_outblk_t;
+
+typedef struct __fdb_ring_cell_t {
+    uint64_t seq;
+    void *data;
+} fdb_ring_cell_t;
+
+/* Bounded lock-free queue (D. Vyukov's array queue). Safe for many
+ * producers and many consumers; per-stream rings get one consumer at a
+ * time via fdb_outstream_t.busy, which keeps blocks in order. */
+typedef struct __fdb_ring_t {
+    fdb_ring_cell_t *cells;
+    uint64_t mask;
+    char pad0[FDB_OUTQ_CACHELINE];
+    uint64_t tail;
+    char pad1[FDB_OUTQ_CACHELINE];
+    uint64_t head;
+    char pad2[FDB_OUTQ_CACHELINE];
+} fdb_ring_t;
+
+typedef struct __fdb_outstream_t {
+    fdb_ring_t ring;
+    fdb_ofile_t *fp;
+    int busy;
+    /* With a cap on files' buffers: fp's, and when it was last written */
+    size_t mem;
+    uint64_t last_use;
+} fdb_outstream_t;
+
+typedef struct __fdb_outq_t {
+    fdb_outstream_t *streams;
+    size_t n_streams;
+    fdb_ring_t free_blocks;
+    fdb_outblk_t *blocks;
+    size_t n_blocks;
+    uint64_t blocks_out;        /* taken from free_blocks, not yet back */
+    int n_writers;
+    pthread_t *writers;
+    int *stream_node;           /* NULL unless sharded across NUMA nodes */
+    int n_nodes;
+    /* Sleeping writers/producers wait for these generations to change */
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t free_cond;
+    uint64_t work_gen;
+    uint64_t free_gen;
+    int n_sleeping;
+    int n_waiting;
+    int shutdown;
+    int error;
+    /* Output files' buffers, and the most they may take; 0 for no cap */
+    size_t file_mem;
+    size_t file_mem_cap;
+    uint64_t file_tick;
+    uint64_t n_parked;
+} fdb_outq_t;
+
+/* A producer's partially filled block for each stream. One per producing
+ * thread. */
+typedef struct __fdb_outq_producer_t {
+    fdb_outq_t *q;
+    fdb_outblk_t **cur;
+    char *scratch;              /* fdb_outq_reserve() space without writers */
+    size_t scratch_cap;
+} fdb_outq_producer_t;
+
+fdb_outq_t *fdb_outq_create (fdb_ofile_t **fps, size_t n_streams, int n_writers,
+                             size_t mem_bytes, const int *stream_node);
+void fdb_outq_set_file_mem (fdb_outq_t *q, size_t cap);
+fdb_outq_producer_t *fdb_outq_producer_new (fdb_outq_t *q);
+char *fdb_outq_reserve (fdb_outq_producer_t *p, size_t stream, size_t len);
+int fdb_outq_commit (fdb_outq_producer_t *p, size_t stream, size_t len);
+int fdb_outq_write (fdb_outq_producer_t *p, size_t stream, const char *data,
+                    size_t len);
+int fdb_outq_flush (fdb_outq_producer_t *p);
+int fdb_outq_wait (fdb_outq_t *q);
+void fdb_outq_producer_destroy (fdb_outq_producer_t *p);
+int fdb_outq_destroy (fdb_outq_t *q);
+
+#endif /* FDB_OUTQ_H */
@@ -0,0 +1,348 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_rescue.c
+ *
+ *    Description:  Second chance for leftover reads, matched with error
+ *                      rates learnt from the reads that were assigned
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 19:12:40
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kdm.h"
+#include "fdb_rescue.h"
+
+/* Whether a read's base says anything: N, or anything else, is as likely
+ * from any barcode as from none */
+static inline int
+is_base (char c)
+{
+    return c == 'A' || c == 'C' || c == 'G' || c == 'T';
+}
+
+/* Opens an anonymous temporary file in $TMPDIR, or /tmp */
+static FILE *
+spill_open (void)
+{
+    const char *dir = getenv("TMPDIR");
+    char *fn = NULL;
+    FILE *fp = NULL;
+    int fd = -1;
+    if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+    fn = km_calloc(strlen(dir) + 32, 1, &km_onerr_print);
+    if (fn == NULL) return NULL;
+    sprintf(fn, "%s/fdb_rescue_XXXXXX", dir);
+    fd = mkstemp(fn);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not make a temporary file in '%s': %s\n",
+                dir, strerror(errno));
+        free(fn);
+        return NULL;
+    }
+    /* Gone once closed, however we exit */
+    unlink(fn);
+    free(fn);
+    fp = fdopen(fd, "w+b");
+    if (fp == NULL) {
+        close(fd);
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    return fp;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rescue_new
+ *  Description:  Makes an untrained rescue stage for m's barcodes, with its
+ *                  spill file.
+ * Return Value:  fdb_rescue_t *: the stage, or NULL on failure
+ * ============================================================================
+ */
+fdb_rescue_t *
+fdb_rescue_new (const fdb_matcher_t *m, double min_prob)
+{
+    fdb_rescue_t *r = km_calloc(1, sizeof(*r), &km_onerr_print);
+    if (r == NULL) return NULL;
+    r->min_prob = min_prob;
+    r->n_pos = m->max_len;
+    r->len_reads = km_calloc(r->n_pos + 1, sizeof(*r->len_reads),
+            &km_onerr_print);
+    r->pos_errs = km_calloc(r->n_pos + 1, sizeof(*r->pos_errs),
+            &km_onerr_print);
+    r->pos_skips = km_calloc(r->n_pos + 1, sizeof(*r->pos_skips),
+            &km_onerr_print);
+    r->bcd_reads = km_calloc(m->n_barcodes + 1, sizeof(*r->bcd_reads),
+            &km_onerr_print);
+    r->exp_bases = km_calloc(r->n_pos + 1, sizeof(*r->exp_bases),
+            &km_onerr_print);
+    r->exp_errs = km_calloc(r->n_pos + 1, sizeof(*r->exp_errs),
+            &km_onerr_print);
+    r->exp_reads = km_calloc(m->n_barcodes + 1, sizeof(*r->exp_reads),
+            &km_onerr_print);
+    r->log_ok = km_calloc(r->n_pos + 1, sizeof(*r->log_ok), &km_onerr_print);
+    r->log_err = km_calloc(r->n_pos + 1, sizeof(*r->log_err),
+            &km_onerr_print);
+    r->log_prior = km_calloc(m->n_barcodes + 1, sizeof(*r->log_prior),
+            &km_onerr_print);
+    r->lls = km_calloc(m->n_barcodes + 1, sizeof(*r->lls), &km_onerr_print);
+    if (r->len_reads == NULL || r->pos_errs == NULL || \
+            r->pos_skips == NULL || r->bcd_reads == NULL || \
+            r->exp_bases == NULL || r->exp_errs == NULL || \
+            r->exp_reads == NULL || r->log_ok == NULL || \
+            r->log_err == NULL || r->log_prior == NULL || r->lls == NULL || \
+            (r->spill = spill_open()) == NULL) {
+        fdb_rescue_destroy(r);
+        return NULL;
+    }
+    return r;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rescue_learn
+ *  Description:  Counts a read from the first pass towards the error model
+ *                  and the barcodes' priors. Call for every read. As in
+ *                  fdb_rescue_assign(), positions where the read has no
+ *                  base (an N, or its end) are left out.
+ * ============================================================================
+ */
+void
+fdb_rescue_learn (fdb_rescue_t *r, const fdb_matcher_t *m, const char *seq,
+                  size_t len, int bcd, size_t mismatches)
+{
+    const char *bseq = NULL;
+    size_t blen = 0;
+    if (bcd == FDB_NO_MATCH) {
+        r->n_leftover++;
+        return;
+    }
+    bseq = m->seqs[bcd];
+    blen = m->lens[bcd];
+    r->bcd_reads[bcd]++;
+    r->len_reads[blen]++;
+    /* Exact matches only need counting */
+    if (mismatches == 0) return;
+    for (size_t iii = 0; iii < blen; iii++) {
+        if (iii >= len || !is_base(seq[iii])) {
+            r->pos_skips[iii]++;
+        } else if (seq[iii] != bseq[iii]) {
+            r->pos_errs[iii]++;
+        }
+    }
+}
+
+/* How much a log rate or prior moved */
+static inline double
+moved (double from, double to)
+{
+    return fabs(to - from);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rescue_fit
+ *  Description:  Turns what fdb_rescue_learn() counted, and what
+ *                  fdb_rescue_expect() has since, into error rates and
+ *                  priors. Rates are smoothed, so positions seen in few
+ *                  reads get rates near a half, and so little weight.
+ * Return Value:  int: 1 if no rate or prior moved by more than
+ *                  FDB_RESCUE_SETTLED, 0 otherwise
+ * ============================================================================
+ */
+int
+fdb_rescue_fit (fdb_rescue_t *r, const fdb_matcher_t *m)
+{
+    double seen = 0, none = r->n_leftover, total = 0, most = 0;
+    if (r->n_expected > 0) {
+        /* Leftovers are only no barcode's as far as they're likely to be */
+        none = r->exp_reads[m->n_barcodes];
+        r->n_rounds++;
+    }
+    total = none + m->n_barcodes + 1.0;
+    /* Reads with barcodes longer than a position cover it */
+    for (size_t pos = r->n_pos; pos-- > 0; ) {
+        double err = 0, bases = 0;
+        seen += r->len_reads[pos + 1];
+        bases = seen - r->pos_skips[pos] + r->exp_bases[pos];
+        err = (r->pos_errs[pos] + r->exp_errs[pos] + 1.0) / (bases + 2.0);
+        if (err < FDB_RESCUE_MIN_ERR) err = FDB_RESCUE_MIN_ERR;
+        if (err > FDB_RESCUE_MAX_ERR) err = FDB_RESCUE_MAX_ERR;
+        most = fmax(most, moved(r->log_err[pos], log(err / 3.0)));
+        r->log_ok[pos] = log(1.0 - err);
+        r->log_err[pos] = log(err / 3.0);
+    }
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        total += r->bcd_reads[bbb] + r->exp_reads[bbb];
+    }
+    /* Before any rounds, leftovers include the reads to be rescued, so
+     * this overstates how many are no barcode's */
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        double prior = log((r->bcd_reads[bbb] + r->exp_reads[bbb] + 1.0) / \
+                total);
+        most = fmax(most, moved(r->log_prior[bbb], prior));
+        r->log_prior[bbb] = prior;
+    }
+    most = fmax(most, moved(r->log_prior_none, log((none + 1.0) / total)));
+    r->log_prior_none = log((none + 1.0) / total);
+    memset(r->exp_bases, 0, r->n_pos * sizeof(*r->exp_bases));
+    memset(r->exp_errs, 0, r->n_pos * sizeof(*r->exp_errs));
+    memset(r->exp_reads, 0, (m->n_barcodes + 1) * sizeof(*r->exp_reads));
+    r->n_expected = 0;
+    return most < log1p(FDB_RESCUE_SETTLED);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  read_lls
+ *  Description:  Log likelihoods of a read, with its prior: each barcode
+ *                  explains the read's first max_len bases, its own with
+ *                  the error rates, and those past it as random bases, as
+ *                  does the hypothesis that the read has no barcode. Bases
+ *                  other than ACGT are left out, as they favour none of
+ *                  these. Barcodes whose buffer sequence doesn't match
+ *                  are skipped, as by the matcher, and get -INFINITY.
+ * Return Value:  double: the largest, with barcodes' in r->lls, no
+ *                  barcode's in *none, and the likeliest barcode (or
+ *                  FDB_NO_MATCH if none is likelier) in *best_bcd
+ * ============================================================================
+ */
+static double
+read_lls (const fdb_rescue_t *r, const fdb_matcher_t *m, const char *seq,
+          size_t len, double *none, int *best_bcd)
+{
+    const double log_random = log(0.25);
+    size_t span = r->n_pos < len ? r->n_pos : len;
+    size_t n_bases = 0;
+    double best = 0;
+    for (size_t iii = 0; iii < span; iii++) {
+        n_bases += is_base(seq[iii]);
+    }
+    best = *none = r->log_prior_none + n_bases * log_random;
+    *best_bcd = FDB_NO_MATCH;
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        const char *bseq = m->seqs[bbb];
+        size_t blen = m->lens[bbb];
+        size_t cmp = blen < len ? blen : len;
+        double ll = r->log_prior[bbb];
+        size_t n_own = 0;
+        r->lls[bbb] = -INFINITY;
+        if (m->buffer_seq != NULL && fdb_hamming_max(m->buffer_seq,
+                    m->buffer_len, seq + cmp, len - cmp,
+                    m->max_buffer_mismatches + 1) > \
+                (size_t)m->max_buffer_mismatches) continue;
+        for (size_t iii = 0; iii < cmp; iii++) {
+            if (!is_base(seq[iii])) continue;
+            ll += seq[iii] == bseq[iii] ? r->log_ok[iii] : r->log_err[iii];
+            n_own++;
+        }
+        /* The rest of the first max_len bases are random */
+        ll += (n_bases - n_own) * log_random;
+        r->lls[bbb] = ll;
+        if (ll > best) {
+            best = ll;
+            *best_bcd = bbb;
+        }
+    }
+    return best;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rescue_expect
+ *  Description:  Counts a leftover read towards the next fdb_rescue_fit(),
+ *                  shared between the barcodes, and no barcode, by how
+ *                  likely it is theirs under the current fit. One round is
+ *                  a call for every spilled read, then a fit.
+ * ============================================================================
+ */
+void
+fdb_rescue_expect (fdb_rescue_t *r, const fdb_matcher_t *m, const char *seq,
+                   size_t len)
+{
+    double none = 0, sum = 0;
+    int best_bcd = FDB_NO_MATCH;
+    double best = read_lls(r, m, seq, len, &none, &best_bcd);
+    sum = exp(none - best);
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        sum += exp(r->lls[bbb] - best);
+    }
+    r->exp_reads[m->n_barcodes] += exp(none - best) / sum;
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        const char *bseq = m->seqs[bbb];
+        size_t cmp = m->lens[bbb] < len ? m->lens[bbb] : len;
+        double w = exp(r->lls[bbb] - best) / sum;
+        r->exp_reads[bbb] += w;
+        /* Too unlikely to move the rates */
+        if (w < 1e-9) continue;
+        for (size_t iii = 0; iii < cmp; iii++) {
+            if (!is_base(seq[iii])) continue;
+            r->exp_bases[iii] += w;
+            if (seq[iii] != bseq[iii]) r->exp_errs[iii] += w;
+        }
+    }
+    r->n_expected++;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_rescue_assign
+ *  Description:  Gives a leftover read its most probable barcode (see
+ *                  read_lls()), if that is at least min_prob probable.
+ *                  Ns are left out, so reads with them can be rescued.
+ * Return Value:  int: the barcode, or FDB_NO_MATCH. The barcode's
+ *                  mismatches are stored in *mismatches.
+ * ============================================================================
+ */
+int
+fdb_rescue_assign (const fdb_rescue_t *r, const fdb_matcher_t *m,
+                   const char *seq, size_t len, size_t *mismatches)
+{
+    double none = 0, sum = 0;
+    int best_bcd = FDB_NO_MATCH;
+    double best = read_lls(r, m, seq, len, &none, &best_bcd);
+    /* Posterior of the best, relative to it to stay in range */
+    sum = exp(none - best);
+    for (size_t bbb = 0; bbb < m->n_barcodes; bbb++) {
+        sum += exp(r->lls[bbb] - best);
+    }
+    if (best_bcd == FDB_NO_MATCH || 1.0 / sum < r->min_prob) {
+        return FDB_NO_MATCH;
+    }
+    *mismatches = fdb_hamming_max(m->seqs[best_bcd], m->lens[best_bcd], seq,
+            len, SIZE_MAX);
+    return best_bcd;
+}
+
+void
+fdb_rescue_destroy (fdb_rescue_t *r)
+{
+    if (r == NULL) return;
+    if (r->spill != NULL) fclose(r->spill);
+    free(r->len_reads);
+    free(r->pos_errs);
+    free(r->pos_skips);
+    free(r->bcd_reads);
+    free(r->exp_bases);
+    free(r->exp_errs);
+    free(r->exp_reads);
+    free(r->lls);
+    free(r->log_ok);
+    free(r->log_err);
+    free(r->log_prior);
+    free(r);
+}
@@ -0,0 +1,81 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_rescue.h
+ *
+ *    Description:  Second chance for leftover reads, matched with error
+ *                      rates learnt from the reads that were assigned
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 19:12:40
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_RESCUE_H
+#define FDB_RESCUE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fdb_match.h"
+
+/* Error rates are kept within these, so one base never decides a read */
+#define FDB_RESCUE_MIN_ERR 1e-4
+#define FDB_RESCUE_MAX_ERR 0.5
+/* Most rounds of fitting to the leftovers, and the change in any rate or
+ * prior (as a ratio) under which the fit has settled */
+#define FDB_RESCUE_ROUNDS 10
+#define FDB_RESCUE_SETTLED 0.01
+
+/* Leftovers are spilled to a temporary file while assigned reads teach the
+ * error model, then given a posterior probability for each barcode (and
+ * for being no barcode's read). A read is rescued if one barcode's is at
+ * least min_prob.
+ *
+ * Assigned reads have fewer than max_mismatches errors, so alone they
+ * understate the error rates, and most of all for the reads worth
+ * rescuing. The model is refit by EM: each round, every leftover counts
+ * towards each barcode (and no barcode) as much as it's likely theirs. */
+typedef struct __fdb_rescue_t {
+    double min_prob;
+    size_t n_pos;
+    uint64_t *len_reads;        /* assigned reads by barcode length */
+    uint64_t *pos_errs;         /* their mismatches by position */
+    uint64_t *pos_skips;        /* their positions with no base (N or past
+                                   the read's end) */
+    uint64_t *bcd_reads;        /* assigned reads by barcode */
+    uint64_t n_leftover;
+    /* Leftovers' expected counts, from fdb_rescue_expect() */
+    double *exp_bases;          /* by position */
+    double *exp_errs;
+    double *exp_reads;          /* by barcode, then none */
+    uint64_t n_expected;        /* leftovers counted since the last fit */
+    int n_rounds;               /* fits to the leftovers so far */
+    /* From fdb_rescue_fit() */
+    double *log_ok;             /* log P(base is right), by position */
+    double *log_err;            /* log P(base is a given wrong one) */
+    double *log_prior;          /* by barcode */
+    double log_prior_none;
+    double *lls;                /* scratch, by barcode */
+    FILE *spill;
+    uint64_t n_spilled;
+    uint64_t n_rescued;
+} fdb_rescue_t;
+
+fdb_rescue_t *fdb_rescue_new (const fdb_matcher_t *m, double min_prob);
+void fdb_rescue_learn (fdb_rescue_t *r, const fdb_matcher_t *m,
+                       const char *seq, size_t len, int bcd,
+                       size_t mismatches);
+int fdb_rescue_fit (fdb_rescue_t *r, const fdb_matcher_t *m);
+void fdb_rescue_expect (fdb_rescue_t *r, const fdb_matcher_t *m,
+                        const char *seq, size_t len);
+int fdb_rescue_assign (const fdb_rescue_t *r, const fdb_matcher_t *m,
+                       const char *seq, size_t len, size_t *mismatches);
+void fdb_rescue_destroy (fdb_rescue_t *r);
+
+#endif /* FDB_RESCUE_H */
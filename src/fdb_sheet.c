@@ -0,0 +1,646 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_sheet.c
+ *
+ *    Description:  Sample sheets: many demultiplexing jobs run by one
+ *                      process, sharing threads, I/O and barcode matchers
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 09:42:17
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <sys/stat.h>
+
+#include "fdb_sheet.h"
+#include "fdb_batch.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t
+fnv1a (uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t iii = 0; iii < len; iii++) {
+        hash = (hash ^ p[iii]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t
+barcode_set_hash (const char **seqs, size_t n_seqs, int max_mismatches,
+                  const char *buffer_seq, int max_buffer_mismatches)
+{
+    uint64_t hash = FNV_OFFSET;
+    for (size_t bbb = 0; bbb < n_seqs; bbb++) {
+        hash = fnv1a(hash, seqs[bbb], strlen(seqs[bbb]) + 1);
+    }
+    if (buffer_seq != NULL) {
+        hash = fnv1a(hash, buffer_seq, strlen(buffer_seq) + 1);
+    }
+    hash = fnv1a(hash, &max_mismatches, sizeof(max_mismatches));
+    return fnv1a(hash, &max_buffer_mismatches, sizeof(max_buffer_mismatches));
+}
+
+static int
+mcache_entry_is (const fdb_mcache_entry_t *ent, const char **seqs,
+                 size_t n_seqs, int max_mismatches, const char *buffer_seq,
+                 int max_buffer_mismatches)
+{
+    if (ent->n_seqs != n_seqs || ent->max_mismatches != max_mismatches || \
+            ent->max_buffer_mismatches != max_buffer_mismatches) return 0;
+    if ((ent->buffer_seq == NULL) != (buffer_seq == NULL)) return 0;
+    if (buffer_seq != NULL && strcmp(ent->buffer_seq, buffer_seq) != 0) {
+        return 0;
+    }
+    for (size_t bbb = 0; bbb < n_seqs; bbb++) {
+        if (strcmp(ent->seqs[bbb], seqs[bbb]) != 0) return 0;
+    }
+    return 1;
+}
+
+static void
+mcache_entry_destroy (fdb_mcache_entry_t *ent)
+{
+    if (ent == NULL) return;
+    for (size_t bbb = 0; ent->seqs != NULL && bbb < ent->n_seqs; bbb++) {
+        free(ent->seqs[bbb]);
+    }
+    free(ent->seqs);
+    free(ent->buffer_seq);
+    fdb_matcher_destroy(ent->matcher);
+    free(ent);
+}
+
+/* Adds matcher to the cache, which takes ownership of it. Call with the
+ * lock held. */
+static int
+mcache_add (fdb_mcache_t *mc, fdb_matcher_t *matcher, uint64_t hash)
+{
+    fdb_mcache_entry_t *ent = km_calloc(1, sizeof(*ent), &km_onerr_print);
+    if (ent == NULL) return 1;
+    ent->matcher = matcher;
+    ent->seqs = km_calloc(matcher->n_barcodes + 1, sizeof(*ent->seqs),
+            &km_onerr_print);
+    if (ent->seqs == NULL) {
+        ent->matcher = NULL;
+        mcache_entry_destroy(ent);
+        return 1;
+    }
+    ent->n_seqs = matcher->n_barcodes;
+    for (size_t bbb = 0; bbb < ent->n_seqs; bbb++) {
+        ent->seqs[bbb] = strdup(matcher->seqs[bbb]);
+    }
+    if (matcher->buffer_seq != NULL) {
+        ent->buffer_seq = strdup(matcher->buffer_seq);
+    }
+    ent->hash = hash;
+    ent->max_mismatches = matcher->max_mismatches;
+    ent->max_buffer_mismatches = matcher->max_buffer_mismatches;
+    ent->next = mc->entries;
+    mc->entries = ent;
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_mcache_get
+ *  Description:  Returns the matcher for a barcode set, building it the
+ *                  first time the set is asked for. Sets are looked up by
+ *                  hash and then compared in full, so barcode order matters
+ *                  (as it does to the matcher). The cache owns the matcher.
+ * Return Value:  fdb_matcher_t *: the matcher, or NULL on failure
+ * ============================================================================
+ */
+fdb_matcher_t *
+fdb_mcache_get (fdb_mcache_t *mc, const char **seqs, size_t n_seqs,
+                int max_mismatches, const char *buffer_seq,
+                int max_buffer_mismatches)
+{
+    uint64_t hash = barcode_set_hash(seqs, n_seqs, max_mismatches, buffer_seq,
+            max_buffer_mismatches);
+    fdb_mcache_entry_t *ent = NULL;
+    fdb_matcher_t *matcher = NULL;
+    /* Held while building, so a set is only ever built once */
+    pthread_mutex_lock(&mc->lock);
+    for (ent = mc->entries; ent != NULL; ent = ent->next) {
+        if (ent->hash == hash && mcache_entry_is(ent, seqs, n_seqs,
+                    max_mismatches, buffer_seq, max_buffer_mismatches)) {
+            mc->hits++;
+            matcher = ent->matcher;
+            goto exit;
+        }
+    }
+    matcher = fdb_matcher_new(seqs, n_seqs, max_mismatches, buffer_seq,
+            max_buffer_mismatches);
+    if (matcher == NULL) goto exit;
+    if (n_seqs >= FDB_MATCHER_INDEX_MIN) {
+        fdb_matcher_compile(matcher);
+    }
+    if (mcache_add(mc, matcher, hash) != 0) {
+        fdb_matcher_destroy(matcher);
+        matcher = NULL;
+        goto exit;
+    }
+    mc->misses++;
+exit:
+    pthread_mutex_unlock(&mc->lock);
+    return matcher;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_mcache_put
+ *  Description:  Adds a matcher made elsewhere (e.g. loaded from an index)
+ *                  to the cache, for jobs with its barcode set to use. The
+ *                  cache takes ownership of it.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_mcache_put (fdb_mcache_t *mc, fdb_matcher_t *matcher)
+{
+    uint64_t hash = barcode_set_hash((const char **)matcher->seqs,
+            matcher->n_barcodes, matcher->max_mismatches, matcher->buffer_seq,
+            matcher->max_buffer_mismatches);
+    int ret = 0;
+    pthread_mutex_lock(&mc->lock);
+    ret = mcache_add(mc, matcher, hash);
+    pthread_mutex_unlock(&mc->lock);
+    return ret;
+}
+
+static fdb_sheet_job_t *
+sheet_job_for (fdb_sheet_t *sheet, const char *infn, size_t *m_jobs)
+{
+    fdb_sheet_job_t *job = NULL;
+    for (size_t jjj = 0; jjj < sheet->n_jobs; jjj++) {
+        if (strcmp(sheet->jobs[jjj].infn, infn) == 0) return &sheet->jobs[jjj];
+    }
+    if (sheet->n_jobs == *m_jobs) {
+        *m_jobs = *m_jobs ? *m_jobs << 1 : 16;
+        sheet->jobs = km_realloc(sheet->jobs, *m_jobs * sizeof(*sheet->jobs),
+                &km_onerr_print);
+        if (sheet->jobs == NULL) return NULL;
+    }
+    job = &sheet->jobs[sheet->n_jobs++];
+    memset(job, 0, sizeof(*job));
+    job->infn = strdup(infn);
+    return job;
+}
+
+/* Outputs of targets with the same prefix, or of one input's targets
+ * without prefixes, would overwrite each other */
+static int
+sheet_check_outputs (const fdb_sheet_t *sheet, const char *fn)
+{
+    for (size_t jjj = 0; jjj < sheet->n_jobs; jjj++) {
+        const fdb_sheet_job_t *job = &sheet->jobs[jjj];
+        for (size_t ttt = 0; ttt < job->n_targets; ttt++) {
+            const char *prefix = job->targets[ttt].prefix;
+            if (prefix == NULL) {
+                if (job->n_targets > 1) {
+                    fprintf(stderr, "ERROR: %s: '%s' has several barcode "
+                            "files, so each needs an output prefix\n", fn,
+                            job->infn);
+                    return 1;
+                }
+                continue;
+            }
+            for (size_t kkk = jjj; kkk < sheet->n_jobs; kkk++) {
+                const fdb_sheet_job_t *other = &sheet->jobs[kkk];
+                for (size_t uuu = (kkk == jjj ? ttt + 1 : 0);
+                        uuu < other->n_targets; uuu++) {
+                    if (other->targets[uuu].prefix != NULL && \
+                            strcmp(other->targets[uuu].prefix, prefix) == 0) {
+                        fprintf(stderr, "ERROR: %s: output prefix '%s' is "
+                                "used more than once\n", fn, prefix);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+cmp_job_size_rev (const void *left, const void *right)
+{
+    const fdb_sheet_job_t *l = left, *r = right;
+    return (l->size < r->size) - (l->size > r->size);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_sheet_load
+ *  Description:  Reads a sample sheet: tab separated lines of input file,
+ *                  barcode file and optionally an output prefix. Blank lines
+ *                  and lines starting with '#' are skipped. Jobs are sorted
+ *                  largest input first, so the longest start soonest.
+ * Return Value:  fdb_sheet_t *: the sheet, or NULL on failure
+ * ============================================================================
+ */
+fdb_sheet_t *
+fdb_sheet_load (const char *fn)
+{
+    FILE *fp = fopen(fn, "r");
+    fdb_sheet_t *sheet = NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+    size_t m_jobs = 0;
+    size_t line_no = 0;
+    if (fp == NULL) {
+        FDB_IO_ERROR(fn);
+        return NULL;
+    }
+    sheet = km_calloc(1, sizeof(*sheet), &km_onerr_print);
+    if (sheet == NULL) goto fail;
+    pthread_mutex_init(&sheet->lock, NULL);
+    pthread_mutex_init(&sheet->mcache.lock, NULL);
+    while (getline(&line, &line_cap, fp) > 0) {
+        char *rest = line;
+        char *infn = NULL, *bcdfn = NULL, *prefix = NULL;
+        fdb_sheet_job_t *job = NULL;
+        fdb_sheet_target_t *target = NULL;
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        infn = strsep(&rest, "\t");
+        bcdfn = strsep(&rest, "\t");
+        prefix = strsep(&rest, "\t");
+        if (infn[0] == '\0' || bcdfn == NULL || bcdfn[0] == '\0' || \
+                rest != NULL) {
+            fprintf(stderr, "ERROR: %s:%zu: expected <input>\\t<barcode_file>"
+                    "[\\t<output_prefix>]\n", fn, line_no);
+            goto fail;
+        }
+        job = sheet_job_for(sheet, infn, &m_jobs);
+        if (job == NULL) goto fail;
+        job->targets = km_realloc(job->targets,
+                (job->n_targets + 1) * sizeof(*job->targets), &km_onerr_print);
+        if (job->targets == NULL) goto fail;
+        target = &job->targets[job->n_targets++];
+        target->barcode_file = strdup(bcdfn);
+        target->prefix = (prefix != NULL && prefix[0] != '\0') ? \
+                         strdup(prefix) : NULL;
+    }
+    if (ferror(fp)) {
+        FDB_IO_ERROR(fn);
+        goto fail;
+    }
+    if (sheet->n_jobs == 0) {
+        fprintf(stderr, "ERROR: %s has no jobs\n", fn);
+        goto fail;
+    }
+    if (sheet_check_outputs(sheet, fn)) goto fail;
+    for (size_t jjj = 0; jjj < sheet->n_jobs; jjj++) {
+        struct stat st;
+        if (stat(sheet->jobs[jjj].infn, &st) == 0) {
+            sheet->jobs[jjj].size = st.st_size;
+        }
+    }
+    qsort(sheet->jobs, sheet->n_jobs, sizeof(*sheet->jobs), cmp_job_size_rev);
+    free(line);
+    fclose(fp);
+    return sheet;
+fail:
+    free(line);
+    fclose(fp);
+    fdb_sheet_destroy(sheet);
+    return NULL;
+}
+
+/* A job's config for one of its targets, with the sheet's options */
+static fdb_config_t *
+job_config (fdb_sheet_t *sheet, const fdb_sheet_job_t *job,
+            const fdb_sheet_target_t *target)
+{
+    const fdb_config_t *opts = sheet->opts;
+    fdb_config_t *cfg = km_calloc(1, sizeof(*cfg), &km_onerr_print);
+    if (cfg == NULL) return NULL;
+    cfg->flag = opts->flag | FLG_SHEET_JOB;
+    cfg->n_infs = 1;
+    cfg->infns = km_calloc(1, sizeof(*cfg->infns), &km_onerr_print);
+    if (cfg->infns != NULL) cfg->infns[0] = strdup(job->infn);
+    cfg->barcode_file = strdup(target->barcode_file);
+    if (target->prefix != NULL) cfg->out_prefix = strdup(target->prefix);
+    if (opts->out_dir != NULL) cfg->out_dir = strdup(opts->out_dir);
+    if (opts->out_ext != NULL) cfg->out_ext = strdup(opts->out_ext);
+    if (opts->buffer_seq != NULL) cfg->buffer_seq = strdup(opts->buffer_seq);
+    cfg->leftover_suffix = strdup(opts->leftover_suffix);
+    cfg->level = opts->level;
+    cfg->max_barcode_mismatches = opts->max_barcode_mismatches;
+    cfg->max_buffer_mismatches = opts->max_buffer_mismatches;
+    cfg->range_end = UINT64_MAX;
+    cfg->n_writers = opts->n_writers;
+    cfg->outq_mem = opts->outq_mem;
+    cfg->aio = sheet->aio;
+    cfg->mcache = &sheet->mcache;
+    if (opts->stats_file != NULL) cfg->stats_file = strdup(opts->stats_file);
+    cfg->rescue_prob = opts->rescue_prob;
+    cfg->filter_min_len = opts->filter_min_len;
+    cfg->filter_max_n = opts->filter_max_n;
+    if (opts->contam_file != NULL) {
+        cfg->contam_file = strdup(opts->contam_file);
+    }
+    cfg->contam_k = opts->contam_k;
+    cfg->max_mem = sheet->job_mem / job->n_targets;
+    return cfg;
+}
+
+/* Keeps a target's stats report for the sheet's report */
+static int
+sheet_add_report (fdb_sheet_t *sheet, const fdb_config_t *cfg)
+{
+    char *report = NULL, **reports = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&report, &len);
+    int ret = 0;
+    if (fp == NULL) return 1;
+    ret = fdb_write_stats(cfg, fp);
+    if (fclose(fp) != 0 || ret != 0) {
+        free(report);
+        return 1;
+    }
+    pthread_mutex_lock(&sheet->lock);
+    reports = km_realloc(sheet->reports,
+            (sheet->n_reports + 1) * sizeof(*reports), &km_onerr_print);
+    if (reports != NULL) {
+        sheet->reports = reports;
+        sheet->reports[sheet->n_reports++] = report;
+        report = NULL;
+    }
+    pthread_mutex_unlock(&sheet->lock);
+    free(report);
+    return reports == NULL;
+}
+
+/* Writes every target's stats report, as {"jobs": [report, ...]} */
+static int
+sheet_write_reports (const fdb_sheet_t *sheet, const char *fn)
+{
+    FILE *fp = fopen(fn, "w");
+    if (fp == NULL) {
+        FDB_IO_ERROR(fn);
+        return 1;
+    }
+    fprintf(fp, "{\"jobs\": [\n");
+    for (size_t rrr = 0; rrr < sheet->n_reports; rrr++) {
+        fprintf(fp, "%s%s", rrr ? ",\n" : "", sheet->reports[rrr]);
+    }
+    fprintf(fp, "]}\n");
+    if (ferror(fp) | (fclose(fp) != 0)) {
+        fprintf(stderr, "ERROR: Could not write stats to '%s'\n", fn);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  run_job
+ *  Description:  Reads a job's input once, splitting each batch of reads
+ *                  by every one of its targets' barcode sets.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+static int
+run_job (fdb_sheet_t *sheet, const fdb_sheet_job_t *job)
+{
+    fdb_config_t **cfgs = km_calloc(job->n_targets, sizeof(*cfgs),
+            &km_onerr_print);
+    fdb_batch_pool_t *pool = NULL;
+    fdb_batch_t *batch = NULL;
+    fdb_results_t res;
+    int ret = 1;
+    memset(&res, 0, sizeof(res));
+    if (cfgs == NULL) return 1;
+    for (size_t ttt = 0; ttt < job->n_targets; ttt++) {
+        cfgs[ttt] = job_config(sheet, job, &job->targets[ttt]);
+        if (cfgs[ttt] == NULL) goto exit;
+    }
+    /* The first target reads the input for all of them */
+    if (open_inputs(cfgs[0]) != 0) goto exit;
+    for (size_t ttt = 0; ttt < job->n_targets; ttt++) {
+        if (parse_barcode_file(cfgs[ttt]) != 0 || \
+                setup_files(cfgs[ttt]) != 0) goto exit;
+    }
+    pool = cfgs[0]->batch_pool = fdb_batch_pool_create();
+    if (pool == NULL) goto exit;
+    while (1) {
+        batch = fdb_batch_get(pool);
+        if (batch == NULL) goto exit;
+        if (fdb_batch_fill(batch, cfgs[0]->in_kseqs[0], 0, UINT64_MAX) == 0) {
+            if (batch->eof < 0) {
+                fprintf(stderr, "ERROR: Could not read '%s'\n",
+                        cfgs[0]->infns[0]);
+                goto exit;
+            }
+            break;
+        }
+        for (size_t ttt = 0; ttt < job->n_targets; ttt++) {
+            if (fdb_process_batch(cfgs[ttt], batch, &res)) goto exit;
+        }
+        fdb_batch_put(pool, batch);
+        batch = NULL;
+    }
+    for (size_t ttt = 0; ttt < job->n_targets; ttt++) {
+        fdb_config_t *cfg = cfgs[ttt];
+        uint64_t assigned = 0;
+        if (fdb_rescue_leftovers(cfg, pool)) goto exit;
+        if (fdb_outq_flush(cfg->outq_prod) || fdb_outq_wait(cfg->outq)) {
+            fprintf(stderr, "ERROR: writing output failed\n");
+            goto exit;
+        }
+        for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+            assigned += cfg->barcodes[bbb]->count;
+        }
+        printf("%s with %s: %zu reads, %" PRIu64 " with a barcode\n",
+                job->infn, cfg->barcode_file, cfg->reads_processed[0],
+                assigned);
+        if (cfg->stats != NULL && sheet_add_report(sheet, cfg) != 0) {
+            goto exit;
+        }
+    }
+    ret = 0;
+exit:
+    fdb_batch_put(pool, batch);
+    fdb_results_free(&res);
+    for (size_t ttt = 0; ttt < job->n_targets; ttt++) {
+        if (cfgs[ttt] == NULL) continue;
+        fdb_config_destroy(cfgs[ttt]);
+        free(cfgs[ttt]);
+    }
+    free(cfgs);
+    return ret;
+}
+
+static void *
+sheet_worker (void *arg)
+{
+    fdb_sheet_t *sheet = arg;
+    while (1) {
+        size_t jjj;
+        pthread_mutex_lock(&sheet->lock);
+        jjj = sheet->next_job++;
+        pthread_mutex_unlock(&sheet->lock);
+        if (jjj >= sheet->n_jobs) break;
+        if (run_job(sheet, &sheet->jobs[jjj]) != 0) {
+            fprintf(stderr, "ERROR: job for '%s' failed\n",
+                    sheet->jobs[jjj].infn);
+            pthread_mutex_lock(&sheet->lock);
+            sheet->n_failed++;
+            pthread_mutex_unlock(&sheet->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_sheet_run
+ *  Description:  Runs every job in the sheet with the options in opts, on
+ *                  n_threads threads. All jobs write through one I/O
+ *                  engine, so one job's writes overlap others' matching,
+ *                  and share matchers for identical barcode sets. A failed
+ *                  job does not stop the others.
+ * Return Value:  int: 0 if every job succeeded, 1 otherwise
+ * ============================================================================
+ */
+int
+fdb_sheet_run (fdb_sheet_t *sheet, const fdb_config_t *opts, int n_threads)
+{
+    pthread_t *threads = NULL;
+    int n_started = 0;
+    sheet->opts = opts;
+    sheet->aio = fdb_setup_aio(opts);
+    if (sheet->aio == NULL) return 1;
+    if ((size_t)n_threads > sheet->n_jobs) n_threads = sheet->n_jobs;
+    if (opts->max_mem > 0) {
+        /* Split between the jobs running at once */
+        sheet->job_mem = opts->max_mem / n_threads;
+        if (opts->io_depth <= 0) sheet->aio->depth = 1;
+    }
+    threads = km_calloc(n_threads, sizeof(*threads), &km_onerr_print);
+    if (threads == NULL) return 1;
+    for (; n_started < n_threads; n_started++) {
+        if (pthread_create(&threads[n_started], NULL, sheet_worker, sheet)) {
+            break;
+        }
+    }
+    if (n_started == 0) {
+        /* Run them here instead */
+        sheet_worker(sheet);
+    }
+    for (int ttt = 0; ttt < n_started; ttt++) {
+        pthread_join(threads[ttt], NULL);
+    }
+    free(threads);
+    if (opts->flag & FLG_VERBOSE) {
+        printf("Ran %zu jobs on %d threads, building %zu matchers for %zu "
+                "barcode files\n", sheet->n_jobs, n_started ? n_started : 1,
+                sheet->mcache.misses, sheet->mcache.hits + sheet->mcache.misses);
+    }
+    if (opts->stats_file != NULL && \
+            sheet_write_reports(sheet, opts->stats_file) != 0) {
+        return 1;
+    }
+    return sheet->n_failed != 0;
+}
+
+void
+fdb_sheet_destroy (fdb_sheet_t *sheet)
+{
+    fdb_mcache_entry_t *ent = NULL;
+    if (sheet == NULL) return;
+    for (size_t jjj = 0; jjj < sheet->n_jobs; jjj++) {
+        fdb_sheet_job_t *job = &sheet->jobs[jjj];
+        for (size_t ttt = 0; ttt < job->n_targets; ttt++) {
+            free(job->targets[ttt].barcode_file);
+            free(job->targets[ttt].prefix);
+        }
+        free(job->targets);
+        free(job->infn);
+    }
+    free(sheet->jobs);
+    for (size_t rrr = 0; rrr < sheet->n_reports; rrr++) {
+        free(sheet->reports[rrr]);
+    }
+    free(sheet->reports);
+    /* Every job's outputs are closed, so nothing is left in flight */
+    fdb_aio_destroy(sheet->aio);
+    ent = sheet->mcache.entries;
+    while (ent != NULL) {
+        fdb_mcache_entry_t *next = ent->next;
+        mcache_entry_destroy(ent);
+        ent = next;
+    }
+    pthread_mutex_destroy(&sheet->mcache.lock);
+    pthread_mutex_destroy(&sheet->lock);
+    free(sheet);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_sheet_main
+ *  Description:  `fastDBarcode sheet`: runs a sample sheet's jobs with the
+ *                  main command's options. Checkpoints, --range and
+ *                  --status are per run, so are not available here, and -t
+ *                  gives way to -j.
+ * ============================================================================
+ */
+int
+fdb_sheet_main (int argc, char **argv)
+{
+    fdb_config_t *opts = km_calloc(1, sizeof(*opts), &km_onerr_print);
+    fdb_sheet_t *sheet = NULL;
+    int n_threads = 0;
+    int ret = EXIT_FAILURE;
+    optind = 1;
+    if (parse_options(opts, argc, argv) != 0) goto exit;
+    if (optind + 1 != argc) {
+        fprintf(stderr, "ERROR: sheet needs exactly one sample sheet\n");
+        print_usage();
+        goto exit;
+    }
+    if (opts->ckpt_file != NULL || opts->flag & FLG_RESUME || \
+            opts->range_end != 0 || opts->status_file != NULL) {
+        fprintf(stderr, "ERROR: checkpoints, --range and --status can't be "
+                "used with sample sheets\n");
+        goto exit;
+    }
+    if (opts->n_threads > 1) {
+        /* Jobs run on one thread each; -j sets how many run at once */
+        fprintf(stderr, "ERROR: -t can't be used with sample sheets, use -j"
+                " to run more jobs at once\n");
+        goto exit;
+    }
+    sheet = fdb_sheet_load(argv[optind]);
+    if (sheet == NULL) goto exit;
+    if (opts->index_file != NULL) {
+        /* Jobs with the index's barcodes use it; others build matchers */
+        fdb_matcher_t *matcher = fdb_matcher_load_index(opts->index_file);
+        if (matcher == NULL || fdb_mcache_put(&sheet->mcache, matcher)) {
+            fdb_matcher_destroy(matcher);
+            goto exit;
+        }
+    }
+    n_threads = opts->n_jobs;
+    if (n_threads < 1) n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1) n_threads = 1;
+    if (fdb_sheet_run(sheet, opts, n_threads) == 0) ret = EXIT_SUCCESS;
+exit:
+    fdb_sheet_destroy(sheet);
+    fdb_config_destroy(opts);
+    free(opts);
+    return ret;
+}
@@ -0,0 +1,88 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_sheet.h
+ *
+ *    Description:  Sample sheets: many demultiplexing jobs run by one
+ *                      process, sharing threads, I/O and barcode matchers
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 09:42:17
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_SHEET_H
+#define FDB_SHEET_H
+
+#include <pthread.h>
+
+#include "fdb.h"
+
+/* Where one sheet line's outputs go */
+typedef struct __fdb_sheet_target_t {
+    char *barcode_file;
+    char *prefix;               /* NULL: named as by the main command */
+} fdb_sheet_target_t;
+
+/* Every line with the same input is one job, so each input is read once
+ * however many barcode sets are split out of it */
+typedef struct __fdb_sheet_job_t {
+    char *infn;
+    uint64_t size;
+    fdb_sheet_target_t *targets;
+    size_t n_targets;
+} fdb_sheet_job_t;
+
+/* A matcher, and what it was built from */
+typedef struct __fdb_mcache_entry_t {
+    uint64_t hash;
+    char **seqs;
+    size_t n_seqs;
+    int max_mismatches;
+    char *buffer_seq;
+    int max_buffer_mismatches;
+    fdb_matcher_t *matcher;
+    struct __fdb_mcache_entry_t *next;
+} fdb_mcache_entry_t;
+
+/* Matchers by barcode set. Jobs with the same barcodes and mismatch
+ * limits share one. */
+typedef struct __fdb_mcache_t {
+    pthread_mutex_t lock;
+    fdb_mcache_entry_t *entries;
+    size_t hits;
+    size_t misses;
+} fdb_mcache_t;
+
+typedef struct __fdb_sheet_t {
+    fdb_sheet_job_t *jobs;
+    size_t n_jobs;
+    const fdb_config_t *opts;   /* options every job is run with */
+    fdb_aio_t *aio;
+    size_t job_mem;             /* each job's share of --max-mem */
+    fdb_mcache_t mcache;
+    pthread_mutex_t lock;
+    size_t next_job;
+    size_t n_failed;
+    /* Each target's --stats report, in the order they finished */
+    char **reports;
+    size_t n_reports;
+} fdb_sheet_t;
+
+fdb_matcher_t *fdb_mcache_get (fdb_mcache_t *mc, const char **seqs,
+                               size_t n_seqs, int max_mismatches,
+                               const char *buffer_seq,
+                               int max_buffer_mismatches);
+int fdb_mcache_put (fdb_mcache_t *mc, fdb_matcher_t *matcher);
+fdb_sheet_t *fdb_sheet_load (const char *fn);
+int fdb_sheet_run (fdb_sheet_t *sheet, const fdb_config_t *opts,
+                   int n_threads);
+void fdb_sheet_destroy (fdb_sheet_t *sheet);
+int fdb_sheet_main (int argc, char **argv);
+
+#endif /* FDB_SHEET_H */
@@ -0,0 +1,348 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_stats.c
+ *
+ *    Description:  Per-barcode QC statistics, and a sketch of the most
+ *                      common starts of leftover reads
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 16:48:02
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "kdm.h"
+#include "fdb_stats.h"
+
+#define FDB_QUAL_OFFSET 33
+
+static uint64_t
+prefix_hash (const char *seq, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t iii = 0; iii < len; iii++) {
+        hash = (hash ^ (uint8_t)seq[iii]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    return hash ^ (hash >> 33);
+}
+
+/* Row r's cell for hash, from two halves of it */
+#define CMS_CELL(hash, r) \
+    ((r) * FDB_CMS_WIDTH + \
+     (((uint32_t)(hash) + (r) * (uint32_t)((hash) >> 32)) % FDB_CMS_WIDTH))
+
+static uint64_t
+cms_count (const uint32_t *cms, uint64_t hash)
+{
+    uint32_t min = UINT32_MAX;
+    for (uint32_t rrr = 0; rrr < FDB_CMS_DEPTH; rrr++) {
+        uint32_t count = cms[CMS_CELL(hash, rrr)];
+        if (count < min) min = count;
+    }
+    return min;
+}
+
+/* Conservative update: only the smallest cells grow, which keeps the
+ * over-count from collisions down */
+static uint64_t
+cms_add (uint32_t *cms, uint64_t hash)
+{
+    uint32_t min = cms_count(cms, hash);
+    if (min == UINT32_MAX) return min;
+    for (uint32_t rrr = 0; rrr < FDB_CMS_DEPTH; rrr++) {
+        uint32_t *count = &cms[CMS_CELL(hash, rrr)];
+        if (*count == min) (*count)++;
+    }
+    return min + 1;
+}
+
+static void
+top_reset_min (fdb_stats_t *st)
+{
+    st->top_min = UINT64_MAX;
+    for (size_t iii = 0; iii < st->n_top; iii++) {
+        if (st->top[iii].count < st->top_min) st->top_min = st->top[iii].count;
+    }
+}
+
+/* Puts prefix in the top list if its count earns it a place */
+static void
+top_offer (fdb_stats_t *st, const char *prefix, uint64_t count)
+{
+    size_t min_i = 0;
+    for (size_t iii = 0; iii < st->n_top; iii++) {
+        if (memcmp(st->top[iii].seq, prefix, st->prefix_len) == 0) {
+            if (count > st->top[iii].count) st->top[iii].count = count;
+            top_reset_min(st);
+            return;
+        }
+        if (st->top[iii].count < st->top[min_i].count) min_i = iii;
+    }
+    if (st->n_top < FDB_STATS_TOP) {
+        min_i = st->n_top++;
+    } else if (count <= st->top[min_i].count) {
+        return;
+    }
+    memcpy(st->top[min_i].seq, prefix, st->prefix_len);
+    st->top[min_i].seq[st->prefix_len] = '\0';
+    st->top[min_i].count = count;
+    top_reset_min(st);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_stats_new
+ *  Description:  Makes empty statistics for reads matched with m.
+ *                  Leftover reads are sketched by their first m->max_len
+ *                  bases (at most FDB_STATS_PREFIX_MAX).
+ * Return Value:  fdb_stats_t *: the stats, or NULL on failure
+ * ============================================================================
+ */
+fdb_stats_t *
+fdb_stats_new (const fdb_matcher_t *m)
+{
+    fdb_stats_t *st = km_calloc(1, sizeof(*st), &km_onerr_print);
+    size_t n = m->n_barcodes + 1;
+    if (st == NULL) return NULL;
+    st->n_barcodes = m->n_barcodes;
+    st->n_bins = m->max_mismatches + 1;
+    st->n_pos = m->max_len;
+    st->prefix_len = m->max_len < FDB_STATS_PREFIX_MAX ? \
+        m->max_len : FDB_STATS_PREFIX_MAX;
+    st->reads = km_calloc(n, sizeof(*st->reads), &km_onerr_print);
+    st->mm_hist = km_calloc(n * st->n_bins, sizeof(*st->mm_hist),
+            &km_onerr_print);
+    st->pos_mm = km_calloc(m->n_barcodes * st->n_pos + 1, sizeof(*st->pos_mm),
+            &km_onerr_print);
+    st->qual_sum = km_calloc(n, sizeof(*st->qual_sum), &km_onerr_print);
+    st->qual_bases = km_calloc(n, sizeof(*st->qual_bases), &km_onerr_print);
+    st->cms = km_calloc((size_t)FDB_CMS_DEPTH * FDB_CMS_WIDTH,
+            sizeof(*st->cms), &km_onerr_print);
+    if (st->reads == NULL || st->mm_hist == NULL || st->pos_mm == NULL || \
+            st->qual_sum == NULL || st->qual_bases == NULL || \
+            st->cms == NULL) {
+        fdb_stats_destroy(st);
+        return NULL;
+    }
+    return st;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_stats_add
+ *  Description:  Counts a read, matched to bcd (or FDB_NO_MATCH) with
+ *                  mismatches as from fdb_matcher_classify(). qual may be
+ *                  NULL (or qual_len 0) for reads without qualities.
+ * ============================================================================
+ */
+void
+fdb_stats_add (fdb_stats_t *st, const fdb_matcher_t *m, const char *seq,
+               size_t len, const char *qual, size_t qual_len, int bcd,
+               size_t mismatches)
+{
+    size_t idx = bcd == FDB_NO_MATCH ? st->n_barcodes : (size_t)bcd;
+    uint64_t qsum = 0;
+    if (mismatches >= st->n_bins) mismatches = st->n_bins - 1;
+    st->reads[idx]++;
+    st->mm_hist[idx * st->n_bins + mismatches]++;
+    for (size_t iii = 0; qual != NULL && iii < qual_len; iii++) {
+        qsum += (uint8_t)qual[iii] - FDB_QUAL_OFFSET;
+    }
+    st->qual_sum[idx] += qsum;
+    st->qual_bases[idx] += qual != NULL ? qual_len : 0;
+    if (bcd != FDB_NO_MATCH) {
+        if (mismatches > 0) {
+            /* Where they were; bases past the read's end are mismatches */
+            const char *bseq = m->seqs[bcd];
+            uint64_t *pos = &st->pos_mm[idx * st->n_pos];
+            size_t blen = m->lens[bcd];
+            for (size_t iii = 0; iii < blen; iii++) {
+                if (iii >= len || seq[iii] != bseq[iii]) pos[iii]++;
+            }
+        }
+    } else if (st->prefix_len > 0 && len >= st->prefix_len) {
+        uint64_t count = cms_add(st->cms, prefix_hash(seq, st->prefix_len));
+        if (st->n_top < FDB_STATS_TOP || count > st->top_min) {
+            top_offer(st, seq, count);
+        }
+    }
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_stats_merge
+ *  Description:  Adds src's counts to dst's. Both must be of the same
+ *                  matcher.
+ * Return Value:  int: 0 on success, 1 if they are of different matchers
+ * ============================================================================
+ */
+int
+fdb_stats_merge (fdb_stats_t *dst, const fdb_stats_t *src)
+{
+    size_t n = dst->n_barcodes + 1;
+    if (dst->n_barcodes != src->n_barcodes || dst->n_bins != src->n_bins || \
+            dst->n_pos != src->n_pos || dst->prefix_len != src->prefix_len) {
+        return 1;
+    }
+    for (size_t iii = 0; iii < n; iii++) {
+        dst->reads[iii] += src->reads[iii];
+        dst->qual_sum[iii] += src->qual_sum[iii];
+        dst->qual_bases[iii] += src->qual_bases[iii];
+    }
+    for (size_t iii = 0; iii < n * dst->n_bins; iii++) {
+        dst->mm_hist[iii] += src->mm_hist[iii];
+    }
+    for (size_t iii = 0; iii < dst->n_barcodes * dst->n_pos; iii++) {
+        dst->pos_mm[iii] += src->pos_mm[iii];
+    }
+    for (size_t iii = 0; iii < (size_t)FDB_CMS_DEPTH * FDB_CMS_WIDTH; iii++) {
+        uint64_t sum = (uint64_t)dst->cms[iii] + src->cms[iii];
+        dst->cms[iii] = sum < UINT32_MAX ? sum : UINT32_MAX;
+    }
+    /* Counts of both lists' prefixes are re-read from the merged sketch */
+    for (size_t iii = 0; iii < dst->n_top; iii++) {
+        dst->top[iii].count = fdb_stats_prefix_count(dst, dst->top[iii].seq);
+    }
+    top_reset_min(dst);
+    for (size_t iii = 0; iii < src->n_top; iii++) {
+        top_offer(dst, src->top[iii].seq,
+                fdb_stats_prefix_count(dst, src->top[iii].seq));
+    }
+    return 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_stats_prefix_count
+ *  Description:  Estimates how many leftover reads started with prefix,
+ *                  which must be st->prefix_len long.
+ * Return Value:  uint64_t: the estimate, which is never an under-count
+ * ============================================================================
+ */
+uint64_t
+fdb_stats_prefix_count (const fdb_stats_t *st, const char *prefix)
+{
+    return cms_count(st->cms, prefix_hash(prefix, st->prefix_len));
+}
+
+/* Writes str as a JSON string */
+void
+fdb_json_str (FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void
+json_u64s (FILE *fp, const uint64_t *vals, size_t n)
+{
+    fputc('[', fp);
+    for (size_t iii = 0; iii < n; iii++) {
+        fprintf(fp, "%s%" PRIu64, iii ? ", " : "", vals[iii]);
+    }
+    fputc(']', fp);
+}
+
+static void
+json_mean_qual (FILE *fp, uint64_t sum, uint64_t n)
+{
+    if (n == 0) {
+        fprintf(fp, "null");
+    } else {
+        fprintf(fp, "%.2f", (double)sum / n);
+    }
+}
+
+static int
+cmp_prefix_rev (const void *left, const void *right)
+{
+    const fdb_stats_prefix_t *l = left, *r = right;
+    if (l->count != r->count) return l->count < r->count ? 1 : -1;
+    return strcmp(l->seq, r->seq);
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_stats_json
+ *  Description:  Writes st as a JSON object, naming barcodes from names.
+ *                  Prefix counts are count-min sketch estimates, so may be
+ *                  over-counts.
+ * ============================================================================
+ */
+void
+fdb_stats_json (const fdb_stats_t *st, const fdb_matcher_t *m,
+                const char *const *names, FILE *fp)
+{
+    const size_t lo = st->n_barcodes;
+    fdb_stats_prefix_t top[FDB_STATS_TOP];
+    uint64_t reads = 0;
+    for (size_t bbb = 0; bbb <= lo; bbb++) reads += st->reads[bbb];
+    fprintf(fp, "{\"reads\": %" PRIu64 ", \"assigned\": %" PRIu64 ",\n",
+            reads, reads - st->reads[lo]);
+    fprintf(fp, "\"barcodes\": [\n");
+    for (size_t bbb = 0; bbb < lo; bbb++) {
+        fprintf(fp, "  {\"name\": ");
+        fdb_json_str(fp, names[bbb]);
+        fprintf(fp, ", \"seq\": ");
+        fdb_json_str(fp, m->seqs[bbb]);
+        fprintf(fp, ", \"reads\": %" PRIu64 ",\n   \"mismatches\": ",
+                st->reads[bbb]);
+        json_u64s(fp, &st->mm_hist[bbb * st->n_bins], st->n_bins);
+        fprintf(fp, ",\n   \"position_mismatches\": ");
+        json_u64s(fp, &st->pos_mm[bbb * st->n_pos], m->lens[bbb]);
+        fprintf(fp, ",\n   \"mean_quality\": ");
+        json_mean_qual(fp, st->qual_sum[bbb], st->qual_bases[bbb]);
+        fprintf(fp, "}%s\n", bbb + 1 < lo ? "," : "");
+    }
+    fprintf(fp, "],\n\"leftover\": {\"reads\": %" PRIu64 ", \"mismatches\": ",
+            st->reads[lo]);
+    json_u64s(fp, &st->mm_hist[lo * st->n_bins], st->n_bins);
+    fprintf(fp, ", \"mean_quality\": ");
+    json_mean_qual(fp, st->qual_sum[lo], st->qual_bases[lo]);
+    fprintf(fp, ",\n  \"top_prefixes\": [");
+    memcpy(top, st->top, st->n_top * sizeof(*top));
+    for (size_t iii = 0; iii < st->n_top; iii++) {
+        top[iii].count = fdb_stats_prefix_count(st, top[iii].seq);
+    }
+    qsort(top, st->n_top, sizeof(*top), cmp_prefix_rev);
+    for (size_t iii = 0; iii < st->n_top; iii++) {
+        fprintf(fp, "%s\n    {\"seq\": ", iii ? "," : "");
+        fdb_json_str(fp, top[iii].seq);
+        fprintf(fp, ", \"count\": %" PRIu64 "}", top[iii].count);
+    }
+    fprintf(fp, "]}}");
+}
+
+void
+fdb_stats_destroy (fdb_stats_t *st)
+{
+    if (st == NULL) return;
+    free(st->reads);
+    free(st->mm_hist);
+    free(st->pos_mm);
+    free(st->qual_sum);
+    free(st->qual_bases);
+    free(st->cms);
+    free(st);
+}
@@ -0,0 +1,69 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_stats.h
+ *
+ *    Description:  Per-barcode QC statistics, and a sketch of the most
+ *                      common starts of leftover reads
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 16:48:02
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_STATS_H
+#define FDB_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fdb_match.h"
+
+/* Leftover prefixes reported, and the longest kept */
+#define FDB_STATS_TOP 20
+#define FDB_STATS_PREFIX_MAX 32
+/* Count-min sketch of leftover prefixes: rows of 32-bit counters */
+#define FDB_CMS_DEPTH 4
+#define FDB_CMS_WIDTH (1u << 15)
+
+typedef struct __fdb_stats_prefix_t {
+    char seq[FDB_STATS_PREFIX_MAX + 1];
+    uint64_t count;
+} fdb_stats_prefix_t;
+
+/* Counters for one thread's reads; threads' stats are combined with
+ * fdb_stats_merge(). Arrays have an entry per barcode and then one for
+ * leftovers, except pos_mm. */
+typedef struct __fdb_stats_t {
+    size_t n_barcodes;
+    size_t n_bins;              /* mismatches 0 to max_mismatches */
+    size_t n_pos;               /* longest barcode */
+    size_t prefix_len;
+    uint64_t *reads;
+    uint64_t *mm_hist;          /* n_bins each */
+    uint64_t *pos_mm;           /* n_pos per barcode */
+    uint64_t *qual_sum;         /* phred scores, and the bases they're of */
+    uint64_t *qual_bases;
+    uint32_t *cms;              /* FDB_CMS_DEPTH rows of FDB_CMS_WIDTH */
+    fdb_stats_prefix_t top[FDB_STATS_TOP];
+    size_t n_top;
+    uint64_t top_min;
+} fdb_stats_t;
+
+fdb_stats_t *fdb_stats_new (const fdb_matcher_t *m);
+void fdb_stats_add (fdb_stats_t *st, const fdb_matcher_t *m, const char *seq,
+                    size_t len, const char *qual, size_t qual_len, int bcd,
+                    size_t mismatches);
+int fdb_stats_merge (fdb_stats_t *dst, const fdb_stats_t *src);
+uint64_t fdb_stats_prefix_count (const fdb_stats_t *st, const char *prefix);
+void fdb_stats_json (const fdb_stats_t *st, const fdb_matcher_t *m,
+                     const char *const *names, FILE *fp);
+void fdb_json_str (FILE *fp, const char *str);
+void fdb_stats_destroy (fdb_stats_t *st);
+
+#endif /* FDB_STATS_H */
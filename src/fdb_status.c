@@ -0,0 +1,191 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_status.c
+ *
+ *    Description:  Periodic progress report of a running job, as a JSON
+ *                      file rewritten in place
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 17:05:51
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include "fdb_ckpt.h"
+#include "fdb_status.h"
+
+double
+fdb_status_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Input bytes consumed: whole inputs before cur_inf, and so far of it */
+static uint64_t
+bytes_in (const fdb_status_t *st, const fdb_config_t *cfg, int cur_inf)
+{
+    uint64_t bytes = 0;
+    for (int fff = 0; fff < cur_inf && fff < st->n_infs; fff++) {
+        bytes += st->in_sizes[fff];
+    }
+    if (cur_inf < st->n_infs) {
+        bytes += fdb_infile_raw_tell(cfg->in_kseqs[cur_inf]->f->f);
+    }
+    return bytes;
+}
+
+static uint64_t
+reads_in (const fdb_config_t *cfg)
+{
+    uint64_t reads = 0;
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        reads += cfg->reads_processed[fff];
+    }
+    return reads;
+}
+
+/* Bytes written so far; writer threads update these as they go */
+static uint64_t
+bytes_out (const fdb_config_t *cfg)
+{
+    uint64_t bytes = 0;
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+            bytes += __atomic_load_n(&cfg->barcodes[bbb]->fps[fff]->size,
+                    __ATOMIC_RELAXED);
+        }
+        bytes += __atomic_load_n(&cfg->leftover_outfps[fff]->size,
+                __ATOMIC_RELAXED);
+        if (cfg->filter != NULL) {
+            bytes += __atomic_load_n(&cfg->filtered_outfps[fff]->size,
+                    __ATOMIC_RELAXED);
+        }
+    }
+    return bytes;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_status_new
+ *  Description:  Starts reporting cfg's progress to fn every `every`
+ *                  seconds. Call once setup_files() has opened everything.
+ * Return Value:  fdb_status_t *: the reporter, or NULL on failure
+ * ============================================================================
+ */
+fdb_status_t *
+fdb_status_new (const fdb_config_t *cfg, const char *fn, double every)
+{
+    fdb_status_t *st = km_calloc(1, sizeof(*st), &km_onerr_print);
+    int first_inf = cfg->ckpt != NULL ? cfg->ckpt->cur_inf : 0;
+    if (st == NULL) return NULL;
+    st->fn = strdup(fn);
+    st->tmp_fn = km_calloc(strlen(fn) + 5, 1, &km_onerr_print);
+    st->n_infs = cfg->n_infs;
+    st->in_sizes = km_calloc(cfg->n_infs, sizeof(*st->in_sizes),
+            &km_onerr_print);
+    if (st->fn == NULL || st->tmp_fn == NULL || st->in_sizes == NULL) {
+        fdb_status_destroy(st);
+        return NULL;
+    }
+    sprintf(st->tmp_fn, "%s.tmp", fn);
+    for (int fff = 0; fff < cfg->n_infs; fff++) {
+        struct stat sb;
+        if (stat(cfg->infns[fff], &sb) == 0) st->in_sizes[fff] = sb.st_size;
+        st->in_total += st->in_sizes[fff];
+    }
+    st->every = every;
+    st->start = st->last = fdb_status_now();
+    st->next = st->start + every;
+    st->start_reads = st->last_reads = reads_in(cfg);
+    st->start_bytes = bytes_in(st, cfg, first_inf);
+    return st;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_status_write
+ *  Description:  Atomically rewrites the status file, with counts giving
+ *                  each barcode's reads so far, and cur_inf the input being
+ *                  read ("input" is null once they are all read). Readers of
+ *                  the file see either the last report or this one, never
+ *                  part of one.
+ * Return Value:  int: 0 on success, 1 on failure
+ * ============================================================================
+ */
+int
+fdb_status_write (fdb_status_t *st, const fdb_config_t *cfg, int cur_inf,
+                  const uint64_t *counts, int done)
+{
+    double now = fdb_status_now();
+    double elapsed = now - st->start;
+    uint64_t reads = reads_in(cfg);
+    uint64_t bytes = done ? st->in_total : bytes_in(st, cfg, cur_inf);
+    double rate = elapsed > 0 ? (reads - st->start_reads) / elapsed : 0;
+    double rate_now = now > st->last ? \
+            (reads - st->last_reads) / (now - st->last) : 0;
+    double byte_rate = elapsed > 0 ? (bytes - st->start_bytes) / elapsed : 0;
+    FILE *fp = fopen(st->tmp_fn, "w");
+    st->next = now + st->every;
+    st->last = now;
+    st->last_reads = reads;
+    if (fp == NULL) {
+        FDB_IO_ERROR(st->tmp_fn);
+        return 1;
+    }
+    fprintf(fp, "{\"state\": \"%s\", \"elapsed_sec\": %.1f, \"reads\": %"
+            PRIu64 ", \"reads_per_sec\": %.0f, \"reads_per_sec_now\": %.0f,\n",
+            done ? "done" : "running", elapsed, reads, rate, rate_now);
+    fprintf(fp, "\"bytes_in\": %" PRIu64 ", \"bytes_in_total\": %" PRIu64
+            ", \"bytes_out\": %" PRIu64 ", \"eta_sec\": ", bytes,
+            st->in_total, bytes_out(cfg));
+    if (done) {
+        fprintf(fp, "0");
+    } else if (byte_rate > 0 && st->in_total >= bytes) {
+        fprintf(fp, "%.0f", (st->in_total - bytes) / byte_rate);
+    } else {
+        fprintf(fp, "null");
+    }
+    fprintf(fp, ",\n\"input\": ");
+    if (cur_inf < cfg->n_infs) {
+        fdb_json_str(fp, cfg->infns[cur_inf]);
+    } else {
+        fprintf(fp, "null");
+    }
+    fprintf(fp, ", \"barcodes\": {");
+    for (size_t bbb = 0; bbb < cfg->n_barcodes; bbb++) {
+        fprintf(fp, "%s\n  ", bbb ? "," : "");
+        fdb_json_str(fp, cfg->barcodes[bbb]->name.s);
+        fprintf(fp, ": %" PRIu64, counts[bbb]);
+    }
+    fprintf(fp, "}}\n");
+    if (ferror(fp) | (fclose(fp) != 0)) {
+        FDB_IO_ERROR(st->tmp_fn);
+        return 1;
+    }
+    if (rename(st->tmp_fn, st->fn) != 0) {
+        FDB_IO_ERROR(st->fn);
+        return 1;
+    }
+    return 0;
+}
+
+void
+fdb_status_destroy (fdb_status_t *st)
+{
+    if (st == NULL) return;
+    free(st->fn);
+    free(st->tmp_fn);
+    free(st->in_sizes);
+    free(st);
+}
@@ -0,0 +1,66 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  fdb_status.h
+ *
+ *    Description:  Periodic progress report of a running job, as a JSON
+ *                      file rewritten in place
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 17:05:51
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef FDB_STATUS_H
+#define FDB_STATUS_H
+
+#include "fdb.h"
+
+/* Default seconds between rewrites of the status file */
+#define FDB_STATUS_EVERY_DEFAULT 10
+
+/* The status file is written by the reading thread between batches, from
+ * counters it owns or reads without locking, so nothing on the matching
+ * and writing paths waits for it. */
+typedef struct __fdb_status_t {
+    char *fn;
+    char *tmp_fn;
+    double every;               /* seconds */
+    double start;               /* monotonic, at fdb_status_new() */
+    double next;
+    /* Progress when started, which a resumed run doesn't count in rates */
+    uint64_t start_reads;
+    uint64_t start_bytes;
+    /* At the last report, for the current rate */
+    double last;
+    uint64_t last_reads;
+    uint64_t *in_sizes;         /* per input, compressed */
+    uint64_t in_total;
+    int n_infs;
+} fdb_status_t;
+
+fdb_status_t *fdb_status_new (const fdb_config_t *cfg, const char *fn,
+                              double every);
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  fdb_status_due
+ *  Description:  Whether it's time for the next report. Cheap enough to
+ *                  call every batch.
+ * ============================================================================
+ */
+static inline int
+fdb_status_due (const fdb_status_t *st, double now)
+{
+    return now >= st->next;
+}
+double fdb_status_now (void);
+int fdb_status_write (fdb_status_t *st, const fdb_config_t *cfg, int cur_inf,
+                      const uint64_t *counts, int done);
+void fdb_status_destroy (fdb_status_t *st);
+
+#endif /* FDB_STATUS_H */
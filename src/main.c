@@ -17,6 +17,7 @@
  */
 
 #include "fdb.h"
+#include "fdb_sheet.h"
 
 /*
  * ===  FUNCTION  =============================================================
@@ -26,27 +27,41 @@
 int
 main (int argc, char *argv[])
 {
-    fdb_config_t *cfg = km_calloc(1, sizeof(*cfg), &km_onerr_print);
+    fdb_config_t *cfg = NULL;
+    /* Subcommands */
+    if (argc > 1 && strcmp(argv[1], "gzindex") == 0) {
+        return fdb_gzindex_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        return fdb_merge_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "index") == 0) {
+        return fdb_index_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "sheet") == 0) {
+        return fdb_sheet_main(argc - 1, argv + 1);
+    }
+    cfg = km_calloc(1, sizeof(*cfg), &km_onerr_print);
     /* Parse all arguments */
-    if (!parse_args(cfg, argc, argv)) {
+    if (parse_args(cfg, argc, argv) != 0) {
         fprintf(stderr, "[main] ERROR: could not parse arguments\n");
         fdb_config_destroy(cfg);
         return EXIT_FAILURE;
     }
     /* Parse barcode file */
-    if (!parse_barcode_file(cfg)) {
+    if (parse_barcode_file(cfg) != 0) {
         fprintf(stderr, "[main] ERROR: could not parse barcode file\n");
         fdb_config_destroy(cfg);
         return EXIT_FAILURE;
     }
     /* Setup input/out files */
-    if (!setup_files(cfg)) {
+    if (setup_files(cfg) != 0) {
         fprintf(stderr, "[main] ERROR: could not setup input\n");
         fdb_config_destroy(cfg);
         return EXIT_FAILURE;
     }
     /* Setup input/out files */
-    if (!fdb_main(cfg)) {
+    if (fdb_main(cfg) != 0) {
         fprintf(stderr, "[main] ERROR: processing files failed\n");
         fdb_config_destroy(cfg);
         return EXIT_FAILURE;
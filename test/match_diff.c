@@ -0,0 +1,461 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  match_diff.c
+ *
+ *    Description:  Differential test of the barcode matchers: random
+ *                      barcode sets and reads, matched by every engine and
+ *                      by a plain scalar reference, which must all agree.
+ *                      Built with -DFDB_FUZZ, a libFuzzer target instead.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 16:02:51
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdb_match.h"
+
+#define DIFF_MAX_BARCODES 80
+/* Past FDB_MIDX_MAX_LEN, so some sets can't be indexed */
+#define DIFF_MAX_LEN 34
+#define DIFF_MAX_READ 64
+/* Reads per barcode set, also classified as one batch */
+#define DIFF_READS 96
+
+enum diff_engine {
+    DIFF_SCAN = 0,
+    DIFF_INDEX,                 /* fdb_matcher_compile()d */
+    DIFF_MAPPED,                /* saved, and mapped back */
+    DIFF_COPY,                  /* fdb_matcher_copy() of the indexed */
+    DIFF_N_ENGINES,
+};
+
+static const char *engine_names[DIFF_N_ENGINES] = {
+    "scan", "index", "mapped", "copy",
+};
+
+typedef struct {
+    const char *bcds[DIFF_MAX_BARCODES];
+    size_t n_barcodes;
+    int max_mismatches;
+    const char *buffer_seq;
+    int max_buffer_mismatches;
+    const char *reads[DIFF_READS];
+    size_t lens[DIFF_READS];
+    size_t n_reads;
+} diff_case_t;
+
+/* Totals over all cases, so a run shows what it covered */
+static struct {
+    size_t cases;
+    size_t indexed;
+    size_t reads;
+    size_t assigned;
+} diff_seen;
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  ref_match
+ *  Description:  The selection loop fastDBarcode started with, written
+ *                  out plainly: mismatches are counted in full (read bases
+ *                  past its end count as mismatches) and capped at
+ *                  max_mismatches, as no barcode that far can be matched.
+ *                  Of the barcodes whose buffer sequence matches, each one
+ *                  scoring no worse than the best so far and no shorter
+ *                  replaces it.
+ * Return Value:  int: the barcode, or FDB_NO_MATCH, with the best score in
+ *                  *mismatches
+ * ============================================================================
+ */
+static size_t
+ref_distance (const char *needle, size_t needle_len, const char *seq,
+              size_t len, size_t cap)
+{
+    size_t dist = 0;
+    for (size_t iii = 0; iii < needle_len; iii++) {
+        if (iii >= len || needle[iii] != seq[iii]) dist++;
+    }
+    return dist < cap ? dist : cap;
+}
+
+static int
+ref_match (const diff_case_t *c, const char *seq, size_t len,
+           size_t *mismatches)
+{
+    size_t best_score = SIZE_MAX;
+    size_t best_len = 0;
+    int best = 0;
+    for (size_t bbb = 0; bbb < c->n_barcodes; bbb++) {
+        size_t blen = strlen(c->bcds[bbb]);
+        size_t score = ref_distance(c->bcds[bbb], blen, seq, len,
+                c->max_mismatches);
+        if (c->buffer_seq != NULL) {
+            size_t off = blen < len ? blen : len;
+            if (ref_distance(c->buffer_seq, strlen(c->buffer_seq), seq + off,
+                        len - off, c->max_buffer_mismatches + 1) > \
+                    (size_t)c->max_buffer_mismatches) continue;
+        }
+        if (score <= best_score && blen >= best_len) {
+            best = bbb;
+            best_len = blen;
+            best_score = score;
+        }
+    }
+    *mismatches = best_score;
+    return best_score < (size_t)c->max_mismatches ? best : FDB_NO_MATCH;
+}
+
+static void
+print_case (const diff_case_t *c)
+{
+    fprintf(stderr, "  max mismatches %d, buffer %s (max %d), barcodes:\n",
+            c->max_mismatches, c->buffer_seq ? c->buffer_seq : "none",
+            c->max_buffer_mismatches);
+    for (size_t bbb = 0; bbb < c->n_barcodes; bbb++) {
+        fprintf(stderr, "    %zu\t%s\n", bbb, c->bcds[bbb]);
+    }
+}
+
+static int
+diverged (const diff_case_t *c, int engine, const char *what, size_t rrr,
+          long want, long got)
+{
+    fprintf(stderr, "ERROR: %s engine's %s of read '%.*s' is %ld, not %ld\n",
+            engine_names[engine], what, (int)c->lens[rrr], c->reads[rrr], got,
+            want);
+    print_case(c);
+    return 1;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  diff_run
+ *  Description:  Makes every engine for c's barcodes, and checks that each
+ *                  matches and classifies c's reads as the reference does.
+ *                  Engines that can't be made for c (sets which can't be
+ *                  indexed) are skipped, but fdb_matcher_compile() must
+ *                  only refuse what it says it refuses.
+ * Return Value:  int: 0 if all agree, 1 on a divergence or failure
+ * ============================================================================
+ */
+static int
+diff_run (const diff_case_t *c)
+{
+    fdb_matcher_t *engines[DIFF_N_ENGINES] = {NULL};
+    char fn[] = "/tmp/fdb_match_diff_XXXXXX";
+    int32_t assign[DIFF_READS];
+    uint32_t trim[DIFF_READS], mm[DIFF_READS];
+    size_t want_mm[DIFF_READS];
+    int want[DIFF_READS];
+    int fd = -1, res = 1;
+    int indexable = 1;
+    for (size_t bbb = 0; bbb < c->n_barcodes; bbb++) {
+        const char *bcd = c->bcds[bbb];
+        indexable &= strlen(bcd) <= 32 && strspn(bcd, "ACGT") == strlen(bcd);
+    }
+    for (int eee = DIFF_SCAN; eee <= DIFF_INDEX; eee++) {
+        engines[eee] = fdb_matcher_new(c->bcds, c->n_barcodes,
+                c->max_mismatches, c->buffer_seq, c->max_buffer_mismatches);
+        if (engines[eee] == NULL) goto exit;
+    }
+    if (fdb_matcher_compile(engines[DIFF_INDEX]) != 0) {
+        /* Only too large a neighbourhood is refused otherwise, and the
+         * cases' sets are small enough up to -m 3 */
+        if (indexable && c->max_mismatches <= 3) {
+            fprintf(stderr, "ERROR: indexable barcodes weren't indexed\n");
+            print_case(c);
+            goto exit;
+        }
+        fdb_matcher_destroy(engines[DIFF_INDEX]);
+        engines[DIFF_INDEX] = NULL;
+    } else if (!indexable) {
+        fprintf(stderr, "ERROR: barcodes were indexed which can't be\n");
+        print_case(c);
+        goto exit;
+    }
+    if (engines[DIFF_INDEX] != NULL) {
+        diff_seen.indexed++;
+        engines[DIFF_COPY] = fdb_matcher_copy(engines[DIFF_INDEX]);
+        if (engines[DIFF_COPY] == NULL) goto exit;
+        fd = mkstemp(fn);
+        if (fd < 0) goto exit;
+        close(fd);
+        if (fdb_matcher_save_index(engines[DIFF_INDEX], fn) != 0) goto exit;
+        engines[DIFF_MAPPED] = fdb_matcher_load_index(fn);
+        if (engines[DIFF_MAPPED] == NULL) goto exit;
+        if (!fdb_matcher_is(engines[DIFF_MAPPED], c->bcds, c->n_barcodes,
+                    c->max_mismatches, c->buffer_seq,
+                    c->max_buffer_mismatches)) {
+            fprintf(stderr, "ERROR: mapped index has other barcodes\n");
+            print_case(c);
+            goto exit;
+        }
+    }
+    for (size_t rrr = 0; rrr < c->n_reads; rrr++) {
+        want[rrr] = ref_match(c, c->reads[rrr], c->lens[rrr], &want_mm[rrr]);
+        diff_seen.assigned += want[rrr] != FDB_NO_MATCH;
+    }
+    diff_seen.reads += c->n_reads;
+    diff_seen.cases++;
+    for (int eee = 0; eee < DIFF_N_ENGINES; eee++) {
+        const fdb_matcher_t *m = engines[eee];
+        size_t cap = c->max_mismatches;
+        if (m == NULL) continue;
+        for (size_t rrr = 0; rrr < c->n_reads; rrr++) {
+            size_t got_mm = 0;
+            int got = fdb_matcher_match(m, c->reads[rrr], c->lens[rrr],
+                    &got_mm);
+            if (got != want[rrr]) {
+                diverged(c, eee, "barcode", rrr, want[rrr], got);
+                goto exit;
+            }
+            if (got_mm != want_mm[rrr]) {
+                diverged(c, eee, "mismatches", rrr, want_mm[rrr], got_mm);
+                goto exit;
+            }
+        }
+        fdb_matcher_classify(m, c->reads, c->lens, c->n_reads, assign, trim,
+                mm);
+        for (size_t rrr = 0; rrr < c->n_reads; rrr++) {
+            size_t want_trim = 0;
+            if (want[rrr] != FDB_NO_MATCH) {
+                want_trim = strlen(c->bcds[want[rrr]]);
+                if (want_trim > c->lens[rrr]) want_trim = c->lens[rrr];
+            }
+            if (assign[rrr] != want[rrr]) {
+                diverged(c, eee, "classified barcode", rrr, want[rrr],
+                        assign[rrr]);
+                goto exit;
+            }
+            if (trim[rrr] != want_trim) {
+                diverged(c, eee, "trim", rrr, want_trim, trim[rrr]);
+                goto exit;
+            }
+            if (mm[rrr] != (want_mm[rrr] < cap ? want_mm[rrr] : cap)) {
+                diverged(c, eee, "classified mismatches", rrr,
+                        want_mm[rrr] < cap ? want_mm[rrr] : cap, mm[rrr]);
+                goto exit;
+            }
+        }
+    }
+    res = 0;
+exit:
+    if (fd >= 0) unlink(fn);
+    for (int eee = 0; eee < DIFF_N_ENGINES; eee++) {
+        fdb_matcher_destroy(engines[eee]);
+    }
+    return res;
+}
+
+#ifdef FDB_FUZZ
+
+/* Input is a byte of limits, then newline separated barcodes, the buffer
+ * (if the limits have one) and finally a read. Bytes other than newline
+ * are taken as bases, mostly ACGT. */
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+    static const char bases[] = "ACGTACGTACGTACGTN";
+    char buf[DIFF_MAX_BARCODES + 2][DIFF_MAX_READ + 1];
+    const char *fields[DIFF_MAX_BARCODES + 2];
+    size_t n_fields = 0, len = 0;
+    diff_case_t c;
+    if (size < 1) return 0;
+    memset(&c, 0, sizeof(c));
+    c.max_mismatches = data[0] & 3;
+    c.max_buffer_mismatches = data[0] >> 2 & 1;
+    for (size_t iii = 1; iii <= size && n_fields < DIFF_MAX_BARCODES + 2;
+            iii++) {
+        if (iii == size || data[iii] == '\n') {
+            buf[n_fields][len] = '\0';
+            fields[n_fields] = buf[n_fields];
+            n_fields++;
+            len = 0;
+        } else if (len < DIFF_MAX_READ) {
+            buf[n_fields][len++] = bases[data[iii] % (sizeof(bases) - 1)];
+        }
+    }
+    /* The read comes last, and may be empty */
+    c.reads[0] = fields[--n_fields];
+    c.lens[0] = strlen(c.reads[0]);
+    c.n_reads = 1;
+    if (data[0] & 8 && n_fields > 0 && fields[n_fields - 1][0] != '\0') {
+        c.buffer_seq = fields[--n_fields];
+    }
+    for (size_t fff = 0; fff < n_fields; fff++) {
+        if (fields[fff][0] == '\0') continue;
+        c.bcds[c.n_barcodes++] = fields[fff];
+    }
+    if (c.n_barcodes == 0) return 0;
+    if (diff_run(&c) != 0) abort();
+    return 0;
+}
+
+#else
+
+static uint64_t
+rng_next (uint64_t *rng)
+{
+    *rng = *rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *rng >> 33;
+}
+
+static void
+random_seq (char *seq, size_t len, const char *alphabet, uint64_t *rng)
+{
+    size_t n = strlen(alphabet);
+    for (size_t iii = 0; iii < len; iii++) {
+        seq[iii] = alphabet[rng_next(rng) % n];
+    }
+    seq[len] = '\0';
+}
+
+/* Sets crowd barcodes into few bases and lengths, so reads are often as
+ * close to several; some have duplicates, or barcodes which can't be
+ * indexed */
+static void
+random_barcodes (diff_case_t *c, char (*bufs)[DIFF_MAX_LEN + 1],
+                 uint64_t *rng)
+{
+    const char *alphabet = "ACGT" + rng_next(rng) % 3;
+    size_t fixed_len = rng_next(rng) % 3 == 0 ? 1 + rng_next(rng) % 10 : 0;
+    c->n_barcodes = 1 + rng_next(rng) % DIFF_MAX_BARCODES;
+    c->max_mismatches = rng_next(rng) % 4;
+    for (size_t bbb = 0; bbb < c->n_barcodes; bbb++) {
+        size_t len = fixed_len ? fixed_len : 1 + rng_next(rng) % 10;
+        uint64_t odd = rng_next(rng) % 200;
+        if (odd == 0) len = DIFF_MAX_LEN;
+        if (bbb > 0 && odd < 10) {
+            strcpy(bufs[bbb], bufs[rng_next(rng) % bbb]);
+        } else {
+            random_seq(bufs[bbb], len, alphabet, rng);
+        }
+        if (odd == 1) bufs[bbb][rng_next(rng) % len] = 'N';
+        c->bcds[bbb] = bufs[bbb];
+    }
+    c->buffer_seq = NULL;
+    c->max_buffer_mismatches = rng_next(rng) % 2;
+    if (rng_next(rng) % 3 == 0) {
+        random_seq(bufs[DIFF_MAX_BARCODES], 1 + rng_next(rng) % 4, "ACGT",
+                rng);
+        c->buffer_seq = bufs[DIFF_MAX_BARCODES];
+    }
+}
+
+/* Reads starting with a barcode and maybe its buffer, with up to a few
+ * more errors than are allowed, or half way between two barcodes, or
+ * random. Some are cut short, and some have Ns. */
+static void
+random_read (const diff_case_t *c, char *read, size_t *len, uint64_t *rng)
+{
+    const char *bcd = c->bcds[rng_next(rng) % c->n_barcodes];
+    const char *other = c->bcds[rng_next(rng) % c->n_barcodes];
+    size_t blen = strlen(bcd), olen = strlen(other);
+    size_t full = 0, off = 0;
+    uint64_t kind = rng_next(rng) % 8;
+    random_seq(read, DIFF_MAX_READ, "ACGT", rng);
+    if (kind < 6) {
+        memcpy(read, bcd, blen);
+        off = blen;
+        if (kind == 5) {
+            /* Equally far from both where they differ */
+            int take = 0;
+            for (size_t iii = 0; iii < blen && iii < olen; iii++) {
+                if (bcd[iii] == other[iii]) continue;
+                if (take) read[iii] = other[iii];
+                take = !take;
+            }
+        } else {
+            for (uint64_t eee = rng_next(rng) % (c->max_mismatches + 2);
+                    eee > 0; eee--) {
+                read[rng_next(rng) % blen] = "ACGT"[rng_next(rng) % 4];
+            }
+        }
+        if (c->buffer_seq != NULL && rng_next(rng) % 4 != 0) {
+            memcpy(read + off, c->buffer_seq, strlen(c->buffer_seq));
+            if (rng_next(rng) % 3 == 0) {
+                read[off + rng_next(rng) % strlen(c->buffer_seq)] = 'C';
+            }
+        }
+    }
+    full = DIFF_MAX_LEN + 4 + rng_next(rng) % (DIFF_MAX_READ - DIFF_MAX_LEN - 4);
+    switch (rng_next(rng) % 6) {
+        case 0:
+            *len = rng_next(rng) % (blen + 3);
+            break;
+        case 1:
+            read[rng_next(rng) % full] = 'N';
+            /* fall through */
+        default:
+            *len = full;
+            break;
+    }
+    read[*len] = '\0';
+}
+
+static void
+usage (void)
+{
+    printf("USAGE: test_fdb_match_diff [-n CASES] [-s SEED]\n\n"
+            "Matches reads against random barcode sets with every matcher\n"
+            "engine and a scalar reference, failing on any difference.\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    static char bcd_bufs[DIFF_MAX_BARCODES + 1][DIFF_MAX_LEN + 1];
+    static char read_bufs[DIFF_READS][DIFF_MAX_READ + 1];
+    uint64_t seed = 1, rng = 0;
+    size_t n_cases = 1000;
+    diff_case_t c;
+    int opt;
+    while ((opt = getopt(argc, argv, "hn:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                n_cases = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    for (size_t ccc = 0; ccc < n_cases; ccc++) {
+        /* Each case from its own seed, so a failure can be rerun alone */
+        rng = seed + ccc;
+        memset(&c, 0, sizeof(c));
+        random_barcodes(&c, bcd_bufs, &rng);
+        c.n_reads = DIFF_READS;
+        for (size_t rrr = 0; rrr < c.n_reads; rrr++) {
+            random_read(&c, read_bufs[rrr], &c.lens[rrr], &rng);
+            c.reads[rrr] = read_bufs[rrr];
+        }
+        if (diff_run(&c) != 0) {
+            fprintf(stderr, "Rerun with: -s %llu -n 1\n",
+                    (unsigned long long)(seed + ccc));
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%zu barcode sets (%zu indexed), %zu reads (%zu assigned): "
+            "all engines agree\n", diff_seen.cases, diff_seen.indexed,
+            diff_seen.reads, diff_seen.assigned);
+    return EXIT_SUCCESS;
+}
+
+#endif /* FDB_FUZZ */
@@ -15,12 +15,1352 @@
  *
  * ============================================================================
  */
+#include <ctype.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "tinytest.h"
 #include "tinytest_macros.h"
 
+#include "fdb.h"
+#include "fdb_batch.h"
+#include "fdb_ckpt.h"
+#include "fdb_gzidx.h"
+#include "fdb_outq.h"
+#include "fdb_match.h"
+#include "fdb_codec.h"
+#include "fdb_filter.h"
+#include "fdb_rescue.h"
+#include "fdb_stats.h"
+
+
+static void
+test_hamming_max (void *ptr)
+{
+    (void) ptr;
+    tt_uint_op(fdb_hamming_max("ACGT", 4, "ACGTAAAA", 8, 3), ==, 0);
+    tt_uint_op(fdb_hamming_max("ACGT", 4, "ACCTAAAA", 8, 3), ==, 1);
+    tt_uint_op(fdb_hamming_max("ACGT", 4, "TGCAAAAA", 8, 3), ==, 3);
+    /* A read shorter than the barcode: missing bases mismatch */
+    tt_uint_op(fdb_hamming_max("ACGT", 4, "AC", 2, 5), ==, 2);
+    tt_uint_op(fdb_hamming_max("ACGT", 4, "", 0, 3), ==, 3);
+end:
+    ;
+}
+
+static void
+test_matcher_match (void *ptr)
+{
+    const char *bcds[] = {"ACGT", "GGGG", "ACGA", "ACGTTT"};
+    fdb_matcher_t *m = fdb_matcher_new(bcds, 4, 2, NULL, 0);
+    size_t mm = 0;
+    (void) ptr;
+    tt_assert(m != NULL);
+    tt_uint_op(m->max_len, ==, 6);
+    tt_int_op(fdb_matcher_match(m, "GGGGAAAA", 8, &mm), ==, 1);
+    tt_uint_op(mm, ==, 0);
+    /* Longer barcode wins a tie */
+    tt_int_op(fdb_matcher_match(m, "ACGTTTAA", 8, &mm), ==, 3);
+    /* Equal length and score: the later barcode wins */
+    tt_int_op(fdb_matcher_match(m, "ACGCCCCC", 8, &mm), ==, 2);
+    tt_uint_op(mm, ==, 1);
+    /* Must have fewer than max_mismatches */
+    tt_int_op(fdb_matcher_match(m, "TTTTTTTT", 8, NULL), ==, FDB_NO_MATCH);
+    tt_int_op(fdb_matcher_match(m, "CCGGAAAA", 8, NULL), ==, FDB_NO_MATCH);
+    /* Short reads don't read past their end */
+    tt_int_op(fdb_matcher_match(m, "GGG", 3, &mm), ==, 1);
+    tt_uint_op(mm, ==, 1);
+    tt_int_op(fdb_matcher_match(m, "", 0, NULL), ==, FDB_NO_MATCH);
+end:
+    fdb_matcher_destroy(m);
+}
+
+static void
+test_matcher_buffer (void *ptr)
+{
+    const char *bcds[] = {"ACGT", "ACGTT"};
+    fdb_matcher_t *m = fdb_matcher_new(bcds, 2, 1, "GG", 0);
+    (void) ptr;
+    tt_assert(m != NULL);
+    tt_int_op(fdb_matcher_match(m, "ACGTGGAA", 8, NULL), ==, 0);
+    tt_int_op(fdb_matcher_match(m, "ACGTTGGA", 8, NULL), ==, 1);
+    tt_int_op(fdb_matcher_match(m, "ACGTCCAA", 8, NULL), ==, FDB_NO_MATCH);
+    tt_int_op(fdb_matcher_match(m, "ACGTG", 5, NULL), ==, FDB_NO_MATCH);
+end:
+    fdb_matcher_destroy(m);
+}
+
+static void
+test_matcher_classify (void *ptr)
+{
+    const char *bcds[] = {"AAAA", "CCCCC"};
+    const char *seqs[] = {"AAAATTTT", "CCCCCTTT", "GGGGGGGG", "CCCC"};
+    size_t lens[] = {8, 8, 8, 4};
+    int32_t assign[4];
+    uint32_t trim[4];
+    uint32_t mm[4];
+    fdb_matcher_t *m = fdb_matcher_new(bcds, 2, 2, NULL, 0);
+    (void) ptr;
+    tt_assert(m != NULL);
+    tt_int_op(fdb_matcher_classify(m, seqs, lens, 4, assign, trim, mm), ==, 3);
+    tt_int_op(assign[0], ==, 0);
+    tt_uint_op(trim[0], ==, 4);
+    tt_int_op(assign[1], ==, 1);
+    tt_uint_op(trim[1], ==, 5);
+    tt_int_op(assign[2], ==, FDB_NO_MATCH);
+    tt_uint_op(trim[2], ==, 0);
+    tt_uint_op(mm[2], ==, 2);
+    /* Matched with a base missing: trimmed to its end, not past it */
+    tt_int_op(assign[3], ==, 1);
+    tt_uint_op(trim[3], ==, 4);
+    tt_uint_op(mm[3], ==, 1);
+    /* Mismatch counts are optional */
+    tt_int_op(fdb_matcher_classify(m, seqs, lens, 4, assign, trim, NULL), ==,
+            3);
+end:
+    fdb_matcher_destroy(m);
+}
+
+static void
+test_matcher_new_bad (void *ptr)
+{
+    const char *bcds[] = {"ACGT", ""};
+    (void) ptr;
+    tt_ptr_op(fdb_matcher_new(bcds, 2, 1, NULL, 0), ==, NULL);
+    tt_ptr_op(fdb_matcher_new(bcds, 1, -1, NULL, 0), ==, NULL);
+end:
+    ;
+}
+
+static void
+random_seq (char *seq, size_t len, const char *alphabet)
+{
+    size_t n = strlen(alphabet);
+    for (size_t iii = 0; iii < len; iii++) {
+        seq[iii] = alphabet[rand() % n];
+    }
+    seq[len] = '\0';
+}
+
+static void
+test_matcher_index (void *ptr)
+{
+    const size_t lens[] = {4, 5, 6, 8};
+    char bcd_buf[40][9];
+    const char *bcds[40];
+    char read[24];
+    fdb_matcher_t *scan = NULL, *idx = NULL;
+    (void) ptr;
+    srand(42);
+    for (int trial = 0; trial < 200; trial++) {
+        size_t n = 1 + rand() % 40;
+        int max_mm = rand() % 4;
+        const char *buffer = rand() % 3 == 0 ? "GT" : NULL;
+        for (size_t bbb = 0; bbb < n; bbb++) {
+            /* Few distinct bases, so barcodes crowd and tie */
+            random_seq(bcd_buf[bbb], lens[rand() % 4], "ACGT" + rand() % 3);
+            bcds[bbb] = bcd_buf[bbb];
+        }
+        scan = fdb_matcher_new(bcds, n, max_mm, buffer, rand() % 2);
+        idx = fdb_matcher_new(bcds, n, max_mm, scan->buffer_seq,
+                scan->max_buffer_mismatches);
+        tt_assert(scan != NULL && idx != NULL);
+        tt_int_op(fdb_matcher_compile(idx), ==, 0);
+        tt_assert(idx->index != NULL);
+        for (int rrr = 0; rrr < 200; rrr++) {
+            size_t len = rand() % 5 == 0 ? rand() % 10 : 10 + rand() % 12;
+            size_t mm_scan = 0, mm_idx = 0;
+            int res_scan, res_idx;
+            random_seq(read, len, rand() % 4 == 0 ? "ACGTN" : "ACGT");
+            if (len > 0 && rand() % 2) {
+                /* Start with a barcode, maybe mutated */
+                const char *bcd = bcds[rand() % n];
+                memcpy(read, bcd, strlen(bcd) < len ? strlen(bcd) : len);
+                read[rand() % len] = "ACGT"[rand() % 4];
+            }
+            res_scan = fdb_matcher_match(scan, read, len, &mm_scan);
+            res_idx = fdb_matcher_match(idx, read, len, &mm_idx);
+            tt_int_op(res_idx, ==, res_scan);
+            tt_uint_op(mm_idx, ==, mm_scan);
+        }
+        fdb_matcher_destroy(scan);
+        fdb_matcher_destroy(idx);
+        scan = idx = NULL;
+    }
+    /* Only ACGT barcodes of at most 32 bases can be indexed */
+    bcds[0] = "ACGN";
+    idx = fdb_matcher_new(bcds, 1, 1, NULL, 0);
+    tt_int_op(fdb_matcher_compile(idx), ==, 1);
+    tt_ptr_op(idx->index, ==, NULL);
+    tt_int_op(fdb_matcher_match(idx, "ACGNA", 5, NULL), ==, 0);
+end:
+    fdb_matcher_destroy(scan);
+    fdb_matcher_destroy(idx);
+}
+
+/* A plate's worth of 12 base barcodes at -m 3, whose neighbourhoods out to
+ * 3 mismatches wouldn't fit in an index */
+#define LARGE_N_BARCODES 1536
+#define LARGE_LEN 12
+
+static void
+test_matcher_index_large (void *ptr)
+{
+    static char bcd_buf[LARGE_N_BARCODES][LARGE_LEN + 1];
+    const char *bcds[LARGE_N_BARCODES];
+    char read[LARGE_LEN + 21];
+    fdb_matcher_t *scan = NULL, *idx = NULL;
+    size_t n_assigned = 0, n_at_max = 0;
+    (void) ptr;
+    srand(1536);
+    for (size_t bbb = 0; bbb < LARGE_N_BARCODES; bbb++) {
+        size_t ccc = 0;
+        random_seq(bcd_buf[bbb], LARGE_LEN, "ACGT");
+        for (ccc = 0; ccc < bbb; ccc++) {
+            if (strcmp(bcd_buf[ccc], bcd_buf[bbb]) == 0) break;
+        }
+        if (ccc < bbb) {
+            bbb--;
+            continue;
+        }
+        bcds[bbb] = bcd_buf[bbb];
+    }
+    scan = fdb_matcher_new(bcds, LARGE_N_BARCODES, 3, NULL, 0);
+    idx = fdb_matcher_new(bcds, LARGE_N_BARCODES, 3, NULL, 0);
+    tt_assert(scan != NULL && idx != NULL);
+    tt_int_op(fdb_matcher_compile(idx), ==, 0);
+    tt_assert(idx->index != NULL);
+    for (int rrr = 0; rrr < 4000; rrr++) {
+        size_t mm_scan = 0, mm_idx = 0;
+        int res_scan, res_idx;
+        random_seq(read, LARGE_LEN + 20, "ACGT");
+        if (rrr % 8 != 0) {
+            /* A barcode with up to 4 errors */
+            memcpy(read, bcds[rand() % LARGE_N_BARCODES], LARGE_LEN);
+            for (int eee = rand() % 5; eee > 0; eee--) {
+                read[rand() % LARGE_LEN] = "ACGT"[rand() % 4];
+            }
+        }
+        res_scan = fdb_matcher_match(scan, read, LARGE_LEN + 20, &mm_scan);
+        res_idx = fdb_matcher_match(idx, read, LARGE_LEN + 20, &mm_idx);
+        tt_int_op(res_idx, ==, res_scan);
+        tt_uint_op(mm_idx, ==, mm_scan);
+        n_assigned += res_idx != FDB_NO_MATCH;
+        n_at_max += mm_idx == 3;
+    }
+    tt_assert(n_assigned > 2000);
+    tt_assert(n_at_max > 500);
+end:
+    fdb_matcher_destroy(scan);
+    fdb_matcher_destroy(idx);
+}
+
+static void
+test_matcher_index_file (void *ptr)
+{
+    const char *bcds[] = {"ACGT", "GGGG", "ACGA", "ACGTTT"};
+    char fn[] = "/tmp/fdb_test_midx_XXXXXX";
+    fdb_matcher_t *m = fdb_matcher_new(bcds, 4, 2, "CC", 1);
+    fdb_matcher_t *loaded = NULL;
+    FILE *fp = NULL;
+    int fd = mkstemp(fn);
+    (void) ptr;
+    tt_assert(m != NULL && fd >= 0);
+    close(fd);
+    tt_int_op(fdb_matcher_save_index(m, fn), ==, 0);
+    loaded = fdb_matcher_load_index(fn);
+    tt_assert(loaded != NULL);
+    tt_assert(loaded->index_mapped);
+    tt_assert(fdb_matcher_is(loaded, bcds, 4, 2, "CC", 1));
+    tt_assert(!fdb_matcher_is(loaded, bcds, 4, 1, "CC", 1));
+    tt_assert(!fdb_matcher_is(loaded, bcds, 4, 2, NULL, 0));
+    tt_int_op(fdb_matcher_match(loaded, "ACGTTTCCAA", 10, NULL), ==, 3);
+    tt_int_op(fdb_matcher_match(loaded, "GGGGCAAAAA", 10, NULL), ==, 1);
+    tt_int_op(fdb_matcher_match(loaded, "GGGGAAAAAA", 10, NULL), ==,
+            FDB_NO_MATCH);
+    fdb_matcher_destroy(loaded);
+    /* A truncated index is refused */
+    fp = fopen(fn, "r+b");
+    tt_assert(fp != NULL);
+    tt_int_op(ftruncate(fileno(fp), 64), ==, 0);
+    fclose(fp);
+    loaded = fdb_matcher_load_index(fn);
+    tt_ptr_op(loaded, ==, NULL);
+end:
+    unlink(fn);
+    fdb_matcher_destroy(m);
+    fdb_matcher_destroy(loaded);
+}
+
+static void
+test_matcher_copy (void *ptr)
+{
+    const char *bcds[] = {"ACGT", "GGGG", "ACGA", "ACGTTT"};
+    const char *reads[] = {"ACGTTTCCAA", "GGGGCAAAAA", "GGGGAAAAAA", "ACGACC"};
+    fdb_matcher_t *m = fdb_matcher_new(bcds, 4, 2, "CC", 1);
+    fdb_matcher_t *copy = NULL;
+    (void) ptr;
+    tt_assert(m != NULL);
+    tt_int_op(fdb_matcher_compile(m), ==, 0);
+    copy = fdb_matcher_copy(m);
+    tt_assert(copy != NULL);
+    tt_assert(copy->index != NULL && copy->index != m->index);
+    tt_assert(fdb_matcher_is(copy, bcds, 4, 2, "CC", 1));
+    for (int iii = 0; iii < 4; iii++) {
+        size_t mm1 = 0, mm2 = 0;
+        size_t len = strlen(reads[iii]);
+        tt_int_op(fdb_matcher_match(copy, reads[iii], len, &mm2), ==,
+                fdb_matcher_match(m, reads[iii], len, &mm1));
+        tt_uint_op(mm1, ==, mm2);
+    }
+end:
+    fdb_matcher_destroy(m);
+    fdb_matcher_destroy(copy);
+}
+
+static void
+test_stats (void *ptr)
+{
+    const char *bcds[] = {"ACGT", "GGGG"};
+    fdb_matcher_t *m = fdb_matcher_new(bcds, 2, 2, NULL, 0);
+    fdb_stats_t *st = NULL, *st2 = NULL;
+    (void) ptr;
+    tt_assert(m != NULL);
+    st = fdb_stats_new(m);
+    st2 = fdb_stats_new(m);
+    tt_assert(st != NULL && st2 != NULL);
+    tt_uint_op(st->n_bins, ==, 3);
+    fdb_stats_add(st, m, "ACGTAA", 6, "IIII##", 6, 0, 0);
+    fdb_stats_add(st, m, "ACCTAA", 6, "IIIIII", 6, 0, 1);
+    fdb_stats_add(st, m, "GGG", 3, NULL, 0, 1, 1);
+    for (int iii = 0; iii < 50; iii++) {
+        fdb_stats_add(st2, m, "TTTTAA", 6, "######", 6, FDB_NO_MATCH, 3);
+    }
+    fdb_stats_add(st2, m, "CCCCAA", 6, "######", 6, FDB_NO_MATCH, 7);
+    fdb_stats_add(st2, m, "CCC", 3, "###", 3, FDB_NO_MATCH, 2);
+    tt_int_op(fdb_stats_merge(st, st2), ==, 0);
+    tt_uint_op(st->reads[0], ==, 2);
+    tt_uint_op(st->mm_hist[0 * 3 + 1], ==, 1);
+    /* Mismatch at position 2, and a base missing at position 3 */
+    tt_uint_op(st->pos_mm[0 * 4 + 2], ==, 1);
+    tt_uint_op(st->pos_mm[1 * 4 + 3], ==, 1);
+    tt_uint_op(st->qual_sum[0], ==, 40 * 10 + 2 * 2);
+    tt_uint_op(st->qual_bases[1], ==, 0);
+    /* Leftovers: capped mismatches, and prefixes of 4 bases */
+    tt_uint_op(st->reads[2], ==, 52);
+    tt_uint_op(st->mm_hist[2 * 3 + 2], ==, 52);
+    tt_uint_op(fdb_stats_prefix_count(st, "TTTT"), >=, 50);
+    tt_uint_op(fdb_stats_prefix_count(st, "CCCC"), >=, 1);
+    tt_uint_op(st->n_top, ==, 2);
+    tt_str_op(st->top[0].seq, ==, "TTTT");
+    /* Stats of another matcher can't be merged */
+    fdb_stats_destroy(st2);
+    m->max_mismatches = 1;
+    st2 = fdb_stats_new(m);
+    tt_int_op(fdb_stats_merge(st, st2), ==, 1);
+end:
+    fdb_stats_destroy(st);
+    fdb_stats_destroy(st2);
+    fdb_matcher_destroy(m);
+}
+
+static void
+test_rescue (void *ptr)
+{
+    const char *bcds[] = {"ACGTACGT", "TTGGCCAA"};
+    fdb_matcher_t *m = fdb_matcher_new(bcds, 2, 2, NULL, 0);
+    fdb_rescue_t *r = NULL;
+    size_t mm = 0;
+    (void) ptr;
+    tt_assert(m != NULL);
+    r = fdb_rescue_new(m, 0.9);
+    tt_assert(r != NULL && r->spill != NULL);
+    /* Errors only ever seen in the last base */
+    for (int iii = 0; iii < 1000; iii++) {
+        fdb_rescue_learn(r, m, "ACGTACGTAA", 10, 0, 0);
+        fdb_rescue_learn(r, m, "TTGGCCAACC", 10, 1, 0);
+    }
+    for (int iii = 0; iii < 300; iii++) {
+        fdb_rescue_learn(r, m, "ACGTACGGAA", 10, 0, 1);
+    }
+    for (int iii = 0; iii < 100; iii++) {
+        fdb_rescue_learn(r, m, "CATCATCATC", 10, FDB_NO_MATCH, 3);
+    }
+    tt_uint_op(r->pos_errs[7], ==, 300);
+    tt_uint_op(r->pos_errs[0], ==, 0);
+    tt_int_op(fdb_rescue_fit(r, m), ==, 0);
+    tt_assert(r->log_err[7] > r->log_err[0]);
+    /* Ns say nothing, so two don't stop a read being rescued */
+    tt_int_op(fdb_rescue_assign(r, m, "ACNTACNTAA", 10, &mm), ==, 0);
+    tt_uint_op(mm, ==, 2);
+    tt_int_op(fdb_rescue_assign(r, m, "TTGGCNAACC", 10, &mm), ==, 1);
+    /* Two errors where they're rare is likelier no barcode at all */
+    tt_int_op(fdb_rescue_assign(r, m, "AGGTACCTAA", 10, &mm), ==,
+            FDB_NO_MATCH);
+    tt_int_op(fdb_rescue_assign(r, m, "CATCATCATC", 10, &mm), ==,
+            FDB_NO_MATCH);
+end:
+    fdb_rescue_destroy(r);
+    fdb_matcher_destroy(m);
+}
+
+/* Barcodes with 6% errors per base, most of them at -m 2 left over with
+ * two, and random reads */
+#define FIT_N_BARCODES 4
+#define FIT_LEN 10
+#define FIT_READS 20000
+#define FIT_RANDOM 4000
+
+static int
+fit_distance (const char *a, const char *b)
+{
+    int dist = 0;
+    for (size_t iii = 0; iii < FIT_LEN; iii++) dist += a[iii] != b[iii];
+    return dist;
+}
+
+static void
+test_rescue_fit (void *ptr)
+{
+    char bcd_buf[FIT_N_BARCODES][FIT_LEN + 1];
+    const char *bcds[FIT_N_BARCODES];
+    char (*left)[FIT_LEN + 31] = NULL;
+    char read[FIT_LEN + 31];
+    fdb_matcher_t *m = NULL;
+    fdb_rescue_t *r = NULL;
+    size_t n_left = 0, mm = 0;
+    double err = 0;
+    int settled = 0;
+    (void) ptr;
+    srand(37);
+    /* Well apart, so a read two errors from one is far from the others */
+    for (size_t bbb = 0; bbb < FIT_N_BARCODES; bbb++) {
+        size_t ccc = 0;
+        random_seq(bcd_buf[bbb], FIT_LEN, "ACGT");
+        for (ccc = 0; ccc < bbb; ccc++) {
+            if (fit_distance(bcd_buf[ccc], bcd_buf[bbb]) < 6) break;
+        }
+        if (ccc < bbb) {
+            bbb--;
+            continue;
+        }
+        bcds[bbb] = bcd_buf[bbb];
+    }
+    m = fdb_matcher_new(bcds, FIT_N_BARCODES, 2, NULL, 0);
+    tt_assert(m != NULL);
+    r = fdb_rescue_new(m, 0.99);
+    left = calloc(FIT_READS + FIT_RANDOM, sizeof(*left));
+    tt_assert(r != NULL && left != NULL);
+    for (size_t rrr = 0; rrr < FIT_READS + FIT_RANDOM; rrr++) {
+        int bcd = 0;
+        random_seq(read, FIT_LEN + 30, "ACGT");
+        if (rrr < FIT_READS) {
+            memcpy(read, bcds[rand() % FIT_N_BARCODES], FIT_LEN);
+            for (size_t iii = 0; iii < FIT_LEN; iii++) {
+                /* Always to another base */
+                if (rand() % 100 < 6) read[iii] = "ACGTACG"[strchr("ACGT",
+                            read[iii]) - "ACGT" + 1 + rand() % 3];
+            }
+        }
+        bcd = fdb_matcher_match(m, read, FIT_LEN + 30, &mm);
+        fdb_rescue_learn(r, m, read, FIT_LEN + 30, bcd, mm);
+        if (bcd == FDB_NO_MATCH) memcpy(left[n_left++], read, sizeof(*left));
+    }
+    fdb_rescue_fit(r, m);
+    for (int round = 0; round < FDB_RESCUE_ROUNDS && !settled; round++) {
+        for (size_t lll = 0; lll < n_left; lll++) {
+            fdb_rescue_expect(r, m, left[lll], FIT_LEN + 30);
+        }
+        settled = fdb_rescue_fit(r, m);
+    }
+    tt_assert(settled);
+    /* The fit finds the errors the first pass left over */
+    for (size_t iii = 0; iii < FIT_LEN; iii++) err += 3 * exp(r->log_err[iii]);
+    tt_assert(err / FIT_LEN > 0.055 && err / FIT_LEN < 0.065);
+    /* Two errors from a barcode, at -m 2, is still surely its read */
+    memcpy(read, bcds[1], FIT_LEN);
+    read[2] = read[2] == 'A' ? 'C' : 'A';
+    read[7] = read[7] == 'G' ? 'T' : 'G';
+    tt_int_op(fdb_matcher_match(m, read, FIT_LEN + 30, NULL), ==,
+            FDB_NO_MATCH);
+    tt_int_op(fdb_rescue_assign(r, m, read, FIT_LEN + 30, &mm), ==, 1);
+    tt_uint_op(mm, ==, 2);
+    /* But random reads aren't anyone's */
+    random_seq(read, FIT_LEN + 30, "ACGT");
+    tt_int_op(fdb_rescue_assign(r, m, read, FIT_LEN + 30, &mm), ==,
+            FDB_NO_MATCH);
+end:
+    free(left);
+    fdb_rescue_destroy(r);
+    fdb_matcher_destroy(m);
+}
+
+static void
+test_filter (void *ptr)
+{
+    /* The contaminant's reverse complement, and a random read */
+    const char *contam = "GAGTTTTATCGCTTCCATGACGCAGAAGTTAACACTTTCGGATATTTCTG";
+    const char *rc = "CAGAAATATCCGAAAGTGTTAACTTCTGCGTCATGGAAGCGATAAAACTC";
+    const char *other = "ACGTACGTTTGACCATGCAAGTCGATCGGATTACAGGCTAGCATTCAGTG";
+    fdb_filter_t *f = fdb_filter_new(8, 0.25);
+    (void) ptr;
+    tt_assert(f != NULL);
+    tt_int_op(fdb_filter_check(f, "ACGTACG", 7), ==, FDB_FILTER_SHORT);
+    tt_int_op(fdb_filter_check(f, "ACGTACGT", 8), ==, FDB_FILTER_PASS);
+    tt_int_op(fdb_filter_check(f, "ACNNACGT", 8), ==, FDB_FILTER_PASS);
+    tt_int_op(fdb_filter_check(f, "ACNNANGT", 8), ==, FDB_FILTER_NS);
+    /* No contaminants yet */
+    tt_int_op(fdb_filter_check(f, rc, 50), ==, FDB_FILTER_PASS);
+    tt_int_op(fdb_filter_bloom(f, 32, 50), !=, 0);
+    tt_int_op(fdb_filter_bloom(f, 21, 50), ==, 0);
+    fdb_filter_add(f, contam, 50);
+    tt_int_op(fdb_filter_check(f, contam + 10, 30), ==, FDB_FILTER_CONTAM);
+    tt_int_op(fdb_filter_check(f, rc, 50), ==, FDB_FILTER_CONTAM);
+    tt_int_op(fdb_filter_check(f, other, 50), ==, FDB_FILTER_PASS);
+end:
+    fdb_filter_destroy(f);
+}
+
+static void
+test_ofile_aio (void *ptr)
+{
+    const char *fn = "test_ofile_aio.fq";
+    size_t len = 3 * FDB_AIO_BUF_SIZE + 1234;
+    char *data = malloc(len);
+    char *back = malloc(len + 1);
+    fdb_aio_t *aio = fdb_aio_create(FDB_AIO_THREADS, 2);
+    fdb_ofile_t *of = NULL;
+    FILE *fp = NULL;
+    (void) ptr;
+    tt_assert(aio != NULL);
+    aio->direct = 1;
+    for (size_t iii = 0; iii < len; iii++) data[iii] = "ACGT\n"[iii % 5];
+    /* Odd sized writes, and an append from an unaligned length */
+    of = fdb_ofile_open(fn, -1, 0, aio);
+    tt_assert(of != NULL);
+    for (size_t off = 0; off < len / 2; off += 7777) {
+        size_t l = off + 7777 > len / 2 ? len / 2 - off : 7777;
+        tt_int_op(fdb_ofile_write(of, data + off, l), ==, 0);
+    }
+    tt_int_op(fdb_ofile_close(of), ==, 0);
+    of = fdb_ofile_open(fn, -1, 1, aio);
+    tt_assert(of != NULL);
+    tt_int_op(fdb_ofile_write(of, data + len / 2, len - len / 2), ==, 0);
+    tt_int_op(fdb_ofile_close(of), ==, 0);
+    of = NULL;
+    fp = fopen(fn, "rb");
+    tt_assert(fp != NULL);
+    tt_int_op(fread(back, 1, len + 1, fp), ==, len);
+    tt_int_op(memcmp(back, data, len), ==, 0);
+end:
+    if (fp != NULL) fclose(fp);
+    if (of != NULL) fdb_ofile_close(of);
+    remove(fn);
+    fdb_aio_destroy(aio);
+    free(data);
+    free(back);
+}
+
+static void
+test_ofile_park (void *ptr)
+{
+    const char *fn = "test_ofile_park.fq";
+    size_t len = 2 * FDB_AIO_BUF_SIZE + 4321;
+    char *data = malloc(len);
+    char *back = malloc(len + 1);
+    fdb_aio_t *aio = fdb_aio_create(FDB_AIO_THREADS, 2);
+    fdb_ofile_t *of = NULL;
+    FILE *fp = NULL;
+    (void) ptr;
+    tt_assert(aio != NULL);
+    aio->direct = 1;
+    for (size_t iii = 0; iii < len; iii++) data[iii] = "ACGT\n"[iii % 5];
+    of = fdb_ofile_open(fn, -1, 0, aio);
+    tt_assert(of != NULL);
+    /* Parked after every write, so each resumes from an unaligned tail */
+    for (size_t off = 0; off < len; off += 9999) {
+        size_t l = off + 9999 > len ? len - off : 9999;
+        tt_int_op(fdb_ofile_write(of, data + off, l), ==, 0);
+        tt_assert(fdb_ofile_mem(of) > 0);
+        tt_int_op(fdb_ofile_park(of), ==, 0);
+        tt_int_op(fdb_ofile_mem(of), ==, 0);
+    }
+    tt_int_op(fdb_ofile_close(of), ==, 0);
+    of = NULL;
+    fp = fopen(fn, "rb");
+    tt_assert(fp != NULL);
+    tt_int_op(fread(back, 1, len + 1, fp), ==, len);
+    tt_int_op(memcmp(back, data, len), ==, 0);
+end:
+    if (fp != NULL) fclose(fp);
+    if (of != NULL) fdb_ofile_close(of);
+    remove(fn);
+    fdb_aio_destroy(aio);
+    free(data);
+    free(back);
+}
+
+/* Several threads writing their own files through one I/O engine, so
+ * that they wait on each other's completions */
+#define AIO_WRITERS 4
+
+typedef struct {
+    fdb_aio_t *aio;
+    const char *data;
+    size_t len;
+    char fn[64];
+    int ret;
+} aio_writer_arg_t;
+
+static void *
+aio_writer (void *ptr)
+{
+    aio_writer_arg_t *arg = ptr;
+    fdb_ofile_t *of = fdb_ofile_open(arg->fn, -1, 0, arg->aio);
+    arg->ret = of == NULL;
+    for (size_t off = 0; of != NULL && off < arg->len; off += 5555) {
+        size_t l = off + 5555 > arg->len ? arg->len - off : 5555;
+        arg->ret |= fdb_ofile_write(of, arg->data + off, l);
+    }
+    arg->ret |= fdb_ofile_close(of);
+    return NULL;
+}
+
+static void
+test_aio_shared (void *ptr)
+{
+    size_t len = 4 * FDB_AIO_BUF_SIZE + 777;
+    char *data = malloc(len);
+    char *back = malloc(len + 1);
+    /* io_uring if built in, else the thread pool */
+    fdb_aio_t *aio = fdb_aio_create(FDB_AIO_URING, 2);
+    aio_writer_arg_t args[AIO_WRITERS];
+    pthread_t threads[AIO_WRITERS];
+    int n_started = 0, n_joined = 0;
+    (void) ptr;
+    tt_assert(aio != NULL);
+    random_seq(data, len - 1, "ACGT\n");
+    for (int www = 0; www < AIO_WRITERS; www++) {
+        args[www].aio = aio;
+        args[www].data = data;
+        args[www].len = len;
+        args[www].ret = 1;
+        snprintf(args[www].fn, sizeof(args[www].fn), "test_aio_shared_%d.fq",
+                www);
+    }
+    for (; n_started < AIO_WRITERS; n_started++) {
+        tt_int_op(pthread_create(&threads[n_started], NULL, aio_writer,
+                    &args[n_started]), ==, 0);
+    }
+    for (; n_joined < n_started; n_joined++) {
+        pthread_join(threads[n_joined], NULL);
+    }
+    for (int www = 0; www < AIO_WRITERS; www++) {
+        FILE *fp = NULL;
+        tt_int_op(args[www].ret, ==, 0);
+        fp = fopen(args[www].fn, "rb");
+        tt_assert(fp != NULL);
+        tt_int_op(fread(back, 1, len + 1, fp), ==, len);
+        fclose(fp);
+        tt_int_op(memcmp(back, data, len), ==, 0);
+    }
+end:
+    for (; n_joined < n_started; n_joined++) {
+        pthread_join(threads[n_joined], NULL);
+    }
+    for (int www = 0; www < n_started; www++) {
+        remove(args[www].fn);
+    }
+    fdb_aio_destroy(aio);
+    free(data);
+    free(back);
+}
+
+/* Inflates every gzip member of fn, strictly: anything after the last
+ * member must be another member. Returns the data, or NULL if it isn't
+ * valid gzip. */
+static char *
+inflate_members (const char *fn, size_t *len, size_t *n_members)
+{
+    FILE *fp = fopen(fn, "rb");
+    unsigned char in[16384];
+    size_t cap = 1 << 16;
+    char *out = malloc(cap);
+    z_stream strm;
+    int ret = Z_OK, ok = 0;
+    memset(&strm, 0, sizeof(strm));
+    *len = *n_members = 0;
+    if (fp == NULL || inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) goto exit;
+    while (1) {
+        if (strm.avail_in == 0) {
+            strm.avail_in = fread(in, 1, sizeof(in), fp);
+            strm.next_in = in;
+            if (strm.avail_in == 0) break;
+        }
+        if (*len == cap) out = realloc(out, cap <<= 1);
+        strm.next_out = (unsigned char *)out + *len;
+        strm.avail_out = cap - *len;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        *len = cap - strm.avail_out;
+        if (ret == Z_STREAM_END) {
+            (*n_members)++;
+            inflateReset(&strm);
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            goto exit;
+        }
+    }
+    /* Input ends between members */
+    ok = *n_members > 0 && ret == Z_STREAM_END;
+exit:
+    inflateEnd(&strm);
+    if (fp != NULL) fclose(fp);
+    if (!ok) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static void
+test_ofile_gz (void *ptr)
+{
+    const char *fn = "test_ofile_gz.fq.gz";
+    size_t len = 5 * FDB_OFILE_BLOCK / 2 + 1234;
+    char *data = malloc(len);
+    char *back = NULL;
+    size_t back_len = 0, n_members = 0;
+    fdb_aio_t *aio = fdb_aio_create(FDB_AIO_THREADS, 2);
+    fdb_ofile_t *of = NULL;
+    (void) ptr;
+    tt_assert(aio != NULL);
+    random_seq(data, len - 1, "ACGT\n");
+    /* Blocks, a park, and an append, with and without I/O threads */
+    for (int use_aio = 0; use_aio < 2; use_aio++) {
+        of = fdb_ofile_open(fn, -1, 0, use_aio ? aio : NULL);
+        tt_assert(of != NULL);
+        for (size_t off = 0; off < len / 2; off += 7777) {
+            size_t l = off + 7777 > len / 2 ? len / 2 - off : 7777;
+            tt_int_op(fdb_ofile_write(of, data + off, l), ==, 0);
+            if (off == 7777 * 10) tt_int_op(fdb_ofile_park(of), ==, 0);
+        }
+        tt_int_op(fdb_ofile_close(of), ==, 0);
+        of = fdb_ofile_open(fn, -1, 1, use_aio ? aio : NULL);
+        tt_assert(of != NULL);
+        tt_int_op(fdb_ofile_write(of, data + len / 2, len - len / 2), ==, 0);
+        tt_int_op(fdb_ofile_close(of), ==, 0);
+        of = NULL;
+        back = inflate_members(fn, &back_len, &n_members);
+        tt_assert(back != NULL);
+        tt_int_op(back_len, ==, len);
+        tt_int_op(memcmp(back, data, len), ==, 0);
+        tt_assert(n_members > 2);
+        free(back);
+        back = NULL;
+    }
+    /* An empty output must still be a gzip file */
+    of = fdb_ofile_open(fn, -1, 0, NULL);
+    tt_assert(of != NULL);
+    tt_int_op(fdb_ofile_close(of), ==, 0);
+    of = NULL;
+    back = inflate_members(fn, &back_len, &n_members);
+    tt_assert(back != NULL);
+    tt_int_op(back_len, ==, 0);
+    tt_int_op(n_members, ==, 1);
+end:
+    if (of != NULL) fdb_ofile_close(of);
+    remove(fn);
+    fdb_aio_destroy(aio);
+    free(data);
+    free(back);
+}
+
+/* Helpers for tests which run the whole pipeline on files in a temporary
+ * directory */
+static const char *pipe_bcds[] = {"ACTTCA", "ACGGAA", "TTGCAG", "GATCGT"};
+
+/* FASTQ of n reads, most starting with one of pipe_bcds (some with an
+ * error), gzipped if gz */
+static int
+write_reads (const char *fn, size_t n, int gz)
+{
+    gzFile fp = gzopen(fn, gz ? "wb" : "wT");
+    char seq[61], qual[61];
+    if (fp == NULL) return 1;
+    srand(7);
+    for (size_t rrr = 0; rrr < n; rrr++) {
+        random_seq(seq, 60, "ACGT");
+        if (rand() % 8 != 0) memcpy(seq, pipe_bcds[rand() % 4], 6);
+        if (rand() % 8 == 0) seq[rand() % 6] = 'N';
+        /* Phred+33 qualities, so some lines start with '@' */
+        for (size_t iii = 0; iii < 60; iii++) qual[iii] = '#' + rand() % 40;
+        qual[60] = '\0';
+        gzprintf(fp, "@read%zu %s\n%s\n+\n%s\n", rrr,
+                rrr % 3 ? "1:N:0" : "", seq, qual);
+    }
+    return gzclose(fp) != Z_OK;
+}
+
+/* Four barcodes named bcd0 to bcd3 */
+static int
+write_barcodes (const char *fn, const char **seqs)
+{
+    FILE *fp = fopen(fn, "w");
+    if (fp == NULL) return 1;
+    for (size_t bbb = 0; bbb < 4; bbb++) {
+        fprintf(fp, ">bcd%zu\n%s\n", bbb, seqs[bbb]);
+    }
+    return fclose(fp) != 0;
+}
+
+/* Runs the pipeline on argv as main() does. With n_batches, it stops after
+ * that many batches of reads, checkpointing after the first, as if it were
+ * killed. */
+static int
+run_fdb (int argc, char **argv, int n_batches)
+{
+    fdb_config_t *cfg = calloc(1, sizeof(*cfg));
+    fdb_batch_t *batch = NULL;
+    fdb_results_t res;
+    int ret = 1;
+    memset(&res, 0, sizeof(res));
+    optind = 0;
+    if (parse_args(cfg, argc, argv) || parse_barcode_file(cfg) || \
+            setup_files(cfg)) goto exit;
+    if (n_batches == 0) {
+        ret = fdb_main(cfg);
+        goto exit;
+    }
+    cfg->batch_pool = fdb_batch_pool_create();
+    for (int bbb = 0; bbb < n_batches; bbb++) {
+        batch = fdb_batch_get(cfg->batch_pool);
+        if (batch == NULL || \
+                fdb_batch_fill(batch, cfg->in_kseqs[0], 0, UINT64_MAX) == 0 || \
+                fdb_process_batch(cfg, batch, &res)) goto exit;
+        if (bbb == 0 && fdb_ckpt_save(cfg, 0, batch->end_offset)) goto exit;
+        fdb_batch_put(cfg->batch_pool, batch);
+        batch = NULL;
+    }
+    ret = 0;
+exit:
+    if (batch != NULL) fdb_batch_put(cfg->batch_pool, batch);
+    fdb_results_free(&res);
+    fdb_config_destroy(cfg);
+    free(cfg);
+    return ret;
+}
+
+/* A file's contents, decompressed if need be */
+static char *
+slurp (const char *fn, size_t *len)
+{
+    gzFile fp = gzopen(fn, "rb");
+    size_t cap = 1 << 16;
+    char *buf = malloc(cap);
+    int got = 0;
+    *len = 0;
+    if (fp == NULL) {
+        free(buf);
+        return NULL;
+    }
+    while ((got = gzread(fp, buf + *len, cap - *len)) > 0) {
+        *len += got;
+        if (*len == cap) buf = realloc(buf, cap <<= 1);
+    }
+    gzclose(fp);
+    if (got < 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Whether the files in dirs a and b have the same names and contents.
+ * Returns the total length of their contents, or 0 if they differ. */
+static size_t
+same_outputs (const char *a, const char *b)
+{
+    DIR *dir = opendir(a);
+    struct dirent *ent = NULL;
+    size_t total = 0, n_a = 0, n_b = 0;
+    char fn_a[4096], fn_b[4096];
+    if (dir == NULL) return 0;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len_a = 0, len_b = 0;
+        char *buf_a = NULL, *buf_b = NULL;
+        int same = 0;
+        if (ent->d_name[0] == '.') continue;
+        snprintf(fn_a, sizeof(fn_a), "%s/%s", a, ent->d_name);
+        snprintf(fn_b, sizeof(fn_b), "%s/%s", b, ent->d_name);
+        buf_a = slurp(fn_a, &len_a);
+        buf_b = slurp(fn_b, &len_b);
+        same = buf_a != NULL && buf_b != NULL && len_a == len_b && \
+               memcmp(buf_a, buf_b, len_a) == 0;
+        free(buf_a);
+        free(buf_b);
+        if (!same) {
+            closedir(dir);
+            return 0;
+        }
+        total += len_a;
+        n_a++;
+    }
+    closedir(dir);
+    dir = opendir(b);
+    if (dir == NULL) return 0;
+    while ((ent = readdir(dir)) != NULL) n_b += ent->d_name[0] != '.';
+    closedir(dir);
+    return n_a == n_b ? total : 0;
+}
+
+/* Removes dir and the files in it */
+static void
+remove_dir (const char *dir)
+{
+    DIR *dp = opendir(dir);
+    struct dirent *ent = NULL;
+    char fn[4096];
+    if (dp == NULL) return;
+    while ((ent = readdir(dp)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(fn, sizeof(fn), "%s/%s", dir, ent->d_name);
+        remove_dir(fn);
+        remove(fn);
+    }
+    closedir(dp);
+    rmdir(dir);
+}
+
+/* Writes l chars of field to fp in lines of at most width, or on one line
+ * if width is 0 */
+static void
+put_lines (gzFile fp, const char *field, size_t l, size_t width,
+           const char *eol)
+{
+    size_t off = 0;
+    do {
+        size_t n = width == 0 || l - off < width ? l - off : width;
+        gzwrite(fp, field + off, n);
+        gzputs(fp, eol);
+        off += n;
+    } while (off < l);
+}
+
+/* Reads in the forms kseq copes with: FASTA or FASTQ, wrapped or not, with
+ * CRLF, blank lines, odd comments and quality lines starting '@', after a
+ * line of junk. trunc cuts the file short mid-record. */
+static int
+write_odd_reads (const char *fn, int gz, int fasta, int crlf, size_t n,
+                 size_t trunc)
+{
+    gzFile fp = gzopen(fn, gz ? "wb" : "wT");
+    const char *comments[] = {"", " 1:N:0", "\tx y", " ", " \r"};
+    const char *eol = crlf ? "\r\n" : "\n";
+    char seq[301], qual[301];
+    size_t width = 0;
+    if (fp == NULL) return 1;
+    srand(11);
+    gzputs(fp, "junk\n");
+    for (size_t rrr = 0; rrr < n; rrr++) {
+        size_t len = rand() % 10 == 0 ? rand() % 3 : rand() % 300;
+        random_seq(seq, len, "ACGTN");
+        for (size_t iii = 0; iii < len; iii++) qual[iii] = '!' + rand() % 41;
+        width = rand() % 4 == 0 ? 1 + rand() % 80 : 0;
+        gzprintf(fp, "%c%s%zu%s%s", fasta ? '>' : '@', "read", rrr,
+                comments[rand() % 5], eol);
+        put_lines(fp, seq, len, width, eol);
+        if (rand() % 8 == 0) gzputs(fp, eol);
+        if (fasta) continue;
+        gzprintf(fp, "+%s%s", rand() % 2 ? "" : "read", eol);
+        put_lines(fp, qual, len, width, eol);
+    }
+    if (trunc > 0) gzputs(fp, fasta ? ">last\nACGT" : "@last\nACGT\n+\nAC");
+    return gzclose(fp) != Z_OK;
+}
+
+static int
+same_field (const char *s, size_t l, const kstring_t *ref)
+{
+    return l == ref->l && (l == 0 || memcmp(s, ref->s, l) == 0) && \
+            s[l] == '\0';
+}
+
+/* Whether batches parse fn exactly as kseq_read() does, reads, offsets and
+ * all, after reading a few reads with kseq first. Returns reads parsed. */
+static size_t
+fill_like_kseq (const char *fn)
+{
+    fdb_infile_t *ref_in = fdb_infile_open(fn), *in = fdb_infile_open(fn);
+    kseq_t *ref = kseq_init(ref_in), *seq = kseq_init(in);
+    fdb_batch_pool_t *pool = fdb_batch_pool_create();
+    fdb_batch_t *b = fdb_batch_get(pool);
+    size_t n = 0;
+    int ok = 0;
+    for (size_t rrr = 0; rrr < 3; rrr++) {
+        kseq_read(ref);
+        kseq_read(seq);
+    }
+    while (fdb_batch_fill(b, seq, 0, UINT64_MAX) > 0) {
+        for (size_t rrr = 0; rrr < b->n_recs; rrr++) {
+            fdb_rec_t *rec = &b->recs[rrr];
+            if (kseq_read(ref) < 0 || \
+                    !same_field(FDB_REC_NAME(b, rec), rec->name_l,
+                        &ref->name) || \
+                    !same_field(FDB_REC_COMMENT(b, rec), rec->comment_l,
+                        &ref->comment) || \
+                    !same_field(FDB_REC_SEQ(b, rec), rec->seq_l, &ref->seq) || \
+                    !same_field(FDB_REC_QUAL(b, rec), rec->qual_l,
+                        &ref->qual)) {
+                goto exit;
+            }
+            n++;
+        }
+        /* Not at the end, where kseq keeps the last FASTA header char it
+         * read and so its offset is one short */
+        if (b->eof == 0 && b->end_offset != fdb_kseq_tell(ref)) goto exit;
+    }
+    ok = b->eof == 1 && kseq_read(ref) < 0;
+exit:
+    fdb_batch_put(pool, b);
+    fdb_batch_pool_destroy(pool);
+    kseq_destroy(ref);
+    kseq_destroy(seq);
+    fdb_infile_close(ref_in);
+    fdb_infile_close(in);
+    return ok ? n : 0;
+}
+
+static void
+test_batch_fill (void *ptr)
+{
+    const char *fn = "test_batch_fill.fq";
+    const char *gz_fn = "test_batch_fill.fq.gz";
+    (void) ptr;
+    /* Enough reads for several batches, and reads split between them */
+    tt_int_op(write_odd_reads(fn, 0, 0, 0, 9000, 0), ==, 0);
+    tt_int_op(fill_like_kseq(fn), ==, 9000 - 3);
+    tt_int_op(write_odd_reads(fn, 0, 0, 1, 9000, 1), ==, 0);
+    tt_int_op(fill_like_kseq(fn), ==, 9000 - 3);
+    tt_int_op(write_odd_reads(gz_fn, 1, 0, 0, 9000, 1), ==, 0);
+    tt_int_op(fill_like_kseq(gz_fn), ==, 9000 - 3);
+    /* FASTA, where kseq has read the next header when it stops, and the
+     * last read runs to the end of the file */
+    tt_int_op(write_odd_reads(fn, 0, 1, 1, 9000, 1), ==, 0);
+    tt_int_op(fill_like_kseq(fn), ==, 9000 - 3 + 1);
+    tt_int_op(write_odd_reads(fn, 0, 1, 0, 9000, 0), ==, 0);
+    tt_int_op(fill_like_kseq(fn), ==, 9000 - 3);
+end:
+    remove(fn);
+    remove(gz_fn);
+}
+
+/* Output queue stress test: producers each write numbered records of odd
+ * lengths, up to a few K so blocks fill fast, to pseudo-random streams */
+#define STRESS_PRODUCERS 4
+#define STRESS_STREAMS 3
+#define STRESS_RECORDS 4000
+
+typedef struct {
+    fdb_outq_t *q;
+    int id;
+    int ret;
+} stress_arg_t;
+
+static void *
+stress_producer (void *ptr)
+{
+    stress_arg_t *arg = ptr;
+    fdb_outq_producer_t *p = fdb_outq_producer_new(arg->q);
+    unsigned int seed = arg->id + 1;
+    char rec[4096];
+    if (p == NULL) {
+        arg->ret = 1;
+        return NULL;
+    }
+    for (size_t rrr = 0; rrr < STRESS_RECORDS; rrr++) {
+        size_t stream = rand_r(&seed) % STRESS_STREAMS;
+        int len = snprintf(rec, sizeof(rec), "%d %zu %zu ", arg->id, stream,
+                rrr);
+        size_t pad = rand_r(&seed) % 4000;
+        memset(rec + len, 'A' + arg->id, pad);
+        rec[len + pad] = '\n';
+        arg->ret |= fdb_outq_write(p, stream, rec, len + pad + 1);
+    }
+    arg->ret |= fdb_outq_flush(p);
+    fdb_outq_producer_destroy(p);
+    return NULL;
+}
+
+static void
+test_outq_stress (void *ptr)
+{
+    char fns[STRESS_STREAMS][64];
+    fdb_ofile_t *fps[STRESS_STREAMS];
+    stress_arg_t args[STRESS_PRODUCERS];
+    pthread_t threads[STRESS_PRODUCERS];
+    size_t seen[STRESS_PRODUCERS];
+    size_t n_seen = 0;
+    char *buf = NULL;
+    fdb_outq_t *q = NULL;
+    (void) ptr;
+    memset(fps, 0, sizeof(fps));
+    memset(seen, 0, sizeof(seen));
+    for (size_t sss = 0; sss < STRESS_STREAMS; sss++) {
+        snprintf(fns[sss], sizeof(fns[sss]), "test_outq_stress_%zu.txt", sss);
+        fps[sss] = fdb_ofile_open(fns[sss], -1, 0, NULL);
+        tt_assert(fps[sss] != NULL);
+    }
+    /* More writers than streams, so they steal from each other, and too
+     * little memory for even one block per writer, so the block pool runs
+     * dry and producers wait on the writers */
+    q = fdb_outq_create(fps, STRESS_STREAMS, 6, 1, NULL);
+    tt_assert(q != NULL);
+    for (int ppp = 0; ppp < STRESS_PRODUCERS; ppp++) {
+        args[ppp].q = q;
+        args[ppp].id = ppp;
+        args[ppp].ret = 0;
+        tt_int_op(pthread_create(&threads[ppp], NULL, stress_producer,
+                    &args[ppp]), ==, 0);
+    }
+    for (int ppp = 0; ppp < STRESS_PRODUCERS; ppp++) {
+        pthread_join(threads[ppp], NULL);
+        tt_int_op(args[ppp].ret, ==, 0);
+    }
+    tt_int_op(fdb_outq_destroy(q), ==, 0);
+    q = NULL;
+    for (size_t sss = 0; sss < STRESS_STREAMS; sss++) {
+        tt_int_op(fdb_ofile_close(fps[sss]), ==, 0);
+        fps[sss] = NULL;
+    }
+    /* Each record carries its stream and its number from its producer,
+     * which must rise within each stream */
+    for (size_t sss = 0; sss < STRESS_STREAMS; sss++) {
+        size_t last[STRESS_PRODUCERS];
+        size_t len = 0;
+        char *line = NULL;
+        for (int ppp = 0; ppp < STRESS_PRODUCERS; ppp++) last[ppp] = SIZE_MAX;
+        buf = slurp(fns[sss], &len);
+        tt_assert(buf != NULL);
+        tt_assert(len > 0 && buf[len - 1] == '\n');
+        for (line = buf; line < buf + len; line += strlen(line) + 1) {
+            int id = -1;
+            size_t stream = 0, rrr = 0;
+            /* sscanf would otherwise measure the rest of the buffer */
+            *strchr(line, '\n') = '\0';
+            tt_int_op(sscanf(line, "%d %zu %zu ", &id, &stream, &rrr), ==, 3);
+            tt_assert(id >= 0 && id < STRESS_PRODUCERS);
+            tt_int_op(stream, ==, sss);
+            tt_assert(last[id] == SIZE_MAX || rrr > last[id]);
+            last[id] = rrr;
+            seen[id]++;
+            n_seen++;
+        }
+        free(buf);
+        buf = NULL;
+    }
+    /* With no repeats, the right count means none were lost */
+    for (int ppp = 0; ppp < STRESS_PRODUCERS; ppp++) {
+        tt_int_op(seen[ppp], ==, STRESS_RECORDS);
+    }
+    tt_int_op(n_seen, ==, STRESS_PRODUCERS * STRESS_RECORDS);
+end:
+    fdb_outq_destroy(q);
+    for (size_t sss = 0; sss < STRESS_STREAMS; sss++) {
+        if (fps[sss] != NULL) fdb_ofile_close(fps[sss]);
+        remove(fns[sss]);
+    }
+    free(buf);
+}
+
+static void
+test_ckpt_resume (void *ptr)
+{
+    char tmp[] = "/tmp/fdb_test_ckpt_XXXXXX";
+    char bcd_fn[64], in_fn[64], ckpt_fn[64], full[64], resumed[64];
+    char other_fn[64];
+    /* As many barcodes, one of them different */
+    const char *other_bcds[] = {"ACTTCA", "ACGGAA", "TTGCAG", "GATCCA"};
+    (void) ptr;
+    tt_assert(mkdtemp(tmp) != NULL);
+    snprintf(bcd_fn, sizeof(bcd_fn), "%s/bcd.fa", tmp);
+    snprintf(other_fn, sizeof(other_fn), "%s/other.fa", tmp);
+    snprintf(ckpt_fn, sizeof(ckpt_fn), "%s/ckpt", tmp);
+    snprintf(full, sizeof(full), "%s/full", tmp);
+    snprintf(resumed, sizeof(resumed), "%s/resumed", tmp);
+    tt_int_op(write_barcodes(bcd_fn, pipe_bcds), ==, 0);
+    tt_int_op(write_barcodes(other_fn, other_bcds), ==, 0);
+    /* Plain, then gzipped input and output */
+    for (int gz = 0; gz < 2; gz++) {
+        /* getopt moves -z ahead of the positional arguments */
+        char *full_args[] = {"fastDBarcode", "-m", "2", "-o", full, bcd_fn,
+            in_fn, "-z"};
+        char *ckpt_args[] = {"fastDBarcode", "-m", "2", "-o", resumed, "-c",
+            ckpt_fn, bcd_fn, in_fn, "-z"};
+        char *resume_args[] = {"fastDBarcode", "-m", "2", "-o", resumed, "-c",
+            ckpt_fn, "-r", bcd_fn, in_fn, "-z"};
+        /* Resuming with other barcodes, -m or compression must fail: the
+         * plain run gains -z, the gzipped one a compression level */
+        char *other_args[] = {"fastDBarcode", "-m", "2", "-o", resumed, "-c",
+            ckpt_fn, "-r", other_fn, in_fn, "-z"};
+        char *mm_args[] = {"fastDBarcode", "-m", "1", "-o", resumed, "-c",
+            ckpt_fn, "-r", bcd_fn, in_fn, "-z"};
+        char *codec_args[] = {"fastDBarcode", "-m", "2", "-o", resumed, "-c",
+            ckpt_fn, "-r", bcd_fn, in_fn, "-z", "--level", "1"};
+        snprintf(in_fn, sizeof(in_fn), "%s/in.fq%s", tmp, gz ? ".gz" : "");
+        /* Some batches, and a bit */
+        tt_int_op(write_reads(in_fn, 3 * FDB_BATCH_READS + 123, gz), ==, 0);
+        tt_int_op(mkdir(full, 0755), ==, 0);
+        tt_int_op(mkdir(resumed, 0755), ==, 0);
+        tt_int_op(run_fdb(7 + gz, full_args, 0), ==, 0);
+        /* Killed with a batch written past the checkpoint, which resuming
+         * must cut off */
+        tt_int_op(run_fdb(9 + gz, ckpt_args, 2), ==, 0);
+        tt_int_op(same_outputs(full, resumed), ==, 0);
+        tt_int_op(run_fdb(10 + gz, other_args, 0), !=, 0);
+        tt_int_op(run_fdb(10 + gz, mm_args, 0), !=, 0);
+        tt_int_op(run_fdb(gz ? 13 : 11, codec_args, 0), !=, 0);
+        tt_int_op(run_fdb(10 + gz, resume_args, 0), ==, 0);
+        tt_assert(same_outputs(full, resumed) > 0);
+        remove_dir(full);
+        remove_dir(resumed);
+        remove(ckpt_fn);
+    }
+end:
+    remove_dir(tmp);
+}
+
+/* Offset of the record named name in buf, which must have one */
+static uint64_t
+record_start (const char *buf, size_t len, const char *name)
+{
+    size_t nlen = strlen(name);
+    for (size_t iii = 0; iii + nlen < len; iii++) {
+        if ((iii == 0 || buf[iii - 1] == '\n') && buf[iii] == '@' && \
+                memcmp(buf + iii + 1, name, nlen) == 0 && \
+                isspace(buf[iii + 1 + nlen])) {
+            return iii;
+        }
+    }
+    return UINT64_MAX;
+}
+
+static void
+test_gzidx_ranges (void *ptr)
+{
+    char tmp[] = "/tmp/fdb_test_range_XXXXXX";
+    char bcd_fn[64], plain_fn[64], in_fn[64], idx_fn[80], full[64];
+    char merged[64], parts[6][64], range[64], part_fns[6][4096];
+    char *part_argv[8];
+    char *buf = NULL;
+    size_t len = 0;
+    uint64_t bounds[6];
+    const size_t n_parts = 5;
+    fdb_gzidx_t *idx = NULL;
+    DIR *dir = NULL;
+    struct dirent *ent = NULL;
+    (void) ptr;
+    tt_assert(mkdtemp(tmp) != NULL);
+    snprintf(bcd_fn, sizeof(bcd_fn), "%s/bcd.fa", tmp);
+    snprintf(plain_fn, sizeof(plain_fn), "%s/in.fq", tmp);
+    snprintf(in_fn, sizeof(in_fn), "%s/in.fq.gz", tmp);
+    snprintf(idx_fn, sizeof(idx_fn), "%s%s", in_fn, FDB_GZIDX_EXT);
+    snprintf(full, sizeof(full), "%s/full", tmp);
+    snprintf(merged, sizeof(merged), "%s/merged", tmp);
+    tt_int_op(write_barcodes(bcd_fn, pipe_bcds), ==, 0);
+    tt_int_op(write_reads(plain_fn, 3 * FDB_BATCH_READS + 123, 0), ==, 0);
+    buf = slurp(plain_fn, &len);
+    tt_assert(buf != NULL);
+    /* Three gzip members, split mid-record */
+    for (size_t mmm = 0; mmm < 3; mmm++) {
+        gzFile fp = gzopen(in_fn, "ab");
+        size_t from = len * mmm / 3 + 17 * (mmm > 0);
+        size_t to = mmm == 2 ? len : len * (mmm + 1) / 3 + 17;
+        tt_assert(fp != NULL);
+        tt_int_op(gzwrite(fp, buf + from, to - from), ==, to - from);
+        tt_int_op(gzclose(fp), ==, Z_OK);
+    }
+    /* The uninterrupted run reads the file without an index */
+    {
+        char *full_args[] = {"fastDBarcode", "-m", "2", "-z", "-o", full,
+            bcd_fn, in_fn};
+        tt_int_op(mkdir(full, 0755), ==, 0);
+        tt_int_op(run_fdb(8, full_args, 0), ==, 0);
+    }
+    idx = fdb_gzidx_build(in_fn, 64 << 10);
+    tt_assert(idx != NULL);
+    tt_int_op(idx->length, ==, len);
+    tt_assert(idx->n_points > 3);
+    tt_int_op(fdb_gzidx_save(idx, idx_fn), ==, 0);
+    /* Ranges split mid-record, at a record's start and just past one */
+    bounds[0] = 0;
+    bounds[1] = record_start(buf, len, "read1000");
+    bounds[2] = len * 2 / 5;
+    bounds[3] = record_start(buf, len, "read9000") + 1;
+    bounds[4] = len * 4 / 5;
+    bounds[5] = len;
+    for (size_t ppp = 0; ppp < n_parts; ppp++) {
+        char *range_args[] = {"fastDBarcode", "-m", "2", "-z", "--range",
+            range, "-o", parts[ppp], bcd_fn, in_fn};
+        tt_assert(bounds[ppp] < bounds[ppp + 1]);
+        snprintf(parts[ppp], sizeof(parts[ppp]), "%s/part%zu", tmp, ppp);
+        snprintf(range, sizeof(range), "%" PRIu64 ":%" PRIu64, bounds[ppp],
+                bounds[ppp + 1]);
+        tt_int_op(mkdir(parts[ppp], 0755), ==, 0);
+        tt_int_op(run_fdb(10, range_args, 0), ==, 0);
+    }
+    /* Merge each output file across the ranges */
+    tt_int_op(mkdir(merged, 0755), ==, 0);
+    dir = opendir(full);
+    tt_assert(dir != NULL);
+    while ((ent = readdir(dir)) != NULL) {
+        char out_fn[4096];
+        if (ent->d_name[0] == '.') continue;
+        snprintf(out_fn, sizeof(out_fn), "%s/%s", merged, ent->d_name);
+        part_argv[0] = "merge";
+        part_argv[1] = out_fn;
+        for (size_t ppp = 0; ppp < n_parts; ppp++) {
+            snprintf(part_fns[ppp], sizeof(part_fns[ppp]), "%s/%s", parts[ppp],
+                    ent->d_name);
+            part_argv[ppp + 2] = part_fns[ppp];
+        }
+        tt_int_op(fdb_merge_main(n_parts + 2, part_argv), ==, EXIT_SUCCESS);
+    }
+    tt_assert(same_outputs(full, merged) > 0);
+end:
+    if (dir != NULL) closedir(dir);
+    fdb_gzidx_destroy(idx);
+    free(buf);
+    remove_dir(tmp);
+}
 
 struct testcase_t fdb_tests[] = {
+    { "hamming_max", test_hamming_max, 0, NULL, NULL },
+    { "matcher_match", test_matcher_match, 0, NULL, NULL },
+    { "matcher_buffer", test_matcher_buffer, 0, NULL, NULL },
+    { "matcher_classify", test_matcher_classify, 0, NULL, NULL },
+    { "matcher_new_bad", test_matcher_new_bad, 0, NULL, NULL },
+    { "matcher_index", test_matcher_index, 0, NULL, NULL },
+    { "matcher_index_large", test_matcher_index_large, 0, NULL, NULL },
+    { "matcher_index_file", test_matcher_index_file, 0, NULL, NULL },
+    { "matcher_copy", test_matcher_copy, 0, NULL, NULL },
+    { "stats", test_stats, 0, NULL, NULL },
+    { "rescue", test_rescue, 0, NULL, NULL },
+    { "rescue_fit", test_rescue_fit, 0, NULL, NULL },
+    { "filter", test_filter, 0, NULL, NULL },
+    { "ofile_aio", test_ofile_aio, 0, NULL, NULL },
+    { "ofile_park", test_ofile_park, 0, NULL, NULL },
+    { "ofile_gz", test_ofile_gz, 0, NULL, NULL },
+    { "aio_shared", test_aio_shared, 0, NULL, NULL },
+    { "batch_fill", test_batch_fill, 0, NULL, NULL },
+    { "outq_stress", test_outq_stress, 0, NULL, NULL },
+    { "ckpt_resume", test_ckpt_resume, 0, NULL, NULL },
+    { "gzidx_ranges", test_gzidx_ranges, 0, NULL, NULL },
     END_OF_TESTCASES
 };
 